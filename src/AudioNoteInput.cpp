@@ -0,0 +1,76 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "AudioNoteInput.h"
+#include "AudioSource.h"
+
+#include <vector>
+using namespace std;
+
+AudioNoteInput::AudioNoteInput(AudioSource *source)
+   : m_source(source), m_detector(source->SampleRate()), m_input(0), m_thread(0)
+{ }
+
+AudioNoteInput::~AudioNoteInput()
+{
+   if (m_input) Detach(m_input);
+   delete m_source;
+}
+
+void AudioNoteInput::Attach(MidiCommIn *input)
+{
+   // Only one listener at a time
+   if (m_input) return;
+
+   m_input = input;
+
+   m_source->Start();
+   m_thread = new Thread(Run, this);
+}
+
+void AudioNoteInput::Detach(MidiCommIn *input)
+{
+   if (input != m_input) return;
+
+   // The thread finishes up (and lets go of any held notes) once the
+   // source stops giving it audio
+   m_source->Stop();
+   delete m_thread;
+
+   m_thread = 0;
+   m_input = 0;
+}
+
+void AudioNoteInput::Inject(const DetectedNoteList &notes)
+{
+   for (size_t i = 0; i < notes.size(); ++i)
+   {
+      const DetectedNote &n = notes[i];
+
+      const unsigned char status = n.on ? 0x90 : 0x80;
+      const unsigned char velocity = static_cast<unsigned char>(n.on ? n.velocity : 0);
+      m_input->InjectEvent(MidiEvent::Build(MidiEventSimple(status, static_cast<unsigned char>(n.note), velocity)));
+   }
+}
+
+void AudioNoteInput::Run()
+{
+   // A hop at a time, so each one is analyzed as soon as it arrives
+   vector<float> buffer(m_detector.HopFrames());
+   DetectedNoteList notes;
+
+   while (true)
+   {
+      const size_t frames = m_source->Read(&buffer[0], buffer.size());
+      if (frames == 0) break;
+
+      notes.clear();
+      m_detector.Process(&buffer[0], frames, &notes);
+      Inject(notes);
+   }
+
+   notes.clear();
+   m_detector.Reset(&notes);
+   Inject(notes);
+}
@@ -0,0 +1,50 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __AUDIO_NOTE_INPUT_H
+#define __AUDIO_NOTE_INPUT_H
+
+#include "PitchDetector.h"
+#include "Threading.h"
+#include "libmidi/MidiComm.h"
+
+class AudioSource;
+
+// Lets an acoustic piano (with no MIDI of its own) be played into the
+// game.  Registered as a virtual input device, it listens to an
+// AudioSource and turns what it hears into note-on and note-off events on
+// channel 1, which arrive through MidiCommIn like any keyboard's would.
+//
+// Audio is only captured (and analyzed, on a thread of its own) while a
+// MidiCommIn has the device open.
+class AudioNoteInput : public MidiCommInSource
+{
+public:
+   // Takes ownership of the source
+   AudioNoteInput(AudioSource *source);
+   ~AudioNoteInput();
+
+   virtual void Attach(MidiCommIn *input);
+   virtual void Detach(MidiCommIn *input);
+
+   // Only safe to look at while no MidiCommIn has the device open
+   const PitchDetector &Detector() const { return m_detector; }
+
+private:
+   AudioNoteInput(const AudioNoteInput&);
+   AudioNoteInput &operator=(const AudioNoteInput&);
+
+   static void Run(void *context) { reinterpret_cast<AudioNoteInput*>(context)->Run(); }
+   void Run();
+
+   void Inject(const DetectedNoteList &notes);
+
+   AudioSource *m_source;
+   PitchDetector m_detector;
+
+   MidiCommIn *m_input;
+   Thread *m_thread;
+};
+
+#endif
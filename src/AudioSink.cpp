@@ -0,0 +1,148 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "AudioSink.h"
+#include "CompatibleSystem.h"
+#include "PianoGameError.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+using namespace std;
+
+MemoryAudioSink::MemoryAudioSink(size_t capacity_frames)
+   : m_samples(capacity_frames * 2), m_frame_count(0), m_dropped_frames(0)
+{ }
+
+void MemoryAudioSink::Write(const short *samples, size_t frame_count)
+{
+   const size_t capacity = m_samples.size() / 2;
+   const size_t kept = min(frame_count, capacity - m_frame_count);
+
+   if (kept > 0) memcpy(&m_samples[m_frame_count * 2], samples, kept * 2 * sizeof(short));
+
+   m_frame_count += kept;
+   m_dropped_frames += frame_count - kept;
+}
+
+static void WriteLittle32(ostream &out, unsigned long value)
+{
+   out.put(static_cast<char>( value        & 0xFF));
+   out.put(static_cast<char>((value >>  8) & 0xFF));
+   out.put(static_cast<char>((value >> 16) & 0xFF));
+   out.put(static_cast<char>((value >> 24) & 0xFF));
+}
+
+static void WriteLittle16(ostream &out, unsigned short value)
+{
+   out.put(static_cast<char>( value       & 0xFF));
+   out.put(static_cast<char>((value >> 8) & 0xFF));
+}
+
+bool WriteWavFile(const wstring &filename, const short *samples, size_t frame_count, unsigned int sample_rate)
+{
+   ofstream file;
+   Compatible::OpenFile(file, filename, ios::out | ios::trunc | ios::binary);
+
+   if (!file.good()) return false;
+
+   const unsigned short Channels = 2;
+   const unsigned short BitsPerSample = 16;
+   const unsigned short BlockAlign = Channels * BitsPerSample / 8;
+   const unsigned long data_bytes = static_cast<unsigned long>(frame_count * BlockAlign);
+
+   file.write("RIFF", 4);
+   WriteLittle32(file, 36 + data_bytes);
+   file.write("WAVE", 4);
+
+   file.write("fmt ", 4);
+   WriteLittle32(file, 16);
+   WriteLittle16(file, 1); // PCM
+   WriteLittle16(file, Channels);
+   WriteLittle32(file, sample_rate);
+   WriteLittle32(file, sample_rate * BlockAlign);
+   WriteLittle16(file, BlockAlign);
+   WriteLittle16(file, BitsPerSample);
+
+   file.write("data", 4);
+   WriteLittle32(file, data_bytes);
+   for (size_t i = 0; i < frame_count * Channels; ++i) WriteLittle16(file, static_cast<unsigned short>(samples[i]));
+
+   return file.good();
+}
+
+#ifdef WIN32
+
+WaveOutAudioSink::WaveOutAudioSink(unsigned int sample_rate, size_t period_frames, int buffer_count)
+   : m_device(0), m_buffer_done(0), m_period_frames(period_frames), m_next(0)
+{
+   WAVEFORMATEX format;
+   format.wFormatTag = WAVE_FORMAT_PCM;
+   format.nChannels = 2;
+   format.nSamplesPerSec = sample_rate;
+   format.wBitsPerSample = 16;
+   format.nBlockAlign = format.nChannels * format.wBitsPerSample / 8;
+   format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
+   format.cbSize = 0;
+
+   m_buffer_done = CreateEvent(0, FALSE, FALSE, 0);
+   if (waveOutOpen(&m_device, WAVE_MAPPER, &format, reinterpret_cast<DWORD_PTR>(m_buffer_done), 0, CALLBACK_EVENT) != MMSYSERR_NOERROR)
+   {
+      CloseHandle(m_buffer_done);
+      throw PianoGameError(L"Couldn't open the wave output device.");
+   }
+
+   m_buffers.resize(period_frames * 2 * buffer_count);
+   m_headers.resize(buffer_count);
+   for (int i = 0; i < buffer_count; ++i)
+   {
+      WAVEHDR &h = m_headers[i];
+      memset(&h, 0, sizeof(WAVEHDR));
+      h.lpData = reinterpret_cast<LPSTR>(&m_buffers[i * period_frames * 2]);
+      h.dwBufferLength = static_cast<DWORD>(period_frames * 2 * sizeof(short));
+
+      waveOutPrepareHeader(m_device, &h, sizeof(WAVEHDR));
+
+      // Nothing is queued yet, so every buffer starts out free
+      h.dwFlags |= WHDR_DONE;
+   }
+}
+
+WaveOutAudioSink::~WaveOutAudioSink()
+{
+   waveOutReset(m_device);
+   for (size_t i = 0; i < m_headers.size(); ++i) waveOutUnprepareHeader(m_device, &m_headers[i], sizeof(WAVEHDR));
+
+   waveOutClose(m_device);
+   CloseHandle(m_buffer_done);
+}
+
+void WaveOutAudioSink::Write(const short *samples, size_t frame_count)
+{
+   WAVEHDR &h = m_headers[m_next];
+   m_next = (m_next + 1) % m_headers.size();
+
+   // The device signals the event every time it finishes a buffer
+   while ((h.dwFlags & WHDR_DONE) == 0) WaitForSingleObject(m_buffer_done, INFINITE);
+
+   const size_t frames = min(frame_count, m_period_frames);
+   memcpy(h.lpData, samples, frames * 2 * sizeof(short));
+   h.dwBufferLength = static_cast<DWORD>(frames * 2 * sizeof(short));
+
+   h.dwFlags &= ~WHDR_DONE;
+   waveOutWrite(m_device, &h, sizeof(WAVEHDR));
+}
+
+size_t WaveOutAudioSink::BufferedFrames() const
+{
+   size_t frames = 0;
+   for (size_t i = 0; i < m_headers.size(); ++i)
+   {
+      if ((m_headers[i].dwFlags & WHDR_DONE) == 0) frames += m_headers[i].dwBufferLength / (2 * sizeof(short));
+   }
+
+   return frames;
+}
+
+#endif
@@ -0,0 +1,84 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __AUDIO_SINK_H
+#define __AUDIO_SINK_H
+
+#include <string>
+#include <vector>
+
+#include "os.h"
+
+// Somewhere for rendered audio to go.  Audio is always 16-bit signed,
+// interleaved stereo.
+class AudioSink
+{
+public:
+   virtual ~AudioSink() { }
+
+   // Called from the audio thread.  Implementations must not allocate or
+   // lock (blocking until a real device wants more audio is fine).
+   virtual void Write(const short *samples, size_t frame_count) = 0;
+
+   // How many frames have been written but not heard yet
+   virtual size_t BufferedFrames() const { return 0; }
+};
+
+// Collects audio into a buffer allocated up front.  Anything written
+// past the end of it is dropped (and counted).
+class MemoryAudioSink : public AudioSink
+{
+public:
+   MemoryAudioSink(size_t capacity_frames);
+
+   virtual void Write(const short *samples, size_t frame_count);
+
+   // Only safe to look at once nothing is writing any more
+   const short *Samples() const { return m_samples.empty() ? 0 : &m_samples[0]; }
+   size_t FrameCount() const { return m_frame_count; }
+   size_t DroppedFrames() const { return m_dropped_frames; }
+
+   void Clear() { m_frame_count = 0; m_dropped_frames = 0; }
+
+private:
+   std::vector<short> m_samples;
+   size_t m_frame_count;
+   size_t m_dropped_frames;
+};
+
+// Returns false if the file couldn't be written
+bool WriteWavFile(const std::wstring &filename, const short *samples, size_t frame_count, unsigned int sample_rate);
+
+#ifdef WIN32
+
+// Plays audio through the default WinMM wave output.  A few buffers are
+// kept queued with the device; Write() waits for the oldest one to finish
+// playing before reusing it, so the device's clock paces the audio thread.
+class WaveOutAudioSink : public AudioSink
+{
+public:
+   // Throws PianoGameError if the device couldn't be opened
+   WaveOutAudioSink(unsigned int sample_rate, size_t period_frames, int buffer_count);
+   ~WaveOutAudioSink();
+
+   // frame_count must be no more than period_frames
+   virtual void Write(const short *samples, size_t frame_count);
+   virtual size_t BufferedFrames() const;
+
+private:
+   WaveOutAudioSink(const WaveOutAudioSink&);
+   WaveOutAudioSink &operator=(const WaveOutAudioSink&);
+
+   HWAVEOUT m_device;
+   HANDLE m_buffer_done;
+
+   size_t m_period_frames;
+   std::vector<WAVEHDR> m_headers;
+   std::vector<short> m_buffers;
+   size_t m_next;
+};
+
+#endif
+
+#endif
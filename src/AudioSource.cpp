@@ -0,0 +1,257 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "AudioSource.h"
+#include "CompatibleSystem.h"
+#include "PianoGameError.h"
+#include "Threading.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+using namespace std;
+
+static unsigned long ReadLittle32(const unsigned char *data)
+{
+   return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<unsigned long>(data[3]) << 24);
+}
+
+static unsigned short ReadLittle16(const unsigned char *data)
+{
+   return static_cast<unsigned short>(data[0] | (data[1] << 8));
+}
+
+bool ReadWavFile(const wstring &filename, vector<float> *samples, unsigned int *sample_rate)
+{
+   ifstream file;
+   Compatible::OpenFile(file, filename, ios::in | ios::binary);
+
+   if (!file.good()) return false;
+
+   vector<unsigned char> bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+   if (bytes.size() < 12 || memcmp(&bytes[0], "RIFF", 4) != 0 || memcmp(&bytes[8], "WAVE", 4) != 0) return false;
+
+   unsigned short format = 0;
+   unsigned short channels = 0;
+   unsigned short bits = 0;
+   unsigned long rate = 0;
+
+   const unsigned char *data = 0;
+   size_t data_bytes = 0;
+
+   for (size_t pos = 12; pos + 8 <= bytes.size(); )
+   {
+      const unsigned char *chunk = &bytes[pos];
+      const size_t length = min<size_t>(ReadLittle32(chunk + 4), bytes.size() - pos - 8);
+
+      if (memcmp(chunk, "fmt ", 4) == 0 && length >= 16)
+      {
+         format = ReadLittle16(chunk + 8);
+         channels = ReadLittle16(chunk + 10);
+         rate = ReadLittle32(chunk + 12);
+         bits = ReadLittle16(chunk + 22);
+
+         // WAVE_FORMAT_EXTENSIBLE keeps the real format in its sub-type
+         if (format == 0xFFFE && length >= 26) format = ReadLittle16(chunk + 32);
+      }
+
+      if (memcmp(chunk, "data", 4) == 0)
+      {
+         data = chunk + 8;
+         data_bytes = length;
+      }
+
+      // Chunks are padded to an even length
+      pos += 8 + length + (length & 1);
+   }
+
+   const bool pcm16 = (format == 1 && bits == 16);
+   const bool float32 = (format == 3 && bits == 32);
+   if (!data || channels == 0 || rate == 0 || (!pcm16 && !float32)) return false;
+
+   const size_t frame_bytes = channels * bits / 8;
+   const size_t frames = data_bytes / frame_bytes;
+
+   samples->resize(frames);
+   for (size_t f = 0; f < frames; ++f)
+   {
+      float sum = 0.0f;
+      for (unsigned short c = 0; c < channels; ++c)
+      {
+         const unsigned char *s = data + f * frame_bytes + c * bits / 8;
+
+         if (pcm16) sum += static_cast<short>(ReadLittle16(s)) / 32768.0f;
+         else
+         {
+            const unsigned long raw = ReadLittle32(s);
+
+            float value;
+            memcpy(&value, &raw, sizeof(float));
+            sum += value;
+         }
+      }
+
+      (*samples)[f] = sum / channels;
+   }
+
+   *sample_rate = rate;
+   return true;
+}
+
+WavAudioSource::WavAudioSource(const wstring &filename, bool paced)
+   : m_sample_rate(0), m_paced(paced), m_position(0), m_start_time(0), m_stop(0)
+{
+   if (!ReadWavFile(filename, &m_samples, &m_sample_rate)) throw PianoGameError(L"Couldn't read WAV file: " + filename);
+}
+
+void WavAudioSource::Start()
+{
+   m_position = 0;
+   Atomic::Write(&m_stop, 0);
+   m_start_time = Compatible::GetMicroseconds();
+}
+
+void WavAudioSource::Stop()
+{
+   Atomic::Write(&m_stop, 1);
+}
+
+size_t WavAudioSource::Read(float *samples, size_t frame_count)
+{
+   const size_t frames = min(frame_count, m_samples.size() - m_position);
+   if (frames == 0) return 0;
+
+   if (m_paced)
+   {
+      // The last of these frames can't have "arrived" any sooner than this
+      const microseconds_t ready = m_start_time + static_cast<microseconds_t>((m_position + frames) * 1000000.0 / m_sample_rate);
+
+      while (true)
+      {
+         if (Atomic::Read(&m_stop)) return 0;
+
+         const microseconds_t remaining = ready - Compatible::GetMicroseconds();
+         if (remaining <= 0) break;
+
+         // Short naps, so Stop() is noticed quickly
+         Thread::Sleep(static_cast<unsigned long>(min<microseconds_t>(remaining / 1000 + 1, 5)));
+      }
+   }
+   else if (Atomic::Read(&m_stop)) return 0;
+
+   memcpy(samples, &m_samples[m_position], frames * sizeof(float));
+   m_position += frames;
+
+   return frames;
+}
+
+#ifdef WIN32
+
+WaveInAudioSource::WaveInAudioSource(unsigned int sample_rate, size_t period_frames, int buffer_count)
+   : m_device(0), m_buffer_done(0), m_sample_rate(sample_rate), m_period_frames(period_frames), m_next(0), m_offset(0), m_stop(0)
+{
+   WAVEFORMATEX format;
+   format.wFormatTag = WAVE_FORMAT_PCM;
+   format.nChannels = 1;
+   format.nSamplesPerSec = sample_rate;
+   format.wBitsPerSample = 16;
+   format.nBlockAlign = format.nChannels * format.wBitsPerSample / 8;
+   format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
+   format.cbSize = 0;
+
+   m_buffer_done = CreateEvent(0, FALSE, FALSE, 0);
+   if (waveInOpen(&m_device, WAVE_MAPPER, &format, reinterpret_cast<DWORD_PTR>(m_buffer_done), 0, CALLBACK_EVENT) != MMSYSERR_NOERROR)
+   {
+      CloseHandle(m_buffer_done);
+      throw PianoGameError(L"Couldn't open the wave input device.");
+   }
+
+   m_buffers.resize(period_frames * buffer_count);
+   m_headers.resize(buffer_count);
+   for (int i = 0; i < buffer_count; ++i)
+   {
+      WAVEHDR &h = m_headers[i];
+      memset(&h, 0, sizeof(WAVEHDR));
+      h.lpData = reinterpret_cast<LPSTR>(&m_buffers[i * period_frames]);
+      h.dwBufferLength = static_cast<DWORD>(period_frames * sizeof(short));
+
+      waveInPrepareHeader(m_device, &h, sizeof(WAVEHDR));
+   }
+}
+
+WaveInAudioSource::~WaveInAudioSource()
+{
+   waveInReset(m_device);
+   for (size_t i = 0; i < m_headers.size(); ++i) waveInUnprepareHeader(m_device, &m_headers[i], sizeof(WAVEHDR));
+
+   waveInClose(m_device);
+   CloseHandle(m_buffer_done);
+}
+
+void WaveInAudioSource::Start()
+{
+   Atomic::Write(&m_stop, 0);
+
+   for (size_t i = 0; i < m_headers.size(); ++i)
+   {
+      m_headers[i].dwFlags &= ~WHDR_DONE;
+      m_headers[i].dwBytesRecorded = 0;
+      waveInAddBuffer(m_device, &m_headers[i], sizeof(WAVEHDR));
+   }
+
+   m_next = 0;
+   m_offset = 0;
+   waveInStart(m_device);
+}
+
+void WaveInAudioSource::Stop()
+{
+   // Only the reading thread talks to the device once it's started, so
+   // just wake it up and let it shut the device down
+   Atomic::Write(&m_stop, 1);
+   SetEvent(m_buffer_done);
+}
+
+size_t WaveInAudioSource::Read(float *samples, size_t frame_count)
+{
+   size_t done = 0;
+   while (done < frame_count)
+   {
+      WAVEHDR &h = m_headers[m_next];
+
+      // The device signals the event every time it fills a buffer
+      while ((h.dwFlags & WHDR_DONE) == 0 && !Atomic::Read(&m_stop)) WaitForSingleObject(m_buffer_done, INFINITE);
+
+      if (Atomic::Read(&m_stop))
+      {
+         waveInReset(m_device);
+         return 0;
+      }
+
+      const short *recorded = reinterpret_cast<const short*>(h.lpData);
+      const size_t available = h.dwBytesRecorded / sizeof(short) - m_offset;
+      const size_t frames = min(available, frame_count - done);
+
+      for (size_t i = 0; i < frames; ++i) samples[done + i] = recorded[m_offset + i] / 32768.0f;
+
+      done += frames;
+      m_offset += frames;
+
+      // Hand finished buffers straight back to be filled again
+      if (m_offset * sizeof(short) >= h.dwBytesRecorded)
+      {
+         h.dwFlags &= ~WHDR_DONE;
+         h.dwBytesRecorded = 0;
+         waveInAddBuffer(m_device, &h, sizeof(WAVEHDR));
+
+         m_next = (m_next + 1) % m_headers.size();
+         m_offset = 0;
+      }
+   }
+
+   return done;
+}
+
+#endif
@@ -0,0 +1,109 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __AUDIO_SOURCE_H
+#define __AUDIO_SOURCE_H
+
+#include <string>
+#include <vector>
+
+#include "os.h"
+#include "libmidi/MidiTypes.h"
+
+// Somewhere audio comes from (the other direction from AudioSink).
+// Audio is always mono, as floats in [-1.0, 1.0].
+class AudioSource
+{
+public:
+   virtual ~AudioSource() { }
+
+   virtual unsigned int SampleRate() const = 0;
+
+   // Starts capturing from scratch.  Called before the first Read().
+   virtual void Start() = 0;
+
+   // May be called from any thread.  A Read() that's waiting (or the
+   // next one) returns 0 soon after.
+   virtual void Stop() = 0;
+
+   // Waits until frame_count frames have arrived and copies them out.
+   // Returns fewer (possibly 0) once the source has run dry or been
+   // stopped.  Only one thread may call this.
+   virtual size_t Read(float *samples, size_t frame_count) = 0;
+};
+
+// Reads 16-bit PCM or 32-bit float WAV files, mixing down to mono.
+// Returns false if the file couldn't be read.
+bool ReadWavFile(const std::wstring &filename, std::vector<float> *samples, unsigned int *sample_rate);
+
+// Plays a recording as though it were coming in live.  This stands in for
+// a microphone when testing: when paced, Read() waits for the wall clock
+// to catch up with the audio, exactly as a real device would make it.
+class WavAudioSource : public AudioSource
+{
+public:
+   // Throws PianoGameError if the file couldn't be read
+   WavAudioSource(const std::wstring &filename, bool paced);
+
+   virtual unsigned int SampleRate() const { return m_sample_rate; }
+
+   virtual void Start();
+   virtual void Stop();
+   virtual size_t Read(float *samples, size_t frame_count);
+
+   size_t FrameCount() const { return m_samples.size(); }
+
+   // Compatible::GetMicroseconds() at the last Start(), which is when the
+   // first frame of the recording "happened"
+   microseconds_t StartTime() const { return m_start_time; }
+
+private:
+   std::vector<float> m_samples;
+   unsigned int m_sample_rate;
+   bool m_paced;
+
+   size_t m_position;
+   microseconds_t m_start_time;
+   volatile long m_stop;
+};
+
+#ifdef WIN32
+
+// Captures from the default WinMM wave input.  A few period-sized buffers
+// are kept queued with the device; Read() waits for the oldest one to fill.
+class WaveInAudioSource : public AudioSource
+{
+public:
+   // Throws PianoGameError if the device couldn't be opened
+   WaveInAudioSource(unsigned int sample_rate, size_t period_frames, int buffer_count);
+   ~WaveInAudioSource();
+
+   virtual unsigned int SampleRate() const { return m_sample_rate; }
+
+   virtual void Start();
+   virtual void Stop();
+   virtual size_t Read(float *samples, size_t frame_count);
+
+private:
+   WaveInAudioSource(const WaveInAudioSource&);
+   WaveInAudioSource &operator=(const WaveInAudioSource&);
+
+   HWAVEIN m_device;
+   HANDLE m_buffer_done;
+
+   unsigned int m_sample_rate;
+   size_t m_period_frames;
+   std::vector<WAVEHDR> m_headers;
+   std::vector<short> m_buffers;
+
+   // The buffer Read() is working through, and how far into it
+   size_t m_next;
+   size_t m_offset;
+
+   volatile long m_stop;
+};
+
+#endif
+
+#endif
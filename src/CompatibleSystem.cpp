@@ -11,6 +11,14 @@
     #include <sys/time.h>
 #endif
 
+#if !defined WIN32 && !defined __APPLE__
+#include <iostream>
+
+// Headless builds pretend to have a display this size
+const static int HeadlessDisplayWidth = 1024;
+const static int HeadlessDisplayHeight = 768;
+#endif
+
 namespace Compatible
 {
    unsigned long GetMilliseconds()
@@ -24,6 +32,26 @@ namespace Compatible
 #endif
    }
 
+   microseconds_t GetMicroseconds()
+   {
+#ifdef WIN32
+      static LARGE_INTEGER frequency = { 0 };
+      if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+
+      LARGE_INTEGER now;
+      QueryPerformanceCounter(&now);
+
+      // Split the division to avoid overflowing on long uptimes
+      const microseconds_t seconds = now.QuadPart / frequency.QuadPart;
+      const microseconds_t remainder = now.QuadPart % frequency.QuadPart;
+      return seconds * 1000000 + (remainder * 1000000) / frequency.QuadPart;
+#else
+      timeval tv;
+      gettimeofday(&tv, 0);
+      return static_cast<microseconds_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+#endif
+   }
+
 
 #ifdef WIN32
    void ShowError(const std::wstring &err)
@@ -33,13 +61,18 @@ namespace Compatible
       
       MessageBox(0, err.c_str(), message_box_title.c_str(), MB_ICONERROR);
    }
+#elif !defined __APPLE__
+   void ShowError(const std::wstring &err)
+   {
+      std::wcerr << L"Piano Game " << PianoGameVersionString << L" Error: " << err << std::endl;
+   }
 #endif
 
    void HideMouseCursor()
    {
 #ifdef WIN32
       ShowCursor(false);
-#else
+#elif defined __APPLE__
       CGDisplayHideCursor(kCGDirectMainDisplay);
 #endif
    }
@@ -48,7 +81,7 @@ namespace Compatible
    {
 #ifdef WIN32
       ShowCursor(true);
-#else
+#elif defined __APPLE__
       CGDisplayShowCursor(kCGDirectMainDisplay);
 #endif
    }
@@ -58,8 +91,10 @@ namespace Compatible
    {
 #ifdef WIN32
       return GetSystemMetrics(SM_CXSCREEN);
-#else
+#elif defined __APPLE__
       return int(CGDisplayBounds(kCGDirectMainDisplay).size.width);
+#else
+      return HeadlessDisplayWidth;
 #endif
    }
 
@@ -67,8 +102,35 @@ namespace Compatible
    {
 #ifdef WIN32
       return GetSystemMetrics(SM_CYSCREEN);
-#else
+#elif defined __APPLE__
       return int(CGDisplayBounds(kCGDirectMainDisplay).size.height);
+#else
+      return HeadlessDisplayHeight;
+#endif
+   }
+
+   int GetDisplayRefreshRate()
+   {
+#ifdef WIN32
+      DEVMODE mode;
+      ZeroMemory(&mode, sizeof(mode));
+      mode.dmSize = sizeof(mode);
+      if (!EnumDisplaySettings(0, ENUM_CURRENT_SETTINGS, &mode)) return 0;
+
+      // 0 and 1 both mean "the hardware's default"
+      if (mode.dmDisplayFrequency <= 1) return 0;
+      return static_cast<int>(mode.dmDisplayFrequency);
+#elif defined __APPLE__
+      CGDisplayModeRef mode = CGDisplayCopyDisplayMode(kCGDirectMainDisplay);
+      if (!mode) return 0;
+
+      // Built-in LCDs usually report 0
+      const double rate = CGDisplayModeGetRefreshRate(mode);
+      CGDisplayModeRelease(mode);
+
+      return static_cast<int>(rate + 0.5);
+#else
+      return 0;
 #endif
    }
 
@@ -78,6 +140,17 @@ namespace Compatible
    {
       PostQuitMessage(0);
    }
+#elif !defined __APPLE__
+   void GracefulShutdown()
+   {
+      // Headless tools run their own loop and don't need to be told
+   }
 #endif
 
+   std::string NarrowFilename(const std::wstring &filename)
+   {
+      // TODO: This isn't Unicode!
+      return std::string(filename.begin(), filename.end());
+   }
+
 }; // End namespace
@@ -6,24 +6,48 @@
 #define __COMPATIBLE_SYSTEM_H
 
 #include <string>
+#include <fstream>
+#include "libmidi/MidiTypes.h"
 
 namespace Compatible
 {
    // Some monotonically increasing value tied to the system
    // clock (but not necessarily based on app-start)
    unsigned long GetMilliseconds();
+
+   // A higher resolution version of the above for timing
+   // measurements.  Same caveats apply.
+   microseconds_t GetMicroseconds();
    
    // Shows an error box with an OK button
    void ShowError(const std::wstring &err);
    
    int GetDisplayWidth();
    int GetDisplayHeight();
+
+   // In Hz, or 0 if the system won't say
+   int GetDisplayRefreshRate();
    
    void HideMouseCursor();
    void ShowMouseCursor();
    
    // Send a message to terminate the application loop gracefully
    void GracefulShutdown();
+
+   // For APIs that can only take a narrow filename
+   std::string NarrowFilename(const std::wstring &filename);
+
+   // Opens a std::ifstream, std::ofstream or std::fstream by its (wide)
+   // filename.  Check file.good() afterward, as usual.
+   template <class FileStream>
+   void OpenFile(FileStream &file, const std::wstring &filename, std::ios::openmode mode)
+   {
+#ifdef WIN32
+      file.open(filename.c_str(), mode);
+#else
+      file.open(NarrowFilename(filename).c_str(), mode);
+#endif
+   }
 };
 
 #endif
@@ -13,10 +13,12 @@ const static int GraphicHeight = 36;
 DeviceTile::DeviceTile(int x, int y, int device_id, DeviceTileType type,
                        const MidiCommDescriptionList &device_list, 
                        Tga *button_graphics, Tga *frame_graphics)
-: m_x(x), m_y(y), m_device_id(device_id), m_preview_on(false), m_tile_type(type),
+: m_x(x), m_y(y), m_device_index(-1), m_preview_on(false), m_tile_type(type),
   m_device_list(device_list), m_button_graphics(button_graphics),
   m_frame_graphics(frame_graphics)
 {
+   SetDeviceId(device_id);
+
    // Initialize the size and position of each button
    whole_tile = ButtonState(0, 0, DeviceTileWidth, DeviceTileHeight);
    button_mode_left  = ButtonState(  6, 38, GraphicWidth, GraphicHeight);
@@ -34,18 +36,19 @@ void DeviceTile::Update(const MouseInfo &translated_mouse)
 
    if (m_device_list.size() > 0)
    {
-      const int last_device = static_cast<int>(m_device_list.size() - 1);
+      int last_device = static_cast<int>(m_device_list.size() - 1);
+      if (OffersAllDevices()) ++last_device;
 
       if (button_mode_left.hit)
       {
-         if (m_device_id == -1) m_device_id = last_device;
-         else --m_device_id;
+         if (m_device_index == -1) m_device_index = last_device;
+         else --m_device_index;
       }
 
       if (button_mode_right.hit)
       {
-         if (m_device_id == last_device) m_device_id = -1;
-         else ++m_device_id;
+         if (m_device_index == last_device) m_device_index = -1;
+         else ++m_device_index;
       }
    }
 
@@ -56,6 +59,53 @@ void DeviceTile::Update(const MouseInfo &translated_mouse)
 
 }
 
+bool DeviceTile::OffersAllDevices() const
+{
+   return (m_tile_type == DeviceTileInput && m_device_list.size() > 1);
+}
+
+int DeviceTile::GetDeviceId() const
+{
+   if (m_device_index < 0) return -1;
+   if (m_device_index == static_cast<int>(m_device_list.size())) return AllInputDevicesId;
+
+   return static_cast<int>(m_device_list[m_device_index].id);
+}
+
+void DeviceTile::SetDeviceId(int device_id)
+{
+   m_device_index = -1;
+   if (device_id == AllInputDevicesId && OffersAllDevices()) m_device_index = static_cast<int>(m_device_list.size());
+   if (device_id < 0) return;
+
+   for (size_t i = 0; i < m_device_list.size(); ++i)
+   {
+      if (static_cast<int>(m_device_list[i].id) == device_id) m_device_index = static_cast<int>(i);
+   }
+}
+
+void DeviceTile::SetDeviceList(const MidiCommDescriptionList &device_list)
+{
+   const int selected_id = GetDeviceId();
+   const bool had_selection = (selected_id >= 0);
+
+   std::wstring selected_name;
+   if (had_selection) selected_name = m_device_list[m_device_index].name;
+
+   m_device_list = device_list;
+   m_device_index = -1;
+
+   if (selected_id == AllInputDevicesId) SetDeviceId(AllInputDevicesId);
+   if (!had_selection) return;
+   for (size_t i = 0; i < m_device_list.size(); ++i)
+   {
+      if (m_device_list[i].name != selected_name) continue;
+
+      m_device_index = static_cast<int>(i);
+      break;
+   }
+}
+
 int DeviceTile::LookupGraphic(TrackTileGraphic graphic, bool button_hovering) const
 {
    // There are three sets of graphics
@@ -100,9 +150,13 @@ void DeviceTile::Draw(Renderer &renderer) const
    else
    {
       // A -1 for device_id means "disabled"
-      if (m_device_id >= 0)
+      if (GetDeviceId() == AllInputDevicesId)
+      {
+         mode << L"[All " << static_cast<int>(m_device_list.size()) << L" Input Devices]";
+      }
+      else if (m_device_index >= 0)
       {
-         mode << m_device_list[m_device_id].name;
+         mode << m_device_list[m_device_index].name;
       }
       else
       {
@@ -27,6 +27,10 @@ enum DeviceTileType
    DeviceTileInput
 };
 
+// Input tiles with more than one device to choose from also offer
+// every device at once, which they report with this special id.
+const int AllInputDevicesId = -2;
+
 class DeviceTile
 {
 public:
@@ -43,7 +47,17 @@ public:
    bool IsPreviewOn() const { return m_preview_on; }
    void TurnOffPreview() { m_preview_on = false; }
 
-   int GetDeviceId() const { return m_device_id; }
+   // Returns -1 if the tile is set to "disabled" (or AllInputDevicesId)
+   int GetDeviceId() const;
+
+   // Replaces the list of devices to choose from (e.g. after a device was
+   // plugged in or removed).  The current selection is kept if a device
+   // with the same name is still present, otherwise the tile is disabled.
+   void SetDeviceList(const MidiCommDescriptionList &device_list);
+
+   // Selects the device with the given id, or disables the tile if there
+   // isn't one.
+   void SetDeviceId(int device_id);
 
    const ButtonState WholeTile() const { return whole_tile; }
    const ButtonState ButtonPreview() const { return button_preview; }
@@ -57,9 +71,14 @@ private:
    int m_y;
 
    bool m_preview_on;
-   int m_device_id;
 
-   const MidiCommDescriptionList m_device_list;
+   // An index into m_device_list, or -1 for "disabled".  One past the end
+   // of the list means "all devices".
+   int m_device_index;
+
+   bool OffersAllDevices() const;
+
+   MidiCommDescriptionList m_device_list;
 
    DeviceTileType m_tile_type;
 
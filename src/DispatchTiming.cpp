@@ -0,0 +1,72 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "DispatchTiming.h"
+#include "CompatibleSystem.h"
+
+#include <fstream>
+using namespace std;
+
+DispatchTiming::DispatchTiming(size_t track_count)
+   : m_track_count(track_count), m_by_track(0), m_by_track_and_type(0)
+{
+   // Everything is allocated up front so Record() never has to
+   m_by_track = new LatencyHistogram[m_track_count];
+   m_by_track_and_type = new LatencyHistogram[m_track_count * TypeCount];
+}
+
+DispatchTiming::~DispatchTiming()
+{
+   delete[] m_by_track;
+   delete[] m_by_track_and_type;
+}
+
+void DispatchTiming::Record(size_t track_id, MidiEventType type, microseconds_t lateness)
+{
+   if (track_id >= m_track_count) return;
+   if (type < 0 || type >= TypeCount) return;
+
+   m_total.Record(lateness);
+   m_by_type[type].Record(lateness);
+   m_by_track[track_id].Record(lateness);
+   m_by_track_and_type[track_id * TypeCount + type].Record(lateness);
+}
+
+void DispatchTiming::Reset()
+{
+   m_total.Reset();
+   for (int i = 0; i < TypeCount; ++i) m_by_type[i].Reset();
+   for (size_t i = 0; i < m_track_count; ++i) m_by_track[i].Reset();
+   for (size_t i = 0; i < m_track_count * TypeCount; ++i) m_by_track_and_type[i].Reset();
+}
+
+bool DispatchTiming::WriteCsv(const wstring &filename) const
+{
+   ofstream file;
+   Compatible::OpenFile(file, filename, ios::out | ios::trunc);
+
+   if (!file.good()) return false;
+
+   file << "track,event_type,count,p50_us,p99_us,max_us\n";
+
+   for (size_t t = 0; t < m_track_count; ++t)
+   {
+      for (int type = 0; type < TypeCount; ++type)
+      {
+         const LatencyHistogram &h = ForTrackAndType(t, static_cast<MidiEventType>(type));
+         if (h.Count() == 0) continue;
+
+         const wstring wide_name = GetMidiEventTypeDescription(static_cast<MidiEventType>(type));
+         const string type_name(wide_name.begin(), wide_name.end());
+
+         file << t << "," << type_name << "," << h.Count() << "," << h.Percentile(0.50) << ","
+            << h.Percentile(0.99) << "," << h.Max() << "\n";
+      }
+   }
+
+   file << "all,all," << m_total.Count() << "," << m_total.Percentile(0.50) << ","
+      << m_total.Percentile(0.99) << "," << m_total.Max() << "\n";
+
+   return file.good();
+}
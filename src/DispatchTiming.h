@@ -0,0 +1,55 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __DISPATCH_TIMING_H
+#define __DISPATCH_TIMING_H
+
+#include <string>
+
+#include "LatencyHistogram.h"
+#include "libmidi/MidiUtil.h"
+#include "libmidi/MidiTypes.h"
+
+// Keeps track of how late each outgoing MIDI event was actually sent
+// relative to the moment the song said it should be played.  Samples are
+// broken down by event type and by track.
+//
+// Record() is lock-free, so every output worker can record into the same
+// DispatchTiming at once while the game thread reads the results.  A
+// Reset() racing a worker may keep that worker's latest sample.
+class DispatchTiming
+{
+public:
+   const static int TypeCount = MidiEventType_PitchWheel + 1;
+
+   DispatchTiming(size_t track_count);
+   ~DispatchTiming();
+
+   void Record(size_t track_id, MidiEventType type, microseconds_t lateness);
+   void Reset();
+
+   size_t TrackCount() const { return m_track_count; }
+
+   const LatencyHistogram &Total() const { return m_total; }
+   const LatencyHistogram &ForType(MidiEventType type) const { return m_by_type[type]; }
+   const LatencyHistogram &ForTrack(size_t track_id) const { return m_by_track[track_id]; }
+   const LatencyHistogram &ForTrackAndType(size_t track_id, MidiEventType type) const { return m_by_track_and_type[track_id * TypeCount + type]; }
+
+   // Writes one row for each track/type pair that received any samples.
+   // Returns false if the file couldn't be written.
+   bool WriteCsv(const std::wstring &filename) const;
+
+private:
+   DispatchTiming(const DispatchTiming&);
+   DispatchTiming &operator=(const DispatchTiming&);
+
+   size_t m_track_count;
+
+   LatencyHistogram m_total;
+   LatencyHistogram m_by_type[TypeCount];
+   LatencyHistogram *m_by_track;
+   LatencyHistogram *m_by_track_and_type;
+};
+
+#endif
@@ -0,0 +1,128 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "FramePacer.h"
+#include "CompatibleSystem.h"
+#include "Threading.h"
+
+#include <algorithm>
+using namespace std;
+
+// Always left between finishing a frame and its vsync
+const static microseconds_t Margin = 2000;
+
+// How much each missed deadline widens the margin, and how much each
+// frame that makes it narrows it again
+const static microseconds_t MissPenalty = 1000;
+const static microseconds_t MarginRecovery = 10;
+
+// SwapBuffers returns a little after vsync, by however long it took the
+// OS to wake us.  Only this fraction of any lateness is believed, so the
+// odd slow wakeup doesn't push the predicted vsyncs (and every frame
+// after it) later.  Vsync coming early is always believed.
+const static microseconds_t LatenessTrust = 8;
+
+// Past this many periods without a frame (while the main loop idles, say)
+// the predicted vsync has drifted too far to trust
+const static microseconds_t MaxPredictedFrames = 8;
+
+// Sleeping is only accurate to a millisecond or so, so we spin through the
+// last stretch
+const static microseconds_t SpinMicroseconds = 2000;
+
+FramePacer::FramePacer(microseconds_t refresh_period)
+   : m_period(refresh_period), m_cost_count(0), m_longest_cost(0), m_extra_margin(0), m_vsync(0),
+   m_frame_start(0), m_predicted(0), m_last_predicted(0), m_last_shown(0), m_missed(0)
+{
+#ifdef WIN32
+   // Otherwise Sleep(1) can take as long as 15ms
+   timeBeginPeriod(1);
+#endif
+}
+
+FramePacer::~FramePacer()
+{
+#ifdef WIN32
+   timeEndPeriod(1);
+#endif
+}
+
+microseconds_t FramePacer::WorkBudget() const
+{
+   return m_longest_cost + Margin + m_extra_margin;
+}
+
+void FramePacer::WaitForFrameStart()
+{
+   const microseconds_t now = Compatible::GetMicroseconds();
+
+   m_predicted = 0;
+   m_frame_start = now;
+
+   if (m_period <= 0 || m_vsync == 0) return;
+   if (now - m_vsync > m_period * MaxPredictedFrames) return;
+
+   // Frames that don't fit between two vsyncs can't afford to wait
+   const microseconds_t budget = WorkBudget();
+   if (budget >= m_period) return;
+
+   // The first vsync we can still make
+   microseconds_t deadline = m_vsync + m_period;
+   while (deadline < now + budget) deadline += m_period;
+
+   m_predicted = deadline;
+   const microseconds_t start = deadline - budget;
+
+   for (;;)
+   {
+      const microseconds_t remaining = start - Compatible::GetMicroseconds();
+      if (remaining <= 0) break;
+
+      if (remaining > SpinMicroseconds) Thread::Sleep(static_cast<unsigned long>((remaining - SpinMicroseconds) / 1000));
+   }
+
+   m_frame_start = Compatible::GetMicroseconds();
+}
+
+void FramePacer::DrawFinished()
+{
+   const microseconds_t cost = Compatible::GetMicroseconds() - m_frame_start;
+   m_costs[m_cost_count++ % HistorySize] = max(cost, static_cast<microseconds_t>(0));
+
+   const int count = static_cast<int>(min(m_cost_count, static_cast<unsigned long>(HistorySize)));
+   m_longest_cost = *max_element(m_costs, m_costs + count);
+}
+
+void FramePacer::FrameShown()
+{
+   const microseconds_t now = Compatible::GetMicroseconds();
+
+   if (m_vsync == 0 || now - m_vsync > m_period * MaxPredictedFrames) m_vsync = now;
+   else
+   {
+      // The vsync nearest to now
+      microseconds_t expected = m_vsync + m_period;
+      while (expected + m_period / 2 < now) expected += m_period;
+
+      const microseconds_t lateness = now - expected;
+      if (lateness < 0) m_vsync = now;
+      else m_vsync = expected + lateness / LatenessTrust;
+   }
+
+   if (m_predicted != 0)
+   {
+      const microseconds_t error = now - m_predicted;
+      m_deadline_error.Record(error < 0 ? -error : error);
+
+      if (error > m_period / 2)
+      {
+         m_missed++;
+         m_extra_margin = min(m_extra_margin + MissPenalty, m_period / 2);
+      }
+      else m_extra_margin = max(m_extra_margin - MarginRecovery, static_cast<microseconds_t>(0));
+   }
+
+   m_last_predicted = m_predicted;
+   m_last_shown = now;
+}
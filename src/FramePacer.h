@@ -0,0 +1,82 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __FRAME_PACER_H
+#define __FRAME_PACER_H
+
+#include "LatencyHistogram.h"
+#include "libmidi/MidiTypes.h"
+
+// Starts each frame as late as it safely can, so input (and MIDI) is
+// picked up as close as possible to the vsync that shows it.
+//
+// Left alone, a frame is updated the moment the previous SwapBuffers
+// returns and then sits finished until the next vsync, so a key that
+// arrives just after Listen() waits almost two frames to be seen.  The
+// pacer follows when vsync happens from when SwapBuffers returns, keeps
+// track of how long recent frames took to update and draw, and sleeps
+// until that long (plus a margin) before the next vsync.
+//
+// Every frame that misses its deadline widens the margin a little, which
+// covers work the CPU can't see (like the GPU finishing up), and it
+// slowly closes again while frames make it.
+class FramePacer
+{
+public:
+   // The time between vsyncs, from the display's refresh rate
+   FramePacer(microseconds_t refresh_period);
+   ~FramePacer();
+
+   // Sleeps until it's time to start the next frame.  This returns right
+   // away until a frame has been shown (or after a long pause in drawing,
+   // which throws the prediction off).
+   void WaitForFrameStart();
+
+   // Call just before SwapBuffers and again as soon as it returns
+   void DrawFinished();
+   void FrameShown();
+
+   microseconds_t RefreshPeriod() const { return m_period; }
+
+   // How long before a vsync each frame is started
+   microseconds_t WorkBudget() const;
+
+   // When the last frame was expected to be shown (0 if it wasn't paced)
+   // and when it actually was
+   microseconds_t PredictedDeadline() const { return m_last_predicted; }
+   microseconds_t ActualDeadline() const { return m_last_shown; }
+
+   // How far each paced frame was shown from its predicted deadline
+   // (either way), and how many were at least half a period late
+   const LatencyHistogram &DeadlineError() const { return m_deadline_error; }
+   unsigned long MissedDeadlines() const { return m_missed; }
+
+private:
+   FramePacer(const FramePacer&);
+   FramePacer &operator=(const FramePacer&);
+
+   const static int HistorySize = 32;
+
+   const microseconds_t m_period;
+
+   // How long the most recent HistorySize frames took
+   microseconds_t m_costs[HistorySize];
+   unsigned long m_cost_count;
+   microseconds_t m_longest_cost;
+
+   microseconds_t m_extra_margin;
+
+   // Our best guess at when the last vsync happened
+   microseconds_t m_vsync;
+
+   microseconds_t m_frame_start;
+   microseconds_t m_predicted;
+   microseconds_t m_last_predicted;
+   microseconds_t m_last_shown;
+
+   LatencyHistogram m_deadline_error;
+   unsigned long m_missed;
+};
+
+#endif
@@ -7,16 +7,19 @@
 #include "Textures.h"
 #include "CompatibleSystem.h"
 #include "Tga.h"
+#include "TextureAtlas.h"
+#include "SessionLog.h"
+#include "FramePacer.h"
 #include "os_graphics.h"
 
 // For FPS display
 #include "TextWriter.h"
 #include <iomanip>
 
-Tga *GameState::GetTexture(Texture tex_name, bool smooth) const
+Tga *GameState::GetTexture(Texture tex_name) const
 {
    if (!m_manager) throw GameStateError("Cannot retrieve texture if manager not set!");
-   return m_manager->GetTexture(tex_name, smooth);
+   return m_manager->GetTexture(tex_name);
 }
 
 void GameState::ChangeState(GameState *new_state)
@@ -49,6 +52,18 @@ const MouseInfo &GameState::Mouse() const
    return m_manager->Mouse();
 }
 
+bool GameState::IsOverlayVisible() const
+{
+   if (!m_manager) throw GameStateError("Cannot determine overlay visibility if manager not set!");
+   return m_manager->IsOverlayVisible();
+}
+
+void GameState::RecordSession(SessionRecorder *recorder)
+{
+   if (!m_manager) throw GameStateError("Cannot record a session if manager not set!");
+   m_manager->SetSessionRecorder(recorder);
+}
+
 void GameState::SetManager(GameStateManager *manager)
 {
    if (m_manager) throw GameStateError("State already has a manager!");
@@ -62,27 +77,64 @@ void GameState::SetManager(GameStateManager *manager)
 
 GameStateManager::~GameStateManager()
 {
-   for (std::map<Texture, Tga*>::iterator i = m_textures.begin(); i != m_textures.end(); ++i)
-   {
-      if (i->second) Tga::Release(i->second);
-      i->second = 0;
-   }
+   delete m_atlas;
+   m_atlas = 0;
 }
 
-Tga *GameStateManager::GetTexture(Texture tex_name, bool smooth) const
+Tga *GameStateManager::GetTexture(Texture tex_name) const
 {
-   if (!m_textures[tex_name])
-   {
-      m_textures[tex_name] = Tga::Load(TextureResourceNames[tex_name]);
-   }
+   if (!m_atlas) m_atlas = new TextureAtlas(TextureResourceNames, TextureIsSmooth, _TextureEnumCount);
+   return m_atlas->Get(tex_name);
+}
+
+// Long enough to let the CPU rest, short enough that anything a state
+// only notices by polling still shows up promptly
+const static unsigned long IdleTimeoutMilliseconds = 250;
+
+unsigned long GameStateManager::GetIdleMilliseconds() const
+{
+   // A state change is still in progress
+   if (!m_current_state || m_next_state) return 0;
+
+   // Keys pressed last frame are seen as released on the next one
+   if (m_key_presses || m_last_key_presses) return 0;
 
-   m_textures[tex_name]->SetSmooth(smooth);
+   // The frame counter only means something when frames keep coming
+   if (m_show_fps) return 0;
 
-   return m_textures[tex_name];
+   if (m_current_state->NeedsContinuousFrames()) return 0;
+   return IdleTimeoutMilliseconds;
+}
+
+unsigned long GameStateManager::GetMilliseconds() const
+{
+   if (m_clock) return m_clock->GetMilliseconds();
+   return Compatible::GetMilliseconds();
+}
+
+void GameStateManager::SetClock(GameClock *clock)
+{
+   m_clock = clock;
+
+   // Start counting from the new clock's idea of now
+   m_last_milliseconds = GetMilliseconds();
+}
+
+void GameStateManager::SetSessionRecorder(SessionRecorder *recorder)
+{
+   m_session = recorder;
+   if (!m_session) return;
+
+   // Keys pressed before the recording started still count this frame
+   for (unsigned long key = 1; key <= m_key_presses; key <<= 1)
+   {
+      if (m_key_presses & key) m_session->Key(static_cast<GameKey>(key));
+   }
 }
 
 void GameStateManager::KeyPress(GameKey key)
 {
+   if (m_session) m_session->Key(key);
    m_key_presses |= static_cast<unsigned long>(key);
 }
 
@@ -98,6 +150,8 @@ bool GameStateManager::IsKeyReleased(GameKey key) const
 
 void GameStateManager::MousePress(MouseButton button)
 {
+   if (m_session) m_session->MousePress(button);
+
    switch (button)
    {
    case MouseLeft:
@@ -116,6 +170,8 @@ void GameStateManager::MousePress(MouseButton button)
 
 void GameStateManager::MouseRelease(MouseButton button)
 {
+   if (m_session) m_session->MouseRelease(button);
+
    switch (button)
    {
    case MouseLeft:
@@ -134,6 +190,8 @@ void GameStateManager::MouseRelease(MouseButton button)
 
 void GameStateManager::MouseMove(int x, int y)
 {
+   if (m_session) m_session->MouseMove(x, y);
+
    m_mouse.x = x;
    m_mouse.y = y;
 }
@@ -161,11 +219,17 @@ void GameStateManager::ChangeState(GameState *new_state)
 
 void GameStateManager::Update(bool skip_this_update)
 {
+   // Everything below (the state's input and MIDI included) happens as
+   // late as the pacer thinks is safe
+   if (m_pacer) m_pacer->WaitForFrameStart();
+
    // Manager's timer grows constantly
-   const unsigned long now = Compatible::GetMilliseconds();
+   const unsigned long now = GetMilliseconds();
    const unsigned long delta = now - m_last_milliseconds;
    m_last_milliseconds = now;
 
+   if (m_session) m_session->Frame(delta, skip_this_update);
+
    // Now that we've updated the time, we can return if
    // we've been told to skip this one.
    if (skip_this_update) return;
@@ -189,7 +253,11 @@ void GameStateManager::Update(bool skip_this_update)
       m_current_state = m_next_state;
       m_next_state = 0;
 
+      // A recording started by the new state's Init() begins with this
+      // frame, which its first Update() is about to get
+      SessionRecorder *const recording = m_session;
       m_current_state->SetManager(this);
+      if (m_session && m_session != recording) m_session->Frame(delta, false);
    }
 
    if (!m_current_state) return;
@@ -219,16 +287,7 @@ void GameStateManager::Draw(Renderer &renderer)
    // the previous state *and* the current state during some transition
    // would be really easy.
 
-   const static float gray = 64.0f / 255.0f;
-   glClearColor(gray, gray, gray, 1.0f);
-
-   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-   glMatrixMode(GL_MODELVIEW);
-   glLoadIdentity();
-   glTranslatef(0., static_cast<GLfloat>(GetStateHeight()), 0.);
-   glScalef (1., -1., 1.);
-   glTranslatef(0.375, 0.375, 0.);
+   Renderer::BeginFrame(GetStateWidth(), GetStateHeight(), Renderer::ToColor(64, 64, 64));
 
    m_current_state->Draw(renderer);
 
@@ -236,8 +295,36 @@ void GameStateManager::Draw(Renderer &renderer)
    {
       TextWriter fps_writer(0, 0, renderer);
       fps_writer << Text(WSTRING(L"FPS: "), Gray) << Text(WSTRING(std::setprecision(6) << m_fps.GetFramesPerSecond()), White);
+
+      // The previous frame's totals; this one isn't finished yet
+      const SpriteBatchStats &stats = Renderer::LastFrameStats();
+      fps_writer << newline << Text(WSTRING(L"Draw calls: "), Gray) << Text(WSTRING(stats.draw_calls), White)
+         << Text(WSTRING(L"  Vertices: "), Gray) << Text(WSTRING(stats.vertices), White);
+      fps_writer << newline << Text(WSTRING(L"Fill: "), Gray) << Text(WSTRING(stats.pixels), White)
+         << Text(WSTRING(L" px  Copied: "), Gray) << Text(WSTRING(stats.copied_pixels), White) << Text(WSTRING(L" px"), Gray);
+
+      if (Renderer::GetSoftwareRasterizer())
+      {
+         fps_writer << newline << Text(WSTRING(L"Raster: "), Gray) << Text(WSTRING(stats.raster_time), White) << Text(WSTRING(L" us"), Gray);
+      }
+
+      // Where the last frame was expected to land against where it did
+      if (m_pacer && m_pacer->RefreshPeriod() > 0)
+      {
+         const microseconds_t predicted = m_pacer->PredictedDeadline();
+         const microseconds_t error = (predicted == 0 ? 0 : m_pacer->ActualDeadline() - predicted);
+
+         fps_writer << newline << Text(WSTRING(L"Vsync: "), Gray) << Text(WSTRING(m_pacer->RefreshPeriod()), White)
+            << Text(WSTRING(L" us  Budget: "), Gray) << Text(WSTRING(m_pacer->WorkBudget()), White)
+            << Text(WSTRING(L" us  Deadline error: "), Gray) << Text(WSTRING(error), White)
+            << Text(WSTRING(L" us (p99 "), Gray) << Text(WSTRING(m_pacer->DeadlineError().Percentile(0.99)), White)
+            << Text(WSTRING(L")  Missed: "), Gray) << Text(WSTRING(m_pacer->MissedDeadlines()), White);
+      }
    }
 
-   glFlush ();
+   Renderer::EndFrame();
+
+   if (m_pacer) m_pacer->DrawFinished();
    renderer.SwapBuffers();
+   if (m_pacer) m_pacer->FrameShown();
 }
@@ -16,6 +16,9 @@
 
 class Renderer;
 class Tga;
+class TextureAtlas;
+class SessionRecorder;
+class FramePacer;
 
 class GameStateError : public std::exception
 {
@@ -44,6 +47,8 @@ enum GameKey
    KeyEnter =  0x0040,
 
    KeyF6 =     0x0080,
+   KeyF7 =     0x0400,
+   KeyF8 =     0x0800,
 
    KeyPlus =   0x0100,
    KeyMinus =  0x0200
@@ -75,6 +80,15 @@ struct MouseInfo
    MouseButtons released;
 };
 
+// Where GameStateManager gets the time from.  Without one it uses the
+// system clock; a session replay substitutes the recorded frame times.
+class GameClock
+{
+public:
+   virtual ~GameClock() { }
+   virtual unsigned long GetMilliseconds() = 0;
+};
+
 class GameState
 {
 public:
@@ -98,6 +112,11 @@ protected:
    // GetStateWidth()) and [0, GetStateHeight())
    virtual void Draw(Renderer &renderer) const = 0;
 
+   // Whether anything on screen moves on its own (or a song is playing).
+   // When it doesn't, the main loop sleeps between frames until there is
+   // input, MIDI, or an idle timeout.
+   virtual bool NeedsContinuousFrames() const { return true; }
+
    // How long has this state been running
    unsigned long GetStateMilliseconds() const { return m_state_milliseconds; }
    
@@ -121,12 +140,20 @@ protected:
    // of the memory to the state handling subsystem.
    void ChangeState(GameState *new_state);
 
-   Tga *GetTexture(Texture tex_name, bool smooth = false) const;
+   Tga *GetTexture(Texture tex_name) const;
 
    // These are usable inside Update()
    bool IsKeyPressed(GameKey key) const;
    const MouseInfo &Mouse() const;
 
+   // Whether the F6 diagnostic overlay (FPS, etc.) is being shown
+   bool IsOverlayVisible() const;
+
+   // Logs everything the manager hands this state (frame times, keys
+   // and mouse) to recorder from here on, or stops if it's null.  The
+   // recorder must outlive the recording.
+   void RecordSession(SessionRecorder *recorder);
+
 private:
    void SetManager(GameStateManager *manager);
    GameStateManager *m_manager;
@@ -150,7 +177,7 @@ public:
    GameStateManager(int screen_width, int screen_height)
       : m_current_state(0), m_screen_x(screen_width), m_screen_y(screen_height),
       m_last_milliseconds(Compatible::GetMilliseconds()), m_next_state(0), m_key_presses(0), m_last_key_presses(0),
-      m_inside_update(false), m_fps(500.0), m_show_fps(false)
+      m_inside_update(false), m_fps(500.0), m_show_fps(false), m_atlas(0), m_clock(0), m_session(0), m_pacer(0)
    { }
    
    ~GameStateManager();
@@ -174,12 +201,35 @@ public:
 
    void ChangeState(GameState *new_state);
 
-   Tga *GetTexture(Texture tex_name, bool smooth) const;
+   // Every texture is loaded (and packed into the atlas) the first time
+   // any of them is asked for
+   Tga *GetTexture(Texture tex_name) const;
 
    int GetStateWidth() const { return m_screen_x; }
    int GetStateHeight() const { return m_screen_y; }
 
+   bool IsOverlayVisible() const { return m_show_fps; }
+
+   // How long the main loop may sleep before the next Update() and Draw()
+   // (waking early for input or MIDI), or 0 if it should keep going
+   unsigned long GetIdleMilliseconds() const;
+
+   // The clock must outlive the manager.  Null goes back to the system
+   // clock.
+   void SetClock(GameClock *clock);
+
+   // See GameState::RecordSession
+   void SetSessionRecorder(SessionRecorder *recorder);
+
+   // With a pacer, Update() sleeps until just before the next vsync is
+   // due (see FramePacer), and Draw() tells it when the frame was
+   // finished and shown.  The pacer must outlive the manager.  Null turns
+   // pacing off.
+   void SetFramePacer(FramePacer *pacer) { m_pacer = pacer; }
+
 private:
+   unsigned long GetMilliseconds() const;
+
    GameState *m_next_state;
    GameState *m_current_state;
 
@@ -197,7 +247,11 @@ private:
    int m_screen_x;
    int m_screen_y;
 
-   mutable std::map<Texture, Tga*> m_textures;
+   mutable TextureAtlas *m_atlas;
+
+   GameClock *m_clock;
+   SessionRecorder *m_session;
+   FramePacer *m_pacer;
 };
 
 
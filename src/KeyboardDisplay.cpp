@@ -11,6 +11,7 @@
 #include "Textures.h"
 #include "Tga.h"
 
+#include <cmath>
 using namespace std;
 
 const KeyboardDisplay::NoteTexDimensions KeyboardDisplay::WhiteNoteDimensions = { 32, 128, 4, 25, 22, 28, 93, 100 };
@@ -19,183 +20,377 @@ struct KeyTexDimensions
 {
    int tex_width;
    int tex_height;
-   
+
    int left;
    int right;
-   
+
    int top;
    int bottom;
 };
 const KeyboardDisplay::KeyTexDimensions KeyboardDisplay::BlackKeyDimensions = { 32, 128, 8, 20, 15, 109 };
 
+// Shiny music domain knowledge
+const static unsigned int NotesPerOctave = 12;
+const static bool IsBlackNote[12] = { false, true,  false, true,  false, false,
+                                      true,  false, true,  false, true,  false };
+
+const static int MinNoteHeight = 3;
+
+// Note geometry slots to start with (see m_note_vertices).  Always a
+// power of two.
+const static size_t InitialNoteSlots = 256;
+
+// Whether a ring of slot_count slots gives every note drawn this frame
+// (the held notes plus first up to last) a slot of its own
+static bool NotesFitSlots(size_t slot_count, const vector<size_t> &held_notes, size_t first, size_t last)
+{
+   if (held_notes.size() + (last - first) > slot_count) return false;
+
+   const size_t mask = slot_count - 1;
+   for (size_t i = 0; i < held_notes.size(); ++i)
+   {
+      if (((held_notes[i] - first) & mask) < last - first) return false;
+      for (size_t j = 0; j < i; ++j) if (((held_notes[i] ^ held_notes[j]) & mask) == 0) return false;
+   }
+
+   return true;
+}
+
 
 KeyboardDisplay::KeyboardDisplay(KeyboardSize size, int pixelWidth, int pixelHeight)
-   : m_size(size), m_width(pixelWidth), m_height(pixelHeight)
+   : m_width(pixelWidth), m_height(pixelHeight), m_merge_notes(true), m_retain_keys(true), m_cached_notes(0), m_cached_note_count(0),
+   m_cached_x(0), m_cached_y(0), m_cached_show_duration(0),
+   m_layer_x(0), m_layer_y(0), m_layer_shadow_tex(0), m_layer_black_key_tex(0)
 {
+   for (int i = 0; i < 4; ++i) m_cached_note_tex[i] = 0;
+   ResetActiveKeys();
+
+   unsigned int first_key = 0;
+   unsigned int last_key = 0;
+   GetKeyboardRange(size, &first_key, &last_key);
+
+   BuildLayout(first_key, last_key);
 }
 
+KeyboardDisplay::KeyboardDisplay(unsigned int first_key, unsigned int last_key, int pixelWidth, int pixelHeight)
+   : m_width(pixelWidth), m_height(pixelHeight), m_merge_notes(true), m_retain_keys(true), m_cached_notes(0), m_cached_note_count(0),
+   m_cached_x(0), m_cached_y(0), m_cached_show_duration(0),
+   m_layer_x(0), m_layer_y(0), m_layer_shadow_tex(0), m_layer_black_key_tex(0)
+{
+   for (int i = 0; i < 4; ++i) m_cached_note_tex[i] = 0;
+   ResetActiveKeys();
 
+   BuildLayout(first_key, last_key);
+}
 
-void KeyboardDisplay::Draw(Renderer &renderer, const Tga *key_tex[3], const Tga *note_tex[4], int x, int y,
-                           const TranslatedNoteSet &notes, microseconds_t show_duration, microseconds_t current_time,
-                           const std::vector<Track::Properties> &track_properties)
+void KeyboardDisplay::GetKeyboardRange(KeyboardSize size, unsigned int *first_key, unsigned int *last_key)
+{
+   // Source: Various "Specification" pages at Yamaha's website.  (In MIDI
+   // note numbers, so F3 here is what MidiEvent::NoteName calls "F3".)
+   const static unsigned int KeysOn37[2] = { 41, 77 };   // F3-F6
+   const static unsigned int KeysOn49[2] = { 24, 72 };   // C2-C6
+   const static unsigned int KeysOn61[2] = { 24, 84 };   // C2-C7
+   const static unsigned int KeysOn76[2] = { 16, 91 };   // E1-G7
+   const static unsigned int KeysOn88[2] = { 21, 108 };  // A1-C9
+
+   const unsigned int *keys = 0;
+   switch (size)
+   {
+   case KeyboardSize37: keys = KeysOn37; break;
+   case KeyboardSize49: keys = KeysOn49; break;
+   case KeyboardSize61: keys = KeysOn61; break;
+   case KeyboardSize76: keys = KeysOn76; break;
+   case KeyboardSize88: keys = KeysOn88; break;
+   default: throw PianoGameError(Error_BadPianoType);
+   }
+
+   *first_key = keys[0];
+   *last_key = keys[1];
+}
+
+void KeyboardDisplay::BuildLayout(unsigned int first_key, unsigned int last_key)
 {
+   // A keyboard has to start and end on white keys (a black key needs the
+   // white keys on either side of it to sit between)
+   if (first_key >= KeyCount || last_key >= KeyCount || first_key > last_key) throw PianoGameError(Error_BadPianoType);
+   if (IsBlackNote[first_key % NotesPerOctave]) first_key--;
+   if (IsBlackNote[last_key % NotesPerOctave] && last_key + 1 < KeyCount) last_key++;
+
+   m_first_key = first_key;
+   m_last_key = last_key;
+
+   m_white_key_count = 0;
+   for (unsigned int n = first_key; n <= last_key; ++n)
+   {
+      if (!IsBlackNote[n % NotesPerOctave]) m_white_key_count++;
+   }
+
    // Source: Measured from Yamaha P-70
    const static double WhiteWidthHeightRatio = 6.8181818;
    const static double BlackWidthHeightRatio = 7.9166666;
    const static double WhiteBlackWidthRatio = 0.5454545;
 
-   const int white_key_count = GetWhiteKeyCount();
-
    // Calculate the largest white key size we can, and then
    // leave room for a single pixel space between each key
-   int white_width = (m_width / white_key_count) - 1;
-   int white_space = 1;
+   m_white_width = (m_width / m_white_key_count) - 1;
+   m_white_space = 1;
 
-   int white_height = static_cast<int>(white_width * WhiteWidthHeightRatio);
+   m_white_height = static_cast<int>(m_white_width * WhiteWidthHeightRatio);
 
-   const int black_width = static_cast<int>(white_width * WhiteBlackWidthRatio);
-   const int black_height = static_cast<int>(black_width * BlackWidthHeightRatio);
-   const int black_offset = white_width - (black_width / 2);
+   m_black_width = static_cast<int>(m_white_width * WhiteBlackWidthRatio);
+   m_black_height = static_cast<int>(m_black_width * BlackWidthHeightRatio);
+   const int black_offset = m_white_width - (m_black_width / 2);
 
    // The dimensions given to the keyboard object are bounds.  Because of pixel
    // rounding, the keyboard will usually occupy less than the maximum in
    // either direction.
    //
    // So, we just try to center the keyboard inside the bounds.
-   const int final_width = (white_width + white_space) * white_key_count;
-   const int x_offset = (m_width - final_width) / 2;
-   const int y_offset = (m_height - white_height);
+   const int final_width = (m_white_width + m_white_space) * m_white_key_count;
+   m_x_offset = (m_width - final_width) / 2;
+   m_y_offset = (m_height - m_white_height);
 
    // Give the notes a little more room to work with so they can roll under
    // the keys without distortion
-   const int y_roll_under = white_height*3/4;
+   m_y_roll_under = m_white_height*3/4;
+
+   // Each black key straddles the white key before it and the next one
+   int white_index = 0;
+   for (unsigned int n = 0; n < KeyCount; ++n)
+   {
+      KeyGeometry &key = m_keys[n];
+      key.shown = (n >= first_key && n <= last_key);
+      key.black = IsBlackNote[n % NotesPerOctave];
+      key.x = 0;
+      key.width = (key.black ? m_black_width : m_white_width);
+
+      if (!key.shown) continue;
+
+      if (key.black) key.x = (white_index - 1) * (m_white_width + m_white_space) + black_offset;
+      else key.x = (white_index++) * (m_white_width + m_white_space);
+   }
+
+   // Nothing retained (see DrawRetainedKeys) matches a new layout
+   for (unsigned int n = 0; n < KeyCount; ++n) m_layer_keys[n] = -2;
+}
 
+void KeyboardDisplay::Draw(Renderer &renderer, const Tga *key_tex[3], const Tga *note_tex[4], int x, int y,
+                           const TranslatedNoteList &notes, const NoteStateList &note_states,
+                           const std::vector<size_t> &held_notes, size_t first_note,
+                           microseconds_t show_duration, microseconds_t current_time,
+                           const std::vector<Track::Properties> &track_properties)
+{
    // Symbolic names for the arbitrary array passed in here
    enum { Rail, Shadow, BlackKey };
 
-   DrawGuides(renderer, white_key_count, white_width, white_space, x + x_offset, y, y_offset);
+   const int left = x + m_x_offset;
+
+   DrawGuides(renderer, left, y);
+
+   // Cached note geometry only holds for the layout it was built with
+   const TranslatedNote *note_data = notes.empty() ? 0 : &notes[0];
+   bool cache_stale = (note_data != m_cached_notes || notes.size() != m_cached_note_count
+      || x != m_cached_x || y != m_cached_y || show_duration != m_cached_show_duration);
+   for (int i = 0; i < 4; ++i) cache_stale = cache_stale || (note_tex[i] != m_cached_note_tex[i]);
+
+   // Every note DrawNotePass might look at this frame needs a slot of its
+   // own.  The notes are sorted by start time, so they're the held notes
+   // and then first_note up to the first one that starts above the top of
+   // the screen.
+   const size_t first = min(first_note, notes.size());
+   size_t low = first;
+   size_t high = notes.size();
+   while (low < high)
+   {
+      const size_t mid = (low + high) / 2;
+      if (notes[mid].start > current_time + show_duration) high = mid;
+      else low = mid + 1;
+   }
+
+   size_t slot_count = max(m_slot_notes.size(), InitialNoteSlots);
+   while (!NotesFitSlots(slot_count, held_notes, first, low)) slot_count <<= 1;
+
+   if (cache_stale || slot_count != m_slot_notes.size())
+   {
+      m_note_vertices[0].assign(slot_count * VerticesPerNote, SpriteVertex());
+      m_note_vertices[1].assign(slot_count * VerticesPerNote, SpriteVertex());
+      m_slot_notes.assign(slot_count, 0);
+      m_slot_brushes.assign(slot_count, -1);
+
+      m_cached_notes = note_data;
+      m_cached_note_count = notes.size();
+      m_cached_x = x;
+      m_cached_y = y;
+      m_cached_show_duration = show_duration;
+      for (int i = 0; i < 4; ++i) m_cached_note_tex[i] = note_tex[i];
+   }
 
    // Do two passes on the notes, the first for note shadows and the second
    // for the note blocks themselves.  This is to avoid shadows being drawn
    // on top of notes.
    renderer.SetColor(Renderer::ToColor(255, 255, 255));
-   DrawNotePass(renderer, note_tex[0], note_tex[1], white_width, white_space, black_width, black_offset, x + x_offset, y, y_offset, y_roll_under, notes, show_duration, current_time, track_properties);
-   DrawNotePass(renderer, note_tex[2], note_tex[3], white_width, white_space, black_width, black_offset, x + x_offset, y, y_offset, y_roll_under, notes, show_duration, current_time, track_properties);
+   DrawNotePass(renderer, 0, note_tex, left, y, notes, note_states, held_notes, first, show_duration, current_time, track_properties);
+   DrawNotePass(renderer, 1, note_tex, left, y, notes, note_states, held_notes, first, show_duration, current_time, track_properties);
+
+   const int ActualKeyboardWidth = m_white_width*m_white_key_count + m_white_space*(m_white_key_count-1);
+
+   if (m_retain_keys) DrawRetainedKeys(renderer, key_tex[Shadow], key_tex[BlackKey], left, y+m_y_offset, ActualKeyboardWidth);
+   else DrawKeys(renderer, key_tex[Shadow], key_tex[BlackKey], left, y+m_y_offset, ActualKeyboardWidth, left, left + ActualKeyboardWidth, true);
 
-   const int ActualKeyboardWidth = white_width*white_key_count + white_space*(white_key_count-1);
+   DrawRail(renderer, key_tex[Rail], left, y+m_y_offset, ActualKeyboardWidth);
+
+   // Top of the screen shadow and rail
+   DrawShadow(renderer, key_tex[Shadow], left, y, ActualKeyboardWidth+1);
+   DrawRail(renderer, key_tex[Rail], left, y, ActualKeyboardWidth+1);
+}
 
+void KeyboardDisplay::DrawKeys(Renderer &renderer, const Tga *shadow_tex, const Tga *black_key_tex, int x, int y, int width,
+                               int from_x, int to_x, bool shadow_below) const
+{
    // Black out the background of where the keys are about to appear
    renderer.SetColor(Renderer::ToColor(0, 0, 0));
-   renderer.DrawQuad(x + x_offset, y+y_offset, ActualKeyboardWidth, white_height);
+   renderer.DrawQuad(x, y, width, m_white_height);
 
-   DrawShadow(renderer, key_tex[Shadow], x+x_offset, y+y_offset+white_height - 10, ActualKeyboardWidth);
-   DrawWhiteKeys(renderer, false, white_key_count, white_width, white_height, white_space, x+x_offset, y+y_offset);
-   DrawBlackKeys(renderer, key_tex[BlackKey], false, white_key_count, white_width, black_width, black_height, white_space, x+x_offset, y+y_offset, black_offset);
-   DrawShadow(renderer, key_tex[Shadow], x+x_offset, y+y_offset, ActualKeyboardWidth);
-   DrawRail(renderer, key_tex[Rail], x+x_offset, y+y_offset, ActualKeyboardWidth);
+   if (shadow_below) DrawShadow(renderer, shadow_tex, x, y + m_white_height - 10, width);
+   DrawWhiteKeys(renderer, false, x, y, from_x, to_x);
+   DrawBlackKeys(renderer, black_key_tex, false, x, y, from_x, to_x);
+   DrawShadow(renderer, shadow_tex, x, y, width);
+}
 
-   // Top of the screen shadow and rail
-   DrawShadow(renderer, key_tex[Shadow], x+x_offset, y, ActualKeyboardWidth+1);
-   DrawRail(renderer, key_tex[Rail], x+x_offset, y, ActualKeyboardWidth+1);
+void KeyboardDisplay::GetKeyColumns(unsigned int note_id, int x, int y, int *left, int *right) const
+{
+   const KeyGeometry &key = m_keys[note_id];
+
+   *left = x + key.x;
+   *right = *left + key.width;
+   if (!key.black) return;
+
+   int dest_y = 0;
+   int dest_w = 0;
+   int dest_h = 0;
+   GetBlackKeyRect(BlackKeyDimensions, x + key.x, y, key.width, m_black_height, left, &dest_y, &dest_w, &dest_h);
+   *right = *left + dest_w;
 }
 
-int KeyboardDisplay::GetStartingOctave() const
+void KeyboardDisplay::DrawRetainedKeys(Renderer &renderer, const Tga *shadow_tex, const Tga *black_key_tex, int x, int y, int width)
 {
-   // Source: Various "Specification" pages at Yamaha's website
-   const static int StartingOctaveOn37 = 2;
-   const static int StartingOctaveOn49 = 1;
-   const static int StartingOctaveOn61 = 1; // TODO!
-   const static int StartingOctaveOn76 = 0; // TODO!
-   const static int StartingOctaveOn88 = 0;
-
-   switch (m_size)
+   const static int ShadowOffsetY = 10;
+
+   // Black keys hang over the top of the keyboard a little (where notes
+   // show through, so that part is drawn every time), and the shadow
+   // under the keyboard is entirely below it.  Everything else has to
+   // land inside, or the keyboard can't be kept.
+   int black_x = 0;
+   int black_y = 0;
+   int black_w = 0;
+   int black_h = 0;
+   GetBlackKeyRect(BlackKeyDimensions, x, y, m_black_width, m_black_height, &black_x, &black_y, &black_w, &black_h);
+
+   // The same goes if the video card can't hold a texture that big
+   bool redraw_all = false;
+   const int bottom = y + m_white_height;
+   if (black_y + black_h > bottom || y + ShadowOffsetY + static_cast<int>(shadow_tex->GetHeight()) > bottom
+      || !m_key_layer.Resize(width, m_white_height, &redraw_all))
    {
-   case KeyboardSize37: return StartingOctaveOn37;
-   case KeyboardSize49: return StartingOctaveOn49;
-   case KeyboardSize61: return StartingOctaveOn61;
-   case KeyboardSize76: return StartingOctaveOn76;
-   case KeyboardSize88: return StartingOctaveOn88;
-   default: throw PianoGameError(Error_BadPianoType);
+      DrawKeys(renderer, shadow_tex, black_key_tex, x, y, width, x, x + width, true);
+      return;
    }
-}
 
-char KeyboardDisplay::GetStartingNote() const
-{
-   // Source: Various "Specification" pages at Yamaha's website
-   const static char StartingKeyOn37 = 'F'; // F3-F6
-   const static char StartingKeyOn49 = 'C'; // C3-C6
-   const static char StartingKeyOn61 = 'C'; // C1-C6 // TODO!
-   const static char StartingKeyOn76 = 'E'; // E0-G6 // TODO!
-   const static char StartingKeyOn88 = 'A'; // A0-C6
-
-   switch (m_size)
+   redraw_all = redraw_all || x != m_layer_x || y != m_layer_y;
+   redraw_all = redraw_all || shadow_tex != m_layer_shadow_tex || black_key_tex != m_layer_black_key_tex;
+
+   m_layer_x = x;
+   m_layer_y = y;
+   m_layer_shadow_tex = shadow_tex;
+   m_layer_black_key_tex = black_key_tex;
+
+   // Mark the columns under every key that looks different than it did
+   // when it was captured.  (A white key is covered by the black keys
+   // beside it, and they're redrawn with it.)
+   m_dirty_columns.assign(width, redraw_all ? 1 : 0);
+   for (unsigned int n = m_first_key; n <= m_last_key; ++n)
    {
-   case KeyboardSize37: return StartingKeyOn37;
-   case KeyboardSize49: return StartingKeyOn49;
-   case KeyboardSize61: return StartingKeyOn61;
-   case KeyboardSize76: return StartingKeyOn76;
-   case KeyboardSize88: return StartingKeyOn88;
-   default: throw PianoGameError(Error_BadPianoType);
+      const KeyState &state = m_key_states[n];
+      const int look = (state.presses > 0 ? static_cast<int>(state.stack[state.depth - 1].color) : -1);
+      if (look == m_layer_keys[n]) continue;
+      m_layer_keys[n] = look;
+
+      int left = 0;
+      int right = 0;
+      GetKeyColumns(n, x, y, &left, &right);
+
+      for (int c = max(left - x, 0); c < min(right - x, width); ++c) m_dirty_columns[c] = 1;
    }
-}
 
-int KeyboardDisplay::GetWhiteKeyCount() const
-{
-   // Source: Google Image Search
-   const static int WhiteKeysOn37 = 22;
-   const static int WhiteKeysOn49 = 29;
-   const static int WhiteKeysOn61 = 36;
-   const static int WhiteKeysOn76 = 45;
-   const static int WhiteKeysOn88 = 52;
-
-   switch (m_size)
+   if (!redraw_all) m_key_layer.Draw(renderer, x, y);
+
+   // Redraw each run of changed columns (just the keys that reach it) and
+   // capture it
+   int run_start = -1;
+   for (int c = 0; c <= width; ++c)
    {
-   case KeyboardSize37: return WhiteKeysOn37;
-   case KeyboardSize49: return WhiteKeysOn49;
-   case KeyboardSize61: return WhiteKeysOn61;
-   case KeyboardSize76: return WhiteKeysOn76;
-   case KeyboardSize88: return WhiteKeysOn88;
-   default: throw PianoGameError(Error_BadPianoType);
+      const bool dirty = (c < width && m_dirty_columns[c]);
+      if (dirty && run_start < 0) run_start = c;
+      if (dirty || run_start < 0) continue;
+
+      renderer.SetClip(x + run_start, y, c - run_start, m_white_height);
+      DrawKeys(renderer, shadow_tex, black_key_tex, x, y, width, x + run_start, x + c, false);
+      renderer.ClearClip();
+
+      m_key_layer.Capture(renderer, x + run_start, y, run_start, 0, c - run_start, m_white_height);
+      run_start = -1;
+   }
+
+   // The tops of the black keys
+   GetBlackKeyRect(BlackKeyDimensions, x, y, m_black_width, m_black_height, &black_x, &black_y, &black_w, &black_h);
+   if (black_y < y)
+   {
+      renderer.SetColor(Renderer::ToColor(255, 255, 255));
+      renderer.SetClip(x, black_y, width, y - black_y);
+      DrawBlackKeys(renderer, black_key_tex, false, x, y, x, x + width);
+      renderer.ClearClip();
    }
+
+   // Nothing in the layer reaches the shadow, so it doesn't matter that
+   // it's drawn last here
+   renderer.SetColor(Renderer::ToColor(0, 0, 0));
+   DrawShadow(renderer, shadow_tex, x, bottom - 10, width);
+   renderer.SetColor(Renderer::ToColor(255, 255, 255));
 }
 
-void KeyboardDisplay::DrawWhiteKeys(Renderer &renderer, bool active_only, int key_count, int key_width, int key_height,
-   int key_space, int x_offset, int y_offset) const
+void KeyboardDisplay::DrawWhiteKeys(Renderer &renderer, bool active_only, int x_offset, int y_offset, int from_x, int to_x) const
 {
    Color white = Renderer::ToColor(255, 255, 255);
 
-   char current_white = GetStartingNote();
-   int current_octave = GetStartingOctave() + 1;
-   for (int i = 0; i < key_count; ++i)
+   for (unsigned int n = m_first_key; n <= m_last_key; ++n)
    {
-      // Check to see if this is one of the active notes
-      const string note_name = STRING(current_white << current_octave);
+      const KeyGeometry &key = m_keys[n];
+      if (key.black) continue;
+
+      int left = 0;
+      int right = 0;
+      GetKeyColumns(n, x_offset, y_offset, &left, &right);
+      if (right <= from_x || left >= to_x) continue;
 
-      KeyNames::const_iterator find_result = m_active_keys.find(note_name);
-      bool active = (find_result != m_active_keys.end());
+      // Check to see if this is one of the active notes
+      const KeyState &state = m_key_states[n];
+      bool active = (state.presses > 0);
 
       Color c = white;
-      if (active) c = Track::ColorNoteWhite[find_result->second];
+      if (active) c = Track::ColorNoteWhite[state.stack[state.depth - 1].color];
 
       if ((active_only && active) || !active_only)
       {
          renderer.SetColor(c);
-
-         const int key_x = i * (key_width + key_space) + x_offset;
-         renderer.DrawQuad(key_x, y_offset, key_width, key_height);
+         renderer.DrawQuad(key.x + x_offset, y_offset, key.width, m_white_height);
       }
-
-      current_white++;
-      if (current_white == 'H') current_white = 'A';
-      if (current_white == 'C') current_octave++;
    }
-   
+
    renderer.SetColor(white);
 }
 
-void KeyboardDisplay::DrawBlackKey(Renderer &renderer, const Tga *tex, const KeyTexDimensions &tex_dimensions,
-                                   int x, int y, int w, int h, Track::TrackColor color) const
+void KeyboardDisplay::GetBlackKeyRect(const KeyTexDimensions &tex_dimensions, int x, int y, int w, int h,
+                                      int *dest_x, int *dest_y, int *dest_w, int *dest_h)
 {
    const KeyTexDimensions &d = tex_dimensions;
 
@@ -204,62 +399,59 @@ void KeyboardDisplay::DrawBlackKey(Renderer &renderer, const Tga *tex, const Key
    const double full_tex_width = d.tex_width * width_scale;
    const double left_offset = d.left * width_scale;
 
-   const int src_x = (int(color) * d.tex_width);
-   const int dest_x = int(x - left_offset) - 1;
-   const int dest_w = int(full_tex_width);
+   *dest_x = int(x - left_offset) - 1;
+   *dest_w = int(full_tex_width);
 
    const int tex_h = d.bottom - d.top;
    const double height_scale = double(h) / double(tex_h);
    const double full_tex_height = d.tex_height * height_scale;
    const double top_offset = d.top * height_scale;
 
-   const int dest_y = int(y - top_offset) - 1;
-   const int dest_h = int(full_tex_height);
+   *dest_y = int(y - top_offset) - 1;
+   *dest_h = int(full_tex_height);
+}
+
+void KeyboardDisplay::DrawBlackKey(Renderer &renderer, const Tga *tex, const KeyTexDimensions &tex_dimensions,
+                                   int x, int y, int w, int h, Track::TrackColor color) const
+{
+   const KeyTexDimensions &d = tex_dimensions;
+
+   int dest_x = 0;
+   int dest_y = 0;
+   int dest_w = 0;
+   int dest_h = 0;
+   GetBlackKeyRect(d, x, y, w, h, &dest_x, &dest_y, &dest_w, &dest_h);
 
+   const int src_x = (int(color) * d.tex_width);
    renderer.DrawStretchedTga(tex, dest_x, dest_y, dest_w, dest_h, src_x, 0, d.tex_width, d.tex_height);
 }
 
-void KeyboardDisplay::DrawBlackKeys(Renderer &renderer, const Tga *tex, bool active_only, int white_key_count, int white_width,
-   int black_width, int black_height, int key_space, int x_offset, int y_offset, int black_offset) const
+void KeyboardDisplay::DrawBlackKeys(Renderer &renderer, const Tga *tex, bool active_only, int x_offset, int y_offset, int from_x, int to_x) const
 {
-   char current_white = GetStartingNote();
-   int current_octave = GetStartingOctave() + 1;
-   for (int i = 0; i < white_key_count; ++i)
+   for (unsigned int n = m_first_key; n <= m_last_key; ++n)
    {
-      // Don't allow a very last black key
-      if (i == white_key_count - 1) break;
+      const KeyGeometry &key = m_keys[n];
+      if (!key.black) continue;
+
+      int left = 0;
+      int right = 0;
+      GetKeyColumns(n, x_offset, y_offset, &left, &right);
+      if (right <= from_x || left >= to_x) continue;
+
+      // Check to see if this is one of the active notes
+      const KeyState &state = m_key_states[n];
+      bool active = (state.presses > 0);
 
-      switch (current_white)
+      // In this case, MissedNote isn't actually MissedNote.  In the black key
+      // texture we use this value (which doesn't make any sense in this context)
+      // as the default "Black" color.
+      Track::TrackColor c = Track::MissedNote;
+      if (active) c = state.stack[state.depth - 1].color;
+
+      if (!active_only || (active_only && active))
       {
-      case 'A':
-      case 'C':
-      case 'D':
-      case 'F':
-      case 'G':
-         {
-            // Check to see if this is one of the active notes
-            const string note_name = STRING(current_white << '#' << current_octave);
-
-            KeyNames::const_iterator find_result = m_active_keys.find(note_name);
-            bool active = (find_result != m_active_keys.end());
-
-            // In this case, MissedNote isn't actually MissedNote.  In the black key
-            // texture we use this value (which doesn't make any sense in this context)
-            // as the default "Black" color.
-            Track::TrackColor c = Track::MissedNote;
-            if (active) c = find_result->second;
-
-            if (!active_only || (active_only && active))
-            {
-               const int start_x = i * (white_width + key_space) + x_offset + black_offset;
-               DrawBlackKey(renderer, tex, BlackKeyDimensions, start_x, y_offset, black_width, black_height, c);
-            }
-         }
+         DrawBlackKey(renderer, tex, BlackKeyDimensions, key.x + x_offset, y_offset, key.width, m_black_height, c);
       }
-
-      current_white++;
-      if (current_white == 'H') current_white = 'A';
-      if (current_white == 'C') current_octave++;
    }
 }
 
@@ -280,64 +472,50 @@ void KeyboardDisplay::DrawShadow(Renderer &renderer, const Tga *tex, int x, int
    DrawWidthStretched(renderer, tex, x, y + ShadowOffsetY, width);
 }
 
-void KeyboardDisplay::DrawGuides(Renderer &renderer, int key_count, int key_width, int key_space,
-                                 int x_offset, int y, int y_offset) const
+void KeyboardDisplay::DrawGuides(Renderer &renderer, int x_offset, int y) const
 {
    const static int PixelsOffKeyboard = 2;
-   int keyboard_width = key_width*key_count + key_space*(key_count-1);
+   int keyboard_width = m_white_width*m_white_key_count + m_white_space*(m_white_key_count-1);
 
    // Fill the background of the note-falling area
    renderer.ForceTexture(0);
    renderer.SetColor(0x60, 0x60, 0x60);
-   renderer.DrawQuad(x_offset, y, keyboard_width, y_offset - PixelsOffKeyboard);
+   renderer.DrawQuad(x_offset, y, keyboard_width, m_y_offset - PixelsOffKeyboard);
 
    // MACNOTE: Having 'static' keyword on these two makes the guide NOT appear
    // in Release mode.  (Debug mode works either way.)
    const Color thick(Renderer::ToColor(0x48,0x48,0x48));
    const Color thin(Renderer::ToColor(0x50,0x50,0x50));
 
-   char current_white = GetStartingNote() - 1;
-   int current_octave = GetStartingOctave() + 1;
-   for (int i = 0; i < key_count + 1; ++i)
+   // A guide runs down the right side of each white key that has a black
+   // key after it: thin beside C# and D#, thick beside F#, G# and A#
+   for (unsigned int n = m_first_key; n <= m_last_key; ++n)
    {
-      const int key_x = i * (key_width + key_space) + x_offset - 1;
+      const KeyGeometry &key = m_keys[n];
+      if (key.black) continue;
 
-      int guide_thickness = 1;
-      Color guide_color = thin;
+      const unsigned int next = (n + 1) % NotesPerOctave;
+      if (!IsBlackNote[next]) continue;
 
-      bool draw_guide = true;
-      switch (current_white)
-      {
-      case 'C':
-      case 'D':
-         guide_color = thin;
-         break;
-
-      case 'F':
-      case 'G':
-      case 'A':
-         guide_color = thick;
-         guide_thickness = 2;
-         break;
-
-      default:
-         draw_guide = false;
-         break;
-      }
+      const bool is_thick = (next == 6 || next == 8 || next == 10);
+      const int guide_thickness = (is_thick ? 2 : 1);
 
-      if (draw_guide)
-      {
-         renderer.SetColor(guide_color);
-         renderer.DrawQuad(key_x - guide_thickness/2, y, guide_thickness, y_offset - PixelsOffKeyboard);
-      }
+      const int key_x = key.x + key.width + m_white_space + x_offset - 1;
 
-      current_white++;
-      if (current_white == 'H') current_white = 'A';
-      if (current_white == 'C') current_octave++;
+      renderer.SetColor(is_thick ? thick : thin);
+      renderer.DrawQuad(key_x - guide_thickness/2, y, guide_thickness, m_y_offset - PixelsOffKeyboard);
    }
 }
 
 void KeyboardDisplay::DrawNote(Renderer &renderer, const Tga *tex, const NoteTexDimensions &tex_dimensions, int x, int y, int w, int h, int color_id) const
+{
+   SpriteVertex quads[VerticesPerNote];
+   BuildNote(quads, tex, tex_dimensions, x, y, w, h, color_id);
+
+   renderer.DrawQuads(tex->GetId(), quads, VerticesPerNote, 0, 0);
+}
+
+void KeyboardDisplay::BuildNote(SpriteVertex quads[VerticesPerNote], const Tga *tex, const NoteTexDimensions &tex_dimensions, int x, int y, int w, int h, int color_id) const
 {
    const NoteTexDimensions &d = tex_dimensions;
 
@@ -348,8 +526,11 @@ void KeyboardDisplay::DrawNote(Renderer &renderer, const Tga *tex, const NoteTex
    const double full_tex_width = d.tex_width * width_scale;
    const double left_offset = d.left * width_scale;
 
+   // Offsets are rounded on their own (rather than after they're added to
+   // the position) so a note comes out the same shape wherever it's built.
+   // See DrawNotePass.
    const int src_x = (color_id * d.tex_width);
-   const int dest_x = int(x - left_offset);
+   const int dest_x = x - int(ceil(left_offset));
    const int dest_w = int(full_tex_width);
 
    // Now we draw the note in three sections:
@@ -358,12 +539,10 @@ void KeyboardDisplay::DrawNote(Renderer &renderer, const Tga *tex, const NoteTex
    // - Heel (fixed (relative) height)
 
    // Force the note to be at least as large as the crown + heel height
-   const double crown_h = (d.crown_end - d.crown_start) * width_scale;
-   const double heel_h = (d.heel_end - d.heel_start) * width_scale;
-   const double min_height = crown_h + heel_h + 1.0;
+   const int min_height = MinimumNoteHeight(d, w);
    if (h < min_height)
    {
-      const int diff = int(min_height - h);
+      const int diff = min_height - h;
       h += diff;
       y -= diff;
    }
@@ -375,112 +554,257 @@ void KeyboardDisplay::DrawNote(Renderer &renderer, const Tga *tex, const NoteTex
    const double heel_height = double(d.heel_end - d.heel_start) * width_scale;
    const double bottom_height = double(d.tex_height - d.heel_end) * width_scale;
 
-   const int dest_y1 = int(y - crown_start_offset);
-   const int dest_y2 = int(dest_y1 + crown_end_offset);
-   const int dest_y3 = int((y+h) - heel_height);
-   const int dest_y4 = int(dest_y3 + bottom_height);
+   const int dest_y1 = y - int(ceil(crown_start_offset));
+   const int dest_y2 = dest_y1 + int(crown_end_offset);
+   const int dest_y3 = (y+h) - int(ceil(heel_height));
+   const int dest_y4 = dest_y3 + int(bottom_height);
 
-   renderer.DrawStretchedTga(tex, dest_x, dest_y1, dest_w, dest_y2 - dest_y1, src_x, 0, d.tex_width, d.crown_end);
-   renderer.DrawStretchedTga(tex, dest_x, dest_y2, dest_w, dest_y3 - dest_y2, src_x, d.crown_end, d.tex_width, d.heel_start - d.crown_end);
-   renderer.DrawStretchedTga(tex, dest_x, dest_y3, dest_w, dest_y4 - dest_y3, src_x, d.heel_start, d.tex_width, d.tex_height - d.heel_start);
+   Renderer::BuildStretchedTga(quads + 0, tex, dest_x, dest_y1, dest_w, dest_y2 - dest_y1, src_x, 0, d.tex_width, d.crown_end);
+   Renderer::BuildStretchedTga(quads + 4, tex, dest_x, dest_y2, dest_w, dest_y3 - dest_y2, src_x, d.crown_end, d.tex_width, d.heel_start - d.crown_end);
+   Renderer::BuildStretchedTga(quads + 8, tex, dest_x, dest_y3, dest_w, dest_y4 - dest_y3, src_x, d.heel_start, d.tex_width, d.tex_height - d.heel_start);
 }
 
+int KeyboardDisplay::MinimumNoteHeight(const NoteTexDimensions &d, int w)
+{
+   const double width_scale = double(w) / double(d.right - d.left);
 
-void KeyboardDisplay::DrawNotePass(Renderer &renderer, const Tga *tex_white, const Tga *tex_black, int white_width,
-   int key_space, int black_width, int black_offset, int x_offset, int y, int y_offset, int y_roll_under, 
-   const TranslatedNoteSet &notes, microseconds_t show_duration, microseconds_t current_time,
-   const std::vector<Track::Properties> &track_properties) const
+   const double crown_h = (d.crown_end - d.crown_start) * width_scale;
+   const double heel_h = (d.heel_end - d.heel_start) * width_scale;
+   return int(crown_h + heel_h + 1.0);
+}
+
+// Song time to pixels (in the note cache's song space).  Notes and the
+// current time are rounded down the same way, so a scrolled note always
+// lands on whole pixels.
+static long long TimeToPixels(microseconds_t time, double scaling_factor)
+{
+   return static_cast<long long>(floor(time * scaling_factor));
+}
+
+void KeyboardDisplay::GetNoteColumn(unsigned int note_id, int x_offset, int *left, int *width) const
+{
+   const KeyGeometry &key = m_keys[note_id];
+
+   *left = key.x + x_offset - 1;
+   *width = key.width + 2;
+}
+
+void KeyboardDisplay::CacheNote(size_t index, const TranslatedNote &note, int brush_id, const Tga *note_tex[4], int x_offset, double scaling_factor)
 {
-   // Shiny music domain knowledge
-   const static unsigned int NotesPerOctave = 12;
-   const static unsigned int WhiteNotesPerOctave = 7;
-   const static bool IsBlackNote[12] = { false, true,  false, true,  false, false,
-                                         true,  false, true,  false, true,  false };
-
-   // The constants used in the switch below refer to the number
-   // of white keys off 'C' that type of piano starts on
-   int keyboard_type_offset = 0;
-   switch (m_size)
+   int left = 0;
+   int width = 0;
+   GetNoteColumn(note.note_id, x_offset, &left, &width);
+
+   const int top = -static_cast<int>(TimeToPixels(note.end, scaling_factor));
+   const int bottom = -static_cast<int>(TimeToPixels(note.start, scaling_factor));
+   const int height = max(bottom - top, MinNoteHeight);
+
+   const bool is_black = m_keys[note.note_id].black;
+   const NoteTexDimensions &dimensions = (is_black ? BlackNoteDimensions : WhiteNoteDimensions);
+
+   const size_t slot = NoteSlot(index);
+   for (int pass = 0; pass < 2; ++pass)
    {
-   case KeyboardSize37: keyboard_type_offset = 4 - WhiteNotesPerOctave; break;
-   case KeyboardSize49: keyboard_type_offset = 0 - WhiteNotesPerOctave; break;
-   case KeyboardSize61: keyboard_type_offset = 7 - WhiteNotesPerOctave; break; // TODO!
-   case KeyboardSize76: keyboard_type_offset = 5 - WhiteNotesPerOctave; break; // TODO!
-   case KeyboardSize88: keyboard_type_offset = 2 - WhiteNotesPerOctave; break;
-   default: throw PianoGameError(Error_BadPianoType);
+      SpriteVertex *quads = &m_note_vertices[pass][slot * VerticesPerNote];
+      BuildNote(quads, note_tex[pass*2 + (is_black ? 1 : 0)], dimensions, left, top, width, height, brush_id);
    }
 
-   // This array describes how to "stack" notes in a single place.  The IsBlackNote array
-   // then tells which one should be shifted slightly to the right
-   const static int NoteToWhiteNoteOffset[12] = { 0, -1, -1, -2, -2, -2, -3, -3, -4, -4, -5, -5 };
+   m_slot_notes[slot] = index;
+   m_slot_brushes[slot] = static_cast<signed char>(brush_id);
+}
+
+bool KeyboardDisplay::IsNoteCached(size_t index, int brush_id) const
+{
+   const size_t slot = NoteSlot(index);
+   return (m_slot_brushes[slot] == brush_id && m_slot_notes[slot] == index);
+}
+
+void KeyboardDisplay::DrawNotePass(Renderer &renderer, int pass, const Tga *note_tex[4], int x_offset, int y,
+   const TranslatedNoteList &notes, const NoteStateList &note_states,
+   const std::vector<size_t> &held_notes, size_t first_note,
+   microseconds_t show_duration, microseconds_t current_time,
+   const std::vector<Track::Properties> &track_properties)
+{
+   const double scaling_factor = static_cast<double>(m_y_offset) / static_cast<double>(show_duration);
+   const long long roll_under = static_cast<int>(m_y_roll_under / scaling_factor);
 
-   const static int MinNoteHeight = 3;
+   // Song space (see m_note_vertices) to the screen
+   const long long now_pixels = TimeToPixels(current_time, scaling_factor);
+   const int scroll_y = static_cast<int>(y + m_y_offset + now_pixels);
+
+   // What's waiting to be drawn in each key's column
+   NoteSpan columns[KeyCount];
+   for (unsigned int c = 0; c < KeyCount; ++c) columns[c].notes = 0;
 
    bool drawing_black = false;
    for (int toggle = 0; toggle < 2; ++toggle)
    {
-      for (TranslatedNoteSet::const_iterator i = notes.begin(); i != notes.end(); ++i)
+      const Tga *tex = note_tex[pass*2 + (drawing_black ? 1 : 0)];
+
+      // However short a note is, DrawNote makes it at least this tall
+      const NoteTexDimensions &dimensions = (drawing_black ? BlackNoteDimensions : WhiteNoteDimensions);
+      const int drawn_height = MinimumNoteHeight(dimensions, (drawing_black ? m_black_width : m_white_width) + 2);
+
+      // The held notes come first, then everything from first_note on
+      const size_t candidates = held_notes.size() + (notes.size() - first_note);
+      for (size_t c = 0; c < candidates; ++c)
       {
+         const size_t n = (c < held_notes.size() ? held_notes[c] : first_note + c - held_notes.size());
+         const TranslatedNote *i = &notes[n];
+
          // This list is sorted by note start time.  The moment we encounter
          // a note scrolled off the window, we're done drawing
          if (i->start > current_time + show_duration) break;
 
+         // Finished notes whose hit windows have closed are gone
+         if (i->end < current_time && i->start + NoteWindowLength / 2 < current_time) continue;
+
+         // So are notes for keys this keyboard doesn't have
+         if (i->note_id >= KeyCount || !m_keys[i->note_id].shown) continue;
+
          const Track::Mode mode = track_properties[i->track_id].mode;
          if (mode == Track::ModeNotPlayed) continue;
          if (mode == Track::ModePlayedButHidden) continue;
 
-         const int octave = (i->note_id / NotesPerOctave) - GetStartingOctave();
-         const int octave_base = i->note_id % NotesPerOctave;
-         const int stack_offset = NoteToWhiteNoteOffset[octave_base];
-         const bool is_black = IsBlackNote[octave_base];
+         if (drawing_black != m_keys[i->note_id].black) continue;
 
-         if (drawing_black != is_black) continue;
-
-         const int octave_offset = (max(octave - 1, 0) * WhiteNotesPerOctave);
-         const int inner_octave_offset = (octave_base + stack_offset);
-         const int generalized_black_offset = (is_black?black_offset:0);
-
-         const double scaling_factor = static_cast<double>(y_offset) / static_cast<double>(show_duration);
-
-         const long long roll_under = static_cast<int>(y_roll_under / scaling_factor);
          const long long adjusted_start = max(i->start - current_time, -roll_under);
          const long long adjusted_end   = max(i->end   - current_time, 0LL);
          if (adjusted_end < adjusted_start) continue;
 
-         // Convert our times to pixel coordinates
-         const int y_end   = y - static_cast<int>(adjusted_start * scaling_factor) + y_offset;
-         const int y_start = y - static_cast<int>(adjusted_end   * scaling_factor) + y_offset;
-
-         const int start_x = (octave_offset + inner_octave_offset + keyboard_type_offset) * (white_width + key_space)
-            + generalized_black_offset + x_offset;
+         const Track::TrackColor color = track_properties[i->track_id].color;
 
-         const int left = start_x - 1;
-         const int top = y_start;
-         const int width = (is_black?black_width:white_width) + 2;
-         int height = y_end - y_start;
+         NoteSpan span;
+         span.note = n;
+         span.notes = 1;
+         span.brush_id = (note_states[n] == UserMissed ? Track::MissedNote : color);
 
-         // Force a note to be a minimum height at all times
-         // except when scrolling off underneath the keyboard and
-         // coming in from the top of the screen.
          const bool hitting_bottom = (adjusted_start + current_time != i->start);
          const bool hitting_top    = (adjusted_end   + current_time != i->end);
-         if (!hitting_bottom && !hitting_top)
+
+         // Nearly every note is whole, and just scrolls its cached geometry
+         // into place
+         span.cached = (!hitting_bottom && !hitting_top);
+         if (span.cached && !IsNoteCached(n, span.brush_id))
          {
-            while ( (height) < MinNoteHeight) height++;
+            CacheNote(n, *i, span.brush_id, note_tex, x_offset, scaling_factor);
          }
 
-         const Track::TrackColor color = track_properties[i->track_id].color;
-         const int &brush_id = (i->state == UserMissed ? Track::MissedNote : color);
+         // Convert our times to pixel coordinates.  (A cached note only
+         // needs them if it might be merged.)
+         if (!span.cached || m_merge_notes)
+         {
+            span.bottom = scroll_y - static_cast<int>(TimeToPixels(adjusted_start + current_time, scaling_factor));
+            span.top    = scroll_y - static_cast<int>(TimeToPixels(adjusted_end   + current_time, scaling_factor));
+
+            // Force a note to be a minimum height at all times except when
+            // scrolling off underneath the keyboard (like the cached ones)
+            if (span.cached) span.bottom = max(span.bottom, span.top + MinNoteHeight);
+
+            // Merge by the space notes take up on screen
+            span.top = min(span.top, span.bottom - drawn_height);
+         }
+
+         // Without merging, a note is drawn the moment it's found
+         if (!m_merge_notes)
+         {
+            DrawNoteSpan(renderer, pass, tex, notes, span, x_offset, scroll_y);
+            continue;
+         }
+
+         // Notes come in start order, so each one in a column sits at or
+         // above the last.  If it overlaps what's waiting to be drawn
+         // there, in the same color, it becomes part of it.
+         NoteSpan &column = columns[i->note_id];
+         if (column.notes > 0 && column.brush_id == span.brush_id && span.bottom > column.top)
+         {
+            column.top = min(column.top, span.top);
+            column.bottom = max(column.bottom, span.bottom);
+            column.notes++;
+            continue;
+         }
+
+         if (column.notes > 0) DrawNoteSpan(renderer, pass, tex, notes, column, x_offset, scroll_y);
+         column = span;
+      }
+
+      for (unsigned int c = m_first_key; c <= m_last_key; ++c)
+      {
+         if (columns[c].notes == 0) continue;
 
-         DrawNote(renderer, (drawing_black ? tex_black : tex_white), (drawing_black ? BlackNoteDimensions : WhiteNoteDimensions), left, top, width, height, brush_id);
+         DrawNoteSpan(renderer, pass, tex, notes, columns[c], x_offset, scroll_y);
+         columns[c].notes = 0;
       }
 
       drawing_black = !drawing_black;
    }
 }
 
-void KeyboardDisplay::SetKeyActive(const string &key_name, bool active, Track::TrackColor color)
+void KeyboardDisplay::DrawNoteSpan(Renderer &renderer, int pass, const Tga *tex, const TranslatedNoteList &notes, const NoteSpan &span,
+   int x_offset, int scroll_y) const
+{
+   if (span.notes == 1 && span.cached)
+   {
+      renderer.DrawQuads(tex->GetId(), &m_note_vertices[pass][NoteSlot(span.note) * VerticesPerNote], VerticesPerNote, 0, scroll_y);
+      return;
+   }
+
+   const unsigned int note_id = notes[span.note].note_id;
+
+   int left = 0;
+   int width = 0;
+   GetNoteColumn(note_id, x_offset, &left, &width);
+
+   DrawNote(renderer, tex, (m_keys[note_id].black ? BlackNoteDimensions : WhiteNoteDimensions), left, span.top, width, span.bottom - span.top, span.brush_id);
+}
+
+void KeyboardDisplay::PressKey(NoteId note_id, Track::TrackColor color, int velocity)
+{
+   if (note_id >= KeyCount) return;
+   KeyState &state = m_key_states[note_id];
+
+   // A full stack forgets its oldest press to make room
+   if (state.depth == KeyStackDepth)
+   {
+      for (int i = 1; i < KeyStackDepth; ++i) state.stack[i - 1] = state.stack[i];
+      state.depth--;
+   }
+
+   KeyPress &press = state.stack[state.depth++];
+   press.color = color;
+   press.velocity = static_cast<unsigned char>(max(0, min(velocity, 127)));
+
+   state.presses++;
+}
+
+void KeyboardDisplay::ReleaseKey(NoteId note_id, Track::TrackColor color)
+{
+   if (note_id >= KeyCount) return;
+   KeyState &state = m_key_states[note_id];
+   if (state.presses == 0) return;
+
+   state.presses--;
+
+   // With presses beyond what the stack holds, the one being released
+   // may already have been forgotten
+   int found = state.depth - 1;
+   while (found >= 0 && state.stack[found].color != color) found--;
+
+   if (found < 0)
+   {
+      if (state.depth <= state.presses) return;
+      found = state.depth - 1;
+   }
+
+   for (int i = found + 1; i < state.depth; ++i) state.stack[i - 1] = state.stack[i];
+   state.depth--;
+}
+
+void KeyboardDisplay::ResetActiveKeys()
 {
-   if (active) m_active_keys[key_name] = color;
-   else m_active_keys.erase(key_name);
+   for (unsigned int n = 0; n < KeyCount; ++n)
+   {
+      m_key_states[n].presses = 0;
+      m_key_states[n].depth = 0;
+   }
 }
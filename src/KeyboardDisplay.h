@@ -5,12 +5,12 @@
 #ifndef __KEYBOARDDISPLAY_H
 #define __KEYBOARDDISPLAY_H
 
-#include <map>
 #include <vector>
-#include <string>
 
 #include "TrackTile.h"
 #include "TrackProperties.h"
+#include "SpriteBatch.h"
+#include "RetainedLayer.h"
 
 #include "libmidi/Note.h"
 #include "libmidi/MidiTypes.h"
@@ -24,9 +24,6 @@ enum KeyboardSize
    KeyboardSize88
 };
 
-
-typedef std::map<std::string, Track::TrackColor> KeyNames;
-
 class Renderer;
 class Tga;
 
@@ -37,13 +34,45 @@ public:
 
    KeyboardDisplay(KeyboardSize size, int pixelWidth, int pixelHeight);
 
+   // Shows MIDI notes first_key through last_key.  A range that starts or
+   // ends on a black key is widened to the white key beside it.
+   KeyboardDisplay(unsigned int first_key, unsigned int last_key, int pixelWidth, int pixelHeight);
+
+   // The MIDI notes a keyboard of the given size starts and ends on
+   static void GetKeyboardRange(KeyboardSize size, unsigned int *first_key, unsigned int *last_key);
+
+   // Drawing starts at notes[first_note]; everything before it is done with
+   // except for held_notes (indexes before first_note, in order)
    void Draw(Renderer &renderer, const Tga *key_tex[3], const Tga *note_tex[4], int x, int y,
-      const TranslatedNoteSet &notes, microseconds_t show_duration, microseconds_t current_time,
+      const TranslatedNoteList &notes, const NoteStateList &note_states,
+      const std::vector<size_t> &held_notes, size_t first_note,
+      microseconds_t show_duration, microseconds_t current_time,
       const std::vector<Track::Properties> &track_properties);
 
-   void SetKeyActive(const std::string &key_name, bool active, Track::TrackColor color);
-
-   void ResetActiveKeys() { m_active_keys.clear(); }
+   // Lights (or darkens) a key by MIDI note number.  Presses are counted,
+   // so a key held by two tracks stays down until both let go, showing the
+   // color of whoever pressed it most recently.  A release takes back the
+   // latest press in the same color (or just the latest press, if none
+   // match).
+   void PressKey(NoteId note_id, Track::TrackColor color, int velocity);
+   void ReleaseKey(NoteId note_id, Track::TrackColor color);
+
+   void ResetActiveKeys();
+
+   // With merging on (the default), notes in a key's column that overlap
+   // on screen are drawn as one long note.  In a dense song (or with a
+   // long show duration) that keeps the cost of drawing the notes down
+   // to what fits on the screen, rather than how many there are.  Off
+   // draws every note exactly.
+   void SetMergeNotes(bool merge) { m_merge_notes = merge; }
+   bool GetMergeNotes() const { return m_merge_notes; }
+
+   // With retaining on (the default), the keyboard is kept in a texture
+   // and copied onto the screen each frame.  Only the keys that changed
+   // since the last frame are drawn again.  Off draws every key every
+   // frame.
+   void SetRetainKeys(bool retain) { m_retain_keys = retain; }
+   bool GetRetainKeys() const { return m_retain_keys; }
 
 private:
 
@@ -78,48 +107,175 @@ private:
    const static KeyTexDimensions BlackKeyDimensions;
 
 
-   void DrawWhiteKeys(Renderer &renderer, bool active_only, int key_count, int key_width, int key_height, 
-      int key_space, int x_offset, int y_offset) const;
+   // Everything below takes the keyboard's left edge as x_offset; key
+   // positions come from m_keys
 
-   void DrawBlackKeys(Renderer &renderer, const Tga *tex, bool active_only,int white_key_count, int white_width,
-      int black_width, int black_height, int key_space, int x_offset, int y_offset, int black_offset) const;
+   // The keyboard itself (keys, background and shadows, but not the rail)
+   // with its top-left corner at (x, y).  Keys that don't reach screen
+   // columns [from_x, to_x) are left out.
+   void DrawKeys(Renderer &renderer, const Tga *shadow_tex, const Tga *black_key_tex, int x, int y, int width,
+      int from_x, int to_x, bool shadow_below) const;
+
+   // Same result as DrawKeys, from m_key_layer
+   void DrawRetainedKeys(Renderer &renderer, const Tga *shadow_tex, const Tga *black_key_tex, int x, int y, int width);
+
+   void DrawWhiteKeys(Renderer &renderer, bool active_only, int x_offset, int y_offset, int from_x, int to_x) const;
+   void DrawBlackKeys(Renderer &renderer, const Tga *tex, bool active_only, int x_offset, int y_offset, int from_x, int to_x) const;
+
+   // The screen columns [left, right) a key's quad covers
+   void GetKeyColumns(unsigned int note_id, int x_offset, int y_offset, int *left, int *right) const;
 
    void DrawRail(Renderer &renderer, const Tga *tex, int x, int y, int width) const;
    void DrawShadow(Renderer &renderer, const Tga *tex, int x, int y, int width) const;
 
-   void DrawGuides(Renderer &renderer, int key_count, int key_width, int key_space,
-      int x_offset, int y, int y_offset) const;
+   void DrawGuides(Renderer &renderer, int x_offset, int y) const;
+
+   // Pass 0 draws note shadows (note_tex[0] and [1]), pass 1 the notes
+   // themselves (note_tex[2] and [3])
+   void DrawNotePass(Renderer &renderer, int pass, const Tga *note_tex[4], int x_offset, int y,
+      const TranslatedNoteList &notes, const NoteStateList &note_states,
+      const std::vector<size_t> &held_notes, size_t first_note,
+      microseconds_t show_duration, microseconds_t current_time,
+      const std::vector<Track::Properties> &track_properties);
+
+   // One or more notes in the same column (and color), drawn as one
+   struct NoteSpan
+   {
+      size_t note;
+      int notes;
+      int brush_id;
+
+      int top;
+      int bottom;
+
+      // A lone, unclipped note can come straight from the cache
+      bool cached;
+   };
+
+   void DrawNoteSpan(Renderer &renderer, int pass, const Tga *tex, const TranslatedNoteList &notes, const NoteSpan &span,
+      int x_offset, int scroll_y) const;
 
-   void DrawNotePass(Renderer &renderer, const Tga *tex_white, const Tga *tex_black, int white_width,
-      int key_space, int black_width, int black_offset, int x_offset, int y, int y_offset, int y_roll_under,
-      const TranslatedNoteSet &notes, microseconds_t show_duration, microseconds_t current_time,
-      const std::vector<Track::Properties> &track_properties) const;
+   // Where a note's column starts (left) and how wide it is
+   void GetNoteColumn(unsigned int note_id, int x_offset, int *left, int *width) const;
+
+   // Builds (in both passes) and remembers the note's unclipped geometry
+   void CacheNote(size_t index, const TranslatedNote &note, int brush_id, const Tga *note_tex[4], int x_offset, double scaling_factor);
+
+   // Where a note's geometry is kept (see m_note_vertices), and whether
+   // it's there now in the given color
+   size_t NoteSlot(size_t index) const { return index & (m_slot_notes.size() - 1); }
+   bool IsNoteCached(size_t index, int brush_id) const;
 
    // This takes the rectangle where the actual note block should appear and transforms
    // it to the multi-quad (with relatively complicated texture coordinates) using the
    // passed-in texture descriptor, and then draws the result
    void DrawNote(Renderer &renderer, const Tga *tex, const NoteTexDimensions &tex_dimensions, int x, int y, int w, int h, int color_id) const;
 
-   // This works very much like DrawNote
-   void DrawBlackKey(Renderer &renderer, const Tga *tex, const KeyTexDimensions &tex_dimensions, int x, int y, int w, int h, Track::TrackColor color) const;
+   // Notes drawn w pixels wide are never shorter than this
+   static int MinimumNoteHeight(const NoteTexDimensions &tex_dimensions, int w);
 
-   // Retrieves which white-key a piano with the given key count
-   // will start with on the far left side
-   char GetStartingNote() const;
+   // The three quads DrawNote draws
+   const static int VerticesPerNote = 12;
+   void BuildNote(SpriteVertex quads[VerticesPerNote], const Tga *tex, const NoteTexDimensions &tex_dimensions, int x, int y, int w, int h, int color_id) const;
 
-   // Retrieves which octave a piano with the given key count
-   // will start with on the far left side
-   int GetStartingOctave() const;
+   // Where DrawBlackKey puts the key's texture
+   static void GetBlackKeyRect(const KeyTexDimensions &tex_dimensions, int x, int y, int w, int h,
+      int *dest_x, int *dest_y, int *dest_w, int *dest_h);
 
-   // Retrieves the number of white keys a piano with the given
-   // key count will contain
-   int GetWhiteKeyCount() const;
+   // This works very much like DrawNote
+   void DrawBlackKey(Renderer &renderer, const Tga *tex, const KeyTexDimensions &tex_dimensions, int x, int y, int w, int h, Track::TrackColor color) const;
 
-   KeyboardSize m_size;
-   KeyNames m_active_keys;
+   // Works out the key sizes and fills m_keys.  Called once, from the
+   // constructors; nothing about the layout changes after that.
+   void BuildLayout(unsigned int first_key, unsigned int last_key);
 
    int m_width;
    int m_height;
+
+   // One per MIDI note
+   const static unsigned int KeyCount = 128;
+
+   // x is from the keyboard's left edge.  Keys outside the range aren't
+   // shown (and neither are their notes).
+   struct KeyGeometry
+   {
+      bool shown;
+      bool black;
+
+      int x;
+      int width;
+   };
+   KeyGeometry m_keys[KeyCount];
+
+   // The most recent presses are kept; older ones are only counted
+   const static int KeyStackDepth = 4;
+
+   struct KeyPress
+   {
+      Track::TrackColor color;
+      unsigned char velocity;
+   };
+
+   // stack[depth - 1] is the latest press.  Presses past the depth were
+   // forgotten.
+   struct KeyState
+   {
+      int presses;
+      int depth;
+      KeyPress stack[KeyStackDepth];
+   };
+   KeyState m_key_states[KeyCount];
+
+   unsigned int m_first_key;
+   unsigned int m_last_key;
+
+   int m_white_key_count;
+   int m_white_width;
+   int m_white_space;
+   int m_white_height;
+   int m_black_width;
+   int m_black_height;
+
+   // Where the keyboard sits inside the bounds it was given, and how far
+   // notes may roll under the keys
+   int m_x_offset;
+   int m_y_offset;
+   int m_y_roll_under;
+
+   bool m_merge_notes;
+   bool m_retain_keys;
+
+   // Note geometry in pixels, with song time zero at y = 0, so the whole
+   // note field scrolls into place with a single translation.  Only notes
+   // near the screen are kept: note n goes in slot n % (slot count), and
+   // there are always at least as many slots as notes on screen.  A note
+   // is built the first time it's drawn unclipped, and again only when
+   // its color changes or another note has taken its slot (brush -1 is
+   // "nothing built").  Everything is thrown out when the notes,
+   // textures, position or show duration change.
+   std::vector<SpriteVertex> m_note_vertices[2];
+   std::vector<size_t> m_slot_notes;
+   std::vector<signed char> m_slot_brushes;
+
+   const TranslatedNote *m_cached_notes;
+   size_t m_cached_note_count;
+   const Tga *m_cached_note_tex[4];
+   int m_cached_x;
+   int m_cached_y;
+   microseconds_t m_cached_show_duration;
+
+   // The keyboard as of the last frame, where it was drawn with these
+   // textures, and how each key looked (-1 for up, otherwise the color it
+   // was lit in; -2 when it hasn't been drawn)
+   RetainedLayer m_key_layer;
+   int m_layer_x;
+   int m_layer_y;
+   const Tga *m_layer_shadow_tex;
+   const Tga *m_layer_black_key_tex;
+   int m_layer_keys[KeyCount];
+
+   // Scratch space for DrawRetainedKeys
+   std::vector<char> m_dirty_columns;
 };
 
 #endif
@@ -0,0 +1,99 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "LatencyHistogram.h"
+#include "Threading.h"
+
+void LatencyHistogram::Reset()
+{
+   for (int i = 0; i < BucketCount; ++i) m_buckets[i] = 0;
+   m_count = 0;
+   m_max = 0;
+
+   Atomic::FullBarrier();
+}
+
+int LatencyHistogram::BucketFor(long value)
+{
+   // The first few buckets are exact
+   if (value < SubBuckets) return static_cast<int>(value);
+
+   int octave = 0;
+   for (unsigned long v = static_cast<unsigned long>(value); v > 1; v >>= 1) ++octave;
+
+   const int shift = octave - SubBucketBits;
+   const int sub_bucket = static_cast<int>(value >> shift) & (SubBuckets - 1);
+
+   return SubBuckets + shift * SubBuckets + sub_bucket;
+}
+
+long LatencyHistogram::BucketUpperBound(int bucket)
+{
+   if (bucket < SubBuckets) return bucket;
+
+   const int shift = (bucket - SubBuckets) / SubBuckets;
+   const int sub_bucket = (bucket - SubBuckets) % SubBuckets;
+
+   const long lower = static_cast<long>(SubBuckets + sub_bucket) << shift;
+   return lower + (1L << shift) - 1;
+}
+
+void LatencyHistogram::Record(microseconds_t value)
+{
+   // Clamp to what fits in our (32-bit safe) counters
+   const static microseconds_t Largest = 0x7FFFFFFF;
+   if (value < 0) value = 0;
+   if (value > Largest) value = Largest;
+
+   const long v = static_cast<long>(value);
+
+   Atomic::Increment(&m_buckets[BucketFor(v)]);
+   Atomic::Increment(&m_count);
+   Atomic::StoreMax(&m_max, v);
+}
+
+unsigned long LatencyHistogram::Count() const
+{
+   return static_cast<unsigned long>(Atomic::Read(&m_count));
+}
+
+microseconds_t LatencyHistogram::Max() const
+{
+   return Atomic::Read(&m_max);
+}
+
+microseconds_t LatencyHistogram::Percentile(double fraction) const
+{
+   // Writers may still be adding samples while we walk the buckets, so
+   // we total the buckets ourselves rather than trusting m_count.
+   long snapshot[BucketCount];
+   long total = 0;
+   for (int i = 0; i < BucketCount; ++i)
+   {
+      snapshot[i] = Atomic::Read(&m_buckets[i]);
+      total += snapshot[i];
+   }
+
+   if (total == 0) return 0;
+
+   if (fraction < 0.0) fraction = 0.0;
+   if (fraction > 1.0) fraction = 1.0;
+
+   long target = static_cast<long>(fraction * total + 0.5);
+   if (target < 1) target = 1;
+
+   long running = 0;
+   for (int i = 0; i < BucketCount; ++i)
+   {
+      running += snapshot[i];
+      if (running < target) continue;
+
+      // Never report more than the largest value we've actually seen
+      const microseconds_t bound = BucketUpperBound(i);
+      const microseconds_t max = Max();
+      return (bound > max ? max : bound);
+   }
+
+   return Max();
+}
@@ -0,0 +1,46 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __LATENCY_HISTOGRAM_H
+#define __LATENCY_HISTOGRAM_H
+
+#include "libmidi/MidiTypes.h"
+
+// A fixed-size histogram of microsecond durations with logarithmic
+// buckets (four per power of two, so percentiles are accurate to within
+// about 20%).  Record() never allocates or locks, so it is safe to call
+// from any thread while another thread is reading the results.
+class LatencyHistogram
+{
+public:
+   LatencyHistogram() { Reset(); }
+
+   // Negative values are recorded as zero
+   void Record(microseconds_t value);
+   void Reset();
+
+   unsigned long Count() const;
+   microseconds_t Max() const;
+
+   // Returns the (upper bound of the) value below which the given
+   // fraction of samples fall.  fraction is in [0.0, 1.0].
+   microseconds_t Percentile(double fraction) const;
+
+private:
+   LatencyHistogram(const LatencyHistogram&);
+   LatencyHistogram &operator=(const LatencyHistogram&);
+
+   const static int SubBucketBits = 2;
+   const static int SubBuckets = 1 << SubBucketBits;
+   const static int BucketCount = SubBuckets + (31 - SubBucketBits) * SubBuckets;
+
+   static int BucketFor(long value);
+   static long BucketUpperBound(int bucket);
+
+   volatile long m_buckets[BucketCount];
+   volatile long m_count;
+   volatile long m_max;
+};
+
+#endif
@@ -0,0 +1,135 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "MappedFile.h"
+#include "PianoGameError.h"
+#include "CompatibleSystem.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#endif
+
+using namespace std;
+
+#ifdef WIN32
+
+MappedFile::MappedFile(const wstring &filename)
+   : m_data(0), m_size(0), m_file(INVALID_HANDLE_VALUE), m_mapping(0)
+{
+   m_file = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+   if (m_file == INVALID_HANDLE_VALUE) throw PianoGameError(L"Couldn't open '" + filename + L"'.");
+
+   LARGE_INTEGER size;
+   if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+   {
+      CloseHandle(m_file);
+      throw PianoGameError(L"'" + filename + L"' is empty.");
+   }
+   m_size = static_cast<size_t>(size.QuadPart);
+
+   m_mapping = CreateFileMapping(m_file, 0, PAGE_READONLY, 0, 0, 0);
+   if (m_mapping) m_data = reinterpret_cast<const unsigned char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+
+   if (!m_data)
+   {
+      if (m_mapping) CloseHandle(m_mapping);
+      CloseHandle(m_file);
+      throw PianoGameError(L"Couldn't map '" + filename + L"' into memory.");
+   }
+}
+
+MappedFile::~MappedFile()
+{
+   UnmapViewOfFile(m_data);
+   CloseHandle(m_mapping);
+   CloseHandle(m_file);
+}
+
+size_t MappedFile::PageSize()
+{
+   SYSTEM_INFO info;
+   GetSystemInfo(&info);
+   return info.dwPageSize;
+}
+
+bool MappedFile::CountResidentPages(size_t, size_t, size_t *) const
+{
+   // QueryWorkingSetEx could answer this, but it isn't in Windows 2000
+   return false;
+}
+
+#else
+
+MappedFile::MappedFile(const wstring &filename)
+   : m_data(0), m_size(0)
+{
+   const int fd = open(Compatible::NarrowFilename(filename).c_str(), O_RDONLY);
+   if (fd < 0) throw PianoGameError(L"Couldn't open '" + filename + L"'.");
+
+   struct stat info;
+   if (fstat(fd, &info) != 0 || info.st_size == 0)
+   {
+      close(fd);
+      throw PianoGameError(L"'" + filename + L"' is empty.");
+   }
+   m_size = static_cast<size_t>(info.st_size);
+
+   void *data = mmap(0, m_size, PROT_READ, MAP_SHARED, fd, 0);
+
+   // The mapping keeps the file open on its own
+   close(fd);
+
+   if (data == MAP_FAILED) throw PianoGameError(L"Couldn't map '" + filename + L"' into memory.");
+   m_data = reinterpret_cast<const unsigned char*>(data);
+
+   // Pages are touched in whatever order the song needs them
+   madvise(data, m_size, MADV_RANDOM);
+}
+
+MappedFile::~MappedFile()
+{
+   munmap(const_cast<unsigned char*>(m_data), m_size);
+}
+
+size_t MappedFile::PageSize()
+{
+   return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+bool MappedFile::CountResidentPages(size_t offset, size_t length, size_t *resident) const
+{
+   const size_t page = PageSize();
+
+   // mincore wants a page-aligned start
+   const size_t first = offset / page * page;
+   const size_t end = min(offset + length, m_size);
+   if (end <= first)
+   {
+      *resident = 0;
+      return true;
+   }
+
+   const size_t pages = (end - first + page - 1) / page;
+
+#ifdef __APPLE__
+   vector<char> status(pages);
+#else
+   vector<unsigned char> status(pages);
+#endif
+
+   if (mincore(const_cast<unsigned char*>(m_data + first), end - first, &status[0]) != 0) return false;
+
+   size_t count = 0;
+   for (size_t i = 0; i < pages; ++i) if (status[i] & 1) count++;
+
+   *resident = count;
+   return true;
+}
+
+#endif
@@ -0,0 +1,43 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __MAPPED_FILE_H
+#define __MAPPED_FILE_H
+
+#include <string>
+
+#include "os.h"
+
+// A read-only view of an entire file.  Nothing is read from disk until a
+// page is first touched, so mapping a huge file is cheap up front.
+class MappedFile
+{
+public:
+   // Throws PianoGameError if the file couldn't be opened or mapped
+   MappedFile(const std::wstring &filename);
+   ~MappedFile();
+
+   const unsigned char *Data() const { return m_data; }
+   size_t Size() const { return m_size; }
+
+   static size_t PageSize();
+
+   // Counts the pages of [offset, offset + length) that are in memory
+   // right now.  Returns false if the OS won't say.
+   bool CountResidentPages(size_t offset, size_t length, size_t *resident) const;
+
+private:
+   MappedFile(const MappedFile&);
+   MappedFile &operator=(const MappedFile&);
+
+   const unsigned char *m_data;
+   size_t m_size;
+
+#ifdef WIN32
+   HANDLE m_file;
+   HANDLE m_mapping;
+#endif
+};
+
+#endif
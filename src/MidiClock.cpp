@@ -0,0 +1,216 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "MidiClock.h"
+#include "CompatibleSystem.h"
+#include "PianoGameError.h"
+
+#include "libmidi/MidiComm.h"
+#include "libmidi/MidiEvent.h"
+#include "libmidi/MidiUtil.h"
+
+// System real-time and common messages
+const static unsigned char SongPositionPointer = 0xF2;
+const static unsigned char TimingClock = 0xF8;
+const static unsigned char Start = 0xFA;
+const static unsigned char Continue = 0xFB;
+const static unsigned char Stop = 0xFC;
+
+MidiClock::MidiClock(MidiCommOut *device, const MidiTempoMap &tempo_map)
+   : m_device(device), m_tempo_map(tempo_map), m_locate_count(0), m_locate_position(0),
+   m_stop(false), m_pulse_count(0), m_thread(0)
+{
+   m_thread = new Thread(Run, this);
+}
+
+MidiClock::~MidiClock()
+{
+   {
+      MutexLock lock(m_mutex);
+      m_stop = true;
+   }
+
+   delete m_thread;
+   delete m_device;
+}
+
+void MidiClock::Locate(microseconds_t song_position)
+{
+   MutexLock lock(m_mutex);
+
+   m_locate_count++;
+   m_locate_position = song_position;
+
+   // Hold still until the next Update tells us how the song is moving
+   m_anchor = Anchor();
+}
+
+void MidiClock::Update(microseconds_t wall_time, microseconds_t song_position, int song_speed, bool paused)
+{
+   MutexLock lock(m_mutex);
+
+   bool changed = (paused != m_anchor.paused || song_speed != m_anchor.song_speed);
+   if (!changed && !paused && song_speed > 0)
+   {
+      // The song position only moves in whole-millisecond steps, so it
+      // will never exactly match our extrapolation.  Only a real
+      // difference (the two clocks wandering apart) is worth a jump.
+      const microseconds_t predicted = m_anchor.song + (wall_time - m_anchor.wall) * m_anchor.song_speed / 100;
+      changed = (predicted - song_position > DriftLimit || song_position - predicted > DriftLimit);
+   }
+
+   if (!changed) return;
+
+   m_anchor.wall = wall_time;
+   m_anchor.song = song_position;
+   m_anchor.song_speed = song_speed;
+   m_anchor.paused = paused;
+}
+
+microseconds_t MidiClock::PulseToSongTime(long pulse) const
+{
+   const double quarter_notes = static_cast<double>(pulse) / PulsesPerQuarterNote;
+
+   // Find the last segment starting at or before this beat
+   size_t low = 0;
+   size_t high = m_tempo_map.size();
+   while (high - low > 1)
+   {
+      const size_t mid = (low + high) / 2;
+      if (m_tempo_map[mid].start_quarter_notes <= quarter_notes) low = mid;
+      else high = mid;
+   }
+
+   const MidiTempoSegment &s = m_tempo_map[low];
+   return s.start + static_cast<microseconds_t>((quarter_notes - s.start_quarter_notes) * s.us_per_quarter_note);
+}
+
+long MidiClock::FirstPulseAtOrAfter(microseconds_t song_time) const
+{
+   if (song_time <= 0) return 0;
+
+   size_t low = 0;
+   size_t high = m_tempo_map.size();
+   while (high - low > 1)
+   {
+      const size_t mid = (low + high) / 2;
+      if (m_tempo_map[mid].start <= song_time) low = mid;
+      else high = mid;
+   }
+
+   const MidiTempoSegment &s = m_tempo_map[low];
+   const double quarter_notes = s.start_quarter_notes + static_cast<double>(song_time - s.start) / s.us_per_quarter_note;
+
+   long pulse = static_cast<long>(quarter_notes * PulsesPerQuarterNote);
+   if (PulseToSongTime(pulse) < song_time) pulse++;
+
+   return pulse;
+}
+
+void MidiClock::Send(unsigned char status, unsigned char byte1, unsigned char byte2)
+{
+   m_device->Write(MidiEvent::Build(MidiEventSimple(status, byte1, byte2)));
+}
+
+void MidiClock::Run()
+{
+#ifdef WIN32
+   // Otherwise Sleep(1) can take as long as 15ms
+   timeBeginPeriod(1);
+   SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#endif
+
+   // Sleeping is only accurate to a millisecond or so, so we spin
+   // through the last stretch before each pulse.
+   const static microseconds_t SpinMicroseconds = 2000;
+
+   bool running = false;
+   long next_pulse = 0;
+   unsigned long handled_locates = 0;
+
+   try
+   {
+      for (;;)
+      {
+         Anchor anchor;
+         unsigned long locate_count;
+         microseconds_t locate_position;
+         {
+            MutexLock lock(m_mutex);
+            if (m_stop) break;
+
+            anchor = m_anchor;
+            locate_count = m_locate_count;
+            locate_position = m_locate_position;
+         }
+
+         if (locate_count != handled_locates)
+         {
+            handled_locates = locate_count;
+
+            // Song Position Pointer is only allowed while stopped
+            if (running) Send(Stop);
+            running = false;
+
+            // ...and can only point at 16th notes, so we pick up again
+            // at the first one we haven't passed.
+            next_pulse = FirstPulseAtOrAfter(locate_position);
+            next_pulse = (next_pulse + PulsesPerSixteenth - 1) / PulsesPerSixteenth * PulsesPerSixteenth;
+
+            const long sixteenths = next_pulse / PulsesPerSixteenth;
+            Send(SongPositionPointer, static_cast<unsigned char>(sixteenths & 0x7F), static_cast<unsigned char>((sixteenths >> 7) & 0x7F));
+         }
+
+         if (anchor.paused)
+         {
+            if (running) Send(Stop);
+            running = false;
+
+            Thread::Sleep(1);
+            continue;
+         }
+
+         // At 0% the song is stuck in place, but it isn't stopped
+         if (anchor.song_speed <= 0)
+         {
+            Thread::Sleep(1);
+            continue;
+         }
+
+         const microseconds_t due = anchor.wall + (PulseToSongTime(next_pulse) - anchor.song) * 100 / anchor.song_speed;
+         const microseconds_t remaining = due - Compatible::GetMicroseconds();
+
+         if (remaining > SpinMicroseconds)
+         {
+            Thread::Sleep(1);
+            continue;
+         }
+
+         // Spin on the anchor we already have, rather than fighting the
+         // frame loop for m_mutex the whole way.  Anything the game tells
+         // us in the meantime is picked up right after this pulse.
+         while (Compatible::GetMicroseconds() < due) { }
+
+         if (!running) Send(next_pulse == 0 ? Start : Continue);
+         running = true;
+
+         Send(TimingClock);
+         next_pulse++;
+         Atomic::Increment(&m_pulse_count);
+      }
+
+      if (running) Send(Stop);
+   }
+   catch (const MidiError &)
+   {
+      // The clock just goes quiet.  The song itself plays on.
+   }
+   catch (const PianoGameError &)
+   {
+   }
+
+#ifdef WIN32
+   timeEndPeriod(1);
+#endif
+}
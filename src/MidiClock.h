@@ -0,0 +1,91 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __MIDI_CLOCK_H
+#define __MIDI_CLOCK_H
+
+#include "Threading.h"
+#include "libmidi/Midi.h"
+#include "libmidi/MidiTypes.h"
+
+class MidiCommOut;
+
+// Sends MIDI beat clock (24 pulses per quarter note) along with Start,
+// Stop, Continue and Song Position Pointer so drum machines and lighting
+// rigs can follow the song.
+//
+// The game only reports the song position once per frame.  Pulses are
+// scheduled from a dedicated thread that extrapolates from the last
+// report, so their spacing doesn't pick up any of the frame loop's
+// jitter.  The thread sleeps until it is close to each pulse and then
+// spins the rest of the way without taking any locks.
+class MidiClock
+{
+public:
+   // Takes ownership of the device
+   MidiClock(MidiCommOut *device, const MidiTempoMap &tempo_map);
+
+   // Sends Stop (if the clock was running) before closing the device
+   ~MidiClock();
+
+   // Call whenever the song position jumps (restarting the song, seeking,
+   // looping back).  The clock stops and sends the new position; it
+   // starts again by itself once the song reaches the next 16th note.
+   void Locate(microseconds_t song_position);
+
+   // Call once per frame.  wall_time is when the song was at song_position
+   // (from Compatible::GetMicroseconds), which should be taken before any
+   // of the frame's work so how long that takes doesn't show up as jitter.
+   // song_speed is a percentage, as in SharedState.
+   void Update(microseconds_t wall_time, microseconds_t song_position, int song_speed, bool paused);
+
+   // Number of clock pulses sent so far
+   unsigned long PulseCount() const { return static_cast<unsigned long>(Atomic::Read(&m_pulse_count)); }
+
+private:
+   MidiClock(const MidiClock&);
+   MidiClock &operator=(const MidiClock&);
+
+   const static int PulsesPerQuarterNote = 24;
+   const static int PulsesPerSixteenth = PulsesPerQuarterNote / 4;
+
+   // If the song drifts this far from where we'd extrapolated it to be,
+   // we start over from the reported position.
+   const static microseconds_t DriftLimit = 5000;
+
+   // Where the song was at some wall-clock time, and how fast it's moving
+   struct Anchor
+   {
+      Anchor() : wall(0), song(0), song_speed(0), paused(true) { }
+
+      microseconds_t wall;
+      microseconds_t song;
+      int song_speed;
+      bool paused;
+   };
+
+   static void Run(void *context) { reinterpret_cast<MidiClock*>(context)->Run(); }
+   void Run();
+
+   microseconds_t PulseToSongTime(long pulse) const;
+   long FirstPulseAtOrAfter(microseconds_t song_time) const;
+
+   void Send(unsigned char status, unsigned char byte1 = 0, unsigned char byte2 = 0);
+
+   MidiCommOut *m_device;
+   const MidiTempoMap m_tempo_map;
+
+   // Guarded by m_mutex
+   Mutex m_mutex;
+   Anchor m_anchor;
+   unsigned long m_locate_count;
+   microseconds_t m_locate_position;
+   bool m_stop;
+
+   volatile long m_pulse_count;
+
+   Thread *m_thread;
+};
+
+#endif
@@ -0,0 +1,272 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "OfflineRenderer.h"
+#include "AudioSink.h"
+#include "SoftSynth.h"
+#include "CompatibleSystem.h"
+#include "Threading.h"
+
+#include <algorithm>
+using namespace std;
+
+#include "libmidi/Midi.h"
+
+// Notes can ring on after the song's last event, but not forever
+const static microseconds_t MaxTail = 10000000;
+
+// Everything the threads share while rendering.  Each chunk of the song
+// is rendered by handing out units until there are none left, then the
+// main thread mixes the chunk while the workers wait for the next one.
+struct OfflineRenderer::Pool
+{
+   OfflineRenderer *renderer;
+
+   size_t start;
+   size_t frames;
+
+   volatile long next_unit;
+   volatile long finished;
+   volatile long stop;
+
+   std::vector<Signal*> go;
+   Signal done;
+
+   struct Context
+   {
+      Pool *pool;
+      size_t index;
+   };
+
+   void RenderUnits()
+   {
+      const long unit_count = static_cast<long>(renderer->m_schedule.size());
+      while (true)
+      {
+         const long i = Atomic::Increment(&next_unit) - 1;
+         if (i >= unit_count) return;
+
+         renderer->RenderUnit(renderer->m_units[renderer->m_schedule[i]], start, frames);
+      }
+   }
+};
+
+static bool MoreNotes(const pair<size_t, size_t> &a, const pair<size_t, size_t> &b)
+{
+   return a.first > b.first;
+}
+
+OfflineRenderer::OfflineRenderer(const Midi &song, const vector<Track::Properties> &tracks, const SoundFont *font, unsigned int sample_rate)
+   : m_sample_rate(sample_rate), m_font(font), m_last_event_frame(0)
+{
+   const static int Channels = 16;
+   vector<Unit> units(Channels * KeyGroups);
+   for (size_t i = 0; i < units.size(); ++i)
+   {
+      units[i].note_count = 0;
+      units[i].synth = 0;
+      units[i].next_event = 0;
+   }
+
+   // Skip the silence before the first note, like the playing screen does
+   const microseconds_t song_start = max<microseconds_t>(0, song.GetDeadAirStartOffsetMicroseconds());
+
+   const MidiSongEventList events = song.MergedEvents();
+   for (size_t i = 0; i < events.size(); ++i)
+   {
+      const MidiSongEvent &e = events[i];
+      if (e.event.Type() == MidiEventType_System) continue;
+
+      UnitEvent u;
+      if (!e.event.GetSimpleEvent(&u.simple)) continue;
+
+      const microseconds_t time = max<microseconds_t>(0, e.time - song_start);
+      u.frame = static_cast<size_t>(time * static_cast<double>(m_sample_rate) / 1000000.0);
+
+      const int channel = u.simple.status & 0x0F;
+      const int type = u.simple.status & 0xF0;
+      const bool note = (type == 0x80 || type == 0x90 || type == 0xA0);
+
+      // This mirrors PlayingState::Play: every track's non-note events are
+      // played, but only the automatically played tracks' notes.
+      if (note && e.track_id < tracks.size())
+      {
+         const Track::Mode mode = tracks[e.track_id].mode;
+         if (mode != Track::ModePlayedAutomatically && mode != Track::ModePlayedButHidden) continue;
+      }
+
+      if (!note)
+      {
+         for (int g = 0; g < KeyGroups; ++g) units[channel * KeyGroups + g].events.push_back(u);
+         continue;
+      }
+
+      Unit &unit = units[channel * KeyGroups + (u.simple.byte1 % KeyGroups)];
+      unit.events.push_back(u);
+
+      if (type == 0x90 && u.simple.byte2 > 0) unit.note_count++;
+      m_last_event_frame = max(m_last_event_frame, u.frame);
+   }
+
+   // Units without notes would only ever render silence
+   vector<pair<size_t, size_t> > by_notes;
+   for (size_t i = 0; i < units.size(); ++i)
+   {
+      if (units[i].note_count == 0) continue;
+
+      by_notes.push_back(make_pair(units[i].note_count, m_units.size()));
+      m_units.push_back(units[i]);
+   }
+
+   stable_sort(by_notes.begin(), by_notes.end(), MoreNotes);
+   for (size_t i = 0; i < by_notes.size(); ++i) m_schedule.push_back(by_notes[i].second);
+}
+
+void OfflineRenderer::RenderUnit(Unit &unit, size_t start, size_t chunk_frames)
+{
+   const size_t end = start + chunk_frames;
+   size_t position = start;
+
+   while (unit.next_event < unit.events.size() && unit.events[unit.next_event].frame < end)
+   {
+      const UnitEvent &e = unit.events[unit.next_event];
+      if (e.frame > position)
+      {
+         unit.synth->RenderFloat(&unit.left[position - start], &unit.right[position - start], e.frame - position);
+         position = e.frame;
+      }
+
+      unit.synth->Play(e.simple);
+      unit.next_event++;
+   }
+
+   if (end > position) unit.synth->RenderFloat(&unit.left[position - start], &unit.right[position - start], end - position);
+}
+
+void OfflineRenderer::Worker(void *context)
+{
+   const Pool::Context *c = reinterpret_cast<Pool::Context*>(context);
+   Pool &pool = *c->pool;
+
+   while (true)
+   {
+      pool.go[c->index]->Wait();
+      if (Atomic::Read(&pool.stop)) return;
+
+      pool.RenderUnits();
+
+      Atomic::Increment(&pool.finished);
+      pool.done.Set();
+   }
+}
+
+OfflineRenderStats OfflineRenderer::Render(int threads)
+{
+   const microseconds_t render_start = Compatible::GetMicroseconds();
+
+   threads = max(1, threads);
+   const size_t chunk_frames = m_sample_rate / 2;
+
+   // Fresh synths every time, so every render comes out the same
+   for (size_t i = 0; i < m_units.size(); ++i)
+   {
+      Unit &u = m_units[i];
+      u.synth = new SoftSynth(m_sample_rate, m_font);
+      u.next_event = 0;
+      u.left.assign(chunk_frames, 0.0f);
+      u.right.assign(chunk_frames, 0.0f);
+   }
+
+   Pool pool;
+   pool.renderer = this;
+   pool.start = 0;
+   pool.frames = chunk_frames;
+   pool.next_unit = 0;
+   pool.finished = 0;
+   pool.stop = 0;
+
+   // The calling thread does its share too
+   const size_t worker_count = static_cast<size_t>(threads - 1);
+   vector<Pool::Context> contexts(worker_count);
+   vector<Thread*> workers;
+   for (size_t i = 0; i < worker_count; ++i)
+   {
+      pool.go.push_back(new Signal);
+
+      contexts[i].pool = &pool;
+      contexts[i].index = i;
+   }
+   for (size_t i = 0; i < worker_count; ++i) workers.push_back(new Thread(Worker, &contexts[i]));
+
+   vector<float> mix_left(chunk_frames);
+   vector<float> mix_right(chunk_frames);
+
+   const size_t max_tail = static_cast<size_t>(MaxTail * static_cast<double>(m_sample_rate) / 1000000.0);
+
+   m_samples.clear();
+   m_samples.reserve((m_last_event_frame + m_sample_rate * 2) * 2);
+
+   for (size_t start = 0; !m_units.empty(); start += chunk_frames)
+   {
+      pool.start = start;
+      Atomic::Write(&pool.next_unit, 0);
+      Atomic::Write(&pool.finished, 0);
+
+      for (size_t i = 0; i < worker_count; ++i) pool.go[i]->Set();
+      pool.RenderUnits();
+      while (static_cast<size_t>(Atomic::Read(&pool.finished)) < worker_count) pool.done.Wait();
+
+      // Always summed in the same order, however the units were handed out
+      fill(mix_left.begin(), mix_left.end(), 0.0f);
+      fill(mix_right.begin(), mix_right.end(), 0.0f);
+      for (size_t u = 0; u < m_units.size(); ++u)
+      {
+         const Unit &unit = m_units[u];
+         for (size_t f = 0; f < chunk_frames; ++f)
+         {
+            mix_left[f] += unit.left[f];
+            mix_right[f] += unit.right[f];
+         }
+      }
+
+      const size_t offset = m_samples.size();
+      m_samples.resize(offset + chunk_frames * 2);
+      SoftSynth::Mixdown(&mix_left[0], &mix_right[0], &m_samples[offset], chunk_frames);
+
+      // Keep going until the last notes have died away
+      const size_t end = start + chunk_frames;
+      if (end <= m_last_event_frame) continue;
+
+      bool silent = true;
+      for (size_t u = 0; u < m_units.size(); ++u) if (m_units[u].synth->ActiveVoices() > 0) silent = false;
+
+      if (silent || end >= m_last_event_frame + max_tail) break;
+   }
+
+   Atomic::Write(&pool.stop, 1);
+   for (size_t i = 0; i < worker_count; ++i) pool.go[i]->Set();
+   for (size_t i = 0; i < worker_count; ++i) delete workers[i];
+   for (size_t i = 0; i < worker_count; ++i) delete pool.go[i];
+
+   for (size_t i = 0; i < m_units.size(); ++i)
+   {
+      delete m_units[i].synth;
+      m_units[i].synth = 0;
+   }
+
+   OfflineRenderStats stats;
+   stats.threads = threads;
+   stats.work_units = m_units.size();
+   stats.frames = FrameCount();
+   stats.audio_length = static_cast<microseconds_t>(stats.frames * 1000000.0 / m_sample_rate);
+   stats.render_time = Compatible::GetMicroseconds() - render_start;
+
+   return stats;
+}
+
+bool OfflineRenderer::WriteWavFile(const wstring &filename) const
+{
+   if (m_samples.empty()) return false;
+   return ::WriteWavFile(filename, &m_samples[0], FrameCount(), m_sample_rate);
+}
@@ -0,0 +1,104 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __OFFLINE_RENDERER_H
+#define __OFFLINE_RENDERER_H
+
+#include <string>
+#include <vector>
+
+#include "TrackProperties.h"
+#include "libmidi/MidiEvent.h"
+#include "libmidi/MidiTypes.h"
+
+class Midi;
+class SoundFont;
+class SoftSynth;
+
+struct OfflineRenderStats
+{
+   int threads;
+   size_t work_units;
+
+   size_t frames;
+   microseconds_t audio_length;
+   microseconds_t render_time;
+
+   // Seconds of audio per second of rendering
+   double RealtimeFactor() const { return render_time > 0 ? static_cast<double>(audio_length) / render_time : 0.0; }
+};
+
+// Renders a song to audio with the built-in synth, as fast as the CPU
+// allows, without running any of the game.  Tracks play the same way they
+// would on the playing screen: "You Play" and "Not Played" tracks only
+// contribute their non-note events, so the result is a backing track to
+// practice against.
+//
+// The work is split into units that can't affect each other: for each
+// channel, its notes are divided up by key (a fixed number of ways),
+// and every unit gets a copy of the channel's other events.  Each unit
+// has its own synth, and the units are spread across however many
+// threads are asked for.  The units are always mixed in the same order,
+// so the output is identical no matter how many threads rendered it.
+class OfflineRenderer
+{
+public:
+   // The song, and the font (if any), must outlive the renderer
+   OfflineRenderer(const Midi &song, const std::vector<Track::Properties> &tracks, const SoundFont *font, unsigned int sample_rate = 44100);
+
+   OfflineRenderStats Render(int threads);
+
+   // 16-bit interleaved stereo, from the last Render()
+   const std::vector<short> &Samples() const { return m_samples; }
+   size_t FrameCount() const { return m_samples.size() / 2; }
+   unsigned int SampleRate() const { return m_sample_rate; }
+
+   // Returns false if the file couldn't be written
+   bool WriteWavFile(const std::wstring &filename) const;
+
+private:
+   OfflineRenderer(const OfflineRenderer&);
+   OfflineRenderer &operator=(const OfflineRenderer&);
+
+   // Notes on each channel are split this many ways by key
+   const static int KeyGroups = 4;
+
+   struct UnitEvent
+   {
+      size_t frame;
+      MidiEventSimple simple;
+   };
+
+   struct Unit
+   {
+      std::vector<UnitEvent> events;
+      size_t note_count;
+
+      // Only used while rendering
+      SoftSynth *synth;
+      size_t next_event;
+      std::vector<float> left;
+      std::vector<float> right;
+   };
+
+   struct Pool;
+   static void Worker(void *context);
+
+   // Renders every unit's next chunk_frames, starting at frame start
+   void RenderUnit(Unit &unit, size_t start, size_t chunk_frames);
+
+   unsigned int m_sample_rate;
+   const SoundFont *m_font;
+
+   std::vector<Unit> m_units;
+
+   // Longest first, to keep the threads evenly loaded
+   std::vector<size_t> m_schedule;
+
+   size_t m_last_event_frame;
+
+   std::vector<short> m_samples;
+};
+
+#endif
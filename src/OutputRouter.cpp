@@ -0,0 +1,106 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "OutputRouter.h"
+#include "PianoGameError.h"
+
+#include "libmidi/MidiComm.h"
+
+OutputRouter::OutputRouter(MidiCommOut *main_output, const std::vector<Track::Properties> &track_properties, DispatchTiming *timing)
+   : m_main_worker(0)
+{
+   if (main_output)
+   {
+      m_main_worker = new MidiCommOutWorker(*main_output, timing);
+      m_workers.push_back(m_main_worker);
+   }
+
+   for (size_t i = 0; i < track_properties.size(); ++i)
+   {
+      MidiCommOutWorker *worker = m_main_worker;
+
+      const int id = track_properties[i].output_device;
+      if (id >= 0)
+      {
+         // Reuse the device if another track already opened it
+         bool found = false;
+         for (size_t w = 0; w < m_workers.size(); ++w)
+         {
+            if (static_cast<int>(m_workers[w]->Device().GetDeviceDescription().id) != id) continue;
+
+            worker = m_workers[w];
+            found = true;
+            break;
+         }
+
+         if (!found)
+         {
+            try
+            {
+               MidiCommOut *device = new MidiCommOut(static_cast<unsigned int>(id));
+               m_opened_devices.push_back(device);
+
+               worker = new MidiCommOutWorker(*device, timing);
+               m_workers.push_back(worker);
+            }
+            catch (const MidiError &) { }
+            catch (const PianoGameError &) { }
+         }
+      }
+
+      m_track_workers.push_back(worker);
+   }
+}
+
+OutputRouter::~OutputRouter()
+{
+   // Workers first, so everything they still have queued goes out before
+   // the devices are closed.
+   for (size_t i = 0; i < m_workers.size(); ++i) delete m_workers[i];
+   for (size_t i = 0; i < m_opened_devices.size(); ++i) delete m_opened_devices[i];
+}
+
+MidiCommOutWorker *OutputRouter::WorkerFor(size_t track_id) const
+{
+   if (track_id < m_track_workers.size()) return m_track_workers[track_id];
+   return m_main_worker;
+}
+
+bool OutputRouter::HasOutput(size_t track_id) const
+{
+   return (WorkerFor(track_id) != 0);
+}
+
+void OutputRouter::Write(size_t track_id, const MidiEvent &ev, microseconds_t intended)
+{
+   MidiCommOutWorker *worker = WorkerFor(track_id);
+   if (worker) worker->Write(ev, track_id, intended);
+}
+
+void OutputRouter::Reset()
+{
+   for (size_t i = 0; i < m_workers.size(); ++i) m_workers[i]->Reset();
+}
+
+void OutputRouter::PrepareSong(const Midi &song)
+{
+   for (size_t i = 0; i < m_workers.size(); ++i) m_workers[i]->Device().PrepareSong(song);
+}
+
+void OutputRouter::SongPosition(microseconds_t song_position)
+{
+   for (size_t i = 0; i < m_workers.size(); ++i) m_workers[i]->Device().SongPosition(song_position);
+}
+
+std::vector<std::wstring> OutputRouter::Status() const
+{
+   std::vector<std::wstring> lines;
+   for (size_t i = 0; i < m_workers.size(); ++i)
+   {
+      const std::wstring status = m_workers[i]->Device().Status();
+      if (status.length() > 0) lines.push_back(status);
+   }
+
+   return lines;
+}
@@ -0,0 +1,70 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __OUTPUT_ROUTER_H
+#define __OUTPUT_ROUTER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "TrackProperties.h"
+#include "libmidi/MidiTypes.h"
+
+class Midi;
+class MidiEvent;
+class MidiCommOut;
+class MidiCommOutWorker;
+class DispatchTiming;
+
+// Sends each track's events to the output device picked for it on the
+// track selection screen (or to the main output chosen on the title
+// screen).  Every device is fed by its own MidiCommOutWorker, so a slow
+// or saturated port never delays events bound for the others.
+class OutputRouter
+{
+public:
+   // main_output may be null.  Any other devices the tracks are routed to
+   // are opened here and closed again when the router is destroyed.  A
+   // device that fails to open falls back to the main output.  Timed
+   // writes are recorded in timing (if it isn't null) as they go out.
+   OutputRouter(MidiCommOut *main_output, const std::vector<Track::Properties> &track_properties, DispatchTiming *timing);
+   ~OutputRouter();
+
+   // Whether this track's events go anywhere at all
+   bool HasOutput(size_t track_id) const;
+
+   // Events on tracks with nowhere to go are dropped.  intended is when
+   // the event should have been sent (see MidiCommOutWorker::Write).
+   void Write(size_t track_id, const MidiEvent &ev, microseconds_t intended = 0);
+
+   // Resets every device
+   void Reset();
+
+   // Tells every device what's about to play, and where it's up to (see
+   // MidiCommOutSink)
+   void PrepareSong(const Midi &song);
+   void SongPosition(microseconds_t song_position);
+
+   // One line for each device with something to say
+   std::vector<std::wstring> Status() const;
+
+private:
+   OutputRouter(const OutputRouter&);
+   OutputRouter &operator=(const OutputRouter&);
+
+   MidiCommOutWorker *WorkerFor(size_t track_id) const;
+
+   // The devices we opened ourselves (not including the main output)
+   std::vector<MidiCommOut*> m_opened_devices;
+
+   // One per device.  The main output's worker (if any) is first.
+   std::vector<MidiCommOutWorker*> m_workers;
+   MidiCommOutWorker *m_main_worker;
+
+   // Indexed by track id.  Entries may be null.
+   std::vector<MidiCommOutWorker*> m_track_workers;
+};
+
+#endif
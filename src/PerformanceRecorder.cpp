@@ -0,0 +1,323 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "PerformanceRecorder.h"
+#include "CompatibleSystem.h"
+#include "Threading.h"
+#include "string_util.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+using namespace std;
+
+#include "libmidi/MidiComm.h"
+#include "libmidi/MidiWriter.h"
+
+// A take waiting to be written out.  The writer thread owns (and frees)
+// the inputs once it's been queued.
+struct PendingTake
+{
+   wstring filename;
+   RecordedInput *inputs;
+   size_t count;
+};
+
+// Everything the writer thread shares with the rest of the program.  Like
+// the MIDI device enumerator, this is allocated the first time it's needed
+// and never freed, so it can't be destroyed out from under the thread.
+struct TakeWriter
+{
+   TakeWriter() : busy(false), thread(0) { }
+
+   Mutex mutex;
+   Signal wake;
+
+   // Guarded by mutex
+   vector<PendingTake> queue;
+   bool busy;
+
+   Thread *thread;
+};
+
+const static char CsvHeader[] = "timestamp_us,song_us,device,status,data1,data2,matched_track,matched_note,matched_start_us,offset_us,score_us,speed,note_offset,scored";
+const static size_t CsvColumns = 14;
+
+static bool WriteCsv(const wstring &filename, const RecordedInput *inputs, size_t count)
+{
+   ofstream file;
+   Compatible::OpenFile(file, filename, ios::out | ios::trunc);
+
+   if (!file.good()) return false;
+
+   file << CsvHeader << "\n";
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      const RecordedInput &r = inputs[i];
+
+      // Missed notes only fill in the scoring columns
+      if (r.missed_notes)
+      {
+         file << ",,,,,,,,,," << r.score_time << "," << r.speed << ",,\n";
+         continue;
+      }
+
+      file << r.timestamp << "," << r.song_time << "," << r.device << ","
+         << int(r.simple.status) << "," << int(r.simple.byte1) << "," << int(r.simple.byte2) << ",";
+
+      if (r.matched) file << r.matched_track_id << "," << r.matched_note_id << "," << r.matched_start << "," << (r.song_time - r.matched_start) << ",";
+      else file << ",,,,";
+
+      file << r.score_time << "," << r.speed << "," << r.note_offset << "," << (r.scored ? 1 : 0) << "\n";
+   }
+
+   return file.good();
+}
+
+static microseconds_t ParseMicroseconds(const string &text)
+{
+   microseconds_t value = 0;
+   istringstream in(text);
+   in >> value;
+   return value;
+}
+
+static void ParseCsvRow(const vector<string> &fields, RecordedInput *r)
+{
+   *r = RecordedInput();
+
+   r->score_time = ParseMicroseconds(fields[10]);
+   r->speed = atoi(fields[11].c_str());
+
+   r->missed_notes = fields[3].empty();
+   if (r->missed_notes) return;
+
+   r->timestamp = ParseMicroseconds(fields[0]);
+   r->song_time = ParseMicroseconds(fields[1]);
+   r->device = atoi(fields[2].c_str());
+   r->simple = MidiEventSimple(static_cast<unsigned char>(atoi(fields[3].c_str())),
+      static_cast<unsigned char>(atoi(fields[4].c_str())), static_cast<unsigned char>(atoi(fields[5].c_str())));
+
+   r->matched = !fields[6].empty();
+   r->matched_track_id = r->matched ? atoi(fields[6].c_str()) : 0;
+   r->matched_note_id = r->matched ? atoi(fields[7].c_str()) : InvalidNoteId;
+   r->matched_start = r->matched ? ParseMicroseconds(fields[8]) : 0;
+
+   r->note_offset = atoi(fields[12].c_str());
+   r->scored = (fields[13] == "1");
+}
+
+static void WriteTake(const PendingTake &take)
+{
+   MidiWriter writer;
+
+   // Track 0 only holds the tempo, so devices start at track 1
+   for (size_t i = 0; i < take.count; ++i)
+   {
+      const RecordedInput &r = take.inputs[i];
+      if (r.missed_notes) continue;
+
+      const size_t track = 1 + (r.device >= 0 ? r.device : 0);
+      writer.AddEvent(track, r.song_time, MidiEvent::Build(r.simple));
+   }
+
+   const size_t track_count = writer.TrackCount();
+   for (size_t t = 1; t < track_count; ++t)
+   {
+      if (track_count == 2) writer.SetTrackName(t, "Performance");
+      else writer.SetTrackName(t, STRING("Performance (Input " << t << ")"));
+   }
+
+   // There is nobody to tell if either of these fails
+   writer.WriteFile(take.filename);
+   WriteCsv(take.filename + L".csv", take.inputs, take.count);
+}
+
+static void WriterThread(void *context)
+{
+   TakeWriter *w = reinterpret_cast<TakeWriter*>(context);
+
+   while (true)
+   {
+      w->wake.Wait();
+
+      while (true)
+      {
+         PendingTake take;
+         {
+            MutexLock lock(w->mutex);
+            if (w->queue.empty())
+            {
+               w->busy = false;
+               break;
+            }
+
+            take = w->queue.front();
+            w->queue.erase(w->queue.begin());
+            w->busy = true;
+         }
+
+         WriteTake(take);
+         delete[] take.inputs;
+      }
+   }
+}
+
+static TakeWriter &Writer()
+{
+   static TakeWriter *writer = 0;
+   if (!writer)
+   {
+      writer = new TakeWriter;
+      writer->thread = new Thread(WriterThread, writer);
+   }
+
+   return *writer;
+}
+
+PerformanceRecorder::PerformanceRecorder(size_t capacity)
+   : m_inputs(0), m_capacity(capacity), m_count(0), m_dropped(0), m_kept_last(false)
+{
+   m_inputs = new RecordedInput[m_capacity];
+}
+
+PerformanceRecorder::~PerformanceRecorder()
+{
+   delete[] m_inputs;
+}
+
+RecordedInput *PerformanceRecorder::Next()
+{
+   if (!m_inputs || m_count >= m_capacity)
+   {
+      m_dropped++;
+      return 0;
+   }
+
+   return &m_inputs[m_count++];
+}
+
+void PerformanceRecorder::Record(const MidiCommInEvent &input, microseconds_t song_time, int device,
+   microseconds_t score_time, int speed, int note_offset, bool scored)
+{
+   m_kept_last = false;
+
+   MidiEventSimple simple;
+   if (!input.event.GetSimpleEvent(&simple)) return;
+
+   RecordedInput *r = Next();
+   if (!r) return;
+   m_kept_last = true;
+
+   r->timestamp = input.timestamp;
+   r->song_time = song_time;
+   r->device = device;
+   r->simple = simple;
+   r->score_time = score_time;
+   r->speed = speed;
+   r->note_offset = note_offset;
+   r->scored = scored;
+   r->missed_notes = false;
+   r->matched = false;
+   r->matched_start = 0;
+   r->matched_note_id = InvalidNoteId;
+   r->matched_track_id = 0;
+}
+
+void PerformanceRecorder::RecordMissedNotes(microseconds_t score_time, int speed)
+{
+   m_kept_last = false;
+
+   RecordedInput *r = Next();
+   if (!r) return;
+
+   *r = RecordedInput();
+   r->score_time = score_time;
+   r->speed = speed;
+   r->missed_notes = true;
+}
+
+void PerformanceRecorder::MatchLast(const TranslatedNote &note)
+{
+   if (!m_kept_last) return;
+
+   RecordedInput &r = m_inputs[m_count - 1];
+   r.matched = true;
+   r.matched_start = note.start;
+   r.matched_note_id = note.note_id;
+   r.matched_track_id = note.track_id;
+}
+
+void PerformanceRecorder::Finish(const wstring &filename)
+{
+   if (!m_inputs) return;
+
+   PendingTake take;
+   take.filename = filename;
+   take.inputs = m_inputs;
+   take.count = m_count;
+
+   // The buffer belongs to the writer now
+   m_inputs = 0;
+   m_kept_last = false;
+
+   TakeWriter &w = Writer();
+   {
+      MutexLock lock(w.mutex);
+      w.queue.push_back(take);
+   }
+   w.wake.Set();
+}
+
+void PerformanceRecorder::WaitForPendingWrites()
+{
+   TakeWriter &w = Writer();
+
+   while (true)
+   {
+      {
+         MutexLock lock(w.mutex);
+         if (w.queue.empty() && !w.busy) return;
+      }
+
+      Thread::Sleep(10);
+   }
+}
+
+bool PerformanceRecorder::ReadCsv(const wstring &filename, vector<RecordedInput> *inputs)
+{
+   ifstream file;
+   Compatible::OpenFile(file, filename, ios::in);
+
+   if (!file.good()) return false;
+
+   // Takes from before the scoring columns were added can't be replayed
+   string line;
+   getline(file, line);
+   if (line.length() > 0 && line[line.length() - 1] == '\r') line.erase(line.length() - 1);
+   if (line != CsvHeader) return false;
+
+   inputs->clear();
+   while (getline(file, line))
+   {
+      if (line.length() > 0 && line[line.length() - 1] == '\r') line.erase(line.length() - 1);
+      if (line.empty()) continue;
+
+      vector<string> fields;
+      istringstream row(line);
+      string field;
+      while (getline(row, field, ',')) fields.push_back(field);
+
+      // A trailing empty field doesn't come back out of getline
+      while (fields.size() < CsvColumns) fields.push_back("");
+
+      RecordedInput r;
+      ParseCsvRow(fields, &r);
+      inputs->push_back(r);
+   }
+
+   return true;
+}
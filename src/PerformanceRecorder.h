@@ -0,0 +1,112 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __PERFORMANCE_RECORDER_H
+#define __PERFORMANCE_RECORDER_H
+
+#include <string>
+#include <vector>
+
+#include "libmidi/MidiEvent.h"
+#include "libmidi/MidiTypes.h"
+#include "libmidi/Note.h"
+
+struct MidiCommInEvent;
+
+// One event from the player, as it arrived
+struct RecordedInput
+{
+   // When the driver handed it to us (Compatible::GetMicroseconds), and
+   // where the song was at that moment
+   microseconds_t timestamp;
+   microseconds_t song_time;
+
+   // Position of the device in the input group
+   int device;
+
+   // Before any octave sliding
+   MidiEventSimple simple;
+
+   // What the scoring went by: the song position it matched against
+   // (where the song was when the frame started), the playback speed, and
+   // the octave sliding.  Input that arrives while paused isn't scored.
+   microseconds_t score_time;
+   int speed;
+   int note_offset;
+   bool scored;
+
+   // Not input at all: the song retired notes the player had missed when
+   // it reached score_time.  These only go in the CSV.
+   bool missed_notes;
+
+   // The song note this was matched to, if any.  (start, note_id and
+   // track_id are enough to find it again in Midi::Notes().)
+   bool matched;
+   microseconds_t matched_start;
+   NoteId matched_note_id;
+   size_t matched_track_id;
+};
+
+// Captures everything the player sends in during a song so the take can
+// be saved as a standard MIDI file, along with which note each key press
+// was matched to and enough about the song's progress that ScoringEngine
+// can score it again later with the same result.
+//
+// Everything is stored in a buffer allocated up front, so recording
+// never allocates on the game thread no matter how long the take is.
+// (Input past the end of the buffer is counted and dropped.)  Finish()
+// hands that buffer to a background thread that does all of the file
+// writing, so the recorder itself can be deleted right away.
+class PerformanceRecorder
+{
+public:
+   const static size_t DefaultCapacity = 65536;
+
+   PerformanceRecorder(size_t capacity = DefaultCapacity);
+
+   // Discards the take unless Finish() has been called
+   ~PerformanceRecorder();
+
+   void Record(const MidiCommInEvent &input, microseconds_t song_time, int device,
+      microseconds_t score_time, int speed, int note_offset, bool scored);
+
+   // Notes that the player missed were retired at this song position
+   void RecordMissedNotes(microseconds_t score_time, int speed);
+
+   // Marks the most recently recorded event as having played this note
+   void MatchLast(const TranslatedNote &note);
+
+   size_t Count() const { return m_count; }
+   unsigned long DroppedCount() const { return m_dropped; }
+
+   // Queues the take to be written to filename (as a standard MIDI file,
+   // one track per input device) and filename + ".csv" (every event with
+   // its timing and match).  Anything recorded afterward is dropped.
+   void Finish(const std::wstring &filename);
+
+   // Blocks until every queued take has been written.  Only needed right
+   // before the program exits.
+   static void WaitForPendingWrites();
+
+   // Reads back the ".csv" half of a take.  Returns false if the file
+   // couldn't be opened or isn't a take.
+   static bool ReadCsv(const std::wstring &filename, std::vector<RecordedInput> *inputs);
+
+private:
+   PerformanceRecorder(const PerformanceRecorder&);
+   PerformanceRecorder &operator=(const PerformanceRecorder&);
+
+   // The next free slot, or null (after counting the drop) if it's full
+   RecordedInput *Next();
+
+   RecordedInput *m_inputs;
+   size_t m_capacity;
+   size_t m_count;
+   unsigned long m_dropped;
+
+   // Whether the last call to Record() actually stored something
+   bool m_kept_last;
+};
+
+#endif
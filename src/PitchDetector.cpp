@@ -0,0 +1,573 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "PitchDetector.h"
+#include "CompatibleSystem.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+using namespace std;
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define PITCH_DETECTOR_SSE2
+#include <emmintrin.h>
+#endif
+
+const static double Pi = 3.14159265358979323846;
+
+// Roughly how much audio each analysis looks at.  Longer separates low
+// notes better but takes longer to notice new ones.
+const static double WindowSeconds = 0.04;
+const static size_t HopsPerWindow = 8;
+
+// Where each harmonic lands, in semitones above the fundamental (rounded
+// to the nearest band), and how much it counts toward a key's score
+const static int HarmonicOffset[] = { 0, 12, 19, 24, 28, 31, 34, 36 };
+const static float HarmonicWeight[] = { 1.0f, 0.75f, 0.6f, 0.5f, 0.42f, 0.36f, 0.32f, 0.28f };
+
+// A partial's energy is spread across a few bins, so even the narrowest
+// bands (down low, where semitones are much closer than bins) are this wide
+const static double MinBandHalfWidth = 2.0;
+
+const static int MaxPolyphony = 8;
+
+// A chord can line up with the harmonics of a note below it that isn't
+// being played.  What gives it away is the missing fundamental.
+const static float FundamentalShare = 0.3f;
+
+// Subtracting a note never quite gets all of it, and the remains are
+// likeliest to turn up a semitone either side
+const static float NeighbourRatio = 4.0f;
+
+// Scores are roughly in units of the fundamental's amplitude (1.0 being
+// full scale).  New notes have to stand out further from the loudest
+// thing in the window than notes that are already sounding.
+const static float AbsoluteFloor = 0.004f;
+const static float OnsetFloor = 0.2f;
+const static float SustainFloor = 0.08f;
+
+// A key's fundamental has to climb by RiseRatio over RiseHops (and by a
+// fair share of the loudest thing in the window) to count as a new note.
+// Slower wobbles, like beating between nearby partials, don't, and
+// neither do new notes landing on its harmonics.
+const static int ConfirmHops = 2;
+const static int MaxDecisionHops = 6;
+const static float RiseRatio = 2.0f;
+const static float RiseFloor = 0.2f;
+
+// A sounding key that has faded this far from its peak before rising
+// again was struck again, as long as it wasn't struck only a moment ago
+const static float RestrikeDip = 0.7f;
+const static int RestrikeHops = 10;
+
+const static float ReleaseFraction = 0.05f;
+const static int ReleaseHops = 10;
+
+static double KeyFrequency(double key)
+{
+   return 440.0 * pow(2.0, (key - 69.0) / 12.0);
+}
+
+static void Multiply(const float *a, const float *b, float *out, size_t count)
+{
+   size_t i = 0;
+
+#ifdef PITCH_DETECTOR_SSE2
+   for (; i + 4 <= count; i += 4) _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+#endif
+
+   for (; i < count; ++i) out[i] = a[i] * b[i];
+}
+
+static void Magnitudes(const float *real, const float *imag, float *out, size_t count, float scale)
+{
+   size_t i = 0;
+
+#ifdef PITCH_DETECTOR_SSE2
+   const __m128 s = _mm_set1_ps(scale);
+   for (; i + 4 <= count; i += 4)
+   {
+      const __m128 r = _mm_loadu_ps(real + i);
+      const __m128 m = _mm_loadu_ps(imag + i);
+      _mm_storeu_ps(out + i, _mm_mul_ps(s, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(m, m)))));
+   }
+#endif
+
+   for (; i < count; ++i) out[i] = scale * sqrt(real[i] * real[i] + imag[i] * imag[i]);
+}
+
+static float Dot(const float *a, const float *b, size_t count)
+{
+   size_t i = 0;
+   float sum = 0.0f;
+
+#ifdef PITCH_DETECTOR_SSE2
+   __m128 acc = _mm_setzero_ps();
+   for (; i + 4 <= count; i += 4) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+
+   float lanes[4];
+   _mm_storeu_ps(lanes, acc);
+   sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+
+   for (; i < count; ++i) sum += a[i] * b[i];
+   return sum;
+}
+
+PitchDetector::PitchDetector(unsigned int sample_rate, NoteId lowest, NoteId highest)
+   : m_sample_rate(sample_rate), m_lowest(lowest), m_highest(highest), m_loudest(0.0f), m_pending(0), m_frames_in(0)
+{
+   m_window_frames = 1;
+   while (m_window_frames < sample_rate * WindowSeconds) m_window_frames *= 2;
+
+   m_hop_frames = m_window_frames / HopsPerWindow;
+
+   // Zero-padded to twice the window, for finer bins to build bands from
+   m_fft_size = m_window_frames * 2;
+
+   // Harmonics above the top of the piano still help, but not those
+   // too close to the top of the spectrum
+   m_top = m_highest + HarmonicOffset[Harmonics - 1];
+   while (KeyFrequency(m_top + 0.5) > sample_rate * 0.45) m_top--;
+   m_band_count = m_top - m_lowest + 1;
+
+   // Heavily weighted toward the most recent audio, so new notes show up
+   // sooner than they would with a symmetric window.  Rises slowly over
+   // the first three quarters, and falls away over the last.
+   const size_t fall = m_window_frames / 4;
+   const size_t rise = m_window_frames - fall;
+   m_window.resize(m_window_frames);
+   for (size_t i = 0; i < m_window_frames; ++i)
+   {
+      const double s = (i < rise) ? sin(Pi / 2.0 * i / rise) : cos(Pi / 2.0 * (i - rise) / fall);
+      m_window[i] = static_cast<float>(s * s);
+   }
+
+   int bits = 0;
+   while ((size_t(1) << bits) < m_fft_size) bits++;
+
+   m_bit_reverse.resize(m_fft_size);
+   for (size_t i = 0; i < m_fft_size; ++i)
+   {
+      size_t reversed = 0;
+      for (int b = 0; b < bits; ++b) if (i & (size_t(1) << b)) reversed |= size_t(1) << (bits - 1 - b);
+      m_bit_reverse[i] = reversed;
+   }
+
+   for (size_t half = 1; half < m_fft_size; half *= 2)
+   {
+      for (size_t j = 0; j < half; ++j)
+      {
+         m_twiddle_real.push_back(static_cast<float>(cos(Pi * j / half)));
+         m_twiddle_imag.push_back(static_cast<float>(-sin(Pi * j / half)));
+      }
+   }
+
+   m_real.resize(m_fft_size);
+   m_imag.resize(m_fft_size);
+   m_windowed.resize(m_window_frames);
+
+   // Room for the last band's padding to run off the end
+   m_magnitude.resize(m_fft_size / 2 + 1 + 8);
+
+   m_history.resize(m_window_frames);
+   m_incoming.resize(m_hop_frames);
+
+   m_band_energy.resize(m_band_count);
+   m_residual.resize(m_band_count);
+   m_salience.resize(m_highest - m_lowest + 1);
+   m_strength.resize(m_highest - m_lowest + 1);
+   m_fundamental.resize(m_highest - m_lowest + 1);
+   m_picked.resize(m_highest - m_lowest + 1);
+
+   KeyState silent;
+   silent.sounding = false;
+   silent.hops_heard = 0;
+   silent.hops_quiet = 0;
+   silent.hops_since_on = 0;
+   silent.hops_since_rise = MaxDecisionHops + 1;
+   silent.next_earlier = 0;
+   for (int i = 0; i < RiseHops; ++i) silent.earlier[i] = 0.0f;
+   silent.peak = 0.0f;
+   silent.low = 0.0f;
+   m_keys.assign(m_highest - m_lowest + 1, silent);
+
+   BuildBands();
+   BuildResponses();
+}
+
+void PitchDetector::BuildBands()
+{
+   const double bin_hz = static_cast<double>(m_sample_rate) / m_fft_size;
+   const size_t last_bin = m_fft_size / 2;
+
+   for (int s = m_lowest; s <= m_top; ++s)
+   {
+      const double center = KeyFrequency(s) / bin_hz;
+      const double half_width = max((KeyFrequency(s + 0.5) - KeyFrequency(s - 0.5)) / 2.0 / bin_hz, MinBandHalfWidth);
+
+      const size_t first = max<size_t>(1, static_cast<size_t>(ceil(center - half_width)));
+      const size_t last = min<size_t>(last_bin, static_cast<size_t>(floor(center + half_width)));
+
+      Band band;
+      band.first_bin = first;
+      band.weight_offset = m_band_weights.size();
+      band.weight_count = (last - first + 1 + 3) & ~size_t(3);
+
+      for (size_t i = 0; i < band.weight_count; ++i)
+      {
+         const double distance = fabs(static_cast<double>(first + i) - center);
+         m_band_weights.push_back(first + i <= last ? static_cast<float>(max(0.0, 1.0 - distance / half_width)) : 0.0f);
+      }
+
+      m_bands.push_back(band);
+   }
+}
+
+void PitchDetector::BuildResponses()
+{
+   m_response.resize(m_band_count * m_band_count);
+   m_response_first.resize(m_band_count);
+   m_response_last.resize(m_band_count);
+
+   vector<float> tone(m_window_frames);
+   for (int row = 0; row < m_band_count; ++row)
+   {
+      const double step = 2.0 * Pi * KeyFrequency(m_lowest + row) / m_sample_rate;
+      for (size_t i = 0; i < m_window_frames; ++i) tone[i] = static_cast<float>(sin(step * i));
+
+      Analyze(&tone[0]);
+      copy(m_band_energy.begin(), m_band_energy.end(), m_response.begin() + row * m_band_count);
+
+      // Anything under a percent of the band's own response can be ignored
+      const float significant = m_band_energy[row] * 0.01f;
+
+      int first = row;
+      int last = row;
+      while (first > 0 && m_band_energy[first - 1] > significant) first--;
+      while (last + 1 < m_band_count && m_band_energy[last + 1] > significant) last++;
+
+      m_response_first[row] = first;
+      m_response_last[row] = last;
+   }
+}
+
+void PitchDetector::Transform()
+{
+   for (size_t i = 0; i < m_fft_size; ++i) m_real[m_bit_reverse[i]] = (i < m_window_frames) ? m_windowed[i] : 0.0f;
+   fill(m_imag.begin(), m_imag.end(), 0.0f);
+
+   size_t stage = 0;
+   for (size_t half = 1; half < m_fft_size; stage += half, half *= 2)
+   {
+      const float *wr = &m_twiddle_real[stage];
+      const float *wi = &m_twiddle_imag[stage];
+
+      for (size_t group = 0; group < m_fft_size; group += half * 2)
+      {
+         float *ar = &m_real[group];
+         float *ai = &m_imag[group];
+         float *br = ar + half;
+         float *bi = ai + half;
+
+         size_t j = 0;
+
+#ifdef PITCH_DETECTOR_SSE2
+         for (; j + 4 <= half; j += 4)
+         {
+            const __m128 xr = _mm_loadu_ps(br + j);
+            const __m128 xi = _mm_loadu_ps(bi + j);
+            const __m128 cr = _mm_loadu_ps(wr + j);
+            const __m128 ci = _mm_loadu_ps(wi + j);
+
+            const __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, cr), _mm_mul_ps(xi, ci));
+            const __m128 ti = _mm_add_ps(_mm_mul_ps(xr, ci), _mm_mul_ps(xi, cr));
+
+            const __m128 yr = _mm_loadu_ps(ar + j);
+            const __m128 yi = _mm_loadu_ps(ai + j);
+
+            _mm_storeu_ps(br + j, _mm_sub_ps(yr, tr));
+            _mm_storeu_ps(bi + j, _mm_sub_ps(yi, ti));
+            _mm_storeu_ps(ar + j, _mm_add_ps(yr, tr));
+            _mm_storeu_ps(ai + j, _mm_add_ps(yi, ti));
+         }
+#endif
+
+         for (; j < half; ++j)
+         {
+            const float tr = br[j] * wr[j] - bi[j] * wi[j];
+            const float ti = br[j] * wi[j] + bi[j] * wr[j];
+
+            br[j] = ar[j] - tr;
+            bi[j] = ai[j] - ti;
+            ar[j] += tr;
+            ai[j] += ti;
+         }
+      }
+   }
+}
+
+void PitchDetector::Analyze(const float *window)
+{
+   Multiply(window, &m_window[0], &m_windowed[0], m_window_frames);
+   Transform();
+
+   // Scaled so a full-scale sine wave peaks at about 1.0
+   float window_sum = 0.0f;
+   for (size_t i = 0; i < m_window_frames; ++i) window_sum += m_window[i];
+
+   Magnitudes(&m_real[0], &m_imag[0], &m_magnitude[0], m_fft_size / 2 + 1, 2.0f / window_sum);
+
+   for (int b = 0; b < m_band_count; ++b)
+   {
+      const Band &band = m_bands[b];
+      m_band_energy[b] = Dot(&m_band_weights[band.weight_offset], &m_magnitude[band.first_bin], band.weight_count);
+   }
+}
+
+float PitchDetector::Salience(int key) const
+{
+   float salience = 0.0f;
+   float fundamental = 0.0f;
+   float strongest = 0.0f;
+
+   for (int h = 0; h < Harmonics; ++h)
+   {
+      const int band = key - m_lowest + HarmonicOffset[h];
+      if (band >= m_band_count) break;
+
+      const float amplitude = m_residual[band] / m_response[band * m_band_count + band];
+      if (h == 0) fundamental = amplitude;
+      strongest = max(strongest, amplitude);
+
+      salience += HarmonicWeight[h] * amplitude;
+   }
+
+   if (fundamental < strongest * FundamentalShare) return 0.0f;
+   return salience;
+}
+
+void PitchDetector::Subtract(int key)
+{
+   // How loud each harmonic seems to be
+   float amplitude[Harmonics];
+   int count = 0;
+   for (; count < Harmonics; ++count)
+   {
+      const int band = key - m_lowest + HarmonicOffset[count];
+      if (band >= m_band_count) break;
+
+      amplitude[count] = m_residual[band] / m_response[band * m_band_count + band];
+   }
+
+   for (int h = 0; h < count; ++h)
+   {
+      // Real instruments' harmonics fall off fairly smoothly, so a
+      // harmonic much louder than both of its neighbours is probably
+      // shared with another note.  Leave the extra for that one.  (The
+      // fundamental is usually the loudest anyway, so it's taken whole.)
+      float take = amplitude[h];
+      if (h > 0)
+      {
+         float neighbours = amplitude[h - 1];
+         if (h + 1 < count) neighbours = (neighbours + amplitude[h + 1]) / 2.0f;
+         take = min(take, neighbours);
+      }
+
+      const int row = key - m_lowest + HarmonicOffset[h];
+      const float *response = &m_response[row * m_band_count];
+      for (int b = m_response_first[row]; b <= m_response_last[row]; ++b)
+      {
+         m_residual[b] = max(0.0f, m_residual[b] - take * response[b]);
+      }
+   }
+}
+
+void PitchDetector::Track(DetectedNoteList *notes)
+{
+   DetectedNote note;
+   note.frame = m_frames_in;
+
+   for (size_t k = 0; k < m_keys.size(); ++k)
+   {
+      KeyState &key = m_keys[k];
+      const float heard = m_picked[k];
+
+      note.note = static_cast<NoteId>(m_lowest + k);
+
+      // Whether it was picked out can flicker from hop to hop, so onsets
+      // are judged from the key's fundamental before anything was
+      // subtracted
+      const float strength = m_strength[k];
+      const float fundamental = m_fundamental[k];
+      const float before = key.earlier[key.next_earlier];
+      if (fundamental > before * RiseRatio && fundamental - before > max(AbsoluteFloor, m_loudest * RiseFloor)) key.hops_since_rise = 0;
+      else if (key.hops_since_rise <= MaxDecisionHops) key.hops_since_rise++;
+
+      key.earlier[key.next_earlier] = fundamental;
+      key.next_earlier = (key.next_earlier + 1) % RiseHops;
+
+      if (!key.sounding)
+      {
+         key.hops_heard = (heard > 0.0f) ? key.hops_heard + 1 : 0;
+         if (key.hops_heard < ConfirmHops || key.hops_since_rise > MaxDecisionHops) continue;
+
+         note.on = true;
+         note.velocity = max(1, min(127, static_cast<int>(100.0 + 30.0 * log10(strength / 2.0))));
+         notes->push_back(note);
+
+         key.sounding = true;
+         key.hops_quiet = 0;
+         key.hops_since_on = 0;
+         key.peak = fundamental;
+         key.low = fundamental;
+         continue;
+      }
+
+      if (fundamental > key.peak)
+      {
+         key.peak = fundamental;
+         key.low = fundamental;
+      }
+      else key.low = min(key.low, fundamental);
+
+      // Struck again: it had died away a little and then jumped back up
+      if (key.hops_since_on < RestrikeHops) key.hops_since_on++;
+      if (heard > 0.0f && key.hops_since_rise == 0 && key.hops_since_on >= RestrikeHops && key.low < key.peak * RestrikeDip)
+      {
+         note.on = false;
+         note.velocity = 0;
+         notes->push_back(note);
+
+         note.on = true;
+         note.velocity = max(1, min(127, static_cast<int>(100.0 + 30.0 * log10(strength / 2.0))));
+         notes->push_back(note);
+
+         key.peak = fundamental;
+         key.low = fundamental;
+         key.hops_since_on = 0;
+      }
+
+      key.hops_quiet = (heard == 0.0f || fundamental < key.peak * ReleaseFraction) ? key.hops_quiet + 1 : 0;
+      if (key.hops_quiet < ReleaseHops) continue;
+
+      note.on = false;
+      note.velocity = 0;
+      notes->push_back(note);
+
+      key.sounding = false;
+      key.hops_heard = 0;
+   }
+}
+
+void PitchDetector::Process(const float *samples, size_t frame_count, DetectedNoteList *notes)
+{
+   while (frame_count > 0)
+   {
+      const size_t take = min(frame_count, m_hop_frames - m_pending);
+      memcpy(&m_incoming[m_pending], samples, take * sizeof(float));
+
+      samples += take;
+      frame_count -= take;
+      m_pending += take;
+      m_frames_in += take;
+
+      if (m_pending < m_hop_frames) break;
+      m_pending = 0;
+
+      const microseconds_t start = Compatible::GetMicroseconds();
+
+      memmove(&m_history[0], &m_history[m_hop_frames], (m_window_frames - m_hop_frames) * sizeof(float));
+      memcpy(&m_history[m_window_frames - m_hop_frames], &m_incoming[0], m_hop_frames * sizeof(float));
+
+      Analyze(&m_history[0]);
+      copy(m_band_energy.begin(), m_band_energy.end(), m_residual.begin());
+      fill(m_picked.begin(), m_picked.end(), 0.0f);
+
+      const int key_count = static_cast<int>(m_keys.size());
+
+      m_loudest = 0.0f;
+      for (int k = 0; k < key_count; ++k)
+      {
+         m_strength[k] = Salience(m_lowest + k);
+         m_fundamental[k] = m_band_energy[k] / m_response[k * m_band_count + k];
+         m_loudest = max(m_loudest, m_strength[k]);
+      }
+
+      const float loudest = m_loudest;
+
+      for (int voice = 0; voice < MaxPolyphony && loudest >= AbsoluteFloor; ++voice)
+      {
+         for (int k = 0; k < key_count; ++k) m_salience[k] = Salience(m_lowest + k);
+
+         // The key that clears its threshold by the most, as long as it
+         // isn't just spill-over from a neighbour that's louder
+         int best = -1;
+         float best_score = 1.0f;
+         for (int k = 0; k < key_count; ++k)
+         {
+            if (m_picked[k] > 0.0f) continue;
+            if (k > 0 && m_salience[k - 1] > m_salience[k]) continue;
+            if (k + 1 < key_count && m_salience[k + 1] > m_salience[k]) continue;
+
+            // Or what's left over next to a note that was just taken
+            if (k > 0 && m_picked[k - 1] > m_salience[k] * NeighbourRatio) continue;
+            if (k + 1 < key_count && m_picked[k + 1] > m_salience[k] * NeighbourRatio) continue;
+
+            const float floor = max(AbsoluteFloor, loudest * (m_keys[k].sounding ? SustainFloor : OnsetFloor));
+
+            const float score = m_salience[k] / floor;
+            if (score < best_score) continue;
+
+            best = k;
+            best_score = score;
+         }
+
+         if (best < 0) break;
+
+         m_picked[best] = m_salience[best];
+         Subtract(m_lowest + best);
+      }
+
+      Track(notes);
+
+      m_hop_time.Record(Compatible::GetMicroseconds() - start);
+   }
+}
+
+void PitchDetector::Reset(DetectedNoteList *notes)
+{
+   for (size_t k = 0; k < m_keys.size(); ++k)
+   {
+      KeyState &key = m_keys[k];
+      if (key.sounding)
+      {
+         DetectedNote note;
+         note.on = false;
+         note.note = static_cast<NoteId>(m_lowest + k);
+         note.velocity = 0;
+         note.frame = m_frames_in;
+         notes->push_back(note);
+      }
+
+      key.sounding = false;
+      key.hops_heard = 0;
+      key.hops_quiet = 0;
+      key.hops_since_on = 0;
+      key.hops_since_rise = MaxDecisionHops + 1;
+      key.next_earlier = 0;
+      for (int i = 0; i < RiseHops; ++i) key.earlier[i] = 0.0f;
+      key.peak = 0.0f;
+      key.low = 0.0f;
+   }
+
+   fill(m_history.begin(), m_history.end(), 0.0f);
+   m_pending = 0;
+}
+
+microseconds_t PitchDetector::LatencyBudget() const
+{
+   return static_cast<microseconds_t>((MaxDecisionHops + 1) * m_hop_frames * 1000000.0 / m_sample_rate);
+}
@@ -0,0 +1,184 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __PITCH_DETECTOR_H
+#define __PITCH_DETECTOR_H
+
+#include <cstddef>
+#include <vector>
+
+#include "LatencyHistogram.h"
+#include "libmidi/Note.h"
+#include "libmidi/MidiTypes.h"
+
+// A note starting or stopping, as heard by a PitchDetector
+struct DetectedNote
+{
+   bool on;
+   NoteId note;
+
+   // Only meaningful for note-ons
+   int velocity;
+
+   // How many frames of audio had gone in when the detector made up its
+   // mind.  (Where the note really started is up to a LatencyBudget()
+   // earlier.)
+   size_t frame;
+};
+
+typedef std::vector<DetectedNote> DetectedNoteList;
+
+// Listens to (mono) audio of a piano being played and works out which
+// keys are going down and coming back up.
+//
+// Every hop (a few milliseconds of audio) the most recent window is
+// transformed and its spectrum gathered into one band per semitone, from
+// the lowest key up to a few octaves above the highest (to catch their
+// harmonics).  Notes are picked out of that one at a time, loudest first:
+// each key is scored by adding up the bands where its harmonics would
+// be, the best is taken, and its harmonics are subtracted back out (no
+// more than the neighbouring harmonics suggest, so a note an octave up
+// still stands out) before looking for the next.
+//
+// A key counts as pressed once it's been picked out a couple of hops
+// running, as long as its fundamental jumped (rather than creeping up, like
+// beating between nearby partials) not long before.  If that doesn't
+// happen soon enough after the jump, the note is never reported at all:
+// by then it's too late to be any use to the game and more likely to be a
+// mistake.  A key that has faded a little and jumps again was struck
+// again; one that stays faded (or stops being picked out) was let go.
+class PitchDetector
+{
+public:
+   PitchDetector(unsigned int sample_rate, NoteId lowest = 36, NoteId highest = 96);
+
+   // Takes any amount of audio at a time.  Notes that start or stop are
+   // appended to notes.
+   void Process(const float *samples, size_t frame_count, DetectedNoteList *notes);
+
+   // Releases every sounding note (appending their note-offs) and
+   // forgets all audio heard so far
+   void Reset(DetectedNoteList *notes);
+
+   unsigned int SampleRate() const { return m_sample_rate; }
+   NoteId Lowest() const { return static_cast<NoteId>(m_lowest); }
+   NoteId Highest() const { return static_cast<NoteId>(m_highest); }
+   size_t WindowFrames() const { return m_window_frames; }
+   size_t HopFrames() const { return m_hop_frames; }
+
+   // The longest it can take, once a key's energy starts rising in the
+   // analysis window, for it to be reported
+   microseconds_t LatencyBudget() const;
+
+   // Wall-clock time taken to analyze each hop
+   const LatencyHistogram &HopTime() const { return m_hop_time; }
+
+private:
+   PitchDetector(const PitchDetector&);
+   PitchDetector &operator=(const PitchDetector&);
+
+   const static int Harmonics = 8;
+   const static int RiseHops = 3;
+
+   struct Band
+   {
+      size_t first_bin;
+
+      // Padded out to a multiple of four with zeros
+      size_t weight_offset;
+      size_t weight_count;
+   };
+
+   struct KeyState
+   {
+      bool sounding;
+
+      // Hops in a row the key has been picked out of the window, since
+      // its fundamental last jumped by RiseRatio, and since it was struck
+      int hops_heard;
+      int hops_since_rise;
+      int hops_since_on;
+      int hops_quiet;
+
+      // The key's fundamental over the last RiseHops hops, oldest first
+      // starting at next_earlier
+      float earlier[RiseHops];
+      int next_earlier;
+
+      // The loudest it's been since it was struck, and the quietest since
+      // that peak
+      float peak;
+      float low;
+   };
+
+   void BuildBands();
+   void BuildResponses();
+
+   // Fills m_band_energy from the given window of audio
+   void Analyze(const float *window);
+   void Transform();
+
+   float Salience(int key) const;
+   void Subtract(int key);
+
+   void Track(DetectedNoteList *notes);
+
+   unsigned int m_sample_rate;
+   int m_lowest;
+   int m_highest;
+
+   // The highest band, and how many there are from m_lowest to it
+   int m_top;
+   int m_band_count;
+
+   size_t m_window_frames;
+   size_t m_hop_frames;
+   size_t m_fft_size;
+
+   std::vector<float> m_window;
+   std::vector<size_t> m_bit_reverse;
+
+   // Stage by stage, one after the other (1 + 2 + 4 + ... of them)
+   std::vector<float> m_twiddle_real;
+   std::vector<float> m_twiddle_imag;
+
+   std::vector<float> m_real;
+   std::vector<float> m_imag;
+   std::vector<float> m_windowed;
+   std::vector<float> m_magnitude;
+
+   std::vector<Band> m_bands;
+   std::vector<float> m_band_weights;
+
+   // How strongly each band (column) picks up a unit-amplitude partial at
+   // the centre of another (row), and the range of columns worth looking at
+   std::vector<float> m_response;
+   std::vector<int> m_response_first;
+   std::vector<int> m_response_last;
+
+   std::vector<float> m_band_energy;
+   std::vector<float> m_residual;
+   std::vector<float> m_salience;
+
+   // From picking over everything in the window
+   std::vector<float> m_strength;
+   std::vector<float> m_picked;
+   float m_loudest;
+
+   // Each key's fundamental band alone, in the same units as its strength
+   std::vector<float> m_fundamental;
+
+   std::vector<KeyState> m_keys;
+
+   // The most recent window of audio, and how much of the next hop has
+   // arrived since it was last analyzed
+   std::vector<float> m_history;
+   std::vector<float> m_incoming;
+   size_t m_pending;
+   size_t m_frames_in;
+
+   LatencyHistogram m_hop_time;
+};
+
+#endif
@@ -4,19 +4,54 @@
 
 #include "Renderer.h"
 #include "Tga.h"
+#include "SoftwareRasterizer.h"
 #include "os_graphics.h"
 
+#include <algorithm>
 #include <limits>
 
 
 // These are static because OpenGL is (essentially) static
-static unsigned int last_texture_id = std::numeric_limits<unsigned int>::max();
-void SelectTexture(unsigned int texture_id)
+static SpriteBatch batch;
+static SpriteBatchStats last_frame;
+static GLubyte current_color[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+static SoftwareRasterizer *software = 0;
+
+// OpenGL's window coordinates count up from the bottom
+static int frame_height = 0;
+
+static void BuildQuad(SpriteVertex quad[4], int x, int y, int w, int h, GLfloat tx, GLfloat ty, GLfloat tw, GLfloat th)
 {
-   if (texture_id == last_texture_id) return;
-   
-   glBindTexture(GL_TEXTURE_2D, texture_id);
-   last_texture_id = texture_id;
+   const GLfloat left = static_cast<GLfloat>(x);
+   const GLfloat top = static_cast<GLfloat>(y);
+   const GLfloat right = static_cast<GLfloat>(x + w);
+   const GLfloat bottom = static_cast<GLfloat>(y + h);
+
+   const GLfloat corners[4][4] = { {  left,    top,    tx,    ty },
+                                   {  left, bottom,    tx, ty+th },
+                                   { right, bottom, tx+tw, ty+th },
+                                   { right,    top, tx+tw,    ty } };
+
+   for (int i = 0; i < 4; ++i)
+   {
+      quad[i].x = corners[i][0];
+      quad[i].y = corners[i][1];
+      quad[i].u = corners[i][2];
+      quad[i].v = corners[i][3];
+
+      quad[i].r = current_color[0];
+      quad[i].g = current_color[1];
+      quad[i].b = current_color[2];
+      quad[i].a = current_color[3];
+   }
+}
+
+static void QueueQuad(unsigned int texture_id, int x, int y, int w, int h, GLfloat tx, GLfloat ty, GLfloat tw, GLfloat th)
+{
+   SpriteVertex quad[4];
+   BuildQuad(quad, x, y, w, h, tx, ty, tw, th);
+
+   batch.AddQuad(texture_id, quad);
 }
 
 
@@ -24,6 +59,93 @@ Renderer::Renderer(Context context) : m_context(context), m_xoffset(0), m_yoffse
 {
 }
 
+void Renderer::UseSoftwareRasterizer(SoftwareRasterizer *rasterizer)
+{
+   batch.SetRasterizer(rasterizer);
+   software = rasterizer;
+}
+
+SoftwareRasterizer *Renderer::GetSoftwareRasterizer()
+{
+   return software;
+}
+
+unsigned int Renderer::CreateTexture(unsigned int width, unsigned int height, const unsigned char *rgba, bool smooth)
+{
+   if (software) return software->CreateTexture(width, height, rgba, smooth);
+
+   const GLint filter = smooth ? GL_LINEAR : GL_NEAREST;
+
+   GLuint id = 0;
+   glGenTextures(1, &id);
+   if (!id) return 0;
+
+   glBindTexture(GL_TEXTURE_2D, id);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+
+   return id;
+}
+
+void Renderer::SetTextureSmooth(unsigned int texture_id, bool smooth)
+{
+   // Quads already queued have to be drawn the old way
+   Flush();
+
+   if (software)
+   {
+      software->SetTextureSmooth(texture_id, smooth);
+      return;
+   }
+
+   const GLint filter = smooth ? GL_LINEAR : GL_NEAREST;
+
+   glBindTexture(GL_TEXTURE_2D, texture_id);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+}
+
+void Renderer::DeleteTexture(unsigned int texture_id)
+{
+   // Anything still queued with this texture has to be drawn first
+   Flush();
+
+   if (software) software->DeleteTexture(texture_id);
+   else glDeleteTextures(1, &texture_id);
+}
+
+unsigned int Renderer::MaxTextureSize()
+{
+   // The software rasterizer has no limit of its own
+   if (software) return std::numeric_limits<unsigned int>::max();
+
+   GLint size = 0;
+   glGetIntegerv(GL_MAX_TEXTURE_SIZE, &size);
+   return (size > 0) ? static_cast<unsigned int>(size) : 0;
+}
+
+void Renderer::BeginFrame(int width, int height, Color background)
+{
+   frame_height = height;
+
+   if (software)
+   {
+      software->Clear(background.r, background.g, background.b, background.a);
+      return;
+   }
+
+   glClearColor(background.r / 255.0f, background.g / 255.0f, background.b / 255.0f, background.a / 255.0f);
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+   glMatrixMode(GL_MODELVIEW);
+   glLoadIdentity();
+   glTranslatef(0., static_cast<GLfloat>(height), 0.);
+   glScalef (1., -1., 1.);
+   glTranslatef(0.375, 0.375, 0.);
+}
+
 Color Renderer::ToColor(int r, int g, int b, int a)
 {
    Color c;
@@ -48,7 +170,7 @@ void Renderer::SetVSyncInterval(int interval)
    SWAP_INTERVAL_PROC wglSwapIntervalEXT = (SWAP_INTERVAL_PROC)wglGetProcAddress( "wglSwapIntervalEXT" );
    if (wglSwapIntervalEXT) wglSwapIntervalEXT(interval);
 
-#else
+#elif defined __APPLE__
 
    GLint i = interval;
    GLboolean ret = CGLSetParameter (m_context, kCGLCPSwapInterval, &interval);
@@ -59,22 +181,65 @@ void Renderer::SetVSyncInterval(int interval)
       // This is non-critical.  V-Sync might just not be supported.
    }
 
+#else
+
+   // Headless; there's nothing to synchronize with.
+
 #endif
 }
 
 void Renderer::SwapBuffers()
 {
+   // Headless, there's nowhere to put the picture
+   if (!m_context) return;
+
+   if (software)
+   {
+      // Straight onto the back buffer, top row first
+      glDisable(GL_TEXTURE_2D);
+      glDisable(GL_BLEND);
+      glRasterPos2i(0, 0);
+      glPixelZoom(1.0f, -1.0f);
+      glDrawPixels(software->Width(), software->Height(), GL_RGBA, GL_UNSIGNED_BYTE, &software->Pixels()[0]);
+      glPixelZoom(1.0f, 1.0f);
+      glEnable(GL_BLEND);
+      glEnable(GL_TEXTURE_2D);
+   }
+
 #ifdef WIN32
    ::SwapBuffers(m_context);
-#else
+#elif defined __APPLE__
    glSwapAPPLE();
 #endif
 }
 
 void Renderer::ForceTexture(unsigned int texture_id)
 {
-   last_texture_id = std::numeric_limits<unsigned int>::max();
-   SelectTexture(texture_id);
+   Flush();
+   if (!software) glBindTexture(GL_TEXTURE_2D, texture_id);
+}
+
+void Renderer::Flush()
+{
+   batch.Flush();
+
+   // Drawing with a color array leaves the current color undefined, and
+   // direct OpenGL drawing (like WGL text) still relies on it
+   if (!software) glColor4ubv(current_color);
+}
+
+void Renderer::EndFrame()
+{
+   Flush();
+   last_frame = batch.EndFrame();
+
+   if (software) last_frame.raster_time = software->TakeRasterTime();
+   else glFlush();
+}
+
+const SpriteBatchStats &Renderer::LastFrameStats()
+{
+   return last_frame;
 }
 
 void Renderer::SetColor(Color c)
@@ -84,44 +249,82 @@ void Renderer::SetColor(Color c)
 
 void Renderer::SetColor(int r, int g, int b, int a)
 {
-   glColor4f(r / 255.0f, g / 255.0f, b / 255.0f, a / 255.0f);
+   current_color[0] = static_cast<GLubyte>(std::min(std::max(r, 0), 0xFF));
+   current_color[1] = static_cast<GLubyte>(std::min(std::max(g, 0), 0xFF));
+   current_color[2] = static_cast<GLubyte>(std::min(std::max(b, 0), 0xFF));
+   current_color[3] = static_cast<GLubyte>(std::min(std::max(a, 0), 0xFF));
+
+   // Only quads queued from here on pick this up, so it's safe to set the
+   // current color for direct OpenGL drawing right away
+   if (!software) glColor4ubv(current_color);
 }
 
 void Renderer::DrawQuad(int x, int y, int w, int h)
 {
-   SelectTexture(0);
+   QueueQuad(0, x + m_xoffset, y + m_yoffset, w, h, 0, 0, 0, 0);
+}
 
-   glBegin(GL_QUADS);
-   glVertex3i(   x + m_xoffset,   y + m_yoffset, 0);
-   glVertex3i( x+w + m_xoffset,   y + m_yoffset, 0);
-   glVertex3i( x+w + m_xoffset, y+h + m_yoffset, 0);
-   glVertex3i(   x + m_xoffset, y+h + m_yoffset, 0);
-   glEnd();
+void Renderer::SetBlending(bool blend)
+{
+   batch.SetBlending(blend);
 }
 
-void Renderer::DrawTga(const Tga *tga, int x, int y) const
+void Renderer::SetClip(int x, int y, int w, int h)
 {
-   DrawTga(tga, x, y, (int)tga->GetWidth(), (int)tga->GetHeight(), 0, 0);
+   // Quads already queued are drawn with the old clip
+   Flush();
+
+   x += m_xoffset;
+   y += m_yoffset;
+   batch.SetClip(x, y, w, h);
+
+   if (software)
+   {
+      software->SetClip(x, y, w, h);
+      return;
+   }
+
+   glEnable(GL_SCISSOR_TEST);
+   glScissor(x, frame_height - (y + h), std::max(w, 0), std::max(h, 0));
+}
+
+void Renderer::ClearClip()
+{
+   Flush();
+   batch.ClearClip();
+
+   if (software) software->ClearClip();
+   else glDisable(GL_SCISSOR_TEST);
 }
 
-void Renderer::DrawTga(const Tga *tga, int in_x, int in_y, int width, int height, int src_x, int src_y) const
+void Renderer::CopyToTexture(unsigned int texture_id, int tex_x, int tex_y, int x, int y, int w, int h)
 {
-   const int x = in_x + m_xoffset;
-   const int y = in_y + m_yoffset;
+   // Everything up to now has to be on the screen to be copied
+   Flush();
+   if (w <= 0 || h <= 0) return;
+
+   x += m_xoffset;
+   y += m_yoffset;
+   batch.RecordCopy(static_cast<unsigned long>(w) * h);
+
+   if (software)
+   {
+      software->CopyToTexture(texture_id, tex_x, tex_y, x, y, w, h);
+      return;
+   }
 
-   const double tx = static_cast<double>(src_x) / static_cast<double>(tga->GetWidth());
-   const double ty = -static_cast<double>(src_y) / static_cast<double>(tga->GetHeight());
-   const double tw = static_cast<double>(width) / static_cast<double>(tga->GetWidth());
-   const double th = -static_cast<double>(height)/ static_cast<double>(tga->GetHeight());
+   glBindTexture(GL_TEXTURE_2D, texture_id);
+   glCopyTexSubImage2D(GL_TEXTURE_2D, 0, tex_x, tex_y, x, frame_height - (y + h), w, h);
+}
 
-   SelectTexture(tga->GetId());
+void Renderer::DrawTga(const Tga *tga, int x, int y) const
+{
+   DrawTga(tga, x, y, (int)tga->GetWidth(), (int)tga->GetHeight(), 0, 0);
+}
 
-   glBegin(GL_QUADS);
-   glTexCoord2d(   tx,    ty); glVertex3i(      x,        y, 0);
-   glTexCoord2d(   tx, ty+th); glVertex3i(      x, y+height, 0);
-   glTexCoord2d(tx+tw, ty+th); glVertex3i(x+width, y+height, 0);
-   glTexCoord2d(tx+tw,    ty); glVertex3i(x+width,        y, 0);
-   glEnd();
+void Renderer::DrawTga(const Tga *tga, int x, int y, int width, int height, int src_x, int src_y) const
+{
+   DrawStretchedTga(tga, x, y, width, height, src_x, src_y, width, height);
 }
 
 void Renderer::DrawTextTextureQuad(unsigned int textureId, int in_x, int in_y, int width, int height) const
@@ -129,14 +332,7 @@ void Renderer::DrawTextTextureQuad(unsigned int textureId, int in_x, int in_y, i
    const int x = in_x;// + m_xoffset;
    const int y = in_y;// + m_yoffset;
 
-   SelectTexture(textureId);
-
-   glBegin(GL_QUADS);
-   glTexCoord2d(0, 1); glVertex3i(      x,        y, 0);
-   glTexCoord2d(0, 0); glVertex3i(      x, y+height, 0);
-   glTexCoord2d(1, 0); glVertex3i(x+width, y+height, 0);
-   glTexCoord2d(1, 1); glVertex3i(x+width,        y, 0);
-   glEnd();
+   QueueQuad(textureId, x, y, width, height, 0, 1, 1, -1);
 }
 
 void Renderer::DrawStretchedTga(const Tga *tga, int x, int y, int w, int h) const
@@ -146,20 +342,29 @@ void Renderer::DrawStretchedTga(const Tga *tga, int x, int y, int w, int h) cons
 
 void Renderer::DrawStretchedTga(const Tga *tga, int x, int y, int w, int h, int src_x, int src_y, int src_w, int src_h) const
 {
-   const int sx = x + m_xoffset;
-   const int sy = y + m_yoffset;
+   SpriteVertex quad[4];
+   BuildStretchedTga(quad, tga, x + m_xoffset, y + m_yoffset, w, h, src_x, src_y, src_w, src_h);
 
-   const double tx =  static_cast<double>(src_x) / static_cast<double>(tga->GetWidth());
-   const double ty = -static_cast<double>(src_y) / static_cast<double>(tga->GetHeight());
-   const double tw =  static_cast<double>(src_w) / static_cast<double>(tga->GetWidth());
-   const double th = -static_cast<double>(src_h) / static_cast<double>(tga->GetHeight());
+   batch.AddQuad(tga->GetId(), quad);
+}
 
-   SelectTexture(tga->GetId());
+void Renderer::BuildStretchedTga(SpriteVertex quad[4], const Tga *tga, int x, int y, int w, int h, int src_x, int src_y, int src_w, int src_h)
+{
+   // The image may be one of many in its texture (see TextureAtlas).  Its
+   // rows are stored bottom up, so source rows count down from its top.
+   const GLfloat texture_w = static_cast<GLfloat>(tga->GetTextureWidth());
+   const GLfloat texture_h = static_cast<GLfloat>(tga->GetTextureHeight());
+   const int image_top = static_cast<int>(tga->GetTextureY() + tga->GetHeight());
+
+   const GLfloat tx =  static_cast<GLfloat>(static_cast<int>(tga->GetTextureX()) + src_x) / texture_w;
+   const GLfloat ty =  static_cast<GLfloat>(image_top - src_y) / texture_h;
+   const GLfloat tw =  static_cast<GLfloat>(src_w) / texture_w;
+   const GLfloat th = -static_cast<GLfloat>(src_h) / texture_h;
+
+   BuildQuad(quad, x, y, w, h, tx, ty, tw, th);
+}
 
-   glBegin(GL_QUADS);
-   glTexCoord2d(   tx,    ty); glVertex3i(  sx,   sy, 0);
-   glTexCoord2d(   tx, ty+th); glVertex3i(  sx, sy+h, 0);
-   glTexCoord2d(tx+tw, ty+th); glVertex3i(sx+w, sy+h, 0);
-   glTexCoord2d(tx+tw,    ty); glVertex3i(sx+w,   sy, 0);
-   glEnd();
+void Renderer::DrawQuads(unsigned int texture_id, const SpriteVertex *vertices, size_t vertex_count, int x, int y) const
+{
+   batch.AddQuads(texture_id, vertices, vertex_count, static_cast<GLfloat>(x + m_xoffset), static_cast<GLfloat>(y + m_yoffset));
 }
@@ -6,22 +6,34 @@
 #define __RENDERER_H
 
 #include "os_graphics.h"
+#include "SpriteBatch.h"
 
 #ifdef WIN32
 typedef HDC Context;
-#else
+#elif defined __APPLE__
 typedef CGLContextObj Context;
+#else
+typedef void *Context;
 #endif
 
 class Tga;
 class Text;
 class TextWriter;
+class SoftwareRasterizer;
 
 struct Color
 {
    int r, g, b, a;
 };
 
+// Everything drawn through a Renderer is queued in a single, shared
+// SpriteBatch (OpenGL is essentially static, so the queue is too) and
+// reaches the screen when the batch is flushed: before any direct OpenGL
+// drawing, when ForceTexture is called, and at the end of each frame.
+//
+// Drawing can go to a SoftwareRasterizer instead of OpenGL.  Textures
+// then have to be created through Renderer too, so they end up wherever
+// the quads that use them are going.
 class Renderer
 {
 public:
@@ -30,6 +42,22 @@ public:
 
    Renderer(Context context);
 
+   // Has to be chosen before any textures are created, and the rasterizer
+   // must outlive everything drawn with it.  Null goes back to OpenGL.
+   static void UseSoftwareRasterizer(SoftwareRasterizer *rasterizer);
+   static SoftwareRasterizer *GetSoftwareRasterizer();
+
+   static unsigned int CreateTexture(unsigned int width, unsigned int height, const unsigned char *rgba, bool smooth);
+   static void SetTextureSmooth(unsigned int texture_id, bool smooth);
+   static void DeleteTexture(unsigned int texture_id);
+   static unsigned int MaxTextureSize();
+
+   // Clears the screen (of the given size) and sets up the view for a
+   // new frame
+   static void BeginFrame(int width, int height, Color background);
+
+   // With a software rasterizer (and a window), its framebuffer is copied
+   // to the screen first
    void SwapBuffers();
 
    // 0 will disable vsync, 1 will enable.  (In Windows, >1 will skip frames.)
@@ -38,12 +66,35 @@ public:
    void SetOffset(int x, int y) { m_xoffset = x; m_yoffset = y; }
    void ResetOffset() { SetOffset(0,0); }
 
+   // Flushes, then binds the texture right away
    void ForceTexture(unsigned int texture_id);
 
+   // Draws everything queued so far.  Anything that calls OpenGL itself
+   // (rather than going through a Renderer) has to do this first.
+   static void Flush();
+
+   // Flushes and closes the books on this frame.  LastFrameStats returns
+   // the totals for the frame most recently ended, including the time the
+   // software rasterizer took (since the previous frame ended).
+   static void EndFrame();
+   static const SpriteBatchStats &LastFrameStats();
+
    void SetColor(Color c);
    void SetColor(int r, int g, int b, int a = 0xFF);
    void DrawQuad(int x, int y, int w, int h);
 
+   // Like the color, only affects quads queued from here on.  Without
+   // blending, quads replace what's under them outright.
+   void SetBlending(bool blend);
+
+   // Nothing outside the rectangle is drawn until the clip is cleared
+   void SetClip(int x, int y, int w, int h);
+   void ClearClip();
+
+   // Copies what's been drawn in the rectangle at (x, y) so far this frame
+   // into the texture at (tex_x, tex_y), bottom row first like an image
+   void CopyToTexture(unsigned int texture_id, int tex_x, int tex_y, int x, int y, int w, int h);
+
    void DrawTga(const Tga *tga, int x, int y) const;
    void DrawTga(const Tga *tga, int x, int y, int width, int height, int src_x, int src_y) const;
 
@@ -52,6 +103,14 @@ public:
    void DrawStretchedTga(const Tga *tga, int x, int y, int w, int h) const;
    void DrawStretchedTga(const Tga *tga, int x, int y, int w, int h, int src_x, int src_y, int src_w, int src_h) const;
 
+   // Fills in the quad DrawStretchedTga would queue (in the current color,
+   // without the offset) so it can be kept and drawn any number of times
+   // with DrawQuads
+   static void BuildStretchedTga(SpriteVertex quad[4], const Tga *tga, int x, int y, int w, int h, int src_x, int src_y, int src_w, int src_h);
+
+   // Queues quads built ahead of time, moved by (x, y) and the offset
+   void DrawQuads(unsigned int texture_id, const SpriteVertex *vertices, size_t vertex_count, int x, int y) const;
+
 private:
 
    // NOTE: These are used externally by the friend
@@ -0,0 +1,79 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "RetainedLayer.h"
+#include "Renderer.h"
+#include "Tga.h"
+#include "PianoGameError.h"
+
+#include <vector>
+using namespace std;
+
+static unsigned int NextPowerOfTwo(unsigned int n)
+{
+   unsigned int p = 1;
+   while (p < n) p <<= 1;
+   return p;
+}
+
+RetainedLayer::RetainedLayer() : m_tga(0), m_width(0), m_height(0)
+{
+}
+
+RetainedLayer::~RetainedLayer()
+{
+   Tga::Release(m_tga);
+}
+
+bool RetainedLayer::Resize(int width, int height, bool *lost)
+{
+   *lost = false;
+   if (m_tga && width == m_width && height == m_height) return true;
+
+   Tga::Release(m_tga);
+   m_tga = 0;
+
+   *lost = true;
+   m_width = width;
+   m_height = height;
+   if (width <= 0 || height <= 0) return true;
+
+   // Textures have to be powers of two; the layer sits in the bottom-left
+   // corner (where an image's first row goes) of one
+   const unsigned int texture_width = NextPowerOfTwo(width);
+   const unsigned int texture_height = NextPowerOfTwo(height);
+
+   // Creating a texture that's too big doesn't fail, it just leaves
+   // nothing in it
+   const unsigned int max_size = Renderer::MaxTextureSize();
+   if (max_size > 0 && (texture_width > max_size || texture_height > max_size)) return false;
+
+   const vector<unsigned char> blank(texture_width * texture_height * 4, 0);
+
+   m_tga = Tga::BuildFromParameters(&blank[0], texture_width, texture_height);
+   if (!m_tga) throw PianoGameError(L"Couldn't create a texture for a retained layer.");
+
+   m_tga->m_width = width;
+   m_tga->m_height = height;
+
+   return true;
+}
+
+void RetainedLayer::Capture(Renderer &renderer, int x, int y, int layer_x, int layer_y, int w, int h)
+{
+   if (!m_tga) return;
+
+   // Rows are stored bottom first
+   renderer.CopyToTexture(m_tga->GetId(), layer_x, m_height - (layer_y + h), x, y, w, h);
+}
+
+void RetainedLayer::Draw(Renderer &renderer, int x, int y) const
+{
+   if (!m_tga) return;
+
+   renderer.SetColor(0xFF, 0xFF, 0xFF);
+   renderer.SetBlending(false);
+   renderer.DrawTga(m_tga, x, y);
+   renderer.SetBlending(true);
+}
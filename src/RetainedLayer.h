@@ -0,0 +1,51 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __RETAINED_LAYER_H
+#define __RETAINED_LAYER_H
+
+class Renderer;
+class Tga;
+
+// A rectangle of the screen, kept in a texture.  Something that takes a
+// lot of drawing but rarely changes can be drawn once, captured, and then
+// put back each frame with a single quad.  When part of it changes, just
+// that part can be redrawn (under a clip) and captured again.
+//
+// The layer goes back without blending, so the pixels come back exactly
+// as they were captured, alpha and all.  That only works if everything
+// in the rectangle was drawn over by the layer's own (opaque) drawing;
+// anything that would show through has to be drawn separately.
+class RetainedLayer
+{
+public:
+   RetainedLayer();
+   ~RetainedLayer();
+
+   int GetWidth() const { return m_width; }
+   int GetHeight() const { return m_height; }
+
+   // Makes room for a layer of the given size.  Returns false (leaving
+   // the layer empty) if the video card can't hold a texture that big, in
+   // which case the caller has to draw without it.  Otherwise, *lost is
+   // set if the contents were lost and the whole layer has to be captured
+   // again.
+   bool Resize(int width, int height, bool *lost);
+
+   // Copies the screen rectangle at (x, y) into the layer, with its
+   // top-left corner at (layer_x, layer_y)
+   void Capture(Renderer &renderer, int x, int y, int layer_x, int layer_y, int w, int h);
+
+   void Draw(Renderer &renderer, int x, int y) const;
+
+private:
+   RetainedLayer(const RetainedLayer&);
+   RetainedLayer &operator=(const RetainedLayer&);
+
+   Tga *m_tga;
+   int m_width;
+   int m_height;
+};
+
+#endif
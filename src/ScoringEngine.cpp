@@ -0,0 +1,164 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "ScoringEngine.h"
+#include "KeyboardDisplay.h"
+#include "PerformanceRecorder.h"
+
+#include <algorithm>
+using namespace std;
+
+#include "libmidi/MidiEvent.h"
+
+static microseconds_t RetireTime(const TranslatedNote &note)
+{
+   return max(note.end, note.start + KeyboardDisplay::NoteWindowLength / 2);
+}
+
+struct RetiresEarlier
+{
+   RetiresEarlier(const TranslatedNoteList &notes) : notes(notes) { }
+   bool operator()(size_t a, size_t b) const { return RetireTime(notes[a]) < RetireTime(notes[b]); }
+
+   const TranslatedNoteList &notes;
+};
+
+bool ScoringEngine::IsRetired(const TranslatedNote &note, microseconds_t song_time)
+{
+   return note.end < song_time && note.start + KeyboardDisplay::NoteWindowLength / 2 < song_time;
+}
+
+ScoringEngine::ScoringEngine(const TranslatedNoteList &notes, const vector<Track::Properties> &track_properties, bool listening)
+   : m_notes(notes), m_track_properties(track_properties), m_listening(listening),
+   m_upcoming(KeyboardDisplay::NoteWindowLength), m_next_miss(0), m_next_retire(0), m_combo(0)
+{
+   m_retire_order.resize(m_notes.size());
+   for (size_t i = 0; i < m_retire_order.size(); ++i) m_retire_order[i] = i;
+   stable_sort(m_retire_order.begin(), m_retire_order.end(), RetiresEarlier(m_notes));
+
+   Reset();
+}
+
+void ScoringEngine::Reset()
+{
+   m_states.resize(m_notes.size());
+   for (size_t i = 0; i < m_notes.size(); ++i)
+   {
+      m_states[i] = AutoPlayed;
+      if (m_track_properties[m_notes[i].track_id].mode == Track::ModeYouPlay) m_states[i] = UserPlayable;
+   }
+
+   vector<int> track_input_devices(m_track_properties.size());
+   for (size_t i = 0; i < track_input_devices.size(); ++i) track_input_devices[i] = m_track_properties[i].input_device;
+   m_upcoming.Reset(m_notes, m_states, track_input_devices);
+
+   m_next_miss = 0;
+   m_next_retire = 0;
+   m_held_notes.clear();
+
+   m_stats = SongStatistics();
+   m_stats.total_note_count = static_cast<int>(m_notes.size());
+
+   m_combo = 0;
+}
+
+double ScoringEngine::Multiplier() const
+{
+   const static double MaxMultiplier = 5.0;
+   double multiplier = 1.0;
+
+   const double combo_addition = m_combo / 10.0;
+   multiplier += combo_addition;
+
+   return std::min(MaxMultiplier, multiplier);
+}
+
+bool ScoringEngine::Press(NoteId note_id, int input_device, microseconds_t song_time, int speed, size_t *note)
+{
+   m_stats.total_notes_user_pressed++;
+
+   size_t match_id = 0;
+   if (!m_upcoming.Match(note_id, song_time, input_device, m_states, &match_id))
+   {
+      m_stats.stray_notes++;
+      return false;
+   }
+
+   m_states[match_id] = UserHit;
+
+   const static double NoteValue = 100.0;
+   m_stats.score += NoteValue * Multiplier() * (speed / 100.0);
+
+   m_stats.notes_user_could_have_played++;
+   m_stats.speed_integral += speed;
+
+   m_stats.notes_user_actually_played++;
+   m_combo++;
+   m_stats.longest_combo = max(m_combo, m_stats.longest_combo);
+
+   if (note) *note = match_id;
+   return true;
+}
+
+size_t ScoringEngine::Advance(microseconds_t song_time, int speed)
+{
+   // Notes whose hit windows have closed can't be hit anymore
+   for (; m_next_miss < m_notes.size(); ++m_next_miss)
+   {
+      if (m_notes[m_next_miss].start + (KeyboardDisplay::NoteWindowLength / 2) > song_time) break;
+      if (m_listening && m_states[m_next_miss] == UserPlayable) m_states[m_next_miss] = UserMissed;
+
+      m_held_notes.push_back(m_next_miss);
+   }
+
+   size_t missed = 0;
+   for (; m_next_retire < m_retire_order.size(); ++m_next_retire)
+   {
+      const size_t note = m_retire_order[m_next_retire];
+      if (!IsRetired(m_notes[note], song_time)) break;
+
+      if (m_states[note] == UserMissed)
+      {
+         // They missed a note, reset the combo counter
+         m_combo = 0;
+
+         m_stats.notes_user_could_have_played++;
+         m_stats.speed_integral += speed;
+         missed++;
+      }
+   }
+
+   size_t held = 0;
+   for (size_t i = 0; i < m_held_notes.size(); ++i)
+   {
+      if (!IsRetired(m_notes[m_held_notes[i]], song_time)) m_held_notes[held++] = m_held_notes[i];
+   }
+   m_held_notes.resize(held);
+
+   return missed;
+}
+
+void ScoringEngine::Replay(const RecordedInput *inputs, size_t count)
+{
+   for (size_t i = 0; i < count; ++i)
+   {
+      const RecordedInput &r = inputs[i];
+
+      // The game only records these when the song retired a missed note,
+      // so advancing at just these points retires exactly the same ones.
+      if (r.missed_notes)
+      {
+         Advance(r.score_time, r.speed);
+         continue;
+      }
+
+      if (!r.scored) continue;
+
+      MidiEvent ev = MidiEvent::Build(r.simple);
+      if (ev.Type() != MidiEventType_NoteOn || ev.NoteVelocity() == 0) continue;
+
+      ev.ShiftNote(r.note_offset);
+      Press(ev.NoteNumber(), r.device, r.score_time, r.speed, 0);
+   }
+}
@@ -0,0 +1,92 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __SCORING_ENGINE_H
+#define __SCORING_ENGINE_H
+
+#include <cstddef>
+#include <vector>
+
+#include "SharedState.h"
+#include "TrackProperties.h"
+#include "UpcomingNotes.h"
+
+#include "libmidi/Note.h"
+#include "libmidi/MidiTypes.h"
+
+struct RecordedInput;
+
+// Everything that decides how well a song was played: which note each key
+// press was meant for, which notes went by unplayed, the combo and score
+// multiplier, and the running SongStatistics.  It only knows about the
+// note table and the song times it's handed, so a recorded take can be
+// scored again without a window, a clock, or any MIDI devices.
+class ScoringEngine
+{
+public:
+   // The notes (and track properties) must outlive this.  Without a
+   // listener (no input device at all) nothing is ever counted as missed.
+   ScoringEngine(const TranslatedNoteList &notes, const std::vector<Track::Properties> &track_properties, bool listening);
+
+   // Back to the start of the song with fresh statistics
+   void Reset();
+
+   // The player pressed a key (after octave sliding) on the device at this
+   // position in the input group while the song was at song_time and
+   // playing at speed percent.  Returns whether it hit a note, and which.
+   bool Press(NoteId note_id, int input_device, microseconds_t song_time, int speed, size_t *note);
+
+   // Moves the song up to song_time: notes whose hit windows have closed
+   // are missed, and finished ones are retired.  Returns how many missed
+   // notes were retired (each of which broke the combo).
+   size_t Advance(microseconds_t song_time, int speed);
+
+   // Replays a take from PerformanceRecorder, scoring each event exactly
+   // as the game did when it was recorded.
+   void Replay(const RecordedInput *inputs, size_t count);
+
+   const SongStatistics &Stats() const { return m_stats; }
+   int Combo() const { return m_combo; }
+   double Multiplier() const;
+
+   const NoteStateList &NoteStates() const { return m_states; }
+
+   // Every note from FirstLiveNote() on is still live.  The only live ones
+   // before it are the held notes: those whose hit windows have closed but
+   // that haven't finished yet, in start order.  One long note held early
+   // in the song leaves the notes after it free to retire.
+   size_t FirstLiveNote() const { return m_next_miss; }
+   const std::vector<size_t> &HeldNotes() const { return m_held_notes; }
+
+   // Once a note has finished and its hit window has closed, it's retired:
+   // it isn't drawn anymore and, if it was missed, it breaks the combo.
+   static bool IsRetired(const TranslatedNote &note, microseconds_t song_time);
+
+private:
+   ScoringEngine(const ScoringEngine&);
+   ScoringEngine &operator=(const ScoringEngine&);
+
+   const TranslatedNoteList &m_notes;
+   const std::vector<Track::Properties> &m_track_properties;
+   bool m_listening;
+
+   NoteStateList m_states;
+   UpcomingNotes m_upcoming;
+
+   // Every note, in the order they're retired
+   std::vector<size_t> m_retire_order;
+
+   // The first note whose hit window is still open and the next to retire
+   // (in m_retire_order)
+   size_t m_next_miss;
+   size_t m_next_retire;
+
+   // Notes before m_next_miss that haven't been retired yet
+   std::vector<size_t> m_held_notes;
+
+   SongStatistics m_stats;
+   int m_combo;
+};
+
+#endif
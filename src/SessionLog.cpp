@@ -0,0 +1,281 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "SessionLog.h"
+#include "CompatibleSystem.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+using namespace std;
+
+const static char Magic[] = "PGSESSN";
+const static unsigned char Version = 1;
+
+// Reads back what SessionRecorder packed.  Running off the end of the
+// data sets 'bad' and returns zeros from then on.
+struct SessionCursor
+{
+   SessionCursor(const vector<unsigned char> &bytes) : bytes(bytes), position(0), bad(false) { }
+
+   bool AtEnd() const { return position >= bytes.size(); }
+
+   unsigned char Byte()
+   {
+      if (AtEnd()) { bad = true; return 0; }
+      return bytes[position++];
+   }
+
+   unsigned long long Unsigned()
+   {
+      unsigned long long value = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+         const unsigned char b = Byte();
+         value |= static_cast<unsigned long long>(b & 0x7F) << shift;
+         if ((b & 0x80) == 0) return value;
+      }
+
+      bad = true;
+      return 0;
+   }
+
+   long long Signed()
+   {
+      const unsigned long long value = Unsigned();
+      return static_cast<long long>(value >> 1) ^ -static_cast<long long>(value & 1);
+   }
+
+   const vector<unsigned char> &bytes;
+   size_t position;
+   bool bad;
+};
+
+SessionRecorder::SessionRecorder(const SessionHeader &header) : m_last_timestamp(0)
+{
+   // Enough for a few minutes of a busy song without growing
+   m_bytes.reserve(256 * 1024);
+
+   m_bytes.insert(m_bytes.end(), Magic, Magic + sizeof(Magic));
+   PutByte(Version);
+
+   PutUnsigned(header.screen_width);
+   PutUnsigned(header.screen_height);
+   PutUnsigned(header.song_speed);
+   PutUnsigned(header.input_count);
+
+   PutUnsigned(header.track_properties.size());
+   for (size_t t = 0; t < header.track_properties.size(); ++t)
+   {
+      PutByte(static_cast<unsigned char>(header.track_properties[t].mode));
+      PutSigned(header.track_properties[t].input_device);
+   }
+
+   PutUnsigned(header.note_count);
+   PutSigned(header.song_length);
+}
+
+void SessionRecorder::PutUnsigned(unsigned long long value)
+{
+   while (value >= 0x80)
+   {
+      PutByte(static_cast<unsigned char>(value | 0x80));
+      value >>= 7;
+   }
+   PutByte(static_cast<unsigned char>(value));
+}
+
+void SessionRecorder::PutSigned(long long value)
+{
+   // Zig-zag, so small negative numbers stay small
+   PutUnsigned((static_cast<unsigned long long>(value) << 1) ^ static_cast<unsigned long long>(value >> 63));
+}
+
+void SessionRecorder::Frame(unsigned long delta_milliseconds, bool skipped)
+{
+   PutByte(SessionFrame);
+   PutUnsigned(delta_milliseconds);
+   PutByte(skipped ? 1 : 0);
+}
+
+void SessionRecorder::Key(GameKey key)
+{
+   PutByte(SessionKey);
+   PutUnsigned(key);
+}
+
+void SessionRecorder::MousePress(MouseButton button)
+{
+   PutByte(SessionMousePress);
+   PutByte(static_cast<unsigned char>(button));
+}
+
+void SessionRecorder::MouseRelease(MouseButton button)
+{
+   PutByte(SessionMouseRelease);
+   PutByte(static_cast<unsigned char>(button));
+}
+
+void SessionRecorder::MouseMove(int x, int y)
+{
+   PutByte(SessionMouseMove);
+   PutSigned(x);
+   PutSigned(y);
+}
+
+void SessionRecorder::MidiIn(int device, const MidiEvent &ev, microseconds_t timestamp)
+{
+   MidiEventSimple simple;
+   if (!ev.GetSimpleEvent(&simple)) return;
+
+   PutByte(SessionMidiIn);
+   PutSigned(device);
+   PutByte(simple.status);
+   PutByte(simple.byte1);
+   PutByte(simple.byte2);
+
+   PutSigned(timestamp - m_last_timestamp);
+   m_last_timestamp = timestamp;
+}
+
+void SessionRecorder::MidiOut(size_t track_id, const MidiEvent &ev)
+{
+   MidiEventSimple simple;
+   if (!ev.GetSimpleEvent(&simple)) return;
+
+   PutByte(SessionMidiOut);
+   PutUnsigned(track_id);
+   PutByte(simple.status);
+   PutByte(simple.byte1);
+   PutByte(simple.byte2);
+}
+
+void SessionRecorder::Stats(const SongStatistics &stats)
+{
+   PutByte(SessionStats);
+   PutUnsigned(stats.total_note_count);
+   PutUnsigned(stats.notes_user_could_have_played);
+   PutSigned(stats.speed_integral);
+   PutUnsigned(stats.notes_user_actually_played);
+   PutUnsigned(stats.stray_notes);
+   PutUnsigned(stats.total_notes_user_pressed);
+   PutUnsigned(stats.longest_combo);
+
+   // Every bit of it, so a replay has to come out exactly the same
+   unsigned long long score_bits = 0;
+   memcpy(&score_bits, &stats.score, sizeof(score_bits));
+   PutUnsigned(score_bits);
+}
+
+bool SessionRecorder::WriteFile(const wstring &filename) const
+{
+   ofstream file;
+   Compatible::OpenFile(file, filename, ios::out | ios::trunc | ios::binary);
+
+   if (!file.good()) return false;
+
+   if (!m_bytes.empty()) file.write(reinterpret_cast<const char*>(&m_bytes[0]), static_cast<streamsize>(m_bytes.size()));
+   return file.good();
+}
+
+bool SessionRecorder::ReadFile(const wstring &filename, SessionHeader *header, vector<SessionRecord> *records)
+{
+   ifstream file;
+   Compatible::OpenFile(file, filename, ios::in | ios::binary);
+
+   if (!file.good()) return false;
+
+   const vector<unsigned char> bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+   if (bytes.size() < sizeof(Magic) + 1) return false;
+   if (memcmp(&bytes[0], Magic, sizeof(Magic)) != 0 || bytes[sizeof(Magic)] != Version) return false;
+
+   SessionCursor in(bytes);
+   in.position = sizeof(Magic) + 1;
+
+   *header = SessionHeader();
+   header->screen_width = static_cast<int>(in.Unsigned());
+   header->screen_height = static_cast<int>(in.Unsigned());
+   header->song_speed = static_cast<int>(in.Unsigned());
+   header->input_count = static_cast<int>(in.Unsigned());
+
+   const size_t track_count = static_cast<size_t>(in.Unsigned());
+   for (size_t t = 0; t < track_count && !in.bad; ++t)
+   {
+      Track::Properties p;
+      p.mode = static_cast<Track::Mode>(in.Byte());
+      p.input_device = static_cast<int>(in.Signed());
+      header->track_properties.push_back(p);
+   }
+
+   header->note_count = static_cast<size_t>(in.Unsigned());
+   header->song_length = in.Signed();
+
+   records->clear();
+   microseconds_t last_timestamp = 0;
+   while (!in.AtEnd() && !in.bad)
+   {
+      SessionRecord r;
+      r.type = static_cast<SessionRecordType>(in.Byte());
+
+      switch (r.type)
+      {
+      case SessionFrame:
+         r.delta_milliseconds = static_cast<unsigned long>(in.Unsigned());
+         r.skipped = (in.Byte() != 0);
+         break;
+
+      case SessionKey:
+         r.key = static_cast<GameKey>(in.Unsigned());
+         break;
+
+      case SessionMousePress:
+      case SessionMouseRelease:
+         r.button = static_cast<MouseButton>(in.Byte());
+         break;
+
+      case SessionMouseMove:
+         r.x = static_cast<int>(in.Signed());
+         r.y = static_cast<int>(in.Signed());
+         break;
+
+      case SessionMidiIn:
+         r.device = static_cast<int>(in.Signed());
+         r.simple.status = in.Byte();
+         r.simple.byte1 = in.Byte();
+         r.simple.byte2 = in.Byte();
+         r.timestamp = last_timestamp + in.Signed();
+         last_timestamp = r.timestamp;
+         break;
+
+      case SessionMidiOut:
+         r.track_id = static_cast<size_t>(in.Unsigned());
+         r.simple.status = in.Byte();
+         r.simple.byte1 = in.Byte();
+         r.simple.byte2 = in.Byte();
+         break;
+
+      case SessionStats:
+         {
+            r.stats.total_note_count = static_cast<int>(in.Unsigned());
+            r.stats.notes_user_could_have_played = static_cast<int>(in.Unsigned());
+            r.stats.speed_integral = static_cast<long>(in.Signed());
+            r.stats.notes_user_actually_played = static_cast<int>(in.Unsigned());
+            r.stats.stray_notes = static_cast<int>(in.Unsigned());
+            r.stats.total_notes_user_pressed = static_cast<int>(in.Unsigned());
+            r.stats.longest_combo = static_cast<int>(in.Unsigned());
+
+            const unsigned long long score_bits = in.Unsigned();
+            memcpy(&r.stats.score, &score_bits, sizeof(score_bits));
+         }
+         break;
+
+      default:
+         return false;
+      }
+
+      if (!in.bad) records->push_back(r);
+   }
+
+   return !in.bad;
+}
@@ -0,0 +1,129 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __SESSION_LOG_H
+#define __SESSION_LOG_H
+
+#include <string>
+#include <vector>
+
+#include "GameState.h"
+#include "SharedState.h"
+#include "TrackProperties.h"
+
+#include "libmidi/MidiEvent.h"
+#include "libmidi/MidiTypes.h"
+
+// What the playing screen was started with.  The song itself isn't kept,
+// only enough to tell whether a replay was given the right one.
+struct SessionHeader
+{
+   SessionHeader() : screen_width(0), screen_height(0), song_speed(100), input_count(0), note_count(0), song_length(0) { }
+
+   int screen_width;
+   int screen_height;
+   int song_speed;
+
+   // How many devices were in SharedState::midi_in
+   int input_count;
+
+   // Only mode and input_device matter to a replay
+   std::vector<Track::Properties> track_properties;
+
+   size_t note_count;
+   microseconds_t song_length;
+};
+
+enum SessionRecordType
+{
+   SessionFrame = 1,
+   SessionKey,
+   SessionMousePress,
+   SessionMouseRelease,
+   SessionMouseMove,
+   SessionMidiIn,
+   SessionMidiOut,
+   SessionStats
+};
+
+// One thing that happened during the session.  Only the fields for its
+// type are filled in.
+struct SessionRecord
+{
+   SessionRecord() : type(SessionFrame), delta_milliseconds(0), skipped(false), key(KeySpace), button(MouseLeft),
+      x(0), y(0), device(0), timestamp(0), track_id(0) { }
+
+   SessionRecordType type;
+
+   // SessionFrame: GameStateManager::Update's delta, and whether that
+   // update was skipped
+   unsigned long delta_milliseconds;
+   bool skipped;
+
+   // SessionKey
+   GameKey key;
+
+   // SessionMousePress and SessionMouseRelease
+   MouseButton button;
+
+   // SessionMouseMove
+   int x;
+   int y;
+
+   // SessionMidiIn: the device's position in the input group, and when
+   // the event arrived (Compatible::GetMicroseconds)
+   int device;
+   microseconds_t timestamp;
+
+   // SessionMidiOut: the track the event was played for
+   size_t track_id;
+
+   // SessionMidiIn and SessionMidiOut
+   MidiEventSimple simple;
+
+   // SessionStats: the score when the playing screen closed
+   SongStatistics stats;
+};
+
+// Logs everything that decides how the playing screen behaves: the time
+// each GameStateManager::Update was given, every key and mouse event in
+// between, every MIDI event the game read, and (as a check on the rest)
+// every event it played and the final score.  Replaying the frames, input
+// and MIDI in the same order through an injected GameClock and virtual
+// input devices reproduces the same output events and score exactly.
+//
+// Records are packed into a growing byte buffer (variable-length
+// integers, timestamps as the difference from the previous one), so a
+// few minutes of play is typically a few tens of kilobytes.
+class SessionRecorder
+{
+public:
+   SessionRecorder(const SessionHeader &header);
+
+   void Frame(unsigned long delta_milliseconds, bool skipped);
+   void Key(GameKey key);
+   void MousePress(MouseButton button);
+   void MouseRelease(MouseButton button);
+   void MouseMove(int x, int y);
+   void MidiIn(int device, const MidiEvent &ev, microseconds_t timestamp);
+   void MidiOut(size_t track_id, const MidiEvent &ev);
+   void Stats(const SongStatistics &stats);
+
+   const std::vector<unsigned char> &Bytes() const { return m_bytes; }
+
+   bool WriteFile(const std::wstring &filename) const;
+
+   // Returns false if the file couldn't be read or isn't a session
+   static bool ReadFile(const std::wstring &filename, SessionHeader *header, std::vector<SessionRecord> *records);
+
+private:
+   void PutUnsigned(unsigned long long value);
+   void PutSigned(long long value);
+   void PutByte(unsigned char value) { m_bytes.push_back(value); }
+
+   std::vector<unsigned char> m_bytes;
+   microseconds_t m_last_timestamp;
+};
+
+#endif
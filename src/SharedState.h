@@ -11,7 +11,7 @@
 
 class Midi;
 class MidiCommOut;
-class MidiCommIn;
+class MidiCommInGroup;
 
 struct SongStatistics
 {
@@ -43,7 +43,7 @@ struct SharedState
 
    Midi *midi;
    MidiCommOut *midi_out;
-   MidiCommIn *midi_in;
+   MidiCommInGroup *midi_in;
 
    SongStatistics stats;
 
@@ -0,0 +1,768 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "SoftSynth.h"
+#include "AudioSink.h"
+#include "SoundFont.h"
+#include "CompatibleSystem.h"
+#include "string_util.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <iomanip>
+using namespace std;
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define SOFT_SYNTH_SSE2
+#include <emmintrin.h>
+#endif
+
+const static float Pi = 3.14159265358979f;
+
+// Envelopes below this are inaudible, so the voice can be freed
+const static float Silence = 0.0005f;
+
+// Leaves some headroom for a few dozen loud voices at once
+const static float MasterGain = 0.25f;
+
+// Adds source into left and right, scaled by a level that moves linearly
+// by step each frame (so envelope changes don't click at block edges).
+static void MixVoice(float *left, float *right, const float *source, int frames,
+   float level, float step, float gain_left, float gain_right)
+{
+   int i = 0;
+
+#ifdef SOFT_SYNTH_SSE2
+   __m128 ramp = _mm_set_ps(level + step * 3, level + step * 2, level + step, level);
+   const __m128 ramp_step = _mm_set1_ps(step * 4);
+   const __m128 gl = _mm_set1_ps(gain_left);
+   const __m128 gr = _mm_set1_ps(gain_right);
+
+   for (; i + 4 <= frames; i += 4)
+   {
+      const __m128 s = _mm_mul_ps(_mm_loadu_ps(source + i), ramp);
+      _mm_storeu_ps(left + i, _mm_add_ps(_mm_loadu_ps(left + i), _mm_mul_ps(s, gl)));
+      _mm_storeu_ps(right + i, _mm_add_ps(_mm_loadu_ps(right + i), _mm_mul_ps(s, gr)));
+
+      ramp = _mm_add_ps(ramp, ramp_step);
+   }
+   level += step * i;
+#endif
+
+   for (; i < frames; ++i)
+   {
+      const float s = source[i] * level;
+      left[i] += s * gain_left;
+      right[i] += s * gain_right;
+
+      level += step;
+   }
+}
+
+static short ToSample(float value)
+{
+   const float scaled = value * 32767.0f;
+   if (scaled >= 32767.0f) return 32767;
+   if (scaled <= -32768.0f) return -32768;
+   return static_cast<short>(scaled);
+}
+
+static void Interleave(const float *left, const float *right, short *out, int frames, float gain)
+{
+   int i = 0;
+
+#ifdef SOFT_SYNTH_SSE2
+   const __m128 scale = _mm_set1_ps(gain * 32767.0f);
+   const __m128 high = _mm_set1_ps(32767.0f);
+   const __m128 low = _mm_set1_ps(-32768.0f);
+
+   for (; i + 4 <= frames; i += 4)
+   {
+      // Clamp before converting; out-of-range floats don't convert sensibly
+      const __m128 l = _mm_max_ps(low, _mm_min_ps(high, _mm_mul_ps(_mm_loadu_ps(left + i), scale)));
+      const __m128 r = _mm_max_ps(low, _mm_min_ps(high, _mm_mul_ps(_mm_loadu_ps(right + i), scale)));
+
+      const __m128i li = _mm_cvttps_epi32(l);
+      const __m128i ri = _mm_cvttps_epi32(r);
+
+      // L0 R0 L1 R1 | L2 R2 L3 R3, narrowed to 16 bits
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2), _mm_packs_epi32(_mm_unpacklo_epi32(li, ri), _mm_unpackhi_epi32(li, ri)));
+   }
+#endif
+
+   for (; i < frames; ++i)
+   {
+      out[i * 2] = ToSample(left[i] * gain);
+      out[i * 2 + 1] = ToSample(right[i] * gain);
+   }
+}
+
+SoftSynth::SoftSynth(unsigned int sample_rate, const SoundFont *font)
+   : m_sample_rate(sample_rate), m_font(font), m_prefetcher(0),
+   m_active_count(0), m_stolen_voices(0), m_dropped_commands(0)
+{
+   const static float Piano[] = { 1.0f, 0.5f, 0.33f, 0.25f, 0.2f, 0.12f, 0.08f, 0.05f };
+   const static float Plucked[] = { 1.0f, 0.35f, 0.15f, 0.08f, 0.04f };
+   const static float Organ[] = { 1.0f, 0.7f, 0.0f, 0.5f, 0.0f, 0.3f, 0.0f, 0.25f };
+
+   float saw[24];
+   for (int i = 0; i < 24; ++i) saw[i] = 1.0f / (i + 1);
+
+   BuildTimbre(TimbrePiano, Piano, sizeof(Piano) / sizeof(float), 0.002f, 1.2f, 0.0f, 0.2f);
+   BuildTimbre(TimbrePlucked, Plucked, sizeof(Plucked) / sizeof(float), 0.001f, 0.6f, 0.0f, 0.12f);
+   BuildTimbre(TimbreOrgan, Organ, sizeof(Organ) / sizeof(float), 0.006f, 0.2f, 0.85f, 0.04f);
+   BuildTimbre(TimbreSustained, saw, 24, 0.05f, 0.6f, 0.7f, 0.3f);
+   BuildTimbre(TimbrePercussion, 0, 0, 0.0005f, 0.08f, 0.0f, 0.05f);
+
+   if (m_font)
+   {
+      // SoundFont decay and release times are for a 100dB fall, which is
+      // about 11.5 of our time constants
+      const float FallToConstant = 1.0f / 11.5f;
+
+      m_region_envelopes.resize(m_font->RegionCount());
+
+      const vector<SoundFontPreset> &presets = m_font->Presets();
+      for (size_t p = 0; p < presets.size(); ++p)
+      {
+         for (size_t r = 0; r < presets[p].regions.size(); ++r)
+         {
+            const SoundFontRegion &region = presets[p].regions[r];
+            BuildEnvelope(&m_region_envelopes[region.index], region.attack, region.decay * FallToConstant, region.sustain, region.release * FallToConstant);
+         }
+      }
+   }
+
+   ResetAll();
+}
+
+SoftSynth::~SoftSynth()
+{
+   delete m_prefetcher;
+}
+
+void SoftSynth::BuildEnvelope(Envelope *e, float attack, float decay, float sustain, float release) const
+{
+   // Anything much shorter than this clicks
+   const float MinimumTime = 0.0005f;
+
+   const float rate = static_cast<float>(m_sample_rate);
+   e->attack_step = 1.0f / (max(attack, MinimumTime) * rate);
+   e->decay_coefficient = exp(-1.0f / (max(decay, MinimumTime) * rate));
+   e->decay_block = pow(e->decay_coefficient, static_cast<float>(BlockFrames));
+   e->sustain = sustain;
+   e->release_coefficient = exp(-1.0f / (max(release, MinimumTime) * rate));
+   e->release_block = pow(e->release_coefficient, static_cast<float>(BlockFrames));
+}
+
+void SoftSynth::BuildTimbre(TimbreId id, const float *harmonics, int harmonic_count, float attack, float decay, float sustain, float release)
+{
+   Timbre &t = m_timbres[id];
+
+   unsigned long seed = 12345;
+   float peak = 0.0f;
+   for (int i = 0; i < TableSize; ++i)
+   {
+      float value = 0.0f;
+
+      if (harmonic_count == 0)
+      {
+         seed = seed * 1103515245 + 12345;
+         value = static_cast<float>((seed >> 16) & 0x7FFF) / 16384.0f - 1.0f;
+      }
+
+      for (int h = 0; h < harmonic_count; ++h)
+      {
+         value += harmonics[h] * sin(2.0f * Pi * (h + 1) * i / TableSize);
+      }
+
+      t.table[i] = value;
+      peak = max(peak, fabs(value));
+   }
+
+   if (peak > 0.0f) for (int i = 0; i < TableSize; ++i) t.table[i] /= peak;
+   t.table[TableSize] = t.table[0];
+
+   BuildEnvelope(&t.envelope, attack, decay, sustain, release);
+}
+
+SoftSynth::TimbreId SoftSynth::TimbreFor(unsigned char channel) const
+{
+   if (channel == PercussionChannel) return TimbrePercussion;
+
+   // By General MIDI family
+   const int program = m_channels[channel].program;
+   if (program < 16) return TimbrePiano;
+   if (program < 24) return TimbreOrgan;
+   if (program < 40) return TimbrePlucked;
+   return TimbreSustained;
+}
+
+void SoftSynth::Write(const MidiEvent &out)
+{
+   if (out.Type() == MidiEventType_System) return;
+
+   Command c;
+   if (!out.GetSimpleEvent(&c.simple)) return;
+   c.reset = false;
+   c.queued_at = Compatible::GetMicroseconds();
+
+   MutexLock lock(m_write_mutex);
+   if (!m_commands.Push(c)) Atomic::Increment(&m_dropped_commands);
+}
+
+void SoftSynth::Reset()
+{
+   Command c;
+   c.reset = true;
+   c.queued_at = Compatible::GetMicroseconds();
+
+   MutexLock lock(m_write_mutex);
+   if (!m_commands.Push(c)) Atomic::Increment(&m_dropped_commands);
+}
+
+void SoftSynth::PrepareSong(const Midi &song)
+{
+   if (!m_font) return;
+
+   delete m_prefetcher;
+   m_prefetcher = 0;
+
+   m_prefetcher = new SoundFontPrefetcher(*m_font, song);
+}
+
+void SoftSynth::SongPosition(microseconds_t song_position)
+{
+   if (m_prefetcher) m_prefetcher->SetPosition(song_position);
+}
+
+wstring SoftSynth::Status() const
+{
+   if (!m_prefetcher) return L"";
+
+   const SoundFontResidency r = m_prefetcher->Residency();
+   const double MB = 1024.0 * 1024.0;
+
+   wstring status = WSTRING(L"SoundFont: " << r.presets_used << L" presets, "
+      << fixed << setprecision(1) << (r.pages_prefetched * r.page_size / MB) << L" of "
+      << (r.bytes_used / MB) << L" MB prefetched");
+
+   if (r.resident_known)
+   {
+      status += WSTRING(L", " << fixed << setprecision(1) << (r.pages_resident * r.page_size / MB)
+         << L" of " << (r.bytes_mapped / MB) << L" MB resident");
+   }
+
+   return status;
+}
+
+void SoftSynth::ResetAll()
+{
+   for (int i = 0; i < MaxVoices; ++i) m_free[i] = MaxVoices - 1 - i;
+   m_free_count = MaxVoices;
+   m_oldest = -1;
+   m_newest = -1;
+
+   for (int c = 0; c < Channels; ++c)
+   {
+      for (int n = 0; n < 128; ++n) m_key_voices[c][n] = 0;
+
+      ChannelState &s = m_channels[c];
+      s.bank = (c == PercussionChannel ? 128 : 0);
+      s.program = 0;
+      s.volume = 100.0f / 127.0f;
+      s.expression = 1.0f;
+      s.pan = 0.5f;
+      s.bend_semitones = 0.0f;
+      s.sustain = false;
+   }
+
+   Atomic::Write(&m_active_count, 0);
+}
+
+int SoftSynth::AllocateVoice()
+{
+   if (m_free_count == 0)
+   {
+      FreeVoice(m_oldest);
+      Atomic::Increment(&m_stolen_voices);
+   }
+
+   const int index = m_free[--m_free_count];
+   Voice &v = m_voices[index];
+
+   v.prev = m_newest;
+   v.next = -1;
+   if (m_newest >= 0) m_voices[m_newest].next = index;
+   else m_oldest = index;
+   m_newest = index;
+
+   Atomic::Increment(&m_active_count);
+   return index;
+}
+
+void SoftSynth::FreeVoice(int index)
+{
+   Voice &v = m_voices[index];
+
+   if (v.prev >= 0) m_voices[v.prev].next = v.next;
+   else m_oldest = v.next;
+
+   if (v.next >= 0) m_voices[v.next].prev = v.prev;
+   else m_newest = v.prev;
+
+   if (v.held_by_key) m_key_voices[v.channel][v.note]--;
+
+   m_free[m_free_count++] = index;
+   Atomic::Add(&m_active_count, -1);
+}
+
+void SoftSynth::UpdateGain(Voice &v) const
+{
+   const ChannelState &c = m_channels[v.channel];
+   const float gain = v.velocity_gain * v.region_gain * c.volume * c.volume * c.expression * c.expression;
+
+   // Equal-power panning
+   const float pan = max(0.0f, min(1.0f, c.pan + v.region_pan - 0.5f));
+   v.gain_left = gain * cos(pan * Pi / 2.0f);
+   v.gain_right = gain * sin(pan * Pi / 2.0f);
+}
+
+float SoftSynth::IncrementFor(const Voice &v) const
+{
+   // Built-in drums only loosely follow the key; they're noise either way
+   if (v.timbre == &m_timbres[TimbrePercussion]) return pow(2.0f, (v.note - 60) / 24.0f);
+
+   const float semitones = v.note + v.pitch_offset + m_channels[v.channel].bend_semitones;
+   const float increment = v.rate_scale * pow(2.0f, semitones / 12.0f);
+
+   // Wavetables can't skip more than a whole cycle per frame
+   if (v.timbre) return min(increment, static_cast<float>(TableSize - 1));
+   return increment;
+}
+
+void SoftSynth::StartVoice(unsigned char channel, unsigned char note, unsigned char velocity, const Timbre *timbre, const SoundFontRegion *region)
+{
+   const int index = AllocateVoice();
+   Voice &v = m_voices[index];
+
+   v.channel = channel;
+   v.note = note;
+   v.timbre = timbre;
+   v.region = region;
+   v.position = 0.0;
+
+   if (timbre)
+   {
+      v.envelope = &timbre->envelope;
+      v.rate_scale = 440.0f * TableSize / m_sample_rate;
+      v.pitch_offset = -69.0f;
+      v.region_gain = 1.0f;
+      v.region_pan = 0.5f;
+   }
+   else
+   {
+      v.envelope = &m_region_envelopes[region->index];
+      v.rate_scale = static_cast<float>(region->sample_rate) / m_sample_rate;
+      v.pitch_offset = region->tune_cents / 100.0f - region->root_key;
+      v.region_gain = region->gain;
+      v.region_pan = region->pan;
+   }
+
+   v.increment = IncrementFor(v);
+   v.stage = StageAttack;
+   v.level = 0.0f;
+   v.held_by_key = true;
+   v.held_by_pedal = false;
+
+   const float normalized = velocity / 127.0f;
+   v.velocity_gain = normalized * normalized;
+   UpdateGain(v);
+
+   m_key_voices[channel][note]++;
+}
+
+void SoftSynth::NoteOn(unsigned char channel, unsigned char note, unsigned char velocity)
+{
+   // Striking a key that's still sounding lets the old note ring out
+   if (m_key_voices[channel][note] > 0)
+   {
+      for (int i = m_oldest; i != -1; i = m_voices[i].next)
+      {
+         Voice &v = m_voices[i];
+         if (!v.held_by_key || v.channel != channel || v.note != note) continue;
+
+         v.stage = StageRelease;
+         v.held_by_key = false;
+         v.held_by_pedal = false;
+      }
+      m_key_voices[channel][note] = 0;
+   }
+
+   if (!m_font)
+   {
+      StartVoice(channel, note, velocity, &m_timbres[TimbreFor(channel)], 0);
+      return;
+   }
+
+   const ChannelState &c = m_channels[channel];
+   const SoundFontPreset *preset = m_font->FindPreset(c.bank, c.program);
+   if (!preset) return;
+
+   // Layered instruments (stereo pairs, mostly) start several voices
+   for (size_t r = 0; r < preset->regions.size(); ++r)
+   {
+      const SoundFontRegion &region = preset->regions[r];
+      if (note < region.key_low || note > region.key_high) continue;
+      if (velocity < region.velocity_low || velocity > region.velocity_high) continue;
+
+      StartVoice(channel, note, velocity, 0, &region);
+   }
+}
+
+void SoftSynth::NoteOff(unsigned char channel, unsigned char note)
+{
+   if (m_key_voices[channel][note] == 0) return;
+
+   // Drums always play out in full
+   const bool percussion = (channel == PercussionChannel);
+
+   for (int i = m_oldest; i != -1; i = m_voices[i].next)
+   {
+      Voice &v = m_voices[i];
+      if (!v.held_by_key || v.channel != channel || v.note != note) continue;
+
+      v.held_by_key = false;
+      if (percussion) continue;
+
+      if (m_channels[channel].sustain) v.held_by_pedal = true;
+      else v.stage = StageRelease;
+   }
+
+   m_key_voices[channel][note] = 0;
+}
+
+void SoftSynth::Controller(unsigned char channel, unsigned char controller, unsigned char value)
+{
+   ChannelState &c = m_channels[channel];
+
+   switch (controller)
+   {
+   case 0:
+      // The percussion channel always uses the drum bank
+      if (channel != PercussionChannel) c.bank = value;
+      return;
+
+   case 7:  c.volume = value / 127.0f; break;
+   case 10: c.pan = value / 127.0f; break;
+   case 11: c.expression = value / 127.0f; break;
+   case 64: c.sustain = (value >= 64); break;
+
+   case 121: // Reset All Controllers
+      c.expression = 1.0f;
+      c.bend_semitones = 0.0f;
+      c.sustain = false;
+      break;
+
+   case 120: // All Sound Off
+   case 123: // All Notes Off
+      break;
+
+   default:
+      return;
+   }
+
+   for (int i = m_oldest; i != -1; )
+   {
+      Voice &v = m_voices[i];
+      const int next = v.next;
+
+      if (v.channel == channel)
+      {
+         if (controller == 120) FreeVoice(i);
+         else
+         {
+            if (controller == 123 && v.held_by_key)
+            {
+               v.held_by_key = false;
+               m_key_voices[channel][v.note]--;
+            }
+
+            if (controller == 123 || (v.held_by_pedal && !c.sustain))
+            {
+               v.stage = StageRelease;
+               v.held_by_pedal = false;
+            }
+
+            UpdateGain(v);
+            v.increment = IncrementFor(v);
+         }
+      }
+
+      i = next;
+   }
+}
+
+void SoftSynth::Apply(const Command &c)
+{
+   if (c.reset)
+   {
+      ResetAll();
+      return;
+   }
+
+   const unsigned char channel = c.simple.status & 0x0F;
+   const unsigned char byte1 = c.simple.byte1 & 0x7F;
+   const unsigned char byte2 = c.simple.byte2 & 0x7F;
+
+   switch (c.simple.status & 0xF0)
+   {
+   case 0x80:
+      NoteOff(channel, byte1);
+      break;
+
+   case 0x90:
+      if (byte2 == 0) NoteOff(channel, byte1);
+      else NoteOn(channel, byte1, byte2);
+      break;
+
+   case 0xB0:
+      Controller(channel, byte1, byte2);
+      break;
+
+   case 0xC0:
+      m_channels[channel].program = byte1;
+      break;
+
+   case 0xE0:
+      // +/- 2 semitones, the General MIDI default range
+      m_channels[channel].bend_semitones = (((byte2 << 7) | byte1) - 8192) / 4096.0f;
+
+      for (int i = m_oldest; i != -1; i = m_voices[i].next)
+      {
+         if (m_voices[i].channel == channel) m_voices[i].increment = IncrementFor(m_voices[i]);
+      }
+      break;
+   }
+}
+
+bool SoftSynth::AdvanceEnvelope(Voice &v, int frames, float *start, float *end) const
+{
+   const Envelope &e = *v.envelope;
+   *start = v.level;
+
+   switch (v.stage)
+   {
+   case StageAttack:
+      v.level += e.attack_step * frames;
+      if (v.level >= 1.0f)
+      {
+         v.level = 1.0f;
+         v.stage = StageDecay;
+      }
+      break;
+
+   case StageDecay:
+      v.level = e.sustain + (v.level - e.sustain) * (frames == BlockFrames ? e.decay_block : pow(e.decay_coefficient, static_cast<float>(frames)));
+      break;
+
+   case StageRelease:
+      v.level *= (frames == BlockFrames ? e.release_block : pow(e.release_coefficient, static_cast<float>(frames)));
+      break;
+   }
+
+   *end = v.level;
+
+   if (v.stage == StageRelease) return v.level > Silence;
+   if (v.stage == StageDecay && e.sustain <= 0.0f) return v.level > Silence;
+   return true;
+}
+
+bool SoftSynth::OscillateTable(Voice &v, int frames)
+{
+   // Linear interpolation into the wavetable
+   const float *table = v.timbre->table;
+   double phase = v.position;
+   for (int f = 0; f < frames; ++f)
+   {
+      const int index = static_cast<int>(phase);
+      const float fraction = static_cast<float>(phase - index);
+      m_oscillator[f] = table[index] + (table[index + 1] - table[index]) * fraction;
+
+      phase += v.increment;
+      if (phase >= TableSize) phase -= TableSize;
+   }
+   v.position = phase;
+
+   return true;
+}
+
+bool SoftSynth::OscillateSample(Voice &v, int frames)
+{
+   const SoundFontRegion &r = *v.region;
+   const short *samples = m_font->Samples() + r.start;
+
+   const double length = r.end - r.start;
+   const double loop_start = r.loop_start - r.start;
+   const double loop_end = r.loop_end - r.start;
+   const double loop_length = loop_end - loop_start;
+
+   // Positions are relative to the region's start, which can be far
+   // enough into a big font that a float couldn't address single frames
+   double position = v.position;
+   for (int f = 0; f < frames; ++f)
+   {
+      if (r.loops)
+      {
+         while (position >= loop_end) position -= loop_length;
+      }
+      else if (position >= length)
+      {
+         for (; f < frames; ++f) m_oscillator[f] = 0.0f;
+         v.position = position;
+         return false;
+      }
+
+      // The SoundFont spec guarantees (at least) 46 frames of silence
+      // after every sample, so reading one past the end is fine
+      const size_t index = static_cast<size_t>(position);
+      const float fraction = static_cast<float>(position - index);
+      const float a = samples[index];
+      const float b = samples[index + 1];
+      m_oscillator[f] = (a + (b - a) * fraction) * (1.0f / 32768.0f);
+
+      position += v.increment;
+   }
+   v.position = position;
+
+   return true;
+}
+
+void SoftSynth::RenderBlock(int frames)
+{
+   memset(m_left, 0, sizeof(float) * frames);
+   memset(m_right, 0, sizeof(float) * frames);
+
+   for (int i = m_oldest; i != -1; )
+   {
+      Voice &v = m_voices[i];
+      const int next = v.next;
+
+      float start, end;
+      bool alive = AdvanceEnvelope(v, frames, &start, &end);
+
+      if (v.timbre) alive = OscillateTable(v, frames) && alive;
+      else alive = OscillateSample(v, frames) && alive;
+
+      MixVoice(m_left, m_right, m_oscillator, frames, start, (end - start) / frames, v.gain_left, v.gain_right);
+
+      if (!alive) FreeVoice(i);
+      i = next;
+   }
+}
+
+void SoftSynth::Render(short *out, size_t frame_count)
+{
+   const microseconds_t now = Compatible::GetMicroseconds();
+   while (!m_commands.Empty())
+   {
+      const Command c = m_commands.Front();
+      m_commands.Pop();
+
+      m_queue_latency.Record(now - c.queued_at);
+      Apply(c);
+   }
+
+   size_t done = 0;
+   while (done < frame_count)
+   {
+      const int frames = static_cast<int>(min(frame_count - done, static_cast<size_t>(BlockFrames)));
+
+      RenderBlock(frames);
+      Interleave(m_left, m_right, out + done * 2, frames, MasterGain);
+
+      done += frames;
+   }
+}
+
+void SoftSynth::Play(const MidiEventSimple &simple)
+{
+   Command c;
+   c.reset = false;
+   c.simple = simple;
+   c.queued_at = 0;
+
+   Apply(c);
+}
+
+void SoftSynth::RenderFloat(float *left, float *right, size_t frame_count)
+{
+   size_t done = 0;
+   while (done < frame_count)
+   {
+      const int frames = static_cast<int>(min(frame_count - done, static_cast<size_t>(BlockFrames)));
+
+      RenderBlock(frames);
+      memcpy(left + done, m_left, sizeof(float) * frames);
+      memcpy(right + done, m_right, sizeof(float) * frames);
+
+      done += frames;
+   }
+}
+
+void SoftSynth::Mixdown(const float *left, const float *right, short *out, size_t frame_count)
+{
+   Interleave(left, right, out, static_cast<int>(frame_count), MasterGain);
+}
+
+SynthAudioThread::SynthAudioThread(SoftSynth &synth, AudioSink &sink, size_t period_frames, bool paced)
+   : m_synth(synth), m_sink(sink), m_period_frames(period_frames), m_paced(paced),
+   m_buffer(0), m_stop(0), m_periods(0), m_thread(0)
+{
+   m_buffer = new short[m_period_frames * 2];
+   m_thread = new Thread(Run, this);
+}
+
+SynthAudioThread::~SynthAudioThread()
+{
+   Atomic::CompareAndSwap(&m_stop, 0, 1);
+   delete m_thread;
+
+   delete[] m_buffer;
+}
+
+void SynthAudioThread::Run()
+{
+#ifdef WIN32
+   SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+   if (m_paced) timeBeginPeriod(1);
+#endif
+
+   const microseconds_t started = Compatible::GetMicroseconds();
+   unsigned long long frames_rendered = 0;
+
+   while (!Atomic::Read(&m_stop))
+   {
+      const microseconds_t render_start = Compatible::GetMicroseconds();
+      m_synth.Render(m_buffer, m_period_frames);
+      m_render_time.Record(Compatible::GetMicroseconds() - render_start);
+
+      m_sink.Write(m_buffer, m_period_frames);
+      Atomic::Increment(&m_periods);
+
+      if (!m_paced) continue;
+
+      // Worked out from the total so rounding doesn't accumulate
+      frames_rendered += m_period_frames;
+      const microseconds_t due = started + static_cast<microseconds_t>(frames_rendered * 1000000 / m_synth.SampleRate());
+
+      const microseconds_t remaining = due - Compatible::GetMicroseconds();
+      if (remaining >= 1000) Thread::Sleep(static_cast<unsigned long>(remaining / 1000));
+   }
+
+#ifdef WIN32
+   if (m_paced) timeEndPeriod(1);
+#endif
+}
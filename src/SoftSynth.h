@@ -0,0 +1,286 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __SOFT_SYNTH_H
+#define __SOFT_SYNTH_H
+
+#include <string>
+#include <vector>
+
+#include "Threading.h"
+#include "LatencyHistogram.h"
+
+#include "libmidi/MidiComm.h"
+#include "libmidi/MidiEvent.h"
+#include "libmidi/MidiTypes.h"
+
+class AudioSink;
+class SoundFont;
+class SoundFontPrefetcher;
+struct SoundFontRegion;
+
+// A small synthesizer that runs inside the game, for when the system's
+// own synth is slow (the Microsoft GS Wavetable synth adds ~100ms) or
+// missing.  Register it with MidiCommOut::RegisterVirtualDevice and it
+// can be picked like any other output.
+//
+// Given a SoundFont, each note plays the matching samples from the
+// channel's preset.  Without one, each voice is a wavetable oscillator
+// with an ADSR envelope: the channel's program picks one of a handful of
+// timbres, and channel 10 gets a noise-based percussion voice.  Voices
+// are mixed four samples at a time with SSE2 where it's available.
+//
+// Voice allocation is O(1): free voices are kept on a stack, and when
+// none are left the oldest sounding voice is stolen.
+//
+// Write() and Reset() may be called from any thread; they only queue a
+// command.  Render() is meant for a single audio thread and never
+// allocates or locks.
+class SoftSynth : public MidiCommOutSink
+{
+public:
+   const static int MaxVoices = 256;
+
+   // Envelopes are updated once per block
+   const static int BlockFrames = 64;
+
+   // The font (if any) must outlive the synth
+   SoftSynth(unsigned int sample_rate = 44100, const SoundFont *font = 0);
+   ~SoftSynth();
+
+   virtual void Write(const MidiEvent &out);
+   virtual void Reset();
+
+   // Starts paging in the font's samples for the song's presets
+   virtual void PrepareSong(const Midi &song);
+   virtual void SongPosition(microseconds_t song_position);
+   virtual std::wstring Status() const;
+
+   // Applies everything queued so far, then renders frame_count frames of
+   // 16-bit interleaved stereo.  Only one thread may call this at a time.
+   void Render(short *out, size_t frame_count);
+
+   // For offline rendering, where events have to land on exact frames:
+   // Play() applies an event right away (skipping the queue) and
+   // RenderFloat() renders without touching the queue.  Its output is the
+   // raw mix, so several synths' output can be summed and then handed to
+   // Mixdown().  Only the thread doing the rendering may call these.
+   void Play(const MidiEventSimple &simple);
+   void RenderFloat(float *left, float *right, size_t frame_count);
+   static void Mixdown(const float *left, const float *right, short *out, size_t frame_count);
+
+   unsigned int SampleRate() const { return m_sample_rate; }
+
+   const SoundFont *Font() const { return m_font; }
+
+   // Null until PrepareSong is called with a font loaded
+   const SoundFontPrefetcher *Prefetcher() const { return m_prefetcher; }
+
+   int ActiveVoices() const { return static_cast<int>(Atomic::Read(&m_active_count)); }
+   unsigned long StolenVoices() const { return static_cast<unsigned long>(Atomic::Read(&m_stolen_voices)); }
+   unsigned long DroppedCommands() const { return static_cast<unsigned long>(Atomic::Read(&m_dropped_commands)); }
+
+   // How long each command waited to be picked up by Render()
+   const LatencyHistogram &QueueLatency() const { return m_queue_latency; }
+
+private:
+   SoftSynth(const SoftSynth&);
+   SoftSynth &operator=(const SoftSynth&);
+
+   const static int TableSize = 2048;
+   const static int Channels = 16;
+   const static int PercussionChannel = 9;
+
+   enum TimbreId
+   {
+      TimbrePiano,
+      TimbrePlucked,
+      TimbreOrgan,
+      TimbreSustained,
+      TimbrePercussion,
+
+      TimbreCount
+   };
+
+   // In per-frame terms (and per whole block, for speed)
+   struct Envelope
+   {
+      float attack_step;
+      float decay_coefficient;
+      float decay_block;
+      float sustain;
+      float release_coefficient;
+      float release_block;
+   };
+
+   struct Timbre
+   {
+      // TableSize + 1 samples (the last repeats the first so
+      // interpolation never has to wrap)
+      float table[TableSize + 1];
+
+      Envelope envelope;
+   };
+
+   enum Stage { StageAttack, StageDecay, StageRelease };
+
+   struct Voice
+   {
+      // Links in the list of sounding voices, oldest first (-1 at the ends)
+      int prev;
+      int next;
+
+      unsigned char channel;
+      unsigned char note;
+
+      // Exactly one of these is set
+      const Timbre *timbre;
+      const SoundFontRegion *region;
+
+      const Envelope *envelope;
+
+      // Into the wavetable, or in sample frames from the region's start
+      double position;
+      float increment;
+
+      // increment = rate_scale * 2^((note + pitch_offset + bend) / 12)
+      float rate_scale;
+      float pitch_offset;
+
+      Stage stage;
+      float level;
+
+      // Whether the key (or the pedal) is still holding the note
+      bool held_by_key;
+      bool held_by_pedal;
+
+      float velocity_gain;
+      float region_gain;
+      float region_pan;
+      float gain_left;
+      float gain_right;
+   };
+
+   struct ChannelState
+   {
+      int bank;
+      int program;
+      float volume;
+      float expression;
+      float pan;
+      float bend_semitones;
+      bool sustain;
+   };
+
+   struct Command
+   {
+      bool reset;
+      MidiEventSimple simple;
+      microseconds_t queued_at;
+   };
+
+   // Times are the envelope's time constants, in seconds
+   void BuildEnvelope(Envelope *e, float attack, float decay, float sustain, float release) const;
+
+   // With no harmonics, the table is filled with noise instead
+   void BuildTimbre(TimbreId id, const float *harmonics, int harmonic_count, float attack, float decay, float sustain, float release);
+   TimbreId TimbreFor(unsigned char channel) const;
+
+   void Apply(const Command &c);
+   void ResetAll();
+
+   void NoteOn(unsigned char channel, unsigned char note, unsigned char velocity);
+   void NoteOff(unsigned char channel, unsigned char note);
+   void StartVoice(unsigned char channel, unsigned char note, unsigned char velocity, const Timbre *timbre, const SoundFontRegion *region);
+   void Controller(unsigned char channel, unsigned char controller, unsigned char value);
+
+   int AllocateVoice();
+   void FreeVoice(int index);
+   void UpdateGain(Voice &v) const;
+   float IncrementFor(const Voice &v) const;
+
+   void RenderBlock(int frames);
+   bool AdvanceEnvelope(Voice &v, int frames, float *start, float *end) const;
+
+   // Fills m_oscillator.  Returns false if the voice ran out of sample.
+   bool OscillateTable(Voice &v, int frames);
+   bool OscillateSample(Voice &v, int frames);
+
+   unsigned int m_sample_rate;
+
+   const SoundFont *m_font;
+
+   // Indexed by SoundFontRegion::index
+   std::vector<Envelope> m_region_envelopes;
+
+   // Only touched from the game thread
+   SoundFontPrefetcher *m_prefetcher;
+
+   Timbre m_timbres[TimbreCount];
+   ChannelState m_channels[Channels];
+
+   Voice m_voices[MaxVoices];
+   int m_free[MaxVoices];
+   int m_free_count;
+   int m_oldest;
+   int m_newest;
+
+   // How many voices each key is still holding down (SoundFont notes can
+   // layer several samples)
+   unsigned short m_key_voices[Channels][128];
+
+   // Scratch space for RenderBlock
+   float m_oscillator[BlockFrames];
+   float m_left[BlockFrames];
+   float m_right[BlockFrames];
+
+   // Producers lock this against each other; the audio thread never does
+   Mutex m_write_mutex;
+   LockFreeQueue<Command, 4096> m_commands;
+
+   volatile long m_active_count;
+   volatile long m_stolen_voices;
+   volatile long m_dropped_commands;
+
+   LatencyHistogram m_queue_latency;
+};
+
+// Drives a SoftSynth in real time, rendering period_frames at a time and
+// handing them to the sink.  Sinks attached to real hardware block in
+// Write() until the device wants more, which paces the thread.  For the
+// others (like MemoryAudioSink) pass paced and the thread keeps itself
+// to real time.
+class SynthAudioThread
+{
+public:
+   SynthAudioThread(SoftSynth &synth, AudioSink &sink, size_t period_frames, bool paced);
+   ~SynthAudioThread();
+
+   // Time spent rendering each period.  Divided by the period's length,
+   // that's how much of a core the synth is using.
+   const LatencyHistogram &RenderTime() const { return m_render_time; }
+   unsigned long Periods() const { return static_cast<unsigned long>(Atomic::Read(&m_periods)); }
+
+private:
+   SynthAudioThread(const SynthAudioThread&);
+   SynthAudioThread &operator=(const SynthAudioThread&);
+
+   static void Run(void *context) { reinterpret_cast<SynthAudioThread*>(context)->Run(); }
+   void Run();
+
+   SoftSynth &m_synth;
+   AudioSink &m_sink;
+   size_t m_period_frames;
+   bool m_paced;
+
+   short *m_buffer;
+
+   volatile long m_stop;
+   volatile long m_periods;
+   LatencyHistogram m_render_time;
+
+   Thread *m_thread;
+};
+
+#endif
@@ -0,0 +1,427 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "SoftwareRasterizer.h"
+#include "CompatibleSystem.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+using namespace std;
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define RASTER_SSE2
+#include <emmintrin.h>
+#endif
+
+// OpenGL samples at pixel centers; with Renderer's 3/8 pixel offset that
+// lands 1/8 of a pixel past each integer vertex coordinate
+const static double SampleOffset = 0.125;
+
+// x / 255, rounded, for x in [0, 255*255]
+static inline unsigned int Div255(unsigned int x)
+{
+   x += 128;
+   return (x + (x >> 8)) >> 8;
+}
+
+static inline unsigned int PackPixel(unsigned int r, unsigned int g, unsigned int b, unsigned int a)
+{
+   const unsigned char bytes[4] = { static_cast<unsigned char>(r), static_cast<unsigned char>(g),
+                                    static_cast<unsigned char>(b), static_cast<unsigned char>(a) };
+   unsigned int packed;
+   memcpy(&packed, bytes, sizeof(packed));
+   return packed;
+}
+
+static void FillSpan(unsigned char *dest, size_t count, unsigned int pixel)
+{
+   size_t i = 0;
+
+#ifdef RASTER_SSE2
+   const __m128i p = _mm_set1_epi32(static_cast<int>(pixel));
+   for (; i + 4 <= count; i += 4) _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4), p);
+#endif
+
+   for (; i < count; ++i) memcpy(dest + i * 4, &pixel, sizeof(pixel));
+}
+
+#ifdef RASTER_SSE2
+
+// src * a + dest * (255 - a), per 16-bit channel, divided by 255
+static inline __m128i BlendChannels(__m128i src, __m128i dest, __m128i alpha)
+{
+   const __m128i inverse = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+   __m128i t = _mm_add_epi16(_mm_mullo_epi16(src, alpha), _mm_mullo_epi16(dest, inverse));
+
+   t = _mm_add_epi16(t, _mm_set1_epi16(128));
+   return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// Copies each pixel's alpha across its four channels
+static inline __m128i SpreadAlpha(__m128i channels)
+{
+   return _mm_shufflehi_epi16(_mm_shufflelo_epi16(channels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+#endif
+
+// Blends a span of (non-premultiplied) RGBA source pixels onto dest
+static void BlendSpan(unsigned char *dest, const unsigned char *src, size_t count)
+{
+   size_t i = 0;
+
+#ifdef RASTER_SSE2
+   const __m128i zero = _mm_setzero_si128();
+   for (; i + 4 <= count; i += 4)
+   {
+      const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+      const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest + i * 4));
+
+      const __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+      const __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+
+      const __m128i lo = BlendChannels(s_lo, _mm_unpacklo_epi8(d, zero), SpreadAlpha(s_lo));
+      const __m128i hi = BlendChannels(s_hi, _mm_unpackhi_epi8(d, zero), SpreadAlpha(s_hi));
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4), _mm_packus_epi16(lo, hi));
+   }
+#endif
+
+   for (; i < count; ++i)
+   {
+      const unsigned char *s = src + i * 4;
+      unsigned char *d = dest + i * 4;
+
+      const unsigned int a = s[3];
+      for (int c = 0; c < 4; ++c) d[c] = static_cast<unsigned char>(Div255(s[c] * a + d[c] * (255 - a)));
+   }
+}
+
+// Blends one color across a span
+static void BlendSolidSpan(unsigned char *dest, size_t count, const unsigned char color[4])
+{
+   const unsigned int a = color[3];
+
+   size_t i = 0;
+
+#ifdef RASTER_SSE2
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i s = _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(PackPixel(color[0], color[1], color[2], color[3]))), zero);
+   const __m128i alpha = _mm_set1_epi16(static_cast<short>(a));
+
+   for (; i + 4 <= count; i += 4)
+   {
+      const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest + i * 4));
+
+      const __m128i lo = BlendChannels(s, _mm_unpacklo_epi8(d, zero), alpha);
+      const __m128i hi = BlendChannels(s, _mm_unpackhi_epi8(d, zero), alpha);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4), _mm_packus_epi16(lo, hi));
+   }
+#endif
+
+   for (; i < count; ++i)
+   {
+      unsigned char *d = dest + i * 4;
+      for (int c = 0; c < 4; ++c) d[c] = static_cast<unsigned char>(Div255(color[c] * a + d[c] * (255 - a)));
+   }
+}
+
+// GL_REPEAT.  Every texture the game makes is a power of two, which only
+// needs a mask; anything else pays for the division.
+static inline int Wrap(int i, int size)
+{
+   if ((size & (size - 1)) == 0) return i & (size - 1);
+
+   i %= size;
+   return (i < 0) ? i + size : i;
+}
+
+// Texture coordinates are stepped across a row in 16.16 fixed point
+const static int FixedShift = 16;
+const static double FixedOne = 65536.0;
+
+SoftwareRasterizer::SoftwareRasterizer(int width, int height) : m_width(max(width, 1)), m_height(max(height, 1)),
+   m_next_texture_id(1), m_raster_time(0)
+{
+   m_pixels.resize(m_width * m_height * 4, 0);
+   m_span.resize(m_width * 4);
+
+   ClearClip();
+}
+
+void SoftwareRasterizer::SetClip(int x, int y, int width, int height)
+{
+   m_clip_x0 = min(max(x, 0), m_width);
+   m_clip_y0 = min(max(y, 0), m_height);
+   m_clip_x1 = min(max(x + width, m_clip_x0), m_width);
+   m_clip_y1 = min(max(y + height, m_clip_y0), m_height);
+}
+
+void SoftwareRasterizer::ClearClip()
+{
+   m_clip_x0 = 0;
+   m_clip_y0 = 0;
+   m_clip_x1 = m_width;
+   m_clip_y1 = m_height;
+}
+
+void SoftwareRasterizer::Clear(int r, int g, int b, int a)
+{
+   const microseconds_t start = Compatible::GetMicroseconds();
+
+   FillSpan(&m_pixels[0], m_pixels.size() / 4, PackPixel(r, g, b, a));
+
+   m_raster_time += Compatible::GetMicroseconds() - start;
+}
+
+unsigned int SoftwareRasterizer::CreateTexture(unsigned int width, unsigned int height, const unsigned char *rgba, bool smooth)
+{
+   const unsigned int id = m_next_texture_id++;
+
+   Texture &t = m_textures[id];
+   t.width = max(width, 1U);
+   t.height = max(height, 1U);
+   t.smooth = smooth;
+   t.rgba.assign(t.width * t.height * 4, 0);
+   if (rgba) copy(rgba, rgba + width * height * 4, t.rgba.begin());
+
+   return id;
+}
+
+void SoftwareRasterizer::SetTextureSmooth(unsigned int id, bool smooth)
+{
+   map<unsigned int, Texture>::iterator i = m_textures.find(id);
+   if (i != m_textures.end()) i->second.smooth = smooth;
+}
+
+void SoftwareRasterizer::DeleteTexture(unsigned int id)
+{
+   m_textures.erase(id);
+}
+
+void SoftwareRasterizer::DrawQuads(unsigned int texture_id, const SpriteVertex *vertices, size_t vertex_count, bool blend)
+{
+   const microseconds_t start = Compatible::GetMicroseconds();
+
+   const Texture *texture = 0;
+   map<unsigned int, Texture>::const_iterator t = m_textures.find(texture_id);
+   if (texture_id != 0 && t != m_textures.end()) texture = &t->second;
+
+   for (size_t i = 0; i + 4 <= vertex_count; i += 4) DrawQuad(texture, vertices + i, blend);
+
+   m_raster_time += Compatible::GetMicroseconds() - start;
+}
+
+void SoftwareRasterizer::CopyToTexture(unsigned int id, unsigned int tex_x, unsigned int tex_y, int x, int y, int width, int height)
+{
+   const microseconds_t start = Compatible::GetMicroseconds();
+
+   map<unsigned int, Texture>::iterator i = m_textures.find(id);
+   if (i == m_textures.end()) return;
+   Texture &t = i->second;
+
+   // Whatever falls outside the framebuffer or the texture is left alone
+   const int cols = min(min(width, m_width - x), static_cast<int>(t.width) - static_cast<int>(tex_x));
+   for (int row = 0; row < height && cols > 0 && x >= 0; ++row)
+   {
+      const int screen_row = y + row;
+      const int texture_row = static_cast<int>(tex_y) + (height - 1 - row);
+      if (screen_row < 0 || screen_row >= m_height) continue;
+      if (texture_row < 0 || texture_row >= static_cast<int>(t.height)) continue;
+
+      memcpy(&t.rgba[(texture_row * t.width + tex_x) * 4], &m_pixels[(screen_row * m_width + x) * 4], cols * 4);
+   }
+
+   m_raster_time += Compatible::GetMicroseconds() - start;
+}
+
+void SoftwareRasterizer::DrawQuad(const Texture *texture, const SpriteVertex *quad, bool blend)
+{
+   // SpriteBatch quads run (x, y), (x, y+h), (x+w, y+h), (x+w, y), so
+   // opposite corners give everything: u follows x, and v follows y
+   const SpriteVertex &a = quad[0];
+   const SpriteVertex &b = quad[2];
+   if (a.x == b.x || a.y == b.y) return;
+
+   const unsigned char color[4] = { a.r, a.g, a.b, a.a };
+   if (color[3] == 0 && blend) return;
+
+   // Pixels whose sample points fall inside the quad (and the clip)
+   const int x0 = max(static_cast<int>(ceil(min(a.x, b.x) - SampleOffset)), m_clip_x0);
+   const int x1 = min(static_cast<int>(ceil(max(a.x, b.x) - SampleOffset)), m_clip_x1);
+   const int y0 = max(static_cast<int>(ceil(min(a.y, b.y) - SampleOffset)), m_clip_y0);
+   const int y1 = min(static_cast<int>(ceil(max(a.y, b.y) - SampleOffset)), m_clip_y1);
+   if (x0 >= x1 || y0 >= y1) return;
+
+   const size_t span = static_cast<size_t>(x1 - x0);
+
+   if (!texture)
+   {
+      const unsigned int pixel = PackPixel(color[0], color[1], color[2], color[3]);
+      for (int y = y0; y < y1; ++y)
+      {
+         unsigned char *dest = &m_pixels[(y * m_width + x0) * 4];
+         if (color[3] == 255 || !blend) FillSpan(dest, span, pixel);
+         else BlendSolidSpan(dest, span, color);
+      }
+      return;
+   }
+
+   const double du = (b.u - a.u) / static_cast<double>(b.x - a.x);
+   const double dv = (b.v - a.v) / static_cast<double>(b.y - a.y);
+
+   const int tw = static_cast<int>(texture->width);
+   const int th = static_cast<int>(texture->height);
+   const unsigned char *texels = &texture->rgba[0];
+
+   const bool modulate = (color[0] != 255 || color[1] != 255 || color[2] != 255 || color[3] != 255);
+
+   // Texel-space s at the first sample point of every row, and t at the
+   // first row, and their steps
+   const double half_texel = texture->smooth ? 0.5 : 0.0;
+   const long long s_start = static_cast<long long>(floor(((a.u + (x0 + SampleOffset - a.x) * du) * tw - half_texel) * FixedOne));
+   const long long s_step = static_cast<long long>(floor(du * tw * FixedOne + 0.5));
+   long long t = static_cast<long long>(floor(((a.v + (y0 + SampleOffset - a.y) * dv) * th - half_texel) * FixedOne));
+   const long long t_step = static_cast<long long>(floor(dv * th * FixedOne + 0.5));
+
+   // The texels a row's samples can touch, for filtering a row at a time
+   const long long s_end = s_start + s_step * static_cast<long long>(span - 1);
+   const int first_texel = static_cast<int>(min(s_start, s_end) >> FixedShift);
+   const int texel_count = static_cast<int>(max(s_start, s_end) >> FixedShift) - first_texel + 2;
+   if (texture->smooth && m_texel_row.size() < static_cast<size_t>(texel_count) * 4) m_texel_row.resize(texel_count * 4);
+
+   for (int y = y0; y < y1; ++y, t += t_step)
+   {
+      unsigned char *src = &m_span[0];
+      long long s = s_start;
+
+      if (!texture->smooth)
+      {
+         const unsigned char *row = texels + Wrap(static_cast<int>(t >> FixedShift), th) * tw * 4;
+
+         // Texels drawn one to one from inside the texture (like a
+         // RetainedLayer) are just a copy
+         if (s_step == (1 << FixedShift) && first_texel >= 0 && first_texel + static_cast<int>(span) <= tw)
+         {
+            memcpy(src, row + first_texel * 4, span * 4);
+         }
+         else
+         {
+            for (int x = x0; x < x1; ++x, s += s_step)
+            {
+               memcpy(src, row + Wrap(static_cast<int>(s >> FixedShift), tw) * 4, 4);
+               src += 4;
+            }
+         }
+      }
+      else
+      {
+         const int t0 = static_cast<int>(t >> FixedShift);
+         const unsigned int wt = static_cast<unsigned int>(t >> (FixedShift - 8)) & 0xFF;
+
+         const unsigned char *row0 = texels + Wrap(t0, th) * tw * 4;
+         const unsigned char *row1 = texels + Wrap(t0 + 1, th) * tw * 4;
+
+         // Bilinear filtering is separable, so blend the two texture rows
+         // once for the whole span (in 8.8, which still fits 16 bits) and
+         // only blend horizontally per pixel.  The integer sums come out
+         // exactly the same as blending all four texels at every pixel.
+         unsigned short *blended = &m_texel_row[0];
+         for (int i = 0; i < texel_count; ++i)
+         {
+            const int c = Wrap(first_texel + i, tw) * 4;
+            for (int k = 0; k < 4; ++k) blended[i * 4 + k] = static_cast<unsigned short>(row0[c + k] * (256 - wt) + row1[c + k] * wt);
+         }
+
+         for (int x = x0; x < x1; ++x, s += s_step)
+         {
+            const int c0 = (static_cast<int>(s >> FixedShift) - first_texel) * 4;
+            const unsigned int ws = static_cast<unsigned int>(s >> (FixedShift - 8)) & 0xFF;
+
+            const unsigned short *left = blended + c0;
+            const unsigned short *right = left + 4;
+            for (int c = 0; c < 4; ++c) src[c] = static_cast<unsigned char>((left[c] * (256 - ws) + right[c] * ws + 32768) >> 16);
+            src += 4;
+         }
+      }
+
+      if (modulate)
+      {
+         unsigned char *p = &m_span[0];
+         for (size_t i = 0; i < span * 4; i += 4)
+         {
+            for (int c = 0; c < 4; ++c) p[i + c] = static_cast<unsigned char>(Div255(p[i + c] * color[c]));
+         }
+      }
+
+      unsigned char *dest = &m_pixels[(y * m_width + x0) * 4];
+      if (blend) BlendSpan(dest, &m_span[0], span);
+      else memcpy(dest, &m_span[0], span * 4);
+   }
+}
+
+microseconds_t SoftwareRasterizer::TakeRasterTime()
+{
+   const microseconds_t time = m_raster_time;
+   m_raster_time = 0;
+
+   return time;
+}
+
+const static int TgaHeaderLength = 18;
+
+bool SoftwareRasterizer::WriteTga(const wstring &filename) const
+{
+   ofstream file;
+   Compatible::OpenFile(file, filename, ios::out | ios::trunc | ios::binary);
+
+   if (!file.good()) return false;
+
+   // Uncompressed true-color, 32 bits with 8 of alpha, top row first
+   unsigned char header[TgaHeaderLength] = { 0 };
+   header[2] = 2;
+   header[12] = static_cast<unsigned char>(m_width & 0xFF);
+   header[13] = static_cast<unsigned char>(m_width >> 8);
+   header[14] = static_cast<unsigned char>(m_height & 0xFF);
+   header[15] = static_cast<unsigned char>(m_height >> 8);
+   header[16] = 32;
+   header[17] = 0x28;
+   file.write(reinterpret_cast<const char*>(header), TgaHeaderLength);
+
+   // TGA stores BGRA
+   vector<unsigned char> bgra(m_pixels);
+   for (size_t i = 0; i < bgra.size(); i += 4) swap(bgra[i], bgra[i + 2]);
+   file.write(reinterpret_cast<const char*>(&bgra[0]), static_cast<streamsize>(bgra.size()));
+
+   return file.good();
+}
+
+bool SoftwareRasterizer::ReadTga(const wstring &filename, int *width, int *height, vector<unsigned char> *pixels)
+{
+   ifstream file;
+   Compatible::OpenFile(file, filename, ios::in | ios::binary);
+
+   if (!file.good()) return false;
+
+   const vector<unsigned char> bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+   if (bytes.size() < static_cast<size_t>(TgaHeaderLength)) return false;
+
+   // Only the kind WriteTga writes
+   if (bytes[2] != 2 || bytes[16] != 32 || bytes[17] != 0x28) return false;
+
+   *width = bytes[12] | (bytes[13] << 8);
+   *height = bytes[14] | (bytes[15] << 8);
+
+   const size_t size = static_cast<size_t>(*width) * (*height) * 4;
+   if (bytes.size() < TgaHeaderLength + size) return false;
+
+   pixels->assign(bytes.begin() + TgaHeaderLength, bytes.begin() + TgaHeaderLength + size);
+   for (size_t i = 0; i < pixels->size(); i += 4) swap((*pixels)[i], (*pixels)[i + 2]);
+
+   return true;
+}
@@ -0,0 +1,103 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __SOFTWARE_RASTERIZER_H
+#define __SOFTWARE_RASTERIZER_H
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "SpriteBatch.h"
+#include "libmidi/MidiTypes.h"
+
+// Draws what Renderer would have sent to OpenGL into a framebuffer in
+// memory instead, so rendering can be measured (and compared against
+// known-good images) on machines without a graphics card.
+//
+// It does exactly what OpenGL does with the state the game sets up:
+// GL_MODULATE texturing with GL_REPEAT wrapping, nearest or linear
+// filtering, GL_SRC_ALPHA/GL_ONE_MINUS_SRC_ALPHA blending (on alpha too)
+// or none, a scissor rectangle, and pixel centers sampled the way
+// Renderer's 3/8 pixel offset puts them.  It only has to handle the axis-aligned, flat-colored quads
+// SpriteBatch queues.  Spans are filled and blended four pixels at a time
+// with SSE2 where it's available, and give the same results without it.
+//
+// Past each quad's setup, everything is integer (and 16.16 fixed point)
+// math, so the same frame comes out the same on every machine.
+class SoftwareRasterizer
+{
+public:
+   SoftwareRasterizer(int width, int height);
+
+   int Width() const { return m_width; }
+   int Height() const { return m_height; }
+
+   // Four bytes (RGBA) per pixel, top row first
+   const std::vector<unsigned char> &Pixels() const { return m_pixels; }
+
+   void Clear(int r, int g, int b, int a);
+
+   // Same layout glTexImage2D takes: RGBA, bottom row first.  Ids start at
+   // 1; 0 (or any unknown id) draws untextured, like OpenGL's default
+   // texture.
+   unsigned int CreateTexture(unsigned int width, unsigned int height, const unsigned char *rgba, bool smooth);
+   void SetTextureSmooth(unsigned int id, bool smooth);
+   void DeleteTexture(unsigned int id);
+
+   // Without blending, quads replace what's under them (alpha included)
+   void DrawQuads(unsigned int texture_id, const SpriteVertex *vertices, size_t vertex_count, bool blend);
+
+   // Like glScissor: nothing outside the rectangle is drawn until the
+   // clip is cleared
+   void SetClip(int x, int y, int width, int height);
+   void ClearClip();
+
+   // Like glCopyTexSubImage2D: copies the framebuffer rectangle at (x, y)
+   // into the texture at (tex_x, tex_y), with its rows bottom first
+   void CopyToTexture(unsigned int id, unsigned int tex_x, unsigned int tex_y, int x, int y, int width, int height);
+
+   // Time spent in Clear and DrawQuads since the last call
+   microseconds_t TakeRasterTime();
+
+   // Uncompressed 32-bit TGAs, for saving and comparing frames
+   bool WriteTga(const std::wstring &filename) const;
+   static bool ReadTga(const std::wstring &filename, int *width, int *height, std::vector<unsigned char> *pixels);
+
+private:
+   struct Texture
+   {
+      unsigned int width;
+      unsigned int height;
+      bool smooth;
+      std::vector<unsigned char> rgba;
+   };
+
+   void DrawQuad(const Texture *texture, const SpriteVertex *quad, bool blend);
+
+   int m_width;
+   int m_height;
+   std::vector<unsigned char> m_pixels;
+
+   // The scissor rectangle, as [x0, x1) by [y0, y1)
+   int m_clip_x0;
+   int m_clip_y0;
+   int m_clip_x1;
+   int m_clip_y1;
+
+   std::map<unsigned int, Texture> m_textures;
+   unsigned int m_next_texture_id;
+
+   // Room for one row of sampled texels
+   std::vector<unsigned char> m_span;
+
+   // One row of vertically filtered texels (8.8 fixed point) for bilinear
+   // sampling
+   std::vector<unsigned short> m_texel_row;
+
+   microseconds_t m_raster_time;
+};
+
+#endif
@@ -0,0 +1,547 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "SoundFont.h"
+#include "PianoGameError.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+using namespace std;
+
+#include "libmidi/Midi.h"
+
+// Generator numbers from the SoundFont 2.01 spec
+enum Generator
+{
+   GenStartOffset = 0,
+   GenEndOffset = 1,
+   GenLoopStartOffset = 2,
+   GenLoopEndOffset = 3,
+   GenStartCoarseOffset = 4,
+   GenEndCoarseOffset = 12,
+   GenPan = 17,
+   GenAttackVolEnv = 34,
+   GenDecayVolEnv = 36,
+   GenSustainVolEnv = 37,
+   GenReleaseVolEnv = 38,
+   GenInstrument = 41,
+   GenKeyRange = 43,
+   GenVelocityRange = 44,
+   GenLoopStartCoarseOffset = 45,
+   GenAttenuation = 48,
+   GenLoopEndCoarseOffset = 50,
+   GenCoarseTune = 51,
+   GenFineTune = 52,
+   GenSampleId = 53,
+   GenSampleModes = 54,
+   GenRootKey = 58,
+
+   GeneratorCount = 61
+};
+
+// Sizes of the records in each of the preset data sub-chunks
+const static size_t PresetHeaderSize = 38;
+const static size_t BagSize = 4;
+const static size_t GeneratorSize = 4;
+const static size_t InstrumentHeaderSize = 22;
+const static size_t SampleHeaderSize = 46;
+
+static unsigned short ReadWord(const unsigned char *p)
+{
+   return static_cast<unsigned short>(p[0] | (p[1] << 8));
+}
+
+static unsigned long ReadDword(const unsigned char *p)
+{
+   return static_cast<unsigned long>(p[0]) | (static_cast<unsigned long>(p[1]) << 8) |
+      (static_cast<unsigned long>(p[2]) << 16) | (static_cast<unsigned long>(p[3]) << 24);
+}
+
+static string ReadName(const unsigned char *p)
+{
+   // Names are 20 bytes and only null-terminated if they're shorter
+   const char *name = reinterpret_cast<const char*>(p);
+   return string(name, find(name, name + 20, '\0'));
+}
+
+static float TimecentsToSeconds(int timecents)
+{
+   return static_cast<float>(pow(2.0, timecents / 1200.0));
+}
+
+static float CentibelsToGain(int centibels)
+{
+   return static_cast<float>(pow(10.0, -centibels / 200.0));
+}
+
+struct Chunk
+{
+   const unsigned char *data;
+   size_t size;
+};
+
+// Finds the sub-chunk called id inside a RIFF LIST's body
+static bool FindChunk(const Chunk &list, const char *id, Chunk *found)
+{
+   size_t offset = 0;
+   while (offset + 8 <= list.size)
+   {
+      const unsigned char *header = list.data + offset;
+      const size_t size = ReadDword(header + 4);
+      if (size > list.size - offset - 8) return false;
+
+      if (memcmp(header, id, 4) == 0)
+      {
+         found->data = header + 8;
+         found->size = size;
+         return true;
+      }
+
+      // Chunks are padded to an even length
+      offset += 8 + size + (size & 1);
+   }
+
+   return false;
+}
+
+// Finds the LIST chunk of the given type inside the RIFF form
+static bool FindList(const Chunk &form, const char *type, Chunk *found)
+{
+   size_t offset = 0;
+   while (offset + 12 <= form.size)
+   {
+      const unsigned char *header = form.data + offset;
+      const size_t size = ReadDword(header + 4);
+      if (size > form.size - offset - 8 || size < 4) return false;
+
+      if (memcmp(header, "LIST", 4) == 0 && memcmp(header + 8, type, 4) == 0)
+      {
+         found->data = header + 12;
+         found->size = size - 4;
+         return true;
+      }
+
+      offset += 8 + size + (size & 1);
+   }
+
+   return false;
+}
+
+// The value of every generator in a zone, and which were actually given
+struct ZoneGenerators
+{
+   ZoneGenerators() { memset(given, 0, sizeof(given)); memset(values, 0, sizeof(values)); }
+
+   void Set(int generator, short value)
+   {
+      if (generator < 0 || generator >= GeneratorCount) return;
+      values[generator] = value;
+      given[generator] = true;
+   }
+
+   short Get(int generator, short fallback) const { return given[generator] ? values[generator] : fallback; }
+
+   // Ranges are stored as two bytes, low then high
+   unsigned char Low(int generator) const { return given[generator] ? static_cast<unsigned char>(values[generator] & 0xFF) : 0; }
+   unsigned char High(int generator) const { return given[generator] ? static_cast<unsigned char>((values[generator] >> 8) & 0xFF) : 127; }
+
+   short values[GeneratorCount];
+   bool given[GeneratorCount];
+};
+
+// Reads the generators for bag number `bag` on top of whatever is already
+// in `generators` (that's how global zones provide defaults).
+static void ReadZone(const Chunk &bags, const Chunk &gens, size_t bag, ZoneGenerators *generators)
+{
+   const size_t first = ReadWord(bags.data + bag * BagSize);
+   const size_t last = ReadWord(bags.data + (bag + 1) * BagSize);
+
+   const size_t gen_count = gens.size / GeneratorSize;
+   for (size_t g = first; g < last && g < gen_count; ++g)
+   {
+      const unsigned char *p = gens.data + g * GeneratorSize;
+      generators->Set(ReadWord(p), static_cast<short>(ReadWord(p + 2)));
+   }
+}
+
+static bool HasZoneGenerator(const Chunk &bags, const Chunk &gens, size_t bag, int generator)
+{
+   ZoneGenerators z;
+   ReadZone(bags, gens, bag, &z);
+   return z.given[generator];
+}
+
+// Ranges from preset and instrument zones narrow each other
+static bool Intersect(unsigned char *low, unsigned char *high, unsigned char other_low, unsigned char other_high)
+{
+   *low = max(*low, other_low);
+   *high = min(*high, other_high);
+   return *low <= *high;
+}
+
+SoundFont::SoundFont(const wstring &filename)
+   : m_file(filename), m_samples(0), m_sample_count(0), m_sample_offset(0), m_region_count(0)
+{
+   Parse(filename);
+}
+
+void SoundFont::Parse(const wstring &filename)
+{
+   const PianoGameError not_a_soundfont(L"'" + filename + L"' isn't a SoundFont 2 file.");
+
+   const unsigned char *data = m_file.Data();
+   if (m_file.Size() < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "sfbk", 4) != 0) throw not_a_soundfont;
+
+   Chunk form;
+   form.data = data + 12;
+   form.size = min(static_cast<size_t>(ReadDword(data + 4)) - 4, m_file.Size() - 12);
+
+   Chunk sdta, pdta;
+   if (!FindList(form, "sdta", &sdta) || !FindList(form, "pdta", &pdta)) throw not_a_soundfont;
+
+   Chunk smpl;
+   if (!FindChunk(sdta, "smpl", &smpl)) throw not_a_soundfont;
+   m_samples = reinterpret_cast<const short*>(smpl.data);
+   m_sample_count = smpl.size / 2;
+   m_sample_offset = smpl.data - data;
+
+   Chunk phdr, pbag, pgen, inst, ibag, igen, shdr;
+   if (!FindChunk(pdta, "phdr", &phdr) || !FindChunk(pdta, "pbag", &pbag) || !FindChunk(pdta, "pgen", &pgen) ||
+      !FindChunk(pdta, "inst", &inst) || !FindChunk(pdta, "ibag", &ibag) || !FindChunk(pdta, "igen", &igen) ||
+      !FindChunk(pdta, "shdr", &shdr)) throw not_a_soundfont;
+
+   // Every table ends with a terminal record, which only exists to mark
+   // where the last real record's zones stop.
+   const size_t preset_count = phdr.size / PresetHeaderSize;
+   const size_t preset_bag_count = pbag.size / BagSize;
+   const size_t instrument_count = inst.size / InstrumentHeaderSize;
+   const size_t instrument_bag_count = ibag.size / BagSize;
+   const size_t sample_count = shdr.size / SampleHeaderSize;
+   if (preset_count < 1 || instrument_count < 1 || sample_count < 1) throw not_a_soundfont;
+   if (preset_bag_count < 1 || instrument_bag_count < 1) throw not_a_soundfont;
+
+   for (size_t p = 0; p + 1 < preset_count; ++p)
+   {
+      const unsigned char *header = phdr.data + p * PresetHeaderSize;
+
+      SoundFontPreset preset;
+      preset.name = ReadName(header);
+      preset.program = ReadWord(header + 20);
+      preset.bank = ReadWord(header + 22);
+
+      const size_t bag_start = ReadWord(header + 24);
+      const size_t bag_end = min(static_cast<size_t>(ReadWord(header + PresetHeaderSize + 24)), preset_bag_count - 1);
+
+      // A first zone without an instrument holds the preset's defaults
+      ZoneGenerators preset_global;
+      size_t first_bag = bag_start;
+      if (bag_start < bag_end && !HasZoneGenerator(pbag, pgen, bag_start, GenInstrument))
+      {
+         ReadZone(pbag, pgen, bag_start, &preset_global);
+         first_bag++;
+      }
+
+      for (size_t pb = first_bag; pb < bag_end; ++pb)
+      {
+         ZoneGenerators preset_zone = preset_global;
+         ReadZone(pbag, pgen, pb, &preset_zone);
+         if (!preset_zone.given[GenInstrument]) continue;
+
+         const size_t instrument = static_cast<unsigned short>(preset_zone.values[GenInstrument]);
+         if (instrument + 1 >= instrument_count) continue;
+
+         const size_t ibag_start = ReadWord(inst.data + instrument * InstrumentHeaderSize + 20);
+         const size_t ibag_end = min(static_cast<size_t>(ReadWord(inst.data + (instrument + 1) * InstrumentHeaderSize + 20)), instrument_bag_count - 1);
+
+         ZoneGenerators instrument_global;
+         size_t first_ibag = ibag_start;
+         if (ibag_start < ibag_end && !HasZoneGenerator(ibag, igen, ibag_start, GenSampleId))
+         {
+            ReadZone(ibag, igen, ibag_start, &instrument_global);
+            first_ibag++;
+         }
+
+         for (size_t ib = first_ibag; ib < ibag_end; ++ib)
+         {
+            ZoneGenerators z = instrument_global;
+            ReadZone(ibag, igen, ib, &z);
+            if (!z.given[GenSampleId]) continue;
+
+            const size_t sample = static_cast<unsigned short>(z.values[GenSampleId]);
+            if (sample + 1 >= sample_count) continue;
+
+            const unsigned char *s = shdr.data + sample * SampleHeaderSize;
+
+            // ROM samples live in some sound card, not in the file
+            if (ReadWord(s + 44) & 0x8000) continue;
+
+            SoundFontRegion r;
+            r.index = m_region_count;
+
+            r.key_low = z.Low(GenKeyRange);
+            r.key_high = z.High(GenKeyRange);
+            r.velocity_low = z.Low(GenVelocityRange);
+            r.velocity_high = z.High(GenVelocityRange);
+            if (!Intersect(&r.key_low, &r.key_high, preset_zone.Low(GenKeyRange), preset_zone.High(GenKeyRange))) continue;
+            if (!Intersect(&r.velocity_low, &r.velocity_high, preset_zone.Low(GenVelocityRange), preset_zone.High(GenVelocityRange))) continue;
+
+            // Instrument values are absolute; preset values are added on top
+            #define GENERATOR(gen, fallback) (z.Get(gen, fallback) + preset_zone.Get(gen, 0))
+
+            const long start = static_cast<long>(ReadDword(s + 20)) + GENERATOR(GenStartOffset, 0) + 32768L * GENERATOR(GenStartCoarseOffset, 0);
+            const long end = static_cast<long>(ReadDword(s + 24)) + GENERATOR(GenEndOffset, 0) + 32768L * GENERATOR(GenEndCoarseOffset, 0);
+            const long loop_start = static_cast<long>(ReadDword(s + 28)) + GENERATOR(GenLoopStartOffset, 0) + 32768L * GENERATOR(GenLoopStartCoarseOffset, 0);
+            const long loop_end = static_cast<long>(ReadDword(s + 32)) + GENERATOR(GenLoopEndOffset, 0) + 32768L * GENERATOR(GenLoopEndCoarseOffset, 0);
+
+            // The synth reads one frame past the end while interpolating
+            if (start < 0 || end <= start || static_cast<size_t>(end) >= m_sample_count) continue;
+
+            r.start = static_cast<unsigned long>(start);
+            r.end = static_cast<unsigned long>(end);
+            r.loop_start = static_cast<unsigned long>(max(loop_start, start));
+            r.loop_end = static_cast<unsigned long>(min(loop_end, end));
+
+            const int mode = z.Get(GenSampleModes, 0) & 3;
+            r.loops = (mode == 1 || mode == 3) && r.loop_end > r.loop_start + 1;
+
+            r.sample_rate = ReadDword(s + 36);
+            if (r.sample_rate == 0) continue;
+
+            const int original_pitch = s[40];
+            r.root_key = z.Get(GenRootKey, -1);
+            if (r.root_key < 0) r.root_key = (original_pitch <= 127 ? original_pitch : 60);
+
+            const int pitch_correction = static_cast<signed char>(s[41]);
+            r.tune_cents = GENERATOR(GenCoarseTune, 0) * 100 + GENERATOR(GenFineTune, 0) + pitch_correction;
+
+            r.gain = CentibelsToGain(max(0, GENERATOR(GenAttenuation, 0)));
+            r.pan = max(0.0f, min(1.0f, 0.5f + GENERATOR(GenPan, 0) / 1000.0f));
+
+            r.attack = TimecentsToSeconds(GENERATOR(GenAttackVolEnv, -12000));
+            r.decay = TimecentsToSeconds(GENERATOR(GenDecayVolEnv, -12000));
+            r.sustain = CentibelsToGain(max(0, min(1440, GENERATOR(GenSustainVolEnv, 0))));
+            r.release = TimecentsToSeconds(GENERATOR(GenReleaseVolEnv, -12000));
+
+            #undef GENERATOR
+
+            preset.regions.push_back(r);
+            m_region_count++;
+         }
+      }
+
+      m_presets.push_back(preset);
+   }
+}
+
+const SoundFontPreset *SoundFont::FindPreset(int bank, int program) const
+{
+   const SoundFontPreset *fallback = 0;
+
+   for (size_t i = 0; i < m_presets.size(); ++i)
+   {
+      const SoundFontPreset &p = m_presets[i];
+      if (p.program != program) continue;
+
+      if (p.bank == bank) return &p;
+      if (p.bank == 0) fallback = &p;
+   }
+
+   if (fallback) return fallback;
+   return m_presets.empty() ? 0 : &m_presets[0];
+}
+
+SoundFontPrefetcher::SoundFontPrefetcher(const SoundFont &font, const Midi &song)
+   : m_font(font), m_page_size(MappedFile::PageSize()), m_presets_used(0), m_bytes_used(0), m_next(0),
+   m_position_ms(0), m_prefetched_through(0), m_pages_prefetched(0), m_stop(0), m_thread(0)
+{
+   FindFirstUses(song);
+
+   const size_t sample_bytes = m_font.SampleCount() * sizeof(short);
+   m_pages_touched.resize((sample_bytes + m_page_size - 1) / m_page_size + 1, false);
+
+   // Songs start in their lead-in, before zero
+   m_position_ms = static_cast<long>(song.GetSongPositionInMicroseconds() / 1000);
+
+   m_thread = new Thread(Run, this);
+   m_wake.Set();
+}
+
+SoundFontPrefetcher::~SoundFontPrefetcher()
+{
+   Atomic::CompareAndSwap(&m_stop, 0, 1);
+   m_wake.Set();
+
+   delete m_thread;
+}
+
+void SoundFontPrefetcher::FindFirstUses(const Midi &song)
+{
+   // Program changes on one track apply to notes on every other track
+   // that shares the channel, so walk all of the tracks' events together.
+   const MidiSongEventList events = song.MergedEvents();
+
+   int bank[16];
+   int program[16];
+   for (int c = 0; c < 16; ++c)
+   {
+      bank[c] = (c == 9 ? 128 : 0);
+      program[c] = 0;
+   }
+
+   vector<bool> region_seen(m_font.RegionCount(), false);
+   vector<const SoundFontPreset*> presets_seen;
+
+   for (size_t i = 0; i < events.size(); ++i)
+   {
+      const MidiEvent &ev = events[i].event;
+      const int channel = ev.Channel() & 0x0F;
+
+      MidiEventSimple simple;
+      ev.GetSimpleEvent(&simple);
+
+      switch (ev.Type())
+      {
+      case MidiEventType_Controller:
+         // Bank select (the percussion channel always uses the drum bank)
+         if (simple.byte1 == 0 && channel != 9) bank[channel] = simple.byte2;
+         break;
+
+      case MidiEventType_ProgramChange:
+         program[channel] = ev.ProgramNumber();
+         break;
+
+      case MidiEventType_NoteOn:
+         {
+            const int note = ev.NoteNumber();
+            const int velocity = ev.NoteVelocity();
+            if (velocity == 0) break;
+
+            const SoundFontPreset *preset = m_font.FindPreset(bank[channel], program[channel]);
+            if (!preset) break;
+
+            if (find(presets_seen.begin(), presets_seen.end(), preset) == presets_seen.end()) presets_seen.push_back(preset);
+
+            for (size_t r = 0; r < preset->regions.size(); ++r)
+            {
+               const SoundFontRegion &region = preset->regions[r];
+               if (note < region.key_low || note > region.key_high) continue;
+               if (velocity < region.velocity_low || velocity > region.velocity_high) continue;
+               if (region_seen[region.index]) continue;
+
+               region_seen[region.index] = true;
+
+               FirstUse use;
+               use.time = events[i].time;
+               use.region = &region;
+               m_first_uses.push_back(use);
+            }
+         }
+         break;
+
+      default:
+         break;
+      }
+   }
+
+   // The events were already in order, but stable_sort keeps it obvious
+   stable_sort(m_first_uses.begin(), m_first_uses.end());
+
+   m_presets_used = presets_seen.size();
+
+   // Regions often share samples (left/right pairs, velocity layers), so
+   // count bytes through the pages they cover instead
+   vector<bool> pages(m_font.SampleCount() * sizeof(short) / m_page_size + 2, false);
+   for (size_t p = 0; p < presets_seen.size(); ++p)
+   {
+      for (size_t r = 0; r < presets_seen[p]->regions.size(); ++r)
+      {
+         const SoundFontRegion &region = presets_seen[p]->regions[r];
+         for (size_t page = region.start * sizeof(short) / m_page_size; page <= region.end * sizeof(short) / m_page_size; ++page)
+         {
+            if (!pages[page]) m_bytes_used += m_page_size;
+            pages[page] = true;
+         }
+      }
+   }
+}
+
+void SoundFontPrefetcher::Touch(const SoundFontRegion &region)
+{
+   const unsigned char *samples = reinterpret_cast<const unsigned char*>(m_font.Samples());
+
+   // One extra frame for interpolation
+   const size_t first = region.start * sizeof(short) / m_page_size;
+   const size_t last = (region.end + 1) * sizeof(short) / m_page_size;
+
+   // Reading a single byte from each page is enough to fault it in.  The
+   // sum only exists so the reads can't be optimized away.
+   volatile unsigned char sink = 0;
+   for (size_t page = first; page <= last && page < m_pages_touched.size(); ++page)
+   {
+      if (m_pages_touched[page]) continue;
+      m_pages_touched[page] = true;
+
+      const size_t offset = max(page * m_page_size, static_cast<size_t>(region.start * sizeof(short)));
+      sink = sink + samples[offset];
+
+      Atomic::Increment(&m_pages_prefetched);
+   }
+}
+
+void SoundFontPrefetcher::Run()
+{
+   while (true)
+   {
+      m_wake.Wait();
+      if (Atomic::Read(&m_stop)) return;
+
+      const microseconds_t horizon = static_cast<microseconds_t>(Atomic::Read(&m_position_ms)) * 1000 + LookAhead;
+      while (m_next < m_first_uses.size() && m_first_uses[m_next].time <= horizon)
+      {
+         if (Atomic::Read(&m_stop)) return;
+
+         Touch(*m_first_uses[m_next].region);
+
+         m_next++;
+         Atomic::Increment(&m_prefetched_through);
+      }
+   }
+}
+
+void SoundFontPrefetcher::SetPosition(microseconds_t song_position)
+{
+   Atomic::Write(&m_position_ms, static_cast<long>(song_position / 1000));
+
+   // Only bother the thread if there's something new for it to do
+   const size_t through = static_cast<size_t>(Atomic::Read(&m_prefetched_through));
+   if (through < m_first_uses.size() && m_first_uses[through].time <= song_position + LookAhead) m_wake.Set();
+}
+
+bool SoundFontPrefetcher::CaughtUp() const
+{
+   const microseconds_t horizon = static_cast<microseconds_t>(Atomic::Read(&m_position_ms)) * 1000 + LookAhead;
+   const size_t through = static_cast<size_t>(Atomic::Read(&m_prefetched_through));
+
+   return through >= m_first_uses.size() || m_first_uses[through].time > horizon;
+}
+
+SoundFontResidency SoundFontPrefetcher::Residency() const
+{
+   SoundFontResidency r;
+   r.presets_used = m_presets_used;
+   r.regions_used = m_first_uses.size();
+   r.bytes_used = m_bytes_used;
+
+   r.pages_prefetched = static_cast<size_t>(Atomic::Read(&m_pages_prefetched));
+   r.page_size = m_page_size;
+
+   const MappedFile &file = m_font.File();
+   r.bytes_mapped = file.Size();
+
+   r.pages_resident = 0;
+   r.resident_known = file.CountResidentPages(0, file.Size(), &r.pages_resident);
+
+   return r;
+}
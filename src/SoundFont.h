@@ -0,0 +1,198 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __SOUND_FONT_H
+#define __SOUND_FONT_H
+
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+#include "Threading.h"
+
+#include "libmidi/MidiTypes.h"
+
+class Midi;
+
+// One sample, and when and how to play it.  Everything the preset and
+// instrument zones said about it has already been worked out.
+struct SoundFontRegion
+{
+   // Unique across the whole font, starting at 0
+   size_t index;
+
+   unsigned char key_low;
+   unsigned char key_high;
+   unsigned char velocity_low;
+   unsigned char velocity_high;
+
+   // In sample frames from the start of the font's sample data
+   unsigned long start;
+   unsigned long end;
+   unsigned long loop_start;
+   unsigned long loop_end;
+
+   bool loops;
+   unsigned int sample_rate;
+
+   // The key the sample sounds at unchanged, and extra tuning on top of
+   // that in cents
+   int root_key;
+   int tune_cents;
+
+   // Linear, from the zone's attenuation
+   float gain;
+
+   // 0.0 is hard left, 1.0 hard right
+   float pan;
+
+   // In seconds, except sustain (a level in [0.0, 1.0]).  Decay and
+   // release are how long it takes to fall by 100dB.
+   float attack;
+   float decay;
+   float sustain;
+   float release;
+};
+
+struct SoundFontPreset
+{
+   std::string name;
+   int bank;
+   int program;
+
+   std::vector<SoundFontRegion> regions;
+};
+
+// A SoundFont 2 file.  The file is memory-mapped rather than read, so
+// opening even a large General MIDI font only costs as much as parsing
+// its (small) preset tables.  Sample data is paged in by the OS as it's
+// first played, or ahead of time by SoundFontPrefetcher.
+//
+// Only what the built-in synth understands is kept: key and velocity
+// splits, tuning, loops, attenuation, pan, and the volume envelope.
+// Modulators and the filter and modulation envelopes are ignored.
+class SoundFont
+{
+public:
+   // Throws PianoGameError if the file can't be opened or isn't a
+   // SoundFont we can use.
+   SoundFont(const std::wstring &filename);
+
+   const std::vector<SoundFontPreset> &Presets() const { return m_presets; }
+   size_t RegionCount() const { return m_region_count; }
+
+   // Percussion is bank 128.  Missing presets fall back to the same
+   // program in bank 0, then to the first preset in the font.  Returns
+   // null if the font has no presets at all.
+   const SoundFontPreset *FindPreset(int bank, int program) const;
+
+   // 16-bit mono samples, straight out of the file.  (SoundFonts are
+   // little-endian, same as every machine we currently build for.)
+   const short *Samples() const { return m_samples; }
+   size_t SampleCount() const { return m_sample_count; }
+
+   // Where the sample data sits in the mapped file
+   const MappedFile &File() const { return m_file; }
+   size_t SampleDataOffset() const { return m_sample_offset; }
+
+private:
+   SoundFont(const SoundFont&);
+   SoundFont &operator=(const SoundFont&);
+
+   void Parse(const std::wstring &filename);
+
+   MappedFile m_file;
+
+   const short *m_samples;
+   size_t m_sample_count;
+   size_t m_sample_offset;
+
+   std::vector<SoundFontPreset> m_presets;
+   size_t m_region_count;
+};
+
+struct SoundFontResidency
+{
+   // How much of the font the song could ever play
+   size_t presets_used;
+   size_t regions_used;
+   size_t bytes_used;
+
+   // How much has been read in for it so far
+   size_t pages_prefetched;
+   size_t page_size;
+
+   // Everything in the font
+   size_t bytes_mapped;
+
+   // What the OS says is in memory (from the whole file, no matter who
+   // touched it).  Only meaningful if resident_known.
+   bool resident_known;
+   size_t pages_resident;
+};
+
+// Reads the samples a song is going to need into memory a little before
+// it needs them, from a thread of its own, so the audio thread doesn't
+// stall on a page fault the first time each sample is played.  Samples
+// that belong to presets the song never uses are never touched.
+class SoundFontPrefetcher
+{
+public:
+   // How far ahead of the playback position samples are paged in
+   const static microseconds_t LookAhead = 3000000;
+
+   // Both must outlive the prefetcher.  Work starts (from the beginning
+   // of the song) right away.
+   SoundFontPrefetcher(const SoundFont &font, const Midi &song);
+   ~SoundFontPrefetcher();
+
+   // May be called from any thread
+   void SetPosition(microseconds_t song_position);
+
+   // Whether everything up to the last position plus LookAhead is in
+   bool CaughtUp() const;
+
+   SoundFontResidency Residency() const;
+
+private:
+   SoundFontPrefetcher(const SoundFontPrefetcher&);
+   SoundFontPrefetcher &operator=(const SoundFontPrefetcher&);
+
+   struct FirstUse
+   {
+      microseconds_t time;
+      const SoundFontRegion *region;
+
+      bool operator<(const FirstUse &rhs) const { return time < rhs.time; }
+   };
+
+   void FindFirstUses(const Midi &song);
+   void Touch(const SoundFontRegion &region);
+
+   static void Run(void *context) { reinterpret_cast<SoundFontPrefetcher*>(context)->Run(); }
+   void Run();
+
+   const SoundFont &m_font;
+   size_t m_page_size;
+
+   // Sorted by time.  Each region appears at most once.
+   std::vector<FirstUse> m_first_uses;
+   size_t m_presets_used;
+   size_t m_bytes_used;
+
+   // Only the prefetch thread touches these
+   std::vector<bool> m_pages_touched;
+   size_t m_next;
+
+   // Song time, but stored as a long (in milliseconds) so it's atomic
+   volatile long m_position_ms;
+   volatile long m_prefetched_through;
+   volatile long m_pages_prefetched;
+   volatile long m_stop;
+
+   Signal m_wake;
+   Thread *m_thread;
+};
+
+#endif
@@ -0,0 +1,154 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "SpriteBatch.h"
+#include "SoftwareRasterizer.h"
+
+#include <algorithm>
+using namespace std;
+
+// Plenty for a full screen of notes; a bigger frame just flushes early
+const static size_t MaxQueuedQuads = 8192;
+
+SpriteBatch::SpriteBatch() : m_rasterizer(0), m_blend(true), m_clipped(false),
+   m_clip_x0(0), m_clip_y0(0), m_clip_x1(0), m_clip_y1(0)
+{
+   m_vertices.reserve(MaxQueuedQuads * 4);
+   m_runs.reserve(256);
+}
+
+void SpriteBatch::SetRasterizer(SoftwareRasterizer *rasterizer)
+{
+   Flush();
+   m_rasterizer = rasterizer;
+}
+
+void SpriteBatch::SetClip(int x, int y, int width, int height)
+{
+   m_clipped = true;
+   m_clip_x0 = static_cast<GLfloat>(x);
+   m_clip_y0 = static_cast<GLfloat>(y);
+   m_clip_x1 = static_cast<GLfloat>(x + width);
+   m_clip_y1 = static_cast<GLfloat>(y + height);
+}
+
+void SpriteBatch::AddQuad(unsigned int texture_id, const SpriteVertex quad[4])
+{
+   if (m_vertices.size() >= MaxQueuedQuads * 4) Flush();
+
+   if (m_runs.empty() || m_runs.back().texture_id != texture_id || m_runs.back().blend != m_blend)
+   {
+      Run r;
+      r.texture_id = texture_id;
+      r.blend = m_blend;
+      r.first = static_cast<GLint>(m_vertices.size());
+      r.count = 0;
+      m_runs.push_back(r);
+   }
+
+   m_vertices.insert(m_vertices.end(), quad, quad + 4);
+   m_runs.back().count += 4;
+
+   // Opposite corners (see BuildQuad in Renderer.cpp) give the area
+   GLfloat x0 = min(quad[0].x, quad[2].x);
+   GLfloat x1 = max(quad[0].x, quad[2].x);
+   GLfloat y0 = min(quad[0].y, quad[2].y);
+   GLfloat y1 = max(quad[0].y, quad[2].y);
+   if (m_clipped)
+   {
+      x0 = max(x0, m_clip_x0);
+      x1 = min(x1, m_clip_x1);
+      y0 = max(y0, m_clip_y0);
+      y1 = min(y1, m_clip_y1);
+   }
+   if (x1 > x0 && y1 > y0) m_frame.pixels += static_cast<unsigned long>((x1 - x0) * (y1 - y0));
+
+   m_frame.quads++;
+}
+
+void SpriteBatch::AddQuads(unsigned int texture_id, const SpriteVertex *vertices, size_t vertex_count, GLfloat dx, GLfloat dy)
+{
+   for (size_t i = 0; i + 4 <= vertex_count; i += 4)
+   {
+      SpriteVertex quad[4];
+      for (int k = 0; k < 4; ++k)
+      {
+         quad[k] = vertices[i + k];
+         quad[k].x += dx;
+         quad[k].y += dy;
+      }
+
+      AddQuad(texture_id, quad);
+   }
+}
+
+void SpriteBatch::Flush()
+{
+   if (m_runs.empty()) return;
+
+   if (m_rasterizer)
+   {
+      for (size_t i = 0; i < m_runs.size(); ++i)
+      {
+         const Run &r = m_runs[i];
+         m_rasterizer->DrawQuads(r.texture_id, &m_vertices[r.first], r.count, r.blend);
+
+         m_frame.draw_calls++;
+         m_frame.vertices += r.count;
+      }
+
+      m_frame.flushes++;
+
+      m_vertices.clear();
+      m_runs.clear();
+      return;
+   }
+
+   const GLsizei stride = sizeof(SpriteVertex);
+   const SpriteVertex *v = &m_vertices[0];
+
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+   glEnableClientState(GL_COLOR_ARRAY);
+
+   glVertexPointer(2, GL_FLOAT, stride, &v->x);
+   glTexCoordPointer(2, GL_FLOAT, stride, &v->u);
+   glColorPointer(4, GL_UNSIGNED_BYTE, stride, &v->r);
+
+   // Texture uploads and text bind textures behind our back, so the
+   // binding is never trusted from one flush to the next
+   for (size_t i = 0; i < m_runs.size(); ++i)
+   {
+      const Run &r = m_runs[i];
+
+      if (!r.blend) glDisable(GL_BLEND);
+
+      glBindTexture(GL_TEXTURE_2D, r.texture_id);
+      glDrawArrays(GL_QUADS, r.first, r.count);
+
+      if (!r.blend) glEnable(GL_BLEND);
+
+      m_frame.draw_calls++;
+      m_frame.vertices += r.count;
+   }
+
+   glDisableClientState(GL_COLOR_ARRAY);
+   glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+   glDisableClientState(GL_VERTEX_ARRAY);
+
+   m_frame.flushes++;
+
+   m_vertices.clear();
+   m_runs.clear();
+}
+
+SpriteBatchStats SpriteBatch::EndFrame()
+{
+   Flush();
+
+   const SpriteBatchStats finished = m_frame;
+   m_frame = SpriteBatchStats();
+
+   return finished;
+}
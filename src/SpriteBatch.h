@@ -0,0 +1,116 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __SPRITE_BATCH_H
+#define __SPRITE_BATCH_H
+
+#include <cstddef>
+#include <vector>
+
+#include "os_graphics.h"
+#include "libmidi/MidiTypes.h"
+
+class SoftwareRasterizer;
+
+// What it took to draw one frame
+struct SpriteBatchStats
+{
+   SpriteBatchStats() : draw_calls(0), vertices(0), quads(0), flushes(0), pixels(0), copied_pixels(0), raster_time(0) { }
+
+   unsigned long draw_calls;
+   unsigned long vertices;
+   unsigned long quads;
+   unsigned long flushes;
+
+   // Fill: the area of every quad drawn (inside the clip, if any), and of
+   // everything copied from the screen into a texture
+   unsigned long pixels;
+   unsigned long copied_pixels;
+
+   // Microseconds the SoftwareRasterizer (if there is one) spent drawing
+   microseconds_t raster_time;
+};
+
+struct SpriteVertex
+{
+   GLfloat x, y;
+   GLfloat u, v;
+   GLubyte r, g, b, a;
+};
+
+// Collects textured (or, with texture 0, plain) quads into a client-side
+// vertex array and draws them with one glDrawArrays per run of quads that
+// share a texture.
+//
+// Quads are drawn in the order they were added.  Nearly everything here is
+// alpha blended and drawn back to front (note shadows under notes, keys
+// over the notes that roll under them), so moving a quad past another one
+// with a different texture could change what's on top.  Callers already
+// draw a texture's quads together (a whole note pass with one texture, all
+// the guides untextured), so runs are long and a busy playing screen comes
+// down to a couple of dozen draw calls.
+//
+// Anything that talks to OpenGL directly (text, texture uploads) has to
+// Flush() first so the queued quads land underneath it.
+//
+// Quads are alpha blended unless SetBlending(false) was called before they
+// were added; a change in blending starts a new run, like a new texture.
+//
+// With a SoftwareRasterizer, each run goes to it instead of OpenGL.
+class SpriteBatch
+{
+public:
+   SpriteBatch();
+
+   // Null goes back to OpenGL.  Everything queued is flushed first.
+   void SetRasterizer(SoftwareRasterizer *rasterizer);
+
+   void SetBlending(bool blend) { m_blend = blend; }
+
+   // Only used to count pixels; Renderer does the actual clipping
+   void SetClip(int x, int y, int width, int height);
+   void ClearClip() { m_clipped = false; }
+
+   void RecordCopy(unsigned long pixels) { m_frame.copied_pixels += pixels; }
+
+   void AddQuad(unsigned int texture_id, const SpriteVertex quad[4]);
+
+   // Queues quads that were built ahead of time (four vertices each),
+   // moved by (dx, dy)
+   void AddQuads(unsigned int texture_id, const SpriteVertex *vertices, size_t vertex_count, GLfloat dx, GLfloat dy);
+
+   // Draws (and forgets) everything queued so far
+   void Flush();
+
+   // Returns the totals since the last EndFrame, and starts new ones.
+   // Everything queued is flushed first.
+   SpriteBatchStats EndFrame();
+
+   const SpriteBatchStats &CurrentFrame() const { return m_frame; }
+
+private:
+   struct Run
+   {
+      unsigned int texture_id;
+      bool blend;
+      GLint first;
+      GLsizei count;
+   };
+
+   std::vector<SpriteVertex> m_vertices;
+   std::vector<Run> m_runs;
+
+   SoftwareRasterizer *m_rasterizer;
+   SpriteBatchStats m_frame;
+
+   bool m_blend;
+
+   bool m_clipped;
+   GLfloat m_clip_x0;
+   GLfloat m_clip_y0;
+   GLfloat m_clip_x1;
+   GLfloat m_clip_y1;
+};
+
+#endif
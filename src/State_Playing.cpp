@@ -8,6 +8,13 @@
 #include "Renderer.h"
 #include "Textures.h"
 #include "CompatibleSystem.h"
+#include "DispatchTiming.h"
+#include "OutputRouter.h"
+#include "MidiClock.h"
+#include "PerformanceRecorder.h"
+#include "ScoringEngine.h"
+#include "SessionLog.h"
+#include "UserSettings.h"
 
 #include <string>
 #include <iomanip>
@@ -24,25 +31,30 @@ using namespace std;
 
 #include "libmidi/MidiComm.h"
 
-void PlayingState::SetupNoteState()
+// MIDI clock goes to whichever output is named in the "MIDI Clock Output"
+// setting.  It's only an extra, so we quietly go without if that device
+// has gone missing or won't open (a second time, if it's also the main
+// output and the driver only allows one client).
+static MidiClock *OpenClock(const MidiTempoMap &tempo_map)
 {
-   TranslatedNoteSet old = m_notes;
-   m_notes.clear();
+   const wstring name = UserSetting::Get(L"MIDI Clock Output", L"");
+   if (name.length() == 0) return 0;
 
-   for (TranslatedNoteSet::const_iterator i = old.begin(); i != old.end(); ++i)
+   const MidiCommDescriptionList devices = MidiCommOut::GetDeviceList();
+   for (size_t i = 0; i < devices.size(); ++i)
    {
-      TranslatedNote n = *i;
+      if (devices[i].name != name) continue;
 
-      n.state = AutoPlayed;
-      if (m_state.track_properties[n.track_id].mode == Track::ModeYouPlay) n.state = UserPlayable;
-      
-      m_notes.insert(n);
+      try { return new MidiClock(new MidiCommOut(devices[i].id), tempo_map); }
+      catch (const MidiError &) { return 0; }
    }
+
+   return 0;
 }
 
 void PlayingState::ResetSong()
 {
-   if (m_state.midi_out) m_state.midi_out->Reset();
+   m_output->Reset();
    if (m_state.midi_in) m_state.midi_in->Reset();
 
    // TODO: These should be moved to a configuration file
@@ -53,21 +65,20 @@ void PlayingState::ResetSong()
    if (!m_state.midi) return;
 
    m_state.midi->Reset(LeadIn, LeadOut);
+   if (m_clock) m_clock->Locate(m_state.midi->GetSongPositionInMicroseconds());
 
-   m_notes = m_state.midi->Notes();
-   SetupNoteState();
-
-   m_state.stats = SongStatistics();
-   m_state.stats.total_note_count = static_cast<int>(m_notes.size());
+   m_scoring->Reset();
+   m_state.stats = m_scoring->Stats();
 
-   m_current_combo = 0;
+   m_dispatch_timing->Reset();
 
    m_note_offset = 0;
    m_max_allowed_title_alpha = 1.0;
 }
 
 PlayingState::PlayingState(const SharedState &state)
-   : m_state(state), m_keyboard(0), m_first_update(true), m_paused(false), m_any_you_play_tracks(false)
+   : m_state(state), m_keyboard(0), m_first_update(true), m_paused(false), m_any_you_play_tracks(false),
+   m_scoring(0), m_dispatch_timing(0), m_output(0), m_clock(0), m_recorder(0), m_session(0)
 { }
 
 void PlayingState::Init()
@@ -89,7 +100,35 @@ void PlayingState::Init()
    const static microseconds_t DefaultShowDurationMicroseconds = 3250000;
    m_show_duration = DefaultShowDurationMicroseconds;
 
+   // The notes never change from here on, only what becomes of them
+   const TranslatedNoteSet &notes = m_state.midi->Notes();
+   m_notes.assign(notes.begin(), notes.end());
+
    m_keyboard = new KeyboardDisplay(KeyboardSize88, GetStateWidth() - Layout::ScreenMarginX*2, CalcKeyboardHeight());
+   m_scoring = new ScoringEngine(m_notes, m_state.track_properties, m_state.midi_in != 0);
+   m_dispatch_timing = new DispatchTiming(m_state.midi->Tracks().size());
+   m_output = new OutputRouter(m_state.midi_out, m_state.track_properties, m_dispatch_timing);
+   m_output->PrepareSong(*m_state.midi);
+   m_clock = OpenClock(m_state.midi->TempoMap());
+
+   // Keep the take if there's somewhere to put it
+   if (m_state.midi_in && UserSetting::Get(L"Performance Recording", L"").length() > 0) m_recorder = new PerformanceRecorder();
+
+   // Everything needed to play this session back again (see SessionRecorder)
+   if (UserSetting::Get(L"Session Recording", L"").length() > 0)
+   {
+      SessionHeader header;
+      header.screen_width = GetStateWidth();
+      header.screen_height = GetStateHeight();
+      header.song_speed = m_state.song_speed;
+      header.input_count = (m_state.midi_in ? static_cast<int>(m_state.midi_in->Count()) : 0);
+      header.track_properties = m_state.track_properties;
+      header.note_count = m_notes.size();
+      header.song_length = m_state.midi->GetSongLengthInMicroseconds();
+
+      m_session = new SessionRecorder(header);
+      RecordSession(m_session);
+   }
 
    // Hide the mouse cursor while we're playing
    Compatible::HideMouseCursor();
@@ -99,6 +138,21 @@ void PlayingState::Init()
 
 PlayingState::~PlayingState()
 {
+   if (m_session)
+   {
+      m_session->Stats(m_scoring->Stats());
+      RecordSession(0);
+
+      // There is nobody to tell if this fails
+      m_session->WriteFile(UserSetting::Get(L"Session Recording", L""));
+      delete m_session;
+   }
+
+   delete m_recorder;
+   delete m_clock;
+   delete m_output;
+   delete m_dispatch_timing;
+   delete m_scoring;
    Compatible::ShowMouseCursor();
 }
 
@@ -115,7 +169,14 @@ int PlayingState::CalcKeyboardHeight() const
 
 void PlayingState::Play(microseconds_t delta_microseconds)
 {
-   MidiEventListWithTrackId evs = m_state.midi->Update(delta_microseconds);
+   // The song position we're about to advance to "happens" right now.
+   // Anything scheduled before it is already late by the difference.
+   const microseconds_t dispatch_start = Compatible::GetMicroseconds();
+
+   MidiEventMicrosecondList event_times;
+   MidiEventListWithTrackId evs = m_state.midi->Update(delta_microseconds, &event_times);
+   const microseconds_t song_position = m_state.midi->GetSongPositionInMicroseconds();
+   m_output->SongPosition(song_position);
 
    const size_t length = evs.size();
    for (size_t i = 0; i < length; ++i)
@@ -148,34 +209,51 @@ void PlayingState::Play(microseconds_t delta_microseconds)
       if (draw && (ev.Type() == MidiEventType_NoteOn || ev.Type() == MidiEventType_NoteOff))
       {
          int vel = ev.NoteVelocity();
-         const string name = MidiEvent::NoteName(ev.NoteNumber());
+         const Track::TrackColor color = m_state.track_properties[track_id].color;
 
-         m_keyboard->SetKeyActive(name, (vel > 0), m_state.track_properties[track_id].color);
+         if (ev.Type() == MidiEventType_NoteOn && vel > 0) m_keyboard->PressKey(ev.NoteNumber(), color, vel);
+         else m_keyboard->ReleaseKey(ev.NoteNumber(), color);
       }
 
-      if (play && m_state.midi_out) m_state.midi_out->Write(ev);
-   }
-}
-
-double PlayingState::CalculateScoreMultiplier() const
-{
-   const static double MaxMultiplier = 5.0;
-   double multiplier = 1.0;
+      if (play && m_session) m_session->MidiOut(track_id, ev);
 
-   const double combo_addition = m_current_combo / 10.0;
-   multiplier += combo_addition;
+      if (play && m_output->HasOutput(track_id))
+      {
+         // Song time runs at the playback speed, so scale the backlog
+         // back into wall-clock time.  The output's worker records how
+         // late the event was once the device has actually taken it.
+         microseconds_t intended = dispatch_start;
+         if (m_state.song_speed > 0) intended -= (song_position - event_times[i]) * 100 / m_state.song_speed;
 
-   return std::min(MaxMultiplier, multiplier);
+         m_output->Write(track_id, ev, intended);
+      }
+   }
 }
 
-void PlayingState::Listen()
+void PlayingState::Listen(microseconds_t frame_start)
 {
    if (!m_state.midi_in) return;
 
    while (m_state.midi_in->KeepReading())
    {
       microseconds_t cur_time = m_state.midi->GetSongPositionInMicroseconds();
-      MidiEvent ev = m_state.midi_in->Read();
+      const MidiCommInEvent input = m_state.midi_in->Read();
+      MidiEvent ev = input.event;
+
+      // Which device (by position in the group) this came from, so tracks
+      // tied to a particular device only accept that device's notes
+      const int input_device = m_state.midi_in->IndexOf(input.device_id);
+      if (m_session) m_session->MidiIn(input_device, input.event, input.timestamp);
+
+      if (m_recorder)
+      {
+         // The song was at cur_time when the frame started, so work back
+         // from there to where it was when the event actually arrived.
+         microseconds_t song_time = cur_time;
+         if (!m_paused) song_time -= (frame_start - input.timestamp) * m_state.song_speed / 100;
+
+         m_recorder->Record(input, song_time, input_device, cur_time, m_state.song_speed, m_note_offset, !m_paused);
+      }
 
       // Just eat input if we're paused
       if (m_paused) continue;
@@ -186,8 +264,6 @@ void PlayingState::Listen()
       // Octave Sliding
       ev.ShiftNote(m_note_offset);
 
-      string note_name = MidiEvent::NoteName(ev.NoteNumber());
-
       // On key release we have to look for existing "active" notes and turn them off.
       if (ev.Type() == MidiEventType_NoteOff || ev.NoteVelocity() == 0)
       {
@@ -195,99 +271,61 @@ void PlayingState::Listen()
          //       (or even the *same* MIDI file) through another source, we could get the
          //       same NoteId on different channels -- and this code would start behaving
          //       incorrectly.
-         for (ActiveNoteSet::iterator i = m_active_notes.begin(); i != m_active_notes.end(); ++i)
+         ActiveNote key;
+         key.note_id = ev.NoteNumber();
+         key.channel = 0;
+
+         // The key was lit in the color of the note it matched, if any
+         Track::TrackColor note_color = Track::FlatGray;
+
+         ActiveNoteSet::iterator i = m_active_notes.lower_bound(key);
+         if (i != m_active_notes.end() && i->note_id == key.note_id)
          {
-            if (ev.NoteNumber() != i->note_id) continue;
+            note_color = m_state.track_properties[i->track_id].color;
 
             // Play it on the correct channel to turn the note we started
             // previously, off.
             ev.SetChannel(i->channel);
-            if (m_state.midi_out) m_state.midi_out->Write(ev);
+            if (m_session) m_session->MidiOut(i->track_id, ev);
+            m_output->Write(i->track_id, ev);
 
             m_active_notes.erase(i);
-            break;
          }
 
-         m_keyboard->SetKeyActive(note_name, false, Track::FlatGray);
+         m_keyboard->ReleaseKey(ev.NoteNumber(), note_color);
          continue;
       }
 
-      bool any_found = false;
-
-      TranslatedNoteSet::iterator closest_match = m_notes.end();
-      for (TranslatedNoteSet::iterator i = m_notes.begin(); i != m_notes.end(); ++i)
-      {
-         const microseconds_t window_start = i->start - (KeyboardDisplay::NoteWindowLength / 2);
-         const microseconds_t window_end = i->start + (KeyboardDisplay::NoteWindowLength / 2);
-
-         // As soon as we start processing notes that couldn't possibly
-         // have been played yet, we're done.
-         if (window_start > cur_time) break;
-
-         if (i->state != UserPlayable) continue;
-
-         if (window_end > cur_time && i->note_id == ev.NoteNumber())
-         {
-            if (closest_match == m_notes.end())
-            {
-               closest_match = i;
-               continue;
-            }
-
-            microseconds_t this_distance = cur_time - i->start;
-            if (i->start > cur_time) this_distance = i->start - cur_time;
-
-            microseconds_t known_best = cur_time - closest_match->start;
-            if (closest_match->start > cur_time) known_best = closest_match->start - cur_time;
-
-            if (this_distance < known_best) closest_match = i;
-         }
-      }
+      size_t match_id = 0;
+      const bool found = m_scoring->Press(ev.NoteNumber(), input_device, cur_time, m_state.song_speed, &match_id);
 
       Track::TrackColor note_color = Track::FlatGray;
 
-      if (closest_match != m_notes.end())
+      if (found)
       {
-         any_found = true;
-         note_color = m_state.track_properties[closest_match->track_id].color;
+         const TranslatedNote &match = m_notes[match_id];
+
+         note_color = m_state.track_properties[match.track_id].color;
 
          // "Open" this note so we can catch the close later and turn off
          // the note.
          ActiveNote n;
-         n.channel = closest_match->channel;
-         n.note_id = closest_match->note_id;
-         n.velocity = closest_match->velocity;
+         n.channel = match.channel;
+         n.note_id = match.note_id;
+         n.velocity = match.velocity;
+         n.track_id = match.track_id;
          m_active_notes.insert(n);
 
+         if (m_recorder) m_recorder->MatchLast(match);
+
          // Play it
          ev.SetChannel(n.channel);
          ev.SetVelocity(n.velocity);
-         if (m_state.midi_out) m_state.midi_out->Write(ev);
-
-         // Adjust our statistics
-         const static double NoteValue = 100.0;
-         m_state.stats.score += NoteValue * CalculateScoreMultiplier() * (m_state.song_speed / 100.0);
-
-         m_state.stats.notes_user_could_have_played++;
-         m_state.stats.speed_integral += m_state.song_speed;
-
-         m_state.stats.notes_user_actually_played++;
-         m_current_combo++;
-         m_state.stats.longest_combo = max(m_current_combo, m_state.stats.longest_combo);
-
-         TranslatedNote replacement = *closest_match;
-         replacement.state = UserHit;
-         
-         m_notes.erase(closest_match);
-         m_notes.insert(replacement);
-      }
-      else
-      {
-         m_state.stats.stray_notes++;
+         if (m_session) m_session->MidiOut(n.track_id, ev);
+         m_output->Write(n.track_id, ev);
       }
 
-      m_state.stats.total_notes_user_pressed++;
-      m_keyboard->SetKeyActive(note_name, true, note_color);
+      m_keyboard->PressKey(ev.NoteNumber(), note_color, ev.NoteVelocity());
    }
 }
 
@@ -309,6 +347,9 @@ void PlayingState::Update()
    if (double(ms) > stay_ms) m_max_allowed_title_alpha = m_title_alpha;
 
 
+   // The song position below lines up with the start of the frame
+   const microseconds_t frame_start = Compatible::GetMicroseconds();
+
    microseconds_t delta_microseconds = static_cast<microseconds_t>(GetDeltaMilliseconds()) * 1000;
 
    // The 100 term is really paired with the playback speed, but this
@@ -323,49 +364,19 @@ void PlayingState::Update()
    if (!m_first_update)
    {
       Play(delta_microseconds);
-      Listen();
+      Listen(frame_start);
    }
    m_first_update = false;
 
 
    microseconds_t cur_time = m_state.midi->GetSongPositionInMicroseconds();
 
-   // Delete notes that are finished playing (and are no longer available to hit)
-   TranslatedNoteSet::iterator i = m_notes.begin();
-   while (i != m_notes.end())
-   {
-      TranslatedNoteSet::iterator note = i++;
+   // The recording needs to know where these fell among the key presses
+   // to score the take the same way later
+   const size_t missed = m_scoring->Advance(cur_time, m_state.song_speed);
+   if (missed > 0 && m_recorder) m_recorder->RecordMissedNotes(cur_time, m_state.song_speed);
 
-      const microseconds_t window_end = note->start + (KeyboardDisplay::NoteWindowLength / 2);
-
-      if (m_state.midi_in && note->state == UserPlayable && window_end <= cur_time)
-      {
-         TranslatedNote note_copy = *note;
-         note_copy.state = UserMissed;
-         
-         m_notes.erase(note);
-         m_notes.insert(note_copy);
-         
-         // Re-connect the (now-invalid) iterator to the replacement
-         note = m_notes.find(note_copy);
-      }
-
-      if (note->start > cur_time) break;
-
-      if (note->end < cur_time && window_end < cur_time)
-      {
-         if (note->state == UserMissed)
-         {
-            // They missed a note, reset the combo counter
-            m_current_combo = 0;
-
-            m_state.stats.notes_user_could_have_played++;
-            m_state.stats.speed_integral += m_state.song_speed;
-         }
-
-         m_notes.erase(note);
-      }
-   }
+   m_state.stats = m_scoring->Stats();
 
    if(IsKeyPressed(KeyPlus))
    {
@@ -410,9 +421,24 @@ void PlayingState::Update()
       m_paused = !m_paused;
    }
 
+   // Switches between merged and exact notes, for comparing the two
+   if (IsKeyPressed(KeyF7))
+   {
+      m_keyboard->SetMergeNotes(!m_keyboard->GetMergeNotes());
+   }
+
+   // ...and between a retained keyboard and one drawn every frame
+   if (IsKeyPressed(KeyF8))
+   {
+      m_keyboard->SetRetainKeys(!m_keyboard->GetRetainKeys());
+   }
+
+   // After the speed and pause keys so a pause stops the clock right away
+   if (m_clock) m_clock->Update(frame_start, m_state.midi->GetSongPositionInMicroseconds(), m_state.song_speed, m_paused);
+
    if (IsKeyPressed(KeyEscape))
    {
-      if (m_state.midi_out) m_state.midi_out->Reset();
+      m_output->Reset();
       if (m_state.midi_in) m_state.midi_in->Reset();
 
       ChangeState(new TrackSelectionState(m_state));
@@ -421,7 +447,14 @@ void PlayingState::Update()
 
    if (m_state.midi->IsSongOver())
    {
-      if (m_state.midi_out) m_state.midi_out->Reset();
+      // Optionally dump the event timing of this run for later analysis
+      const wstring timing_log = UserSetting::Get(L"Dispatch Timing Log", L"");
+      if (timing_log.length() > 0) m_dispatch_timing->WriteCsv(timing_log);
+
+      // This only queues the take; it's written out in the background
+      if (m_recorder) m_recorder->Finish(UserSetting::Get(L"Performance Recording", L""));
+
+      m_output->Reset();
       if (m_state.midi_in) m_state.midi_in->Reset();
 
       if (m_state.midi_in && m_any_you_play_tracks) ChangeState(new StatsState(m_state));
@@ -435,15 +468,16 @@ void PlayingState::Draw(Renderer &renderer) const
 {
    const Tga *key_tex[3] = { GetTexture(PlayKeyRail),
                              GetTexture(PlayKeyShadow),
-                             GetTexture(PlayKeysBlack, true) };
+                             GetTexture(PlayKeysBlack) };
 
-   const Tga *note_tex[4] = { GetTexture(PlayNotesWhiteShadow, true),
-                              GetTexture(PlayNotesBlackShadow, true),
-                              GetTexture(PlayNotesWhiteColor, true),
-                              GetTexture(PlayNotesBlackColor, true) };
+   const Tga *note_tex[4] = { GetTexture(PlayNotesWhiteShadow),
+                              GetTexture(PlayNotesBlackShadow),
+                              GetTexture(PlayNotesWhiteColor),
+                              GetTexture(PlayNotesBlackColor) };
    renderer.ForceTexture(0);
 
-   m_keyboard->Draw(renderer, key_tex, note_tex, Layout::ScreenMarginX, 0, m_notes, m_show_duration,
+   m_keyboard->Draw(renderer, key_tex, note_tex, Layout::ScreenMarginX, 0, m_notes, m_scoring->NoteStates(),
+      m_scoring->HeldNotes(), m_scoring->FirstLiveNote(), m_show_duration,
       m_state.midi->GetSongPositionInMicroseconds(), m_state.track_properties);
 
    wstring title_text = m_state.song_title;
@@ -475,7 +509,7 @@ void PlayingState::Draw(Renderer &renderer) const
    renderer.DrawTga(GetTexture(PlayStatus),  Layout::ScreenMarginX - 1,   text_y);
    renderer.DrawTga(GetTexture(PlayStatus2), Layout::ScreenMarginX + 273, text_y);
 
-   wstring multiplier_text = WSTRING(fixed << setprecision(1) << CalculateScoreMultiplier());
+   wstring multiplier_text = WSTRING(fixed << setprecision(1) << m_scoring->Multiplier());
    wstring speed_text = WSTRING(m_state.song_speed << "%");
 
    TextWriter score(Layout::ScreenMarginX + 92, text_y + 3, renderer, false, Layout::ScoreFontSize);
@@ -534,16 +568,56 @@ void PlayingState::Draw(Renderer &renderer) const
    }
 
    // Show the combo
-   if (m_current_combo > 5)
+   const int combo = m_scoring->Combo();
+   if (combo > 5)
    {
       int combo_font_size = 20;
-      combo_font_size += (m_current_combo / 10);
+      combo_font_size += (combo / 10);
 
       int combo_x = GetStateWidth() / 2;
       int combo_y = GetStateHeight() - CalcKeyboardHeight() + 30 - (combo_font_size/2);
 
       TextWriter combo_text(combo_x, combo_y, renderer, true, combo_font_size);
-      combo_text << WSTRING(m_current_combo << L" Combo!");
+      combo_text << WSTRING(combo << L" Combo!");
    }
+
+   if (IsOverlayVisible()) DrawDispatchTiming(renderer);
+}
+
+static wstring FormatTimingRow(const wstring &label, const LatencyHistogram &h)
+{
+   return WSTRING(label << L":  " << fixed << setprecision(1)
+      << (h.Percentile(0.50) / 1000.0) << L" / "
+      << (h.Percentile(0.99) / 1000.0) << L" / "
+      << (h.Max() / 1000.0) << L" ms  (" << h.Count() << L")");
+}
+
+void PlayingState::DrawDispatchTiming(Renderer &renderer) const
+{
+   // The FPS counter is drawn by the state manager in the top-left
+   // corner, so start a line below it.
+   TextWriter out(0, 16, renderer, false, Layout::SmallFontSize);
+   out << Text(L"Output lateness p50 / p99 / max", Gray) << newline;
+   out << Text(FormatTimingRow(L"All", m_dispatch_timing->Total()), White) << newline;
+
+   for (int type = 0; type < DispatchTiming::TypeCount; ++type)
+   {
+      const LatencyHistogram &h = m_dispatch_timing->ForType(static_cast<MidiEventType>(type));
+      if (h.Count() == 0) continue;
+
+      out << Text(FormatTimingRow(GetMidiEventTypeDescription(static_cast<MidiEventType>(type)), h), Gray) << newline;
+   }
+
+   for (size_t t = 0; t < m_dispatch_timing->TrackCount(); ++t)
+   {
+      const LatencyHistogram &h = m_dispatch_timing->ForTrack(t);
+      if (h.Count() == 0) continue;
+
+      const Color c = Track::ColorNoteWhite[m_state.track_properties[t].color];
+      out << Text(FormatTimingRow(WSTRING(L"Track " << t), h), c) << newline;
+   }
+
+   const vector<wstring> status = m_output->Status();
+   for (size_t i = 0; i < status.size(); ++i) out << Text(status[i], Gray) << newline;
 }
 
@@ -16,7 +16,13 @@
 struct TrackProperties;
 class Midi;
 class MidiCommOut;
-class MidiCommIn;
+class MidiCommInGroup;
+class DispatchTiming;
+class OutputRouter;
+class MidiClock;
+class PerformanceRecorder;
+class ScoringEngine;
+class SessionRecorder;
 
 struct ActiveNote
 {
@@ -34,6 +40,9 @@ struct ActiveNote
    NoteId note_id;
    unsigned char channel;
    int velocity;
+
+   // So the release goes to the same output as the press
+   size_t track_id;
 };
 typedef std::set<ActiveNote, ActiveNote> ActiveNoteSet;
 
@@ -48,32 +57,53 @@ protected:
    virtual void Update();
    virtual void Draw(Renderer &renderer) const;
 
+   // Everything holds still while paused
+   virtual bool NeedsContinuousFrames() const { return !m_paused || m_first_update; }
+
 private:
 
    int CalcKeyboardHeight() const;
-   void SetupNoteState();
 
    void ResetSong();
    void Play(microseconds_t delta_microseconds);
-   void Listen();
+   void Listen(microseconds_t frame_start);
 
-   double CalculateScoreMultiplier() const;
+   void DrawDispatchTiming(Renderer &renderer) const;
 
    bool m_paused;
 
    KeyboardDisplay *m_keyboard;
    microseconds_t m_show_duration;
-   TranslatedNoteSet m_notes;
+
+   TranslatedNoteList m_notes;
 
    bool m_any_you_play_tracks;
    size_t m_look_ahead_you_play_note_count;
 
+   // Decides what each key press hit, and keeps the score
+   ScoringEngine *m_scoring;
+
    ActiveNoteSet m_active_notes;
 
+   // How late our outgoing events are (shown in the F6 overlay)
+   DispatchTiming *m_dispatch_timing;
+
+   // Everything we play goes through here rather than straight to
+   // m_state.midi_out, so each track reaches its own output device.
+   OutputRouter *m_output;
+
+   // Null unless a clock output is configured
+   MidiClock *m_clock;
+
+   // Null unless the player's input is being saved
+   PerformanceRecorder *m_recorder;
+
+   // Null unless the whole session is being saved for replay
+   SessionRecorder *m_session;
+
    bool m_first_update;
 
    SharedState m_state;
-   int m_current_combo;
 
    double m_title_alpha;
    double m_max_allowed_title_alpha;
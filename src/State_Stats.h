@@ -20,6 +20,7 @@ protected:
    virtual void Init();
    virtual void Update();
    virtual void Draw(Renderer &renderer) const;
+   virtual bool NeedsContinuousFrames() const { return false; }
 
 private:
    ButtonState m_continue_button;
@@ -7,6 +7,7 @@
 
 #include "version.h"
 #include "CompatibleSystem.h"
+#include "PianoGameError.h"
 
 #include "MenuLayout.h"
 #include "UserSettings.h"
@@ -25,6 +26,43 @@ const static wstring OutputKeySpecialDisabled = L"[no output device]";
 
 const static wstring InputDeviceKey = L"Last Input Device";
 const static wstring InputKeySpecialDisabled = L"[no input device]";
+const static wstring InputKeySpecialAll = L"[all input devices]";
+
+// Returns the id of the previously used output device or, failing that,
+// the first available one (unless the user turned output off).  Returns
+// -1 if there is nothing to choose.
+static int ChooseOutputDevice(const MidiCommDescriptionList &devices)
+{
+   const wstring last_output_device = UserSetting::Get(OutputDeviceKey, L"");
+   for (size_t i = 0; i < devices.size(); ++i)
+   {
+      if (devices[i].name == last_output_device) return static_cast<int>(devices[i].id);
+   }
+
+   if (last_output_device != OutputKeySpecialDisabled && devices.size() > 0) return static_cast<int>(devices[0].id);
+   return -1;
+}
+
+// Returns the id of the previously used input device (possibly
+// AllInputDevicesId), or -1 if it isn't available.  Leaving input disabled
+// by default is completely acceptable.
+static int ChooseInputDevice(const MidiCommDescriptionList &devices)
+{
+   const wstring last_input_device = UserSetting::Get(InputDeviceKey, L"");
+   if (last_input_device == InputKeySpecialAll)
+   {
+      if (devices.size() > 1) return AllInputDevicesId;
+      if (devices.size() == 1) return static_cast<int>(devices[0].id);
+      return -1;
+   }
+
+   for (size_t i = 0; i < devices.size(); ++i)
+   {
+      if (devices[i].name == last_input_device) return static_cast<int>(devices[i].id);
+   }
+
+   return -1;
+}
 
 TitleState::~TitleState()
 {
@@ -43,8 +81,13 @@ void TitleState::Init()
       GetStateHeight() - Layout::ScreenMarginY/2 - Layout::ButtonHeight/2,
       Layout::ButtonWidth, Layout::ButtonHeight);
 
-   wstring last_output_device = UserSetting::Get(OutputDeviceKey, L"");
-   wstring last_input_device = UserSetting::Get(InputDeviceKey, L"");
+   // Device enumeration happens in the background.  On a cold start these
+   // may still be empty, in which case Update() will pick the devices up
+   // as soon as they're available.  (Read the version first so we can't
+   // miss a change that lands in between.)
+   m_device_list_version = MidiCommDevices::GetVersion();
+   const MidiCommDescriptionList output_devices = MidiCommOut::GetDeviceList();
+   const MidiCommDescriptionList input_devices = MidiCommIn::GetDeviceList();
 
    // midi_out could be in one of three states right now:
    //    1. We just started and were passed a null MidiCommOut pointer
@@ -53,63 +96,28 @@ void TitleState::Init()
    //    3. a valid MidiCommOut we constructed previously.
    if (!m_state.midi_out)
    {
-      // Try to find the previously used device
-      MidiCommDescriptionList devices = MidiCommOut::GetDeviceList();
-      for (size_t i = 0; i < devices.size(); ++i)
-      {
-         if (devices[i].name == last_output_device)
-         {
-            m_state.midi_out = new MidiCommOut(devices[i].id);
-         }
-      }
-
-      // Next, if we couldn't find a previously used device,
-      // use the first one
-      if (last_output_device != OutputKeySpecialDisabled && !m_state.midi_out && devices.size() > 0)
-      {
-         m_state.midi_out = new MidiCommOut(devices[0].id);
-      }
+      const int id = ChooseOutputDevice(output_devices);
+      if (id >= 0) m_state.midi_out = new MidiCommOut(id);
    }
 
    if (!m_state.midi_in)
    {
-      // Try to find the previously used device
-      MidiCommDescriptionList devices = MidiCommIn::GetDeviceList();
-      for (size_t i = 0; i < devices.size(); ++i)
-      {
-         if (devices[i].name == last_input_device)
-         {
-            try
-            {
-               m_state.midi_in = new MidiCommIn(devices[i].id);
-            }
-            catch (MidiErrorCode)
-            {
-               m_state.midi_in = 0;
-            }
-         }
-      }
-
-      // If we couldn't find the previously used device,
-      // disabling by default (i.e. leaving it null) is
-      // completely acceptable.
+      OpenInput(ChooseInputDevice(input_devices));
+   }
+   else
+   {
+      m_open_input_id = static_cast<int>(m_state.midi_in->Device(0).GetDeviceDescription().id);
+      if (m_state.midi_in->Count() > 1) m_open_input_id = AllInputDevicesId;
    }
 
    int output_device_id = -1;
-   if (last_output_device == OutputKeySpecialDisabled) output_device_id = -1;
-
    if (m_state.midi_out)
    {
       output_device_id = m_state.midi_out->GetDeviceDescription().id;
       m_state.midi_out->Reset();
    }
 
-   int input_device_id = -1;
-   if (m_state.midi_in)
-   {
-      input_device_id = m_state.midi_in->GetDeviceDescription().id;
-      m_state.midi_in->Reset();
-   }
+   if (m_state.midi_in) m_state.midi_in->Reset();
 
    const bool compress_height = (GetStateHeight() < 750);
    const int initial_y = (compress_height ? 230 : 360);
@@ -118,14 +126,19 @@ void TitleState::Init()
    m_file_tile = new StringTile((GetStateWidth() - StringTileWidth) / 2, initial_y + each_y*0, GetTexture(SongBox));
    m_file_tile->SetString(m_state.song_title);
 
-   const MidiCommDescriptionList output_devices = MidiCommOut::GetDeviceList();
-   const MidiCommDescriptionList input_devices = MidiCommIn::GetDeviceList();
    m_output_tile = new DeviceTile((GetStateWidth() - DeviceTileWidth) / 2, initial_y + each_y*1, output_device_id, DeviceTileOutput, output_devices, GetTexture(InterfaceButtons), GetTexture(OutputBox));
-   m_input_tile = new DeviceTile((GetStateWidth() - DeviceTileWidth) / 2, initial_y + each_y*2, input_device_id, DeviceTileInput, input_devices, GetTexture(InterfaceButtons), GetTexture(InputBox));
+   m_input_tile = new DeviceTile((GetStateWidth() - DeviceTileWidth) / 2, initial_y + each_y*2, m_open_input_id, DeviceTileInput, input_devices, GetTexture(InterfaceButtons), GetTexture(InputBox));
 }
 
 void TitleState::Update()
 {
+   const unsigned long device_list_version = MidiCommDevices::GetVersion();
+   if (device_list_version != m_device_list_version)
+   {
+      m_device_list_version = device_list_version;
+      RefreshDeviceLists();
+   }
+
    MouseInfo mouse = Mouse();
    
    if (m_skip_next_mouse_up)
@@ -201,7 +214,8 @@ void TitleState::Update()
 
    // Check to see if we need to switch to a newly selected output device
    int output_id = m_output_tile->GetDeviceId();
-   if (!m_state.midi_out || output_id != static_cast<int>(m_state.midi_out->GetDeviceDescription().id))
+   int open_output_id = (m_state.midi_out ? static_cast<int>(m_state.midi_out->GetDeviceDescription().id) : -1);
+   if (output_id != open_output_id)
    {
       if (m_state.midi_out) m_state.midi_out->Reset();
 
@@ -244,27 +258,14 @@ void TitleState::Update()
 
 
    int input_id = m_input_tile->GetDeviceId();
-   if (!m_state.midi_in || input_id != static_cast<int>(m_state.midi_in->GetDeviceDescription().id))
+   if (input_id != m_open_input_id)
    {
-      if (m_state.midi_in) m_state.midi_in->Reset();
-      m_last_input_note_name = "";
-
-      delete m_state.midi_in;
-      m_state.midi_in = 0;
-
-      if (input_id >= 0)
+      if (OpenInput(input_id))
       {
-         try
-         {
-            m_state.midi_in = new MidiCommIn(input_id);
-            UserSetting::Set(InputDeviceKey, m_state.midi_in->GetDeviceDescription().name);
-         }
-         catch (MidiErrorCode)
-         {
-            m_state.midi_in = 0;
-         }
+         if (input_id == AllInputDevicesId) UserSetting::Set(InputDeviceKey, InputKeySpecialAll);
+         else UserSetting::Set(InputDeviceKey, m_state.midi_in->Device(0).GetDeviceDescription().name);
       }
-      else
+      else if (input_id == -1)
       {
          UserSetting::Set(InputDeviceKey, InputKeySpecialDisabled);
       }
@@ -275,7 +276,7 @@ void TitleState::Update()
       // Read note events to display on screen
       while (m_state.midi_in->KeepReading())
       {
-         MidiEvent ev = m_state.midi_in->Read();
+         MidiEvent ev = m_state.midi_in->Read().event;
          if (ev.Type() == MidiEventType_NoteOff || ev.Type() == MidiEventType_NoteOn)
          {
             string note = MidiEvent::NoteName(ev.NoteNumber());
@@ -350,6 +351,82 @@ void TitleState::Update()
 
 }
 
+void TitleState::RefreshDeviceLists()
+{
+   const MidiCommDescriptionList output_devices = MidiCommOut::GetDeviceList();
+   const MidiCommDescriptionList input_devices = MidiCommIn::GetDeviceList();
+
+   m_output_tile->SetDeviceList(output_devices);
+   m_input_tile->SetDeviceList(input_devices);
+
+   // If an open device was unplugged, close it here rather than letting
+   // Update() do it.  That way the user's choice isn't overwritten with
+   // "disabled" and the device is picked up again if it comes back.
+   if (m_state.midi_out && m_output_tile->GetDeviceId() < 0)
+   {
+      m_output_tile->TurnOffPreview();
+
+      delete m_state.midi_out;
+      m_state.midi_out = 0;
+   }
+
+   // "All devices" is reopened whenever the list changes so it picks up
+   // new arrivals (and drops anything that left).
+   if (m_state.midi_in && (m_input_tile->GetDeviceId() == -1 || m_open_input_id == AllInputDevicesId))
+   {
+      CloseInput();
+   }
+
+   // Give the previously used devices another chance in case they weren't
+   // available yet (or at all) when we last looked.
+   if (!m_state.midi_out) m_output_tile->SetDeviceId(ChooseOutputDevice(output_devices));
+   if (!m_state.midi_in) m_input_tile->SetDeviceId(ChooseInputDevice(input_devices));
+}
+
+void TitleState::CloseInput()
+{
+   m_last_input_note_name = "";
+
+   delete m_state.midi_in;
+   m_state.midi_in = 0;
+   m_open_input_id = -1;
+}
+
+bool TitleState::OpenInput(int id)
+{
+   CloseInput();
+
+   // Even if we fail below, don't keep retrying the same choice every frame
+   m_open_input_id = id;
+   if (id == -1) return false;
+
+   MidiCommInGroup *group = new MidiCommInGroup();
+
+   const MidiCommDescriptionList devices = MidiCommIn::GetDeviceList();
+   for (size_t i = 0; i < devices.size(); ++i)
+   {
+      if (id != AllInputDevicesId && static_cast<int>(devices[i].id) != id) continue;
+
+      // A device that won't open (e.g. because another program has it)
+      // shouldn't keep the others in the group from working.
+      try
+      {
+         group->Add(new MidiCommIn(devices[i].id));
+      }
+      catch (const MidiError &) { }
+      catch (const PianoGameError &) { }
+   }
+
+   if (group->Count() == 0)
+   {
+      delete group;
+      return false;
+   }
+
+   m_state.midi_in = group;
+   return true;
+}
+
 void TitleState::PlayDevicePreview(microseconds_t delta_microseconds)
 {
    if (!m_output_tile->IsPreviewOn()) return;
@@ -363,6 +440,13 @@ void TitleState::PlayDevicePreview(microseconds_t delta_microseconds)
    }
 }
 
+bool TitleState::NeedsContinuousFrames() const
+{
+   // The output test plays a song; the input test only changes when MIDI
+   // arrives, which wakes the main loop on its own
+   return (m_state.midi_out && m_output_tile && m_output_tile->IsPreviewOn());
+}
+
 void TitleState::Draw(Renderer &renderer) const
 {
    const bool compress_height = (GetStateHeight() < 750);
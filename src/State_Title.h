@@ -15,6 +15,7 @@
 
 class Midi;
 class MidiCommOut;
+class MidiCommInGroup;
 
 class Tga;
 
@@ -25,7 +26,8 @@ public:
    // screen pick a device for you.
    TitleState(const SharedState &state)
       : m_state(state), m_output_tile(0), m_input_tile(0),
-        m_file_tile(0), m_skip_next_mouse_up(false)
+        m_file_tile(0), m_skip_next_mouse_up(false), m_device_list_version(0),
+        m_open_input_id(-1)
    { }
 
    ~TitleState();
@@ -34,10 +36,19 @@ protected:
    virtual void Init();
    virtual void Update();
    virtual void Draw(Renderer &renderer) const;
+   virtual bool NeedsContinuousFrames() const;
 
 private:
    void PlayDevicePreview(microseconds_t delta_microseconds);
 
+   // Picks up changes to the (asynchronously enumerated) device lists
+   void RefreshDeviceLists();
+
+   // Replaces m_state.midi_in with the device(s) for the given input
+   // tile id.  Returns false if nothing could be opened.
+   bool OpenInput(int id);
+   void CloseInput();
+
    ButtonState m_continue_button;
    ButtonState m_back_button;
 
@@ -51,6 +62,11 @@ private:
    StringTile *m_file_tile;
 
    bool m_skip_next_mouse_up;
+
+   unsigned long m_device_list_version;
+
+   // The input tile id that m_state.midi_in was opened for
+   int m_open_input_id;
 };
 
 #endif
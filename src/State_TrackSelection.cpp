@@ -9,6 +9,7 @@
 #include "MenuLayout.h"
 #include "Renderer.h"
 #include "Textures.h"
+#include "string_util.h"
 
 #include "libmidi/Midi.h"
 #include "libmidi/MidiUtil.h"
@@ -68,6 +69,21 @@ void TrackSelectionState::Init()
 
    const static int starting_y = 100;
 
+   // With more than one input device open, each "You Play" track can be
+   // tied to a particular one (e.g. for duets).
+   const int input_device_count = (m_state.midi_in ? static_cast<int>(m_state.midi_in->Count()) : 0);
+
+   // Any output device other than the main one can be picked per track
+   // (e.g. drums on one synth, strings on another).
+   MidiCommDescriptionList other_outputs = MidiCommOut::GetDeviceList();
+   for (size_t i = 0; i < other_outputs.size(); ++i)
+   {
+      if (!m_state.midi_out || other_outputs[i].id != m_state.midi_out->GetDeviceDescription().id) continue;
+
+      other_outputs.erase(other_outputs.begin() + i);
+      break;
+   }
+
    int tiles_on_this_line = 0;
    int tiles_on_this_page = 0;
    int current_y = starting_y;
@@ -83,15 +99,20 @@ void TrackSelectionState::Init()
       if (t.IsPercussion()) mode = Track::ModePlayedButHidden;
 
       Track::TrackColor color = static_cast<Track::TrackColor>((m_track_tiles.size()) % Track::UserSelectableColorCount);
+      int input_device = -1;
+      int output_device = -1;
 
       // If we came back here from StatePlaying, reload all our preferences
       if (m_state.track_properties.size() > i)
       {
          color = m_state.track_properties[i].color;
          mode = m_state.track_properties[i].mode;
+         input_device = m_state.track_properties[i].input_device;
+         output_device = m_state.track_properties[i].output_device;
       }
 
-      TrackTile tile(x, y, i, color, mode);
+      TrackTile tile(x, y, i, color, mode, input_device, input_device_count);
+      tile.SetOutputChoices(other_outputs, output_device);
 
       m_track_tiles.push_back(tile);
 
@@ -126,6 +147,8 @@ std::vector<Track::Properties> TrackSelectionState::BuildTrackProperties() const
    {
       props[i->GetTrackId()].color = i->GetColor();
       props[i->GetTrackId()].mode = i->GetMode();
+      props[i->GetTrackId()].input_device = i->GetInputDevice();
+      props[i->GetTrackId()].output_device = i->GetOutputDevice();
    }
 
    return props;
@@ -201,7 +224,13 @@ void TrackSelectionState::Update()
          case Track::ModeNotPlayed: m_tooltip = L"Track won't be played or shown during the game."; break;
          case Track::ModePlayedAutomatically: m_tooltip = L"Track will be played automatically by the game."; break;
          case Track::ModePlayedButHidden: m_tooltip = L"Track will be played automatically by the game, but also hidden from view."; break;
-         case Track::ModeYouPlay: m_tooltip = L"'You Play' means you want to play this track yourself."; break;
+         case Track::ModeYouPlay:
+            m_tooltip = L"'You Play' means you want to play this track yourself.";
+            if (t.GetInputDevice() >= 0)
+            {
+               m_tooltip = WSTRING(L"Only notes from '" << m_state.midi_in->Device(t.GetInputDevice()).GetDeviceDescription().name << L"' count for this track.");
+            }
+            break;
          }
       }
 
@@ -212,6 +241,7 @@ void TrackSelectionState::Update()
       }
 
       if (t.ButtonColor().hovering) m_tooltip = L"Pick a color for this track's notes.";
+      if (t.HasOutputChoices() && t.ButtonOutput().hovering) m_tooltip = L"Click to choose which output device plays this track.";
 
       if (t.HitPreviewButton())
       {
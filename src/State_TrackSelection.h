@@ -24,6 +24,9 @@ protected:
    virtual void Update();
    virtual void Draw(Renderer &renderer) const;
 
+   // Only while a track preview is playing
+   virtual bool NeedsContinuousFrames() const { return m_preview_on; }
+
 private:
    void PlayTrackPreview(microseconds_t additional_time);
    std::vector<Track::Properties> BuildTrackProperties() const;
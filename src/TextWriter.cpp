@@ -9,11 +9,13 @@
 #include "PianoGameError.h"
 #include "os_graphics.h"
 
+#include <algorithm>
+
 #ifdef WIN32
 // TODO: This should be deleted at shutdown
 static std::map<int, HFONT> font_handle_lookup;
 static int next_call_list_start = 1;
-#else
+#elif defined __APPLE__
 // TODO: This should be deleted at shutdown
 
 GLuint Texture2DCreateFromString(const GLchar * const pString,
@@ -100,6 +102,24 @@ TextWriter& TextWriter::next_line()
    return *this;
 }
 
+// The software rasterizer has no fonts, so each character is drawn as a
+// solid block about the size of its ink.  That keeps the layout, and the
+// number of pixels touched, close to the real thing.
+static void DrawTextBlocks(const Renderer &writer_renderer, const std::string &text, int x, int y, int size, Color color)
+{
+   // Text positions already include the renderer's offset
+   Renderer renderer = writer_renderer;
+   renderer.ResetOffset();
+   renderer.SetColor(color);
+
+   const int advance = std::max(size * 6 / 10, 1);
+   for (size_t i = 0; i < text.length(); ++i)
+   {
+      if (text[i] == ' ') continue;
+      renderer.DrawQuad(x + static_cast<int>(i) * advance + advance / 8, y + size / 4, advance * 3 / 4, size * 3 / 4);
+   }
+}
+
 TextWriter& Text::operator<<(TextWriter& tw) const
 {
    int draw_x;
@@ -108,7 +128,17 @@ TextWriter& Text::operator<<(TextWriter& tw) const
     // TODO: This isn't Unicode!
     std::string narrow(m_text.begin(), m_text.end());
 
-#ifndef WIN32
+   if (Renderer::GetSoftwareRasterizer())
+   {
+      draw_x = static_cast<int>(narrow.length()) * tw.size * 6 / 10;
+      draw_y = tw.size;
+      calculate_position_and_advance_cursor(tw, &draw_x, &draw_y);
+
+      DrawTextBlocks(tw.renderer, narrow, draw_x, draw_y, tw.size, m_color);
+      return tw;
+   }
+
+#ifdef __APPLE__
 
    CGFloat color[4] = {m_color.r / 255.0f, m_color.g / 255.0f, m_color.b / 255.0f, m_color.a / 255.0f};
    CGSize size;
@@ -118,18 +148,26 @@ TextWriter& Text::operator<<(TextWriter& tw) const
     draw_x = size.width;
     draw_y = size.height;
 
+#elif !defined WIN32
+
+   // Headless builds have no font rasterizer.  Approximate the metrics
+   // of a typical proportional font so layout still behaves.
+   draw_x = static_cast<int>(narrow.length()) * tw.size * 6 / 10;
+   draw_y = tw.size;
+
 #endif
    calculate_position_and_advance_cursor(tw, &draw_x, &draw_y);
 
    
    glPushMatrix();
 #ifdef WIN32
+    Renderer::Flush();
     glBindTexture(GL_TEXTURE_2D, 0);
     tw.renderer.SetColor(m_color);
     glListBase(font_size_lookup[tw.size]);
     glRasterPos2i(draw_x, draw_y + tw.size);
     glCallLists(static_cast<int>(narrow.length()), GL_UNSIGNED_BYTE, narrow.c_str());
-#else
+#elif defined __APPLE__
     tw.renderer.DrawTextTextureQuad(texture, draw_x, draw_y, size.width, size.height);
 
     //glDeleteTextures(1, &texture);
@@ -164,10 +202,15 @@ void Text::calculate_position_and_advance_cursor(TextWriter &tw, int *out_x, int
    // Return the hdc settings to their previous setting
    SelectObject(c, previous_font);
    SetMapMode(c, previous_map_mode);
-#else
+#elif defined __APPLE__
 
     Rect drawing_rect = { tw.y, tw.x, tw.y + *out_y, tw.x + *out_x};
 
+#else
+
+   struct { int top, left, bottom, right; } drawing_rect = { tw.y, tw.x, tw.y + *out_y, tw.x + *out_x };
+   tw.last_line_height = *out_y;
+
 #endif
 
     // Update the text-writer with post-draw coordinates
@@ -197,6 +240,8 @@ TextWriter& operator<<(TextWriter& tw, const unsigned int& i)  { return tw << Te
 TextWriter& operator<<(TextWriter& tw, const long& l)          { return tw << Text(l, White); }
 TextWriter& operator<<(TextWriter& tw, const unsigned long& l) { return tw << Text(l, White); }
 
+#ifdef __APPLE__
+
 // Create a bitmap context from a string, font, justification, and font size
 static CGContextRef CGContextCreateFromAttributedString(CFAttributedStringRef pAttrString,
                                                         const CFRange& rRange,
@@ -581,7 +626,4 @@ GLuint Texture2DCreateFromString(const GLchar * const pString,
     return nTID;
 } // GLUTexture2DCreateFromString
 
-
-
-
-
+#endif
@@ -101,7 +101,7 @@ private:
    
    Color m_color;
    std::wstring m_text;
-#ifndef WIN32
+#ifdef __APPLE__
     CGSize size;
     unsigned int textureId;
 #endif
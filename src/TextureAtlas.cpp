@@ -0,0 +1,161 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "TextureAtlas.h"
+#include "Renderer.h"
+#include "PianoGameError.h"
+#include "os_graphics.h"
+
+#include <algorithm>
+using namespace std;
+
+// Pixels of repeated edge around each image
+const static unsigned int Gutter = 2;
+
+// Big enough for everything the game draws on two pages (one per kind of
+// filtering), and small enough for any card that runs the game
+const static unsigned int MaxPageSize = 2048;
+
+static unsigned int NextPowerOfTwo(unsigned int n)
+{
+   unsigned int p = 1;
+   while (p < n) p <<= 1;
+   return p;
+}
+
+// Tallest first, which keeps the shelves tight
+struct TallerImage
+{
+   TallerImage(const vector<TgaPixels> &pixels) : pixels(pixels) { }
+   bool operator()(size_t a, size_t b) const { return pixels[a].height > pixels[b].height; }
+
+   const vector<TgaPixels> &pixels;
+};
+
+// Copies the image to (x, y) on the page, along with its gutter
+static void Blit(const TgaPixels &image, vector<unsigned char> &page, unsigned int page_width, unsigned int x, unsigned int y)
+{
+   const int w = static_cast<int>(image.width);
+   const int h = static_cast<int>(image.height);
+   const int g = static_cast<int>(Gutter);
+
+   for (int row = -g; row < h + g; ++row)
+   {
+      const int src_row = min(max(row, 0), h - 1);
+      unsigned char *dest = &page[((y + row) * page_width + (x - g)) * 4];
+
+      for (int col = -g; col < w + g; ++col)
+      {
+         const int src_col = min(max(col, 0), w - 1);
+         const unsigned char *src = &image.rgba[(src_row * w + src_col) * 4];
+
+         dest[0] = src[0];
+         dest[1] = src[1];
+         dest[2] = src[2];
+         dest[3] = src[3];
+         dest += 4;
+      }
+   }
+}
+
+TextureAtlas::TextureAtlas(const wchar_t *const *resource_names, const bool *smooth, size_t count) : m_images(count, 0)
+{
+   vector<TgaPixels> pixels(count);
+   vector<size_t> sharp_images;
+   vector<size_t> smooth_images;
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      Tga::LoadPixels(resource_names[i], &pixels[i]);
+
+      if (smooth[i]) smooth_images.push_back(i);
+      else sharp_images.push_back(i);
+   }
+
+   unsigned int page_size = MaxPageSize;
+   const unsigned int max_size = Renderer::MaxTextureSize();
+   if (max_size > 0) page_size = min(page_size, max_size);
+
+   Pack(sharp_images, pixels, false, page_size);
+   Pack(smooth_images, pixels, true, page_size);
+}
+
+TextureAtlas::~TextureAtlas()
+{
+   for (size_t i = 0; i < m_images.size(); ++i) delete m_images[i];
+   for (size_t i = 0; i < m_pages.size(); ++i) Renderer::DeleteTexture(m_pages[i]);
+}
+
+void TextureAtlas::Pack(vector<size_t> which, const vector<TgaPixels> &pixels, bool smooth, unsigned int page_size)
+{
+   stable_sort(which.begin(), which.end(), TallerImage(pixels));
+
+   size_t next = 0;
+   while (next < which.size())
+   {
+      // Fill shelves left to right, top to bottom, until the page is full
+      vector<unsigned int> xs;
+      vector<unsigned int> ys;
+
+      unsigned int x = 0;
+      unsigned int y = 0;
+      unsigned int shelf_height = 0;
+      unsigned int used_width = 0;
+
+      size_t end = next;
+      for (; end < which.size(); ++end)
+      {
+         const TgaPixels &p = pixels[which[end]];
+         const unsigned int w = p.width + Gutter * 2;
+         const unsigned int h = p.height + Gutter * 2;
+         if (w > page_size || h > page_size) throw PianoGameError(L"Image is too large for a texture atlas page.");
+
+         if (x + w > page_size)
+         {
+            y += shelf_height;
+            x = 0;
+            shelf_height = 0;
+         }
+         if (y + h > page_size) break;
+
+         xs.push_back(x + Gutter);
+         ys.push_back(y + Gutter);
+
+         x += w;
+         shelf_height = max(shelf_height, h);
+         used_width = max(used_width, x);
+      }
+
+      // Textures have to be powers of two, but needn't be square
+      const unsigned int page_width = NextPowerOfTwo(used_width);
+      const unsigned int page_height = NextPowerOfTwo(y + shelf_height);
+
+      vector<unsigned char> page(page_width * page_height * 4, 0);
+      for (size_t i = next; i < end; ++i) Blit(pixels[which[i]], page, page_width, xs[i - next], ys[i - next]);
+
+      const GLint filter = smooth ? GL_LINEAR : GL_NEAREST;
+
+      const TextureId id = Renderer::CreateTexture(page_width, page_height, &page[0], smooth);
+      if (!id) throw PianoGameError(L"Couldn't create texture atlas page.");
+      m_pages.push_back(id);
+
+      for (size_t i = next; i < end; ++i)
+      {
+         Tga *t = new Tga();
+         t->m_texture_id = id;
+         t->m_width = pixels[which[i]].width;
+         t->m_height = pixels[which[i]].height;
+         t->m_texture_x = xs[i - next];
+         t->m_texture_y = ys[i - next];
+         t->m_texture_width = page_width;
+         t->m_texture_height = page_height;
+         t->m_owns_texture = false;
+         t->m_filter = filter;
+
+         m_images[which[i]] = t;
+      }
+
+      next = end;
+   }
+}
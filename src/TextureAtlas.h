@@ -0,0 +1,46 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __TEXTURE_ATLAS_H
+#define __TEXTURE_ATLAS_H
+
+#include <cstddef>
+#include <vector>
+
+#include "Tga.h"
+
+// Packs a set of images onto as few OpenGL textures (pages) as will hold
+// them, so everything drawn from them can go out in a handful of draw
+// calls instead of one per image.  Each image comes back as a Tga that is
+// just a rectangle of its page; Renderer turns source rectangles into
+// page coordinates.
+//
+// Filtering belongs to a texture, not an image, so images that are drawn
+// scaled (and want linear filtering) never share a page with the ones
+// drawn pixel for pixel.  Each image is surrounded by a copy of its own
+// edge pixels so neither kind of filtering picks up a neighbor.
+class TextureAtlas
+{
+public:
+   // Loads each named resource (see Tga::Load) and packs it.  Throws
+   // PianoGameError if one can't be loaded or won't fit on a page.
+   TextureAtlas(const wchar_t *const *resource_names, const bool *smooth, size_t count);
+   ~TextureAtlas();
+
+   // In the order the resources were given
+   Tga *Get(size_t index) const { return m_images[index]; }
+
+   size_t PageCount() const { return m_pages.size(); }
+
+private:
+   TextureAtlas(const TextureAtlas&);
+   TextureAtlas &operator=(const TextureAtlas&);
+
+   void Pack(std::vector<size_t> which, const std::vector<TgaPixels> &pixels, bool smooth, unsigned int page_size);
+
+   std::vector<Tga*> m_images;
+   std::vector<TextureId> m_pages;
+};
+
+#endif
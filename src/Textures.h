@@ -73,4 +73,39 @@ const static wchar_t* TextureResourceNames[_TextureEnumCount] =
    L"play_KeysBlack"
 };
 
+// Textures that are drawn scaled get linear filtering.  The rest are
+// drawn pixel for pixel, where nearest-neighbor keeps them crisp.
+const static bool TextureIsSmooth[_TextureEnumCount] =
+{
+   false,
+   false,
+
+   false,
+   false,
+   false,
+   false,
+   false,
+
+   false,
+   false,
+   false,
+
+   false,
+
+   false,
+
+   false,
+   false,
+   false,
+
+   true,
+   true,
+   true,
+   true,
+
+   false,
+   false,
+   true
+};
+
 #endif
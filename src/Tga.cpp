@@ -1,11 +1,34 @@
 #include "Tga.h"
+#include "Renderer.h"
 
 #include "os.h"
 #include "os_graphics.h"
 #include "string_util.h"
 #include "PianoGameError.h"
+#include "CompatibleSystem.h"
+
+#include <cstring>
+
+#if !defined WIN32 && !defined __APPLE__
+#include <fstream>
+#include <vector>
+#include <iterator>
+#endif
 
 Tga* Tga::Load(const std::wstring &resource_name)
+{
+   TgaPixels pixels;
+   LoadPixels(resource_name, &pixels);
+
+   Tga *ret = BuildFromParameters(&pixels.rgba[0], pixels.width, pixels.height);
+   if (!ret) throw PianoGameError(L"Couldn't create TGA texture.");
+
+   ret->SetSmooth(false);
+
+   return ret;
+}
+
+void Tga::LoadPixels(const std::wstring &resource_name, TgaPixels *pixels)
 {
 
 #ifdef WIN32
@@ -22,10 +45,10 @@ Tga* Tga::Load(const std::wstring &resource_name)
    const unsigned char *bytes = reinterpret_cast<unsigned char*>(LockResource(resource));
    if (!bytes) throw PianoGameError(L"Couldn't lock TGA resource.");
 
-   Tga *ret = LoadFromData(bytes);
+   LoadFromData(bytes, pixels);
    FreeResource(resource);
 
-#else
+#elif defined __APPLE__
 
    // Append extension on the Mac
    std::wstring full_name = WSTRING(resource_name << L".tga");
@@ -40,21 +63,30 @@ Tga* Tga::Load(const std::wstring &resource_name)
    
    const UInt8 *bytes = CFDataGetBytePtr(data);   
 
-   Tga *ret = LoadFromData(bytes);
+   LoadFromData(bytes, pixels);
    CFRelease(data);
    
-#endif
+#else
 
-   ret->SetSmooth(false);
+   // Headless builds read straight out of the graphics directory
+   std::ifstream file;
+   Compatible::OpenFile(file, WSTRING(L"graphics/" << resource_name << L".tga"), std::ios::in | std::ios::binary);
+   if (!file.good()) throw PianoGameError(L"Couldn't find TGA resource.");
 
-   return ret;
+   std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+   if (data.empty()) throw PianoGameError(L"Couldn't load TGA resource.");
+
+   LoadFromData(&data[0], pixels);
+
+#endif
 }
 
 void Tga::Release(Tga *tga)
 {
    if (!tga) return;
 
-   glDeleteTextures(1, &tga->m_texture_id);
+   // Images packed into an atlas share its pages, which it deletes itself
+   if (tga->m_owns_texture) Renderer::DeleteTexture(tga->m_texture_id);
 
    delete tga;
 }
@@ -68,9 +100,12 @@ void Tga::SetSmooth(bool smooth)
    GLint filter = GL_NEAREST;
    if (smooth) filter = GL_LINEAR;
 
-   glBindTexture(GL_TEXTURE_2D, m_texture_id);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+   // This is asked for every time a texture is looked up, so it's only
+   // worth interrupting the sprite batch when something changes
+   if (filter == m_filter) return;
+   m_filter = filter;
+
+   Renderer::SetTextureSmooth(m_texture_id, smooth);
 }
 
 enum TgaType
@@ -80,9 +115,9 @@ enum TgaType
    TgaUnknown
 };
 
-Tga *Tga::LoadFromData(const unsigned char *bytes)
+void Tga::LoadFromData(const unsigned char *bytes, TgaPixels *pixels)
 {
-   if (!bytes) return 0;
+   if (!bytes) throw PianoGameError(L"Couldn't load TGA resource.");
 
    const unsigned char *pos = bytes;
 
@@ -116,18 +151,34 @@ Tga *Tga::LoadFromData(const unsigned char *bytes)
       throw PianoGameError(L"Unsupported TGA BPP.");
    }
 
+   // Everything comes out RGBA; room is left for the alpha a 24-bit image
+   // doesn't have, which is filled in after decoding
    const unsigned int data_size = width * height * bpp/8;
-   unsigned char *image_data = new unsigned char[data_size];
+   pixels->width = width;
+   pixels->height = height;
+   pixels->rgba.resize(width * height * 4);
 
-   Tga *t = 0;
-   if (type == TgaCompressed) t = LoadCompressed(pos, image_data, width, height, bpp);
-   if (type == TgaUncompressed) t = LoadUncompressed(pos, image_data, data_size, width, height, bpp);
+   unsigned char *image_data = &pixels->rgba[0];
+   if (type == TgaCompressed) LoadCompressed(pos, image_data, width, height, bpp);
+   if (type == TgaUncompressed) LoadUncompressed(pos, image_data, data_size, width, height, bpp);
 
-   delete[] image_data;
-   return t;
+   if (bpp == 24)
+   {
+      // Spread the pixels out from the back so nothing is overwritten early
+      for (unsigned int p = width * height; p > 0; --p)
+      {
+         const unsigned int from = (p - 1) * 3;
+         const unsigned int to = (p - 1) * 4;
+
+         image_data[to + 3] = 0xFF;
+         image_data[to + 2] = image_data[from + 2];
+         image_data[to + 1] = image_data[from + 1];
+         image_data[to + 0] = image_data[from + 0];
+      }
+   }
 }
 
-Tga *Tga::LoadUncompressed(const unsigned char *src, unsigned char *dest, unsigned int size, unsigned int width, unsigned int height, unsigned int bpp)
+void Tga::LoadUncompressed(const unsigned char *src, unsigned char *dest, unsigned int size, unsigned int width, unsigned int height, unsigned int bpp)
 {
    // We can use most of the data as-is with little modification
    memcpy(dest, src, size);
@@ -136,11 +187,9 @@ Tga *Tga::LoadUncompressed(const unsigned char *src, unsigned char *dest, unsign
    {
       dest[cswap] ^= dest[cswap+2] ^= dest[cswap] ^= dest[cswap+2];
    }
-
-   return BuildFromParameters(dest, width, height, bpp);
 }
 
-Tga *Tga::LoadCompressed(const unsigned char *src, unsigned char *dest, unsigned int width, unsigned int height, unsigned int bpp)
+void Tga::LoadCompressed(const unsigned char *src, unsigned char *dest, unsigned int width, unsigned int height, unsigned int bpp)
 {
    const unsigned char *pos = src;
 
@@ -199,29 +248,22 @@ Tga *Tga::LoadCompressed(const unsigned char *src, unsigned char *dest, unsigned
          }
       }
    }
-
-   return BuildFromParameters(dest, width, height, bpp);
 }
 
 
-Tga *Tga::BuildFromParameters(const unsigned char *raw, unsigned int width, unsigned int height, unsigned int bpp)
+Tga *Tga::BuildFromParameters(const unsigned char *rgba, unsigned int width, unsigned int height)
 {
-   unsigned int pixel_format = 0;
-   if (bpp == 24) pixel_format = GL_RGB;
-   if (bpp == 32) pixel_format = GL_RGBA;
-
-   TextureId id;
-   glGenTextures(1, &id);
+   const TextureId id = Renderer::CreateTexture(width, height, rgba, false);
    if (!id) return 0;
 
-   glBindTexture(GL_TEXTURE_2D, id);
-   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-   glTexImage2D(GL_TEXTURE_2D, 0, bpp/8, width, height, 0, pixel_format, GL_UNSIGNED_BYTE, raw);
-
    Tga *t = new Tga();
    t->m_width = width;
    t->m_height = height;
    t->m_texture_id = id;
+   t->m_texture_width = width;
+   t->m_texture_height = height;
+   t->m_owns_texture = true;
+   t->m_filter = GL_NEAREST;
 
    return t;
 }
@@ -2,19 +2,45 @@
 #define __TGA_H
 
 #include <string>
+#include <vector>
 
 typedef unsigned int TextureId;
 
+// A decoded image: four bytes (RGBA) per pixel, bottom row first
+struct TgaPixels
+{
+   TgaPixels() : width(0), height(0) { }
+
+   unsigned int width;
+   unsigned int height;
+   std::vector<unsigned char> rgba;
+};
+
+// An image somewhere in an OpenGL texture.  Images from Load have a
+// texture to themselves; the ones from a TextureAtlas are each a
+// rectangle of a texture shared with others.
 class Tga
 {
 public:
    static Tga *Load(const std::wstring &resource_name);
    static void Release(Tga *tga);
 
+   // Decodes an image without creating a texture for it
+   static void LoadPixels(const std::wstring &resource_name, TgaPixels *pixels);
+
    TextureId GetId() const { return m_texture_id; }
    unsigned int GetWidth() const { return m_width; }
    unsigned int GetHeight() const { return m_height; }
 
+   // Where the image's bottom-left corner sits in its texture, and the
+   // size of the whole texture
+   unsigned int GetTextureX() const { return m_texture_x; }
+   unsigned int GetTextureY() const { return m_texture_y; }
+   unsigned int GetTextureWidth() const { return m_texture_width; }
+   unsigned int GetTextureHeight() const { return m_texture_height; }
+
+   // This is a property of the texture, so it applies to every image
+   // sharing it
    void SetSmooth(bool smooth);
 
 private:
@@ -22,19 +48,32 @@ private:
    unsigned int m_width;
    unsigned int m_height;
 
-   Tga() { }
+   unsigned int m_texture_x;
+   unsigned int m_texture_y;
+   unsigned int m_texture_width;
+   unsigned int m_texture_height;
+   bool m_owns_texture;
+
+   // The filter last given to OpenGL (or 0 before the first SetSmooth)
+   int m_filter;
+
+   Tga() : m_texture_id(0), m_width(0), m_height(0), m_texture_x(0), m_texture_y(0),
+      m_texture_width(0), m_texture_height(0), m_owns_texture(false), m_filter(0) { }
    ~Tga() { }
 
    Tga(const Tga& rhs);
    Tga &operator=(const Tga& rhs);
 
 
-   static Tga *LoadFromData(const unsigned char *bytes);
+   static void LoadFromData(const unsigned char *bytes, TgaPixels *pixels);
+
+   static void LoadCompressed(const unsigned char *src, unsigned char *dest, unsigned int width, unsigned int height, unsigned int bpp);
+   static void LoadUncompressed(const unsigned char *src, unsigned char *dest, unsigned int size, unsigned int width, unsigned int height, unsigned int bpp);
 
-   static Tga *LoadCompressed(const unsigned char *src, unsigned char *dest, unsigned int width, unsigned int height, unsigned int bpp);
-   static Tga *LoadUncompressed(const unsigned char *src, unsigned char *dest, unsigned int size, unsigned int width, unsigned int height, unsigned int bpp);
+   static Tga *BuildFromParameters(const unsigned char *rgba, unsigned int width, unsigned int height);
 
-   static Tga *BuildFromParameters(const unsigned char *data, unsigned int width, unsigned int height, unsigned int bpp);
+   friend class TextureAtlas;
+   friend class RetainedLayer;
 };
 
 #endif
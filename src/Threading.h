@@ -0,0 +1,288 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __THREADING_H
+#define __THREADING_H
+
+#include "os.h"
+
+#ifndef WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Minimal cross-platform atomic operations.  These are full barriers on
+// every platform we support, which is more than enough for the counters
+// and single-producer/single-consumer hand-offs we use them for.
+namespace Atomic
+{
+#ifdef WIN32
+
+   // Returns the new value
+   inline long Add(volatile long *value, long amount) { return InterlockedExchangeAdd(value, amount) + amount; }
+   inline long Increment(volatile long *value) { return InterlockedIncrement(value); }
+
+   // Returns true if *value was 'expected' (and is now 'replacement')
+   inline bool CompareAndSwap(volatile long *value, long expected, long replacement)
+   {
+      return InterlockedCompareExchange(value, replacement, expected) == expected;
+   }
+
+   inline void FullBarrier() { MemoryBarrier(); }
+
+#else
+
+   inline long Add(volatile long *value, long amount) { return __sync_add_and_fetch(value, amount); }
+   inline long Increment(volatile long *value) { return __sync_add_and_fetch(value, 1); }
+
+   inline bool CompareAndSwap(volatile long *value, long expected, long replacement)
+   {
+      return __sync_bool_compare_and_swap(value, expected, replacement);
+   }
+
+   inline void FullBarrier() { __sync_synchronize(); }
+
+#endif
+
+   inline long Read(const volatile long *value) { FullBarrier(); return *value; }
+
+   // Aligned stores of a long are atomic on everything we build for
+   inline void Write(volatile long *value, long replacement) { FullBarrier(); *value = replacement; FullBarrier(); }
+
+   // Raises *value to at least 'candidate'
+   inline void StoreMax(volatile long *value, long candidate)
+   {
+      long current = *value;
+      while (candidate > current)
+      {
+         if (CompareAndSwap(value, current, candidate)) return;
+         current = *value;
+      }
+   }
+};
+
+// A fixed-size FIFO for exactly one producer thread and one consumer
+// thread.  Neither side ever locks or allocates, so the producer can be a
+// driver callback that must not block.  Capacity must be a power of two
+// and one slot is always left empty to tell "full" from "empty".
+template <class T, long Capacity>
+class LockFreeQueue
+{
+public:
+   LockFreeQueue() : m_read(0), m_write(0) { }
+
+   // Producer only.  Returns false (dropping the item) if the queue is full.
+   bool Push(const T &item)
+   {
+      const long write = m_write;
+      const long next = (write + 1) & Mask;
+      if (next == Atomic::Read(&m_read)) return false;
+
+      m_items[write] = item;
+
+      // The item must be visible before the new write position is
+      Atomic::FullBarrier();
+      m_write = next;
+      return true;
+   }
+
+   // Consumer only.  Front() and Pop() may only be called when the queue
+   // isn't Empty().
+   bool Empty() const { return Atomic::Read(&m_write) == m_read; }
+   const T &Front() const { return m_items[m_read]; }
+
+   void Pop()
+   {
+      // Finish reading the item before handing its slot back
+      Atomic::FullBarrier();
+      m_read = (m_read + 1) & Mask;
+   }
+
+   void Clear() { while (!Empty()) Pop(); }
+
+   // Producer only.  The consumer may be emptying the queue at the same
+   // time, so these can only err on the side of too many items.
+   long Size() const { return (m_write - Atomic::Read(&m_read)) & Mask; }
+   bool Full() const { return Size() == Mask; }
+
+private:
+   LockFreeQueue(const LockFreeQueue&);
+   LockFreeQueue &operator=(const LockFreeQueue&);
+
+   const static long Mask = Capacity - 1;
+
+   T m_items[Capacity];
+   volatile long m_read;
+   volatile long m_write;
+};
+
+// A plain (non-recursive) mutex
+class Mutex
+{
+public:
+#ifdef WIN32
+   Mutex() { InitializeCriticalSection(&m_mutex); }
+   ~Mutex() { DeleteCriticalSection(&m_mutex); }
+
+   void Lock() { EnterCriticalSection(&m_mutex); }
+   void Unlock() { LeaveCriticalSection(&m_mutex); }
+#else
+   Mutex() { pthread_mutex_init(&m_mutex, 0); }
+   ~Mutex() { pthread_mutex_destroy(&m_mutex); }
+
+   void Lock() { pthread_mutex_lock(&m_mutex); }
+   void Unlock() { pthread_mutex_unlock(&m_mutex); }
+#endif
+
+private:
+   Mutex(const Mutex&);
+   Mutex &operator=(const Mutex&);
+
+#ifdef WIN32
+   CRITICAL_SECTION m_mutex;
+#else
+   pthread_mutex_t m_mutex;
+#endif
+};
+
+// Holds a Mutex for as long as it is in scope
+class MutexLock
+{
+public:
+   MutexLock(Mutex &mutex) : m_mutex(mutex) { m_mutex.Lock(); }
+   ~MutexLock() { m_mutex.Unlock(); }
+
+private:
+   MutexLock(const MutexLock&);
+   MutexLock &operator=(const MutexLock&);
+
+   Mutex &m_mutex;
+};
+
+// An auto-reset event.  Set() wakes one waiting thread (or the next one
+// to call Wait() if nobody is waiting yet).  Several calls to Set() before
+// anyone waits are collapsed into a single wake-up.
+class Signal
+{
+public:
+#ifdef WIN32
+   Signal() { m_event = CreateEvent(0, FALSE, FALSE, 0); }
+   ~Signal() { CloseHandle(m_event); }
+
+   void Set() { SetEvent(m_event); }
+   void Wait() { WaitForSingleObject(m_event, INFINITE); }
+#else
+   Signal() : m_set(false)
+   {
+      pthread_mutex_init(&m_mutex, 0);
+      pthread_cond_init(&m_cond, 0);
+   }
+
+   ~Signal()
+   {
+      pthread_cond_destroy(&m_cond);
+      pthread_mutex_destroy(&m_mutex);
+   }
+
+   void Set()
+   {
+      pthread_mutex_lock(&m_mutex);
+      m_set = true;
+      pthread_cond_signal(&m_cond);
+      pthread_mutex_unlock(&m_mutex);
+   }
+
+   void Wait()
+   {
+      pthread_mutex_lock(&m_mutex);
+      while (!m_set) pthread_cond_wait(&m_cond, &m_mutex);
+      m_set = false;
+      pthread_mutex_unlock(&m_mutex);
+   }
+#endif
+
+private:
+   Signal(const Signal&);
+   Signal &operator=(const Signal&);
+
+#ifdef WIN32
+   HANDLE m_event;
+#else
+   pthread_mutex_t m_mutex;
+   pthread_cond_t m_cond;
+   bool m_set;
+#endif
+};
+
+// A joinable thread running a plain function.  The thread starts as soon
+// as the object is constructed.  The destructor waits for it to finish,
+// so the function must have some way of being told to stop.
+class Thread
+{
+public:
+   typedef void (*Function)(void *context);
+
+   Thread(Function function, void *context) : m_function(function), m_context(context), m_joined(false)
+   {
+#ifdef WIN32
+      m_thread = CreateThread(0, 0, Trampoline, this, 0, 0);
+#else
+      pthread_create(&m_thread, 0, Trampoline, this);
+#endif
+   }
+
+   ~Thread() { Join(); }
+
+   void Join()
+   {
+      if (m_joined) return;
+      m_joined = true;
+
+#ifdef WIN32
+      WaitForSingleObject(m_thread, INFINITE);
+      CloseHandle(m_thread);
+#else
+      pthread_join(m_thread, 0);
+#endif
+   }
+
+   static void Sleep(unsigned long milliseconds)
+   {
+#ifdef WIN32
+      ::Sleep(milliseconds);
+#else
+      usleep(milliseconds * 1000);
+#endif
+   }
+
+private:
+   Thread(const Thread&);
+   Thread &operator=(const Thread&);
+
+#ifdef WIN32
+   static DWORD WINAPI Trampoline(void *self)
+   {
+      Thread *t = reinterpret_cast<Thread*>(self);
+      t->m_function(t->m_context);
+      return 0;
+   }
+
+   HANDLE m_thread;
+#else
+   static void *Trampoline(void *self)
+   {
+      Thread *t = reinterpret_cast<Thread*>(self);
+      t->m_function(t->m_context);
+      return 0;
+   }
+
+   pthread_t m_thread;
+#endif
+
+   Function m_function;
+   void *m_context;
+   bool m_joined;
+};
+
+#endif
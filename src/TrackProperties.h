@@ -85,10 +85,18 @@ const static Color ColorNoteBlack[ColorCount] = {
 
 struct Properties
 {
-   Properties() : mode(ModeNotPlayed), color(TangoSkyBlue) { }
+   Properties() : mode(ModeNotPlayed), color(TangoSkyBlue), input_device(-1), output_device(-1) { }
 
    Mode mode;
    TrackColor color;
+
+   // For "You Play" tracks, the position (in SharedState::midi_in) of the
+   // only input device allowed to play this track, or -1 for any device.
+   int input_device;
+
+   // The id of the output device this track is played on, or -1 for the
+   // main output (SharedState::midi_out).
+   int output_device;
 };
 
 }; // end namespace
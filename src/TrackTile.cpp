@@ -10,15 +10,39 @@
 const static int GraphicWidth = 36;
 const static int GraphicHeight = 36;
 
-TrackTile::TrackTile(int x, int y, size_t track_id, Track::TrackColor color, Track::Mode mode)
-   : m_x(x), m_y(y), m_track_id(track_id), m_color(color), m_mode(mode), m_preview_on(false)
+TrackTile::TrackTile(int x, int y, size_t track_id, Track::TrackColor color, Track::Mode mode,
+                     int input_device, int input_device_count)
+   : m_x(x), m_y(y), m_track_id(track_id), m_color(color), m_mode(mode), m_preview_on(false),
+   m_input_device(input_device), m_input_device_count(input_device_count), m_output_index(-1)
 {
+   if (m_mode != Track::ModeYouPlay || m_input_device_count < 2 || m_input_device >= m_input_device_count) m_input_device = -1;
+
    // Initialize the size and position of each button
    whole_tile = ButtonState(0, 0, TrackTileWidth, TrackTileHeight);
    button_mode_left  = ButtonState(  2, 68, GraphicWidth, GraphicHeight);
    button_mode_right = ButtonState(192, 68, GraphicWidth, GraphicHeight);
    button_color      = ButtonState(228, 68, GraphicWidth, GraphicHeight);
    button_preview    = ButtonState(264, 68, GraphicWidth, GraphicHeight);
+
+   // The output name shares the "Notes:" line
+   button_output     = ButtonState(150, 30, 140, 20);
+}
+
+void TrackTile::SetOutputChoices(const MidiCommDescriptionList &outputs, int output_device)
+{
+   m_outputs = outputs;
+
+   m_output_index = -1;
+   for (size_t i = 0; i < m_outputs.size(); ++i)
+   {
+      if (static_cast<int>(m_outputs[i].id) == output_device) m_output_index = static_cast<int>(i);
+   }
+}
+
+int TrackTile::GetOutputDevice() const
+{
+   if (m_output_index < 0) return -1;
+   return static_cast<int>(m_outputs[m_output_index].id);
 }
 
 void TrackTile::Update(const MouseInfo &translated_mouse)
@@ -27,23 +51,24 @@ void TrackTile::Update(const MouseInfo &translated_mouse)
    whole_tile.Update(translated_mouse);
    button_preview.Update(translated_mouse);
    button_color.Update(translated_mouse);
+   button_output.Update(translated_mouse);
    button_mode_left.Update(translated_mouse);
    button_mode_right.Update(translated_mouse);
 
    if (button_mode_left.hit)
    {
-      int mode = static_cast<int>(m_mode) - 1;
-      if (mode < 0) mode = 3;
+      int choice = CurrentChoice() - 1;
+      if (choice < 0) choice = ChoiceCount() - 1;
 
-      m_mode = static_cast<Track::Mode>(mode);
+      SetChoice(choice);
    }
 
    if (button_mode_right.hit)
    {
-      int mode = static_cast<int>(m_mode) + 1;
-      if (mode > 3) mode = 0;
+      int choice = CurrentChoice() + 1;
+      if (choice >= ChoiceCount()) choice = 0;
 
-      m_mode = static_cast<Track::Mode>(mode);
+      SetChoice(choice);
    }
 
    if (button_preview.hit)
@@ -51,6 +76,12 @@ void TrackTile::Update(const MouseInfo &translated_mouse)
       m_preview_on = !m_preview_on;
    }
 
+   if (button_output.hit && !m_outputs.empty())
+   {
+      ++m_output_index;
+      if (m_output_index >= static_cast<int>(m_outputs.size())) m_output_index = -1;
+   }
+
    if (button_color.hit && m_mode != Track::ModeNotPlayed && m_mode != Track::ModePlayedButHidden)
    {
       int color = static_cast<int>(m_color) + 1;
@@ -61,6 +92,47 @@ void TrackTile::Update(const MouseInfo &translated_mouse)
 
 }
 
+// Choices are laid out as:
+//    Played Automatically
+//    You Play                (any device)
+//    You Play (Input 1) ...  (only with two or more input devices)
+//    Played But Hidden
+//    Not Played
+int TrackTile::ChoiceCount() const
+{
+   const int per_device = (m_input_device_count > 1 ? m_input_device_count : 0);
+   return Track::ModeCount + per_device;
+}
+
+int TrackTile::CurrentChoice() const
+{
+   const int per_device = (m_input_device_count > 1 ? m_input_device_count : 0);
+
+   if (m_mode < Track::ModeYouPlay) return static_cast<int>(m_mode);
+   if (m_mode == Track::ModeYouPlay) return static_cast<int>(m_mode) + m_input_device + 1;
+   return static_cast<int>(m_mode) + per_device;
+}
+
+void TrackTile::SetChoice(int choice)
+{
+   const int per_device = (m_input_device_count > 1 ? m_input_device_count : 0);
+
+   m_input_device = -1;
+   if (choice <= Track::ModeYouPlay)
+   {
+      m_mode = static_cast<Track::Mode>(choice);
+   }
+   else if (choice <= Track::ModeYouPlay + per_device)
+   {
+      m_mode = Track::ModeYouPlay;
+      m_input_device = choice - Track::ModeYouPlay - 1;
+   }
+   else
+   {
+      m_mode = static_cast<Track::Mode>(choice - per_device);
+   }
+}
+
 int TrackTile::LookupGraphic(TrackTileGraphic graphic, bool button_hovering) const
 {
    // There are three sets of graphics
@@ -108,6 +180,18 @@ void TrackTile::Draw(Renderer &renderer, const Midi *midi, Tga *buttons, Tga *bo
    TextWriter note_count(95, 33, renderer, false, 14);
    note_count << static_cast<const unsigned int>(track.Notes().size());
 
+   if (!m_outputs.empty())
+   {
+      const static size_t MaxNameLength = 16;
+
+      std::wstring name = L"Main Output";
+      if (m_output_index >= 0) name = m_outputs[m_output_index].name;
+      if (name.length() > MaxNameLength) name = name.substr(0, MaxNameLength - 3) + L"...";
+
+      TextWriter output(150, 33, renderer, false, 14);
+      output << Text(L"Out: " + name, button_output.hovering ? White : Gray);
+   }
+
    int color_offset = GraphicHeight * static_cast<int>(m_color);
    if (gray_out_buttons) color_offset = GraphicHeight * Track::UserSelectableColorCount;
 
@@ -122,6 +206,7 @@ void TrackTile::Draw(Renderer &renderer, const Midi *midi, Tga *buttons, Tga *bo
    // Draw mode text
    TextWriter mode(42, 76, renderer, false, 14);
    mode << Track::ModeText[m_mode];
+   if (m_mode == Track::ModeYouPlay && m_input_device >= 0) mode << L" (Input " << m_input_device + 1 << L")";
 
    renderer.ResetOffset();
 }
@@ -11,6 +11,8 @@
 #include "MenuLayout.h"
 #include <vector>
 
+#include "libmidi/MidiComm.h"
+
 class Midi;
 class Tga;
 class Renderer;
@@ -32,7 +34,10 @@ enum TrackTileGraphic
 class TrackTile
 {
 public:
-   TrackTile(int x, int y, size_t track_id, Track::TrackColor color, Track::Mode mode);
+   // With more than one input device, "You Play" is offered once for
+   // "any device" and then once for each individual device.
+   TrackTile(int x, int y, size_t track_id, Track::TrackColor color, Track::Mode mode,
+      int input_device = -1, int input_device_count = 0);
 
    void Update(const MouseInfo &translated_mouse);
    void Draw(Renderer &renderer, const Midi *midi, Tga *buttons, Tga *box) const;
@@ -42,6 +47,16 @@ public:
 
    Track::Mode GetMode() const { return m_mode; }
    Track::TrackColor GetColor() const { return m_color; }
+   int GetInputDevice() const { return m_input_device; }
+
+   // Lets this track be played on a device other than the main output.
+   // The list shouldn't include the main output itself.  Nothing is shown
+   // if the list is empty.
+   void SetOutputChoices(const MidiCommDescriptionList &outputs, int output_device);
+   bool HasOutputChoices() const { return !m_outputs.empty(); }
+
+   // Returns -1 for the main output
+   int GetOutputDevice() const;
 
    bool HitPreviewButton() const { return button_preview.hit; }
    bool IsPreviewOn() const { return m_preview_on; }
@@ -52,6 +67,7 @@ public:
    const ButtonState WholeTile() const { return whole_tile; }
    const ButtonState ButtonPreview() const { return button_preview; }
    const ButtonState ButtonColor() const { return button_color; }
+   const ButtonState ButtonOutput() const { return button_output; }
    const ButtonState ButtonLeft() const { return button_mode_left; }
    const ButtonState ButtonRight() const { return button_mode_right; }
 
@@ -62,16 +78,31 @@ private:
    Track::Mode m_mode;
    Track::TrackColor m_color;
 
+   int m_input_device;
+   int m_input_device_count;
+
+   MidiCommDescriptionList m_outputs;
+
+   // An index into m_outputs, or -1 for the main output
+   int m_output_index;
+
    bool m_preview_on;
 
    ButtonState whole_tile;
    ButtonState button_preview;
    ButtonState button_color;
+   ButtonState button_output;
    ButtonState button_mode_left;
    ButtonState button_mode_right;
 
    int LookupGraphic(TrackTileGraphic graphic, bool button_hovering) const;
 
+   // The mode arrows cycle through a flat list of "choices" made up of the
+   // modes plus any per-device variations of "You Play".
+   int ChoiceCount() const;
+   int CurrentChoice() const;
+   void SetChoice(int choice);
+
    // Link to the track index of the Midi object
    size_t m_track_id;
 };
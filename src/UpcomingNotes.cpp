@@ -0,0 +1,76 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "UpcomingNotes.h"
+
+using namespace std;
+
+UpcomingNotes::UpcomingNotes(microseconds_t window_length)
+   : m_notes(0), m_half_window(window_length / 2), m_queues(PitchCount), m_next(PitchCount, 0)
+{ }
+
+void UpcomingNotes::Reset(const TranslatedNoteList &notes, const NoteStateList &states, const vector<int> &track_input_devices)
+{
+   m_notes = &notes;
+
+   for (NoteId p = 0; p < PitchCount; ++p)
+   {
+      m_queues[p].clear();
+      m_next[p] = 0;
+   }
+
+   // The list is already in song order, so each queue comes out that way too
+   for (size_t i = 0; i < notes.size(); ++i)
+   {
+      if (states[i] != UserPlayable || notes[i].note_id >= PitchCount) continue;
+
+      Entry e;
+      e.note = i;
+      e.input_device = track_input_devices[notes[i].track_id];
+      m_queues[notes[i].note_id].push_back(e);
+   }
+}
+
+bool UpcomingNotes::Match(NoteId note_id, microseconds_t song_time, int input_device, const NoteStateList &states, size_t *note)
+{
+   // Octave sliding can push input right off the keyboard
+   if (note_id >= PitchCount || !m_notes) return false;
+
+   const TranslatedNoteList &notes = *m_notes;
+   const vector<Entry> &queue = m_queues[note_id];
+   size_t &next = m_next[note_id];
+
+   // Anything already hit, or whose window has closed, is done with
+   while (next < queue.size())
+   {
+      const size_t n = queue[next].note;
+      if (states[n] == UserPlayable && notes[n].start + m_half_window > song_time) break;
+      next++;
+   }
+
+   const Entry *closest = 0;
+   microseconds_t closest_distance = 0;
+   for (size_t i = next; i < queue.size(); ++i)
+   {
+      const Entry &e = queue[i];
+      const TranslatedNote &candidate = notes[e.note];
+
+      // Nothing after this could have been played yet
+      if (candidate.start - m_half_window > song_time) break;
+
+      if (states[e.note] != UserPlayable) continue;
+      if (e.input_device >= 0 && e.input_device != input_device) continue;
+
+      const microseconds_t distance = (candidate.start > song_time) ? candidate.start - song_time : song_time - candidate.start;
+      if (closest && distance >= closest_distance) continue;
+
+      closest = &e;
+      closest_distance = distance;
+   }
+
+   if (!closest) return false;
+
+   *note = closest->note;
+   return true;
+}
@@ -0,0 +1,60 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __UPCOMING_NOTES_H
+#define __UPCOMING_NOTES_H
+
+#include <cstddef>
+#include <vector>
+
+#include "libmidi/Note.h"
+#include "libmidi/MidiTypes.h"
+
+// The notes the player has yet to hit, queued up separately for each
+// pitch.  Each queue keeps a cursor that moves past notes as their hit
+// windows close, so finding the note a key press was meant for only
+// looks at the handful of notes of that pitch around the current song
+// position, however many other notes there are.
+//
+// The queues are keyed by pitch alone, not by (channel, pitch), because a
+// press has only ever been matched on its pitch: whatever channel the
+// player's keyboard sends on, it can hit any "You Play" track.  Notes of
+// the same pitch on different tracks and channels share a queue, and each
+// entry's input device is what keeps one player off another's track.
+class UpcomingNotes
+{
+public:
+   // A note can be hit up to half of window_length either side of its start
+   UpcomingNotes(microseconds_t window_length);
+
+   // Queues every note that starts out UserPlayable.  track_input_devices
+   // holds each track's Track::Properties::input_device.  The notes must
+   // outlive this.
+   void Reset(const TranslatedNoteList &notes, const NoteStateList &states, const std::vector<int> &track_input_devices);
+
+   // Looks for the note of this pitch whose start is closest to
+   // song_time, among those that are still UserPlayable, whose hit
+   // windows are open, and that accept input from input_device (its
+   // position in the input group).  Returns false if there isn't one.
+   bool Match(NoteId note_id, microseconds_t song_time, int input_device, const NoteStateList &states, size_t *note);
+
+private:
+   struct Entry
+   {
+      size_t note;
+      int input_device;
+   };
+
+   const static NoteId PitchCount = 128;
+
+   const TranslatedNoteList *m_notes;
+   microseconds_t m_half_window;
+
+   // One queue per pitch in song order, and the first entry in each that
+   // might still be hit
+   std::vector<std::vector<Entry> > m_queues;
+   std::vector<size_t> m_next;
+};
+
+#endif
@@ -3,6 +3,8 @@
 
 #ifdef WIN32
 #include "registry.h"
+#elif !defined __APPLE__
+#include <map>
 #endif
 
 using namespace std;
@@ -42,7 +44,7 @@ namespace UserSetting
       reg.Write(setting, value);
    }
 
-#else
+#elif defined __APPLE__
 
    void Initialize(const std::wstring &app_name)
    {
@@ -66,6 +68,28 @@ namespace UserSetting
       CFPreferencesAppSynchronize(kCFPreferencesCurrentApplication);
    }
       
+#else
+
+   // Headless builds have nowhere to persist settings, so they only
+   // last as long as the process does.
+   static std::map<std::wstring, std::wstring> g_settings;
+
+   void Initialize(const std::wstring &)
+   {
+   }
+
+   std::wstring Get(const std::wstring &setting, const std::wstring &default_value)
+   {
+      std::map<std::wstring, std::wstring>::const_iterator i = g_settings.find(setting);
+      if (i == g_settings.end()) return default_value;
+
+      return i->second;
+   }
+
+   void Set(const std::wstring &setting, const std::wstring &value)
+   {
+      g_settings[setting] = value;
+   }
 
 #endif
 
@@ -84,6 +84,15 @@ void RequestMidiFilename(std::wstring *returned_filename, std::wstring *returned
    
 }
 
+#elif !defined __APPLE__
+
+void RequestMidiFilename(std::wstring *returned_filename, std::wstring *returned_file_title)
+{
+   // Headless builds have no dialog to show, so this is always a "cancel"
+   if (returned_file_title) *returned_file_title = L"";
+   if (returned_filename) *returned_filename = L"";
+}
+
 #endif
 
 void SetLastMidiFilename(const std::wstring &filename)
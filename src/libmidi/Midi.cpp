@@ -6,7 +6,9 @@
 #include "MidiEvent.h"
 #include "MidiTrack.h"
 #include "MidiUtil.h"
+#include "../CompatibleSystem.h"
 
+#include <algorithm>
 #include <fstream>
 #include <map>
 
@@ -14,14 +16,8 @@ using namespace std;
 
 Midi Midi::ReadFromFile(const wstring &filename)
 {
-#if defined WIN32
-   fstream file(reinterpret_cast<const wchar_t*>((filename).c_str()), ios::in|ios::binary);
-#else
-   // TODO: This isn't Unicode!
-   // MACTODO: Test to see if opening a unicode filename works.  I bet it doesn't.
-   std::string narrow(filename.begin(), filename.end());
-   fstream file(narrow.c_str(), ios::in | ios::binary);
-#endif
+   fstream file;
+   Compatible::OpenFile(file, filename, ios::in | ios::binary);
 
    if (!file.good()) throw MidiError(MidiError_BadFilename);
 
@@ -136,6 +132,7 @@ Midi Midi::ReadFromStream(istream &stream)
    }
 
    m.BuildTempoTrack();
+   m.BuildTempoMap(pulses_per_quarter_note);
 
    // Tell our tracks their IDs
    for (int i = 0; i < track_count; ++i)
@@ -299,6 +296,34 @@ microseconds_t Midi::ConvertPulsesToMicroseconds(uint32_t pulses, microseconds_t
    return static_cast<microseconds_t>(microseconds);
 }
 
+void Midi::BuildTempoMap(unsigned short pulses_per_quarter_note)
+{
+   m_tempo_map.clear();
+
+   MidiTempoSegment first;
+   first.start = 0;
+   first.start_quarter_notes = 0.0;
+   first.us_per_quarter_note = DefaultUSTempo;
+   m_tempo_map.push_back(first);
+
+   if (m_tracks.size() == 0 || pulses_per_quarter_note == 0) return;
+   const MidiTrack &tempo_track = m_tracks.back();
+
+   for (size_t i = 0; i < tempo_track.Events().size(); ++i)
+   {
+      const uint32_t pulses = tempo_track.EventPulses()[i];
+
+      MidiTempoSegment segment;
+      segment.start = GetEventPulseInMicroseconds(pulses, pulses_per_quarter_note);
+      segment.start_quarter_notes = static_cast<double>(pulses) / pulses_per_quarter_note;
+      segment.us_per_quarter_note = tempo_track.Events()[i].GetTempoInUsPerQn();
+
+      // A change at the very start replaces the default
+      if (segment.start == m_tempo_map.back().start) m_tempo_map.back() = segment;
+      else m_tempo_map.push_back(segment);
+   }
+}
+
 microseconds_t Midi::GetEventPulseInMicroseconds(uint32_t event_pulses, unsigned short pulses_per_quarter_note) const
 {
    if (m_tracks.size() == 0) return 0;
@@ -373,9 +398,11 @@ void Midi::TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarte
    }
 }
 
-MidiEventListWithTrackId Midi::Update(microseconds_t delta_microseconds)
+MidiEventListWithTrackId Midi::Update(microseconds_t delta_microseconds, MidiEventMicrosecondList *event_times)
 {
    MidiEventListWithTrackId aggregated_events;
+   if (event_times) event_times->clear();
+
    if (!m_initialized) return aggregated_events;
 
    m_microsecond_song_position += delta_microseconds;
@@ -392,7 +419,7 @@ MidiEventListWithTrackId Midi::Update(microseconds_t delta_microseconds)
    const size_t track_count = m_tracks.size();
    for (size_t i = 0; i < track_count; ++i)
    {
-      MidiEventList track_events = m_tracks[i].Update(delta_microseconds);
+      MidiEventList track_events = m_tracks[i].Update(delta_microseconds, event_times);
 
       const size_t event_count = track_events.size();
       for (size_t j = 0; j < event_count; ++j)
@@ -404,6 +431,35 @@ MidiEventListWithTrackId Midi::Update(microseconds_t delta_microseconds)
    return aggregated_events;
 }
 
+static bool SongEventEarlier(const MidiSongEvent &a, const MidiSongEvent &b)
+{
+   return a.time < b.time;
+}
+
+MidiSongEventList Midi::MergedEvents() const
+{
+   MidiSongEventList merged;
+
+   for (size_t t = 0; t < m_tracks.size(); ++t)
+   {
+      const MidiEventList &events = m_tracks[t].Events();
+      const MidiEventMicrosecondList &times = m_tracks[t].EventUsecs();
+
+      for (size_t i = 0; i < events.size() && i < times.size(); ++i)
+      {
+         MidiSongEvent e;
+         e.time = times[i];
+         e.track_id = t;
+         e.event = events[i];
+
+         merged.push_back(e);
+      }
+   }
+
+   stable_sort(merged.begin(), merged.end(), SongEventEarlier);
+   return merged;
+}
+
 microseconds_t Midi::GetSongLengthInMicroseconds() const
 {
    if (!m_initialized) return 0;
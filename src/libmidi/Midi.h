@@ -7,6 +7,7 @@
 
 #include <iostream>
 #include <vector>
+#include <stdint.h>
 
 #include "Note.h"
 #include "MidiTrack.h"
@@ -20,6 +21,25 @@ typedef std::vector<MidiTrack> MidiTrackList;
 typedef std::vector<MidiEvent> MidiEventList;
 typedef std::vector<std::pair<size_t, MidiEvent> > MidiEventListWithTrackId;
 
+// An event from one of the song's tracks, and the song time it happens at
+struct MidiSongEvent
+{
+   microseconds_t time;
+   size_t track_id;
+   MidiEvent event;
+};
+typedef std::vector<MidiSongEvent> MidiSongEventList;
+
+// A stretch of the song with a constant tempo, starting at the given
+// song position (which is also the given number of beats in).
+struct MidiTempoSegment
+{
+   microseconds_t start;
+   double start_quarter_notes;
+   microseconds_t us_per_quarter_note;
+};
+typedef std::vector<MidiTempoSegment> MidiTempoMap;
+
 // NOTE: This library's MIDI loading and handling is destructive.  Perfect
 //       1:1 serialization routines will not be possible without quite a
 //       bit of additional work.
@@ -33,7 +53,16 @@ public:
 
    const TranslatedNoteSet &Notes() const { return m_translated_notes; }
 
-   MidiEventListWithTrackId Update(microseconds_t delta_microseconds);
+   // Always has at least one segment, starting at position 0
+   const MidiTempoMap &TempoMap() const { return m_tempo_map; }
+
+   // Every event from every track, in the order they happen.  Events at
+   // the same time stay in track order (and then file order).
+   MidiSongEventList MergedEvents() const;
+
+   // If event_times is given, it is filled with the song position each of
+   // the returned events was scheduled for (in the same order).
+   MidiEventListWithTrackId Update(microseconds_t delta_microseconds, MidiEventMicrosecondList *event_times = 0);
 
    void Reset(microseconds_t lead_in_microseconds, microseconds_t lead_out_microseconds);
 
@@ -73,11 +102,13 @@ private:
    uint32_t FindFirstNotePulse();
 
    void BuildTempoTrack();
+   void BuildTempoMap(unsigned short pulses_per_quarter_note);
    void TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarter_note);
 
    bool m_initialized;
 
    TranslatedNoteSet m_translated_notes;
+   MidiTempoMap m_tempo_map;
 
    // Position can be negative (for lead-in).
    microseconds_t m_microsecond_song_position;
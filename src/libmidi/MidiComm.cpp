@@ -8,6 +8,7 @@
 
 #include <string>
 #include <sstream>
+#include <map>
 using namespace std;
 
 #include "../os.h"
@@ -15,6 +16,43 @@ using namespace std;
 #include "../CompatibleSystem.h"
 #include "../string_util.h"
 #include "../PianoGameError.h"
+#include "../DispatchTiming.h"
+
+struct VirtualInputDevice
+{
+   wstring name;
+   MidiCommInSource *source;
+};
+
+struct VirtualOutputDevice
+{
+   wstring name;
+   MidiCommOutSink *sink;
+};
+
+// Virtual device ids start here so they never collide with (or shift
+// around along with) native device ids.
+const static unsigned int VirtualDeviceIdBase = 0x10000;
+
+static vector<VirtualInputDevice> &VirtualInputDevices()
+{
+   static vector<VirtualInputDevice> devices;
+   return devices;
+}
+
+static vector<VirtualOutputDevice> &VirtualOutputDevices()
+{
+   static vector<VirtualOutputDevice> devices;
+   return devices;
+}
+
+static void (*volatile wake_callback)() = 0;
+
+static void Wake()
+{
+   void (*callback)() = wake_callback;
+   if (callback) callback();
+}
 
 #ifdef WIN32
 
@@ -40,36 +78,42 @@ void CALLBACK MidiInputCallback(HMIDIIN, UINT msg, DWORD_PTR instance, DWORD p1,
    reinterpret_cast<MidiCommIn*>(instance)->InputCallback(msg, p1, p2);
 }
 
-MidiCommDescriptionList MidiCommIn::GetDeviceList()
+static wstring NativeInputName(unsigned int index)
 {
-   MidiCommDescriptionList devices;
+   MIDIINCAPS dev;
 
-   unsigned int dev_count = midiInGetNumDevs();
-   for (unsigned int i = 0; i < dev_count; ++i)
+   const static int MaxTries = 10;
+   int tries = 0;
+   while (tries++ < MaxTries)
    {
-      MIDIINCAPS dev;
-
-      const static int MaxTries = 10;
-      int tries = 0;
-      while (tries++ < MaxTries)
+      try
       {
-         try
-         {
-            midi_check(midiInGetDevCaps(i, &dev, sizeof(MIDIINCAPS)));
-            break;
-         }
-         catch (MidiError ex)
-         {
-            // Sometimes input needs to take a quick break
-            if (ex.m_error != MidiError_MM_NotEnabled) throw;
-            Sleep(50);
-         }
+         midi_check(midiInGetDevCaps(index, &dev, sizeof(MIDIINCAPS)));
+         break;
+      }
+      catch (MidiError ex)
+      {
+         // Sometimes input needs to take a quick break
+         if (ex.m_error != MidiError_MM_NotEnabled) throw;
+         Sleep(50);
       }
-      if (tries == MaxTries) throw MidiError_MM_NotEnabled;
+   }
+   if (tries == MaxTries) throw MidiError_MM_NotEnabled;
+
+   return dev.szPname;
+}
 
+// Called from the enumeration thread
+static MidiCommDescriptionList NativeInputDevices()
+{
+   MidiCommDescriptionList devices;
+
+   unsigned int dev_count = midiInGetNumDevs();
+   for (unsigned int i = 0; i < dev_count; ++i)
+   {
       MidiCommDescription d;
       d.id = i;
-      d.name = dev.szPname;
+      d.name = NativeInputName(i);
 
       devices.push_back(d);
    }
@@ -77,12 +121,8 @@ MidiCommDescriptionList MidiCommIn::GetDeviceList()
    return devices;
 }
 
-MidiCommIn::MidiCommIn(unsigned int device_id)
+void MidiCommIn::OpenNative(unsigned int device_id)
 {
-   m_description = GetDeviceList()[device_id];
-
-   InitializeCriticalSection(&m_buffer_mutex);
-
    midi_check(midiInOpen(&m_input_device, device_id,
       reinterpret_cast<DWORD_PTR>(MidiInputCallback),
       reinterpret_cast<DWORD_PTR>(this),
@@ -91,13 +131,11 @@ MidiCommIn::MidiCommIn(unsigned int device_id)
    midi_check(midiInStart(m_input_device));
 }
 
-MidiCommIn::~MidiCommIn()
+void MidiCommIn::CloseNative()
 {
    midi_check(midiInStop(m_input_device));
    midi_check(midiInReset(m_input_device));
    midi_check(midiInClose(m_input_device));
-
-   DeleteCriticalSection(&m_buffer_mutex);
 }
 
 // This is only called by the callback function.  The reason this
@@ -114,11 +152,7 @@ void MidiCommIn::InputCallback(unsigned int msg, unsigned long p1, unsigned long
             unsigned char status = LOBYTE(LOWORD(p1));
             unsigned char byte1  = HIBYTE(LOWORD(p1));
             unsigned char byte2  = LOBYTE(HIWORD(p1));
-            MidiEvent ev = MidiEvent::Build(MidiEventSimple(status, byte1, byte2));
-
-            EnterCriticalSection(&m_buffer_mutex);
-            m_event_buffer.push(ev);
-            LeaveCriticalSection(&m_buffer_mutex);
+            InjectEvent(MidiEvent::Build(MidiEventSimple(status, byte1, byte2)));
          }
          break;
 
@@ -150,11 +184,7 @@ void MidiCommIn::InputCallback(unsigned int msg, unsigned long p1, unsigned long
                unsigned char status = LOBYTE(LOWORD(p1));
                unsigned char byte1  = HIBYTE(LOWORD(p1));
                unsigned char byte2  = LOBYTE(HIWORD(p1));
-               MidiEvent ev = MidiEvent::Build(MidiEventSimple(status, byte1, byte2));
-
-               EnterCriticalSection(&m_buffer_mutex);
-               m_event_buffer.push(ev);
-               LeaveCriticalSection(&m_buffer_mutex);
+               InjectEvent(MidiEvent::Build(MidiEventSimple(status, byte1, byte2)));
                break;
             }
             throw MidiError(MidiError_InvalidInputErrorBehavior);
@@ -178,55 +208,25 @@ void MidiCommIn::InputCallback(unsigned int msg, unsigned long p1, unsigned long
 
 }
 
-void MidiCommIn::Reset()
+static wstring NativeOutputName(unsigned int index)
 {
-   EnterCriticalSection(&m_buffer_mutex);
-   while (!m_event_buffer.empty()) m_event_buffer.pop();
-   LeaveCriticalSection(&m_buffer_mutex);
-}
-
-bool MidiCommIn::KeepReading() const
-{
-   bool buffer_empty;
-
-   EnterCriticalSection(&m_buffer_mutex);
-   buffer_empty = m_event_buffer.empty();
-   LeaveCriticalSection(&m_buffer_mutex);
+   MIDIOUTCAPS dev;
+   midi_check(midiOutGetDevCaps(index, &dev, sizeof(MIDIOUTCAPS)));
 
-   return (!buffer_empty);
+   return dev.szPname;
 }
 
-MidiEvent MidiCommIn::Read()
-{
-   MidiEvent ev(MidiEvent::NullEvent());
-   bool buffer_empty;
-
-   EnterCriticalSection(&m_buffer_mutex);
-   buffer_empty = m_event_buffer.empty();
-   if (!buffer_empty)
-   {
-      ev = m_event_buffer.front();
-      m_event_buffer.pop();
-   }
-   LeaveCriticalSection(&m_buffer_mutex);
-
-   if (buffer_empty) throw MidiError(MidiError_NoInputAvailable);
-   return ev;
-}
-
-MidiCommDescriptionList MidiCommOut::GetDeviceList()
+// Called from the enumeration thread
+static MidiCommDescriptionList NativeOutputDevices()
 {
    MidiCommDescriptionList devices;
 
    unsigned int dev_count = midiOutGetNumDevs();
    for (unsigned int i = 0; i < dev_count; ++i)
    {
-      MIDIOUTCAPS dev;
-      midi_check(midiOutGetDevCaps(i, &dev, sizeof(MIDIOUTCAPS)));
-
       MidiCommDescription d;
       d.id = i;
-      d.name = dev.szPname;
+      d.name = NativeOutputName(i);
 
       devices.push_back(d);
    }
@@ -234,20 +234,18 @@ MidiCommDescriptionList MidiCommOut::GetDeviceList()
    return devices;
 }
 
-MidiCommOut::MidiCommOut(unsigned int device_id)
+void MidiCommOut::OpenNative(unsigned int device_id)
 {
-   m_description = GetDeviceList()[device_id];
-
    midi_check(midiOutOpen(&m_output_device, device_id, 0, 0, CALLBACK_NULL));
 }
 
-MidiCommOut::~MidiCommOut()
+void MidiCommOut::CloseNative()
 {
    midi_check(midiOutReset(m_output_device));
    midi_check(midiOutClose(m_output_device));
 }
 
-void MidiCommOut::Write(const MidiEvent &out)
+void MidiCommOut::WriteNative(const MidiEvent &out)
 {
    MidiEventSimple simple;
    if (out.GetSimpleEvent(&simple))
@@ -260,14 +258,20 @@ void MidiCommOut::Write(const MidiEvent &out)
    }
 }
 
-void MidiCommOut::Reset()
+void MidiCommOut::ResetNative()
 {
    midi_check(midiOutReset(m_output_device));
    midi_check(midiOutClose(m_output_device));
-   midi_check(midiOutOpen(&m_output_device, m_description.id, 0, 0, CALLBACK_NULL));
+   midi_check(midiOutOpen(&m_output_device, m_native_index, 0, 0, CALLBACK_NULL));
 }
 
-#else
+// WinMM doesn't have a device notification of its own.  The main window
+// calls MidiCommDevices::Refresh() when it receives WM_DEVICECHANGE.
+static void StartDeviceNotifications()
+{
+}
+
+#elif defined __APPLE__
 
 static CFStringRef BuildEndpointName(MIDIEndpointRef endpoint)
 {
@@ -349,33 +353,37 @@ static CFStringRef BuildEndpointName(MIDIEndpointRef endpoint)
    return result;
 }
 
+static wstring EndpointName(MIDIEndpointRef endpoint)
+{
+   if (endpoint == 0) return wstring();
 
-static bool built_input_list = false;
-static MidiCommDescriptionList in_list(MidiCommIn::GetDeviceList());
+   CFStringRef cf_name = BuildEndpointName(endpoint);
+   const wstring name = WideFromMacString(cf_name);
+   CFRelease(cf_name);
 
+   return name;
+}
 
-MidiCommDescriptionList MidiCommIn::GetDeviceList()
+static wstring NativeInputName(unsigned int index)
 {
-   if (built_input_list) return in_list;
+   return EndpointName(MIDIGetSource(index));
+}
 
+// Called from the enumeration thread
+static MidiCommDescriptionList NativeInputDevices()
+{
    MidiCommDescriptionList devices;
 
    ItemCount sources = MIDIGetNumberOfSources();
    for (int i = 0; i < sources; ++i)
    {
-      MIDIEndpointRef endpoint = MIDIGetSource(i);
-      
-      CFStringRef cf_name = BuildEndpointName(endpoint);
-      
       MidiCommDescription d;
       d.id = i;
-      d.name = WideFromMacString(cf_name);
-      CFRelease(cf_name);
+      d.name = NativeInputName(i);
       
       devices.push_back(d);
    }   
 
-   built_input_list = true;
    return devices;
 }
 
@@ -392,12 +400,8 @@ void midi_input(const MIDIPacketList *packet_list, void *read_ref_con, void *sou
    }
 }
 
-MidiCommIn::MidiCommIn(unsigned int device_id)
+void MidiCommIn::OpenNative(unsigned int device_id)
 {
-   pthread_mutex_init(&m_mutex, 0);
-
-   m_description = MidiCommIn::GetDeviceList()[device_id];
-
     OSStatus result = MIDIClientCreate(CFSTR("Piano Game"), 0, this, &m_client);
     if (result != noErr) {
         throw PianoGameError(L"Can't create midi client " + to_wstring(result));
@@ -417,15 +421,13 @@ MidiCommIn::MidiCommIn(unsigned int device_id)
     };
 }
 
-MidiCommIn::~MidiCommIn()
+void MidiCommIn::CloseNative()
 {
-   MIDIEndpointRef source = MIDIGetSource(m_description.id);
+   MIDIEndpointRef source = MIDIGetSource(m_native_index);
    MIDIPortDisconnectSource(m_port, source);
 
    // This disposes the port too.
    MIDIClientDispose(m_client);
-
-   pthread_mutex_destroy(&m_mutex);
 }
 
 void MidiCommIn::InputCallback(unsigned int status, unsigned long byte1, unsigned long byte2)
@@ -433,92 +435,41 @@ void MidiCommIn::InputCallback(unsigned int status, unsigned long byte1, unsigne
    unsigned char small_status = (unsigned char)status;
    unsigned char small_byte1  = (unsigned char)byte1;
    unsigned char small_byte2  = (unsigned char)byte2;
-   MidiEvent ev = MidiEvent::Build(MidiEventSimple(small_status, small_byte1, small_byte2));
 
-   pthread_mutex_lock(&m_mutex);
-   m_event_buffer.push(ev);
-   pthread_mutex_unlock(&m_mutex);
+   InjectEvent(MidiEvent::Build(MidiEventSimple(small_status, small_byte1, small_byte2)));
 }
 
-void MidiCommIn::Reset()
-{
-   pthread_mutex_lock(&m_mutex);
-   while (!m_event_buffer.empty()) m_event_buffer.pop();
-   pthread_mutex_unlock(&m_mutex);
-}
-
-bool MidiCommIn::KeepReading() const
-{
-   bool buffer_empty;
-
-   pthread_mutex_lock(&m_mutex);
-   buffer_empty = m_event_buffer.empty();
-   pthread_mutex_unlock(&m_mutex);
-
-   return (!buffer_empty);
-}
 
-MidiEvent MidiCommIn::Read()
+// Index 0 is the built-in synth, which pushes all the other devices over
+// by one.
+static wstring NativeOutputName(unsigned int index)
 {
-   MidiEvent ev(MidiEvent::NullEvent());
-   bool buffer_empty;
-
-   pthread_mutex_lock(&m_mutex);
-   buffer_empty = m_event_buffer.empty();
-   if (!buffer_empty)
-   {
-      ev = m_event_buffer.front();
-      m_event_buffer.pop();
-   }
-   pthread_mutex_unlock(&m_mutex);
-
-   if (buffer_empty) throw MidiError(MidiError_NoInputAvailable);
-   return ev;
+   if (index == 0) return L"Built-in MIDI Synthesizer";
+   return EndpointName(MIDIGetDestination(index - 1));
 }
 
-
-
-
-static bool built_output_list = false;
-static MidiCommDescriptionList out_list(MidiCommOut::GetDeviceList());
-
-MidiCommDescriptionList MidiCommOut::GetDeviceList()
+// Called from the enumeration thread
+static MidiCommDescriptionList NativeOutputDevices()
 {
-   if (built_output_list) return out_list;
-
    MidiCommDescriptionList devices;
 
-   // Add the built-in synth
-   MidiCommDescription mac_synth;
-   mac_synth.id = 0;
-   mac_synth.name = L"Built-in MIDI Synthesizer";
-   devices.push_back(mac_synth);
-
-   // Add any external devices
+   // Add the built-in synth and then any external devices
    ItemCount destinations = MIDIGetNumberOfDestinations();
-   for (int i = 0; i < destinations; ++i)
+   for (unsigned int i = 0; i <= destinations; ++i)
    {
-      MIDIEndpointRef endpoint = MIDIGetDestination(i);
-
-      CFStringRef cf_name = BuildEndpointName(endpoint);
-      
       MidiCommDescription d;
-      d.id = i + 1;
-      d.name = WideFromMacString(cf_name);
-      CFRelease(cf_name);
+      d.id = i;
+      d.name = NativeOutputName(i);
       
       devices.push_back(d);
    }
 
-   built_output_list = true;
    return devices;
 }
 
 void MidiCommOut::Acquire(unsigned int device_id)
 {
-   m_description = GetDeviceList()[device_id];
-
-   if (m_description.id == 0)
+   if (device_id == 0)
    {
       // Open the Music Device
       AudioComponentDescription compdesc;
@@ -574,7 +525,7 @@ void MidiCommOut::Acquire(unsigned int device_id)
 
 void MidiCommOut::Release()
 {
-   if (m_description.id == 0)
+   if (m_native_index == 0)
    {
       AudioOutputUnitStop(m_output);
 
@@ -595,24 +546,26 @@ void MidiCommOut::Release()
    }
 }
 
-MidiCommOut::MidiCommOut(unsigned int device_id)
+void MidiCommOut::OpenNative(unsigned int device_id)
 {
    Acquire(device_id);
 }
 
-MidiCommOut::~MidiCommOut()
+void MidiCommOut::CloseNative()
 {
    Release();
 }
 
 
-void MidiCommOut::Write(const MidiEvent &out)
+void MidiCommOut::WriteNative(const MidiEvent &out)
 {
    MidiEventSimple simple;
    if (!out.GetSimpleEvent(&simple)) return;
    
-   if (m_description.id == 0)
+   if (m_native_index == 0)
    {
+      // The software synth has no use for clock or transport messages
+      if (out.Type() == MidiEventType_System) return;
       
       MusicDeviceMIDIEvent(m_device, simple.status, simple.byte1, simple.byte2, 0);
       
@@ -660,8 +613,7 @@ void MidiCommOut::Write(const MidiEvent &out)
       
       MIDIPacket *packet = MIDIPacketListInit(packets);
       
-      int messageSize = 3;
-      if (out.Type() == MidiEventType_ProgramChange || out.Type() == MidiEventType_ChannelPressure) messageSize = 2;
+      const int messageSize = out.SimpleEventLength();
       
       const static int MaxMessageSize = 3;
       const Byte message[MaxMessageSize] = { simple.status, simple.byte1, simple.byte2 };
@@ -672,15 +624,711 @@ void MidiCommOut::Write(const MidiEvent &out)
    
 }
 
-void MidiCommOut::Reset()
+void MidiCommOut::ResetNative()
 {
-   const unsigned int id = m_description.id;
    Release();
-   Acquire(id);
+   Acquire(m_native_index);
 }
 
+static void MidiNotification(const MIDINotification *message, void *)
+{
+   if (message->messageID == kMIDIMsgSetupChanged) MidiCommDevices::Refresh();
+}
 
+// CoreMIDI delivers notifications on the run loop of the thread that
+// created the client, so this has to happen on the main thread.
+static void StartDeviceNotifications()
+{
+   static MIDIClientRef notification_client = 0;
+   if (notification_client) return;
 
+   MIDIClientCreate(CFSTR("Piano Game Notifications"), MidiNotification, 0, &notification_client);
+}
 
+#else
+
+// There is no native MIDI support on this platform (yet), so only
+// virtual devices are available.
+
+static wstring NativeInputName(unsigned int)
+{
+   return wstring();
+}
+
+static MidiCommDescriptionList NativeInputDevices()
+{
+   return MidiCommDescriptionList();
+}
+
+void MidiCommIn::OpenNative(unsigned int)
+{
+   throw MidiError(MidiError_MM_NoDevice);
+}
+
+void MidiCommIn::CloseNative()
+{
+}
+
+void MidiCommIn::InputCallback(unsigned int status, unsigned long byte1, unsigned long byte2)
+{
+   InjectEvent(MidiEvent::Build(MidiEventSimple(static_cast<unsigned char>(status),
+      static_cast<unsigned char>(byte1), static_cast<unsigned char>(byte2))));
+}
+
+static wstring NativeOutputName(unsigned int)
+{
+   return wstring();
+}
+
+static MidiCommDescriptionList NativeOutputDevices()
+{
+   return MidiCommDescriptionList();
+}
+
+void MidiCommOut::OpenNative(unsigned int)
+{
+   throw MidiError(MidiError_MM_NoDevice);
+}
+
+void MidiCommOut::CloseNative()
+{
+}
+
+void MidiCommOut::WriteNative(const MidiEvent &)
+{
+}
+
+void MidiCommOut::ResetNative()
+{
+}
+
+static void StartDeviceNotifications()
+{
+}
 
 #endif
+
+
+
+// The OS numbers native devices by their position in its own list, so the
+// same number can belong to a different device after a hot-plug.  We hand
+// out our own ids instead, keyed on the device's name (and which of several
+// same-named devices it is), so an id keeps meaning the same device for as
+// long as the program runs.  Ids are never reused.
+struct NativeDeviceIds
+{
+   NativeDeviceIds() : next(0) { }
+
+   typedef map<pair<wstring, unsigned int>, unsigned int> IdMap;
+   IdMap ids;
+   unsigned int next;
+};
+
+// Swaps the OS index in each description's id for a stable id, keeping the
+// OS index in the parallel indexes list.
+static void AssignStableIds(NativeDeviceIds *ids, MidiCommDescriptionList *devices, vector<unsigned int> *indexes)
+{
+   indexes->clear();
+
+   for (size_t i = 0; i < devices->size(); ++i)
+   {
+      MidiCommDescription &d = (*devices)[i];
+
+      unsigned int occurrence = 0;
+      for (size_t j = 0; j < i; ++j) if ((*devices)[j].name == d.name) ++occurrence;
+
+      const pair<wstring, unsigned int> key(d.name, occurrence);
+      NativeDeviceIds::IdMap::const_iterator found = ids->ids.find(key);
+      if (found == ids->ids.end()) found = ids->ids.insert(make_pair(key, ids->next++)).first;
+
+      indexes->push_back(d.id);
+      d.id = found->second;
+   }
+}
+
+// Everything the enumeration thread shares with the rest of the program.
+// This is allocated once and never freed.  The thread lives as long as
+// the process does, so destroying this during static destruction could
+// pull it out from under the thread.
+struct DeviceEnumerator
+{
+   DeviceEnumerator() : version(0), ready(false), thread(0) { }
+
+   Mutex mutex;
+   Signal refresh;
+
+   // Guarded by mutex.  The indexes are the OS's numbers for each device
+   // in inputs and outputs.
+   MidiCommDescriptionList inputs;
+   MidiCommDescriptionList outputs;
+   vector<unsigned int> input_indexes;
+   vector<unsigned int> output_indexes;
+   unsigned long version;
+   bool ready;
+
+   // Only touched by the enumeration thread
+   NativeDeviceIds input_ids;
+   NativeDeviceIds output_ids;
+
+   Thread *thread;
+};
+
+static bool SameDevices(const MidiCommDescriptionList &a, const MidiCommDescriptionList &b)
+{
+   if (a.size() != b.size()) return false;
+   for (size_t i = 0; i < a.size(); ++i)
+   {
+      if (a[i].id != b[i].id || a[i].name != b[i].name) return false;
+   }
+
+   return true;
+}
+
+static void EnumerationThread(void *context)
+{
+   DeviceEnumerator *e = reinterpret_cast<DeviceEnumerator*>(context);
+
+   while (true)
+   {
+      e->refresh.Wait();
+
+      MidiCommDescriptionList inputs;
+      MidiCommDescriptionList outputs;
+      vector<unsigned int> input_indexes;
+      vector<unsigned int> output_indexes;
+
+      // There is nobody on this thread to report an error to.  If a driver
+      // is misbehaving we keep what we found last time and try again on
+      // the next refresh.
+      bool succeeded = true;
+      try
+      {
+         inputs = NativeInputDevices();
+         outputs = NativeOutputDevices();
+
+         AssignStableIds(&e->input_ids, &inputs, &input_indexes);
+         AssignStableIds(&e->output_ids, &outputs, &output_indexes);
+      }
+      catch (const MidiError &) { succeeded = false; }
+      catch (MidiErrorCode) { succeeded = false; }
+
+      MutexLock lock(e->mutex);
+
+      bool changed = !e->ready;
+      e->ready = true;
+
+      if (succeeded && !(SameDevices(inputs, e->inputs) && SameDevices(outputs, e->outputs)))
+      {
+         e->inputs = inputs;
+         e->outputs = outputs;
+         e->input_indexes = input_indexes;
+         e->output_indexes = output_indexes;
+         changed = true;
+      }
+
+      if (changed)
+      {
+         ++e->version;
+         Wake();
+      }
+   }
+}
+
+static DeviceEnumerator &Enumerator()
+{
+   static DeviceEnumerator *enumerator = 0;
+   if (!enumerator)
+   {
+      enumerator = new DeviceEnumerator;
+      enumerator->thread = new Thread(EnumerationThread, enumerator);
+      enumerator->refresh.Set();
+
+      StartDeviceNotifications();
+   }
+
+   return *enumerator;
+}
+
+static void BumpDeviceVersion()
+{
+   DeviceEnumerator &e = Enumerator();
+
+   {
+      MutexLock lock(e.mutex);
+      ++e.version;
+   }
+
+   Wake();
+}
+
+// Looks the id up in the most recent list and returns the device's
+// description and its current OS index.  A device that has gone away
+// throws rather than opening whatever took its place.
+static MidiCommDescription FindNativeDevice(bool input, unsigned int device_id, unsigned int *native_index)
+{
+   DeviceEnumerator &e = Enumerator();
+
+   MutexLock lock(e.mutex);
+   const MidiCommDescriptionList &devices = (input ? e.inputs : e.outputs);
+   const vector<unsigned int> &indexes = (input ? e.input_indexes : e.output_indexes);
+
+   for (size_t i = 0; i < devices.size(); ++i)
+   {
+      if (devices[i].id != device_id) continue;
+
+      *native_index = indexes[i];
+      return devices[i];
+   }
+
+   throw MidiError(MidiError_MM_BadDeviceID);
+}
+
+void MidiCommDevices::Refresh()
+{
+   Enumerator().refresh.Set();
+}
+
+unsigned long MidiCommDevices::GetVersion()
+{
+   DeviceEnumerator &e = Enumerator();
+
+   MutexLock lock(e.mutex);
+   return e.version;
+}
+
+bool MidiCommDevices::IsReady()
+{
+   DeviceEnumerator &e = Enumerator();
+
+   MutexLock lock(e.mutex);
+   return e.ready;
+}
+
+
+
+MidiCommDescriptionList MidiCommIn::GetDeviceList()
+{
+   DeviceEnumerator &e = Enumerator();
+
+   MidiCommDescriptionList devices;
+   {
+      MutexLock lock(e.mutex);
+      devices = e.inputs;
+   }
+
+   const vector<VirtualInputDevice> &virtuals = VirtualInputDevices();
+   for (unsigned int i = 0; i < virtuals.size(); ++i)
+   {
+      MidiCommDescription d;
+      d.id = VirtualDeviceIdBase + i;
+      d.name = virtuals[i].name;
+
+      devices.push_back(d);
+   }
+
+   return devices;
+}
+
+unsigned int MidiCommIn::RegisterVirtualDevice(const wstring &name, MidiCommInSource *source)
+{
+   VirtualInputDevice d;
+   d.name = name;
+   d.source = source;
+
+   VirtualInputDevices().push_back(d);
+   BumpDeviceVersion();
+
+   return VirtualDeviceIdBase + static_cast<unsigned int>(VirtualInputDevices().size() - 1);
+}
+
+MidiCommIn::MidiCommIn(unsigned int device_id) : m_dropped_events(0), m_source(0), m_native_index(0)
+{
+   if (device_id < VirtualDeviceIdBase)
+   {
+      m_description = FindNativeDevice(true, device_id, &m_native_index);
+
+      // The list may not have caught up with a device that was just
+      // unplugged, in which case its index could already belong to
+      // another one.
+      if (NativeInputName(m_native_index) != m_description.name) throw MidiError(MidiError_MM_BadDeviceID);
+
+      OpenNative(m_native_index);
+      return;
+   }
+
+   const unsigned int index = device_id - VirtualDeviceIdBase;
+   if (index >= VirtualInputDevices().size()) throw MidiError(MidiError_MM_BadDeviceID);
+
+   m_description.id = device_id;
+   m_description.name = VirtualInputDevices()[index].name;
+
+   m_source = VirtualInputDevices()[index].source;
+   m_source->Attach(this);
+}
+
+MidiCommIn::~MidiCommIn()
+{
+   if (m_source) m_source->Detach(this);
+   else CloseNative();
+}
+
+void MidiCommIn::InjectEvent(const MidiEvent &ev)
+{
+   InjectEvent(ev, Compatible::GetMicroseconds());
+}
+
+void MidiCommIn::InjectEvent(const MidiEvent &ev, microseconds_t timestamp)
+{
+   // Clock and active sensing from a keyboard would only crowd the buffer
+   if (ev.Type() == MidiEventType_System) return;
+
+   BufferedEvent buffered;
+   if (!ev.GetSimpleEvent(&buffered.simple)) return;
+   buffered.timestamp = timestamp;
+
+   if (!m_event_buffer.Push(buffered))
+   {
+      Atomic::Increment(&m_dropped_events);
+      return;
+   }
+
+   Wake();
+}
+
+void MidiCommIn::SetWakeCallback(void (*callback)())
+{
+   wake_callback = callback;
+}
+
+void MidiCommIn::Reset()
+{
+   m_event_buffer.Clear();
+}
+
+bool MidiCommIn::KeepReading() const
+{
+   return (!m_event_buffer.Empty());
+}
+
+microseconds_t MidiCommIn::NextTimestamp() const
+{
+   if (m_event_buffer.Empty()) throw MidiError(MidiError_NoInputAvailable);
+   return m_event_buffer.Front().timestamp;
+}
+
+unsigned long MidiCommIn::DroppedEventCount() const
+{
+   return static_cast<unsigned long>(Atomic::Read(&m_dropped_events));
+}
+
+MidiEvent MidiCommIn::Read()
+{
+   if (m_event_buffer.Empty()) throw MidiError(MidiError_NoInputAvailable);
+
+   const MidiEvent ev = MidiEvent::Build(m_event_buffer.Front().simple);
+   m_event_buffer.Pop();
+
+   return ev;
+}
+
+MidiCommInGroup::~MidiCommInGroup()
+{
+   for (size_t i = 0; i < m_devices.size(); ++i) delete m_devices[i];
+}
+
+void MidiCommInGroup::Add(MidiCommIn *device)
+{
+   m_devices.push_back(device);
+}
+
+int MidiCommInGroup::IndexOf(unsigned int device_id) const
+{
+   for (size_t i = 0; i < m_devices.size(); ++i)
+   {
+      if (m_devices[i]->GetDeviceDescription().id == device_id) return static_cast<int>(i);
+   }
+
+   return -1;
+}
+
+bool MidiCommInGroup::KeepReading() const
+{
+   for (size_t i = 0; i < m_devices.size(); ++i)
+   {
+      if (m_devices[i]->KeepReading()) return true;
+   }
+
+   return false;
+}
+
+MidiCommInEvent MidiCommInGroup::Read()
+{
+   // Each device's queue is already in arrival order, so the next event
+   // overall is whichever device's next event arrived first.
+   MidiCommIn *earliest = 0;
+   microseconds_t earliest_time = 0;
+   for (size_t i = 0; i < m_devices.size(); ++i)
+   {
+      if (!m_devices[i]->KeepReading()) continue;
+
+      const microseconds_t t = m_devices[i]->NextTimestamp();
+      if (earliest && t >= earliest_time) continue;
+
+      earliest = m_devices[i];
+      earliest_time = t;
+   }
+
+   if (!earliest) throw MidiError(MidiError_NoInputAvailable);
+
+   MidiCommInEvent ev;
+   ev.timestamp = earliest_time;
+   ev.device_id = earliest->GetDeviceDescription().id;
+   ev.event = earliest->Read();
+
+   return ev;
+}
+
+void MidiCommInGroup::Reset()
+{
+   for (size_t i = 0; i < m_devices.size(); ++i) m_devices[i]->Reset();
+}
+
+MidiCommDescriptionList MidiCommOut::GetDeviceList()
+{
+   DeviceEnumerator &e = Enumerator();
+
+   MidiCommDescriptionList devices;
+   {
+      MutexLock lock(e.mutex);
+      devices = e.outputs;
+   }
+
+   const vector<VirtualOutputDevice> &virtuals = VirtualOutputDevices();
+   for (unsigned int i = 0; i < virtuals.size(); ++i)
+   {
+      MidiCommDescription d;
+      d.id = VirtualDeviceIdBase + i;
+      d.name = virtuals[i].name;
+
+      devices.push_back(d);
+   }
+
+   return devices;
+}
+
+unsigned int MidiCommOut::RegisterVirtualDevice(const wstring &name, MidiCommOutSink *sink)
+{
+   VirtualOutputDevice d;
+   d.name = name;
+   d.sink = sink;
+
+   VirtualOutputDevices().push_back(d);
+   BumpDeviceVersion();
+
+   return VirtualDeviceIdBase + static_cast<unsigned int>(VirtualOutputDevices().size() - 1);
+}
+
+MidiCommOut::MidiCommOut(unsigned int device_id) : m_sink(0), m_native_index(0)
+{
+   if (device_id < VirtualDeviceIdBase)
+   {
+      m_description = FindNativeDevice(false, device_id, &m_native_index);
+      if (NativeOutputName(m_native_index) != m_description.name) throw MidiError(MidiError_MM_BadDeviceID);
+
+      OpenNative(m_native_index);
+      return;
+   }
+
+   const unsigned int index = device_id - VirtualDeviceIdBase;
+   if (index >= VirtualOutputDevices().size()) throw MidiError(MidiError_MM_BadDeviceID);
+
+   m_description.id = device_id;
+   m_description.name = VirtualOutputDevices()[index].name;
+
+   m_sink = VirtualOutputDevices()[index].sink;
+   m_sink->Open();
+}
+
+MidiCommOut::~MidiCommOut()
+{
+   if (m_sink) m_sink->Close();
+   else CloseNative();
+}
+
+void MidiCommOut::Write(const MidiEvent &out)
+{
+   if (m_sink) m_sink->Write(out);
+   else WriteNative(out);
+}
+
+void MidiCommOut::Reset()
+{
+   if (m_sink) m_sink->Reset();
+   else ResetNative();
+}
+
+void MidiCommOut::PrepareSong(const Midi &song)
+{
+   if (m_sink) m_sink->PrepareSong(song);
+}
+
+void MidiCommOut::SongPosition(microseconds_t song_position)
+{
+   if (m_sink) m_sink->SongPosition(song_position);
+}
+
+wstring MidiCommOut::Status() const
+{
+   if (m_sink) return m_sink->Status();
+   return L"";
+}
+
+MidiCommOutWorker::MidiCommOutWorker(MidiCommOut &device, DispatchTiming *timing)
+   : m_device(device), m_timing(timing), m_stop(0), m_dropped_events(0), m_reset_pending(0), m_error(-1), m_thread(0)
+{
+   m_thread = new Thread(Run, this);
+}
+
+MidiCommOutWorker::~MidiCommOutWorker()
+{
+   Atomic::CompareAndSwap(&m_stop, 0, 1);
+   m_wake.Set();
+
+   delete m_thread;
+}
+
+void MidiCommOutWorker::Write(const MidiEvent &out, size_t track_id, microseconds_t intended)
+{
+   ThrowPendingError();
+
+   Command c;
+   c.reset = false;
+   c.track_id = track_id;
+   c.intended = intended;
+   if (!out.GetSimpleEvent(&c.simple)) return;
+
+   // Keep the last stretch of the queue for the events that end notes
+   const bool note_on = (out.Type() == MidiEventType_NoteOn && out.NoteVelocity() > 0);
+   if (note_on && m_queue.Size() >= NoteOnLimit)
+   {
+      Atomic::Increment(&m_dropped_events);
+      return;
+   }
+
+   // Losing anything else could leave a note stuck on
+   if (!Queue(c) && !note_on) RequestReset();
+}
+
+void MidiCommOutWorker::Reset()
+{
+   ThrowPendingError();
+
+   Command c;
+   c.reset = true;
+   c.track_id = 0;
+   c.intended = 0;
+
+   if (!Queue(c)) RequestReset();
+}
+
+unsigned long MidiCommOutWorker::DroppedEventCount() const
+{
+   return static_cast<unsigned long>(Atomic::Read(&m_dropped_events));
+}
+
+bool MidiCommOutWorker::Queue(const Command &command)
+{
+   if (Atomic::Read(&m_reset_pending))
+   {
+      // The pending reset has to go out before anything written after it
+      if (m_queue.Full())
+      {
+         Atomic::Increment(&m_dropped_events);
+         m_wake.Set();
+         return false;
+      }
+
+      // Only the worker can change the queue now, and only by emptying
+      // it, so there is sure to be room.  If the worker got to the flag
+      // first, it has already handled the reset itself.
+      Command reset;
+      reset.reset = true;
+      reset.track_id = 0;
+      reset.intended = 0;
+      if (Atomic::CompareAndSwap(&m_reset_pending, 1, 0)) m_queue.Push(reset);
+   }
+
+   const bool queued = m_queue.Push(command);
+   if (!queued) Atomic::Increment(&m_dropped_events);
+
+   m_wake.Set();
+   return queued;
+}
+
+void MidiCommOutWorker::RequestReset()
+{
+   Atomic::Write(&m_reset_pending, 1);
+   m_wake.Set();
+}
+
+void MidiCommOutWorker::ThrowPendingError()
+{
+   const long error = Atomic::Read(&m_error);
+   if (error >= 0) throw MidiError(static_cast<MidiErrorCode>(error));
+}
+
+void MidiCommOutWorker::Send(const Command &c)
+{
+   // There's nobody on this thread to report to, so hang on to the first
+   // error for the caller to find.
+   try
+   {
+      if (c.reset) m_device.Reset();
+      else
+      {
+         const MidiEvent ev = MidiEvent::Build(c.simple);
+         m_device.Write(ev);
+
+         if (m_timing && c.intended != 0) m_timing->Record(c.track_id, ev.Type(), Compatible::GetMicroseconds() - c.intended);
+      }
+   }
+   catch (const MidiError &e) { Atomic::CompareAndSwap(&m_error, -1, e.m_error); }
+   catch (const PianoGameError &) { Atomic::CompareAndSwap(&m_error, -1, MidiError_MM_Unknown); }
+}
+
+void MidiCommOutWorker::Run(void *context)
+{
+   reinterpret_cast<MidiCommOutWorker*>(context)->Run();
+}
+
+void MidiCommOutWorker::Run()
+{
+   for (;;)
+   {
+      m_wake.Wait();
+
+      while (!m_queue.Empty())
+      {
+         const Command c = m_queue.Front();
+         m_queue.Pop();
+
+         Send(c);
+      }
+
+      // A reset that didn't fit in the queue.  Everything written before
+      // it has gone out now, and nothing after it has been queued yet.
+      if (Atomic::CompareAndSwap(&m_reset_pending, 1, 0))
+      {
+         Command reset;
+         reset.reset = true;
+         reset.track_id = 0;
+         reset.intended = 0;
+
+         Send(reset);
+      }
+
+      // Checked only after the queue is empty so everything written
+      // before the destructor was called still goes out.
+      if (Atomic::Read(&m_stop)) return;
+   }
+}
@@ -7,16 +7,20 @@
 
 #include <string>
 #include <vector>
-#include <queue>
 
 #include "../os.h"
+#include "../Threading.h"
 
-#ifndef WIN32
+#ifdef __APPLE__
 #include <AudioUnit/AudioUnit.h>
 #include <CoreMIDI/CoreMIDI.h>
 #endif
 
 #include "MidiEvent.h"
+#include "MidiTypes.h"
+
+class Midi;
+class DispatchTiming;
 
 struct MidiCommDescription
 {
@@ -25,17 +29,108 @@ struct MidiCommDescription
 };
 
 typedef std::vector<MidiCommDescription> MidiCommDescriptionList;
-typedef std::queue<MidiEvent> MidiEventQueue;
+
+// An input event tagged with where and when it arrived
+struct MidiCommInEvent
+{
+   MidiEvent event;
+   unsigned int device_id;
+
+   // Compatible::GetMicroseconds() at the moment the event arrived
+   microseconds_t timestamp;
+};
+
+class MidiCommIn;
+
+// Native devices are enumerated on a background thread so that slow or
+// misbehaving drivers can't hold up startup (or a frame).  GetDeviceList()
+// always returns immediately with the most recent results, which will be
+// empty until the first enumeration finishes.
+namespace MidiCommDevices
+{
+   // Asks for the native device lists to be rebuilt.  This is called
+   // automatically the first time a list is requested and whenever the
+   // OS tells us devices were added or removed.  Calling it early during
+   // startup lets enumeration overlap other initialization.
+   void Refresh();
+
+   // Incremented every time either device list changes.  Poll this to
+   // find out when a displayed list needs to be rebuilt.
+   unsigned long GetVersion();
+
+   // Whether the first native enumeration has finished
+   bool IsReady();
+};
+
+// Virtual devices live entirely inside this process (test stand-ins,
+// software instruments, etc.).  Once registered, they are listed after
+// all of the native devices and can be opened like any other.  Their ids
+// don't depend on which native devices happen to be connected.
+
+// Attach() is called when a MidiCommIn opens this device and Detach()
+// when it closes.  While attached, the source delivers its events by
+// calling MidiCommIn::InjectEvent() from whatever thread it likes.
+class MidiCommInSource
+{
+public:
+   virtual ~MidiCommInSource() { }
+
+   virtual void Attach(MidiCommIn *input) = 0;
+   virtual void Detach(MidiCommIn *input) = 0;
+};
+
+// Receives everything written to a MidiCommOut that opened this device.
+// Write() is called synchronously from MidiCommOut::Write().
+//
+// Open() is called when a MidiCommOut opens this device and Close() when
+// it closes.  Several may have it open at once, so sinks with expensive
+// machinery behind them (like an audio thread) should count.
+class MidiCommOutSink
+{
+public:
+   virtual ~MidiCommOutSink() { }
+
+   virtual void Open() { }
+   virtual void Close() { }
+
+   virtual void Write(const MidiEvent &out) = 0;
+   virtual void Reset() { }
+
+   // Sinks that render the song themselves (like the built-in synth) can
+   // use these to get ready for what's coming.  They're called from the
+   // game thread, which isn't necessarily the one calling Write().
+   virtual void PrepareSong(const Midi &) { }
+   virtual void SongPosition(microseconds_t) { }
+
+   // A line for the playing screen's debug overlay, or empty
+   virtual std::wstring Status() const { return L""; }
+};
 
 // Once you create a MidiCommIn object, MIDI events are read continuously
 // in a separate thread and stored in a buffer.  Use the Read() function
 // to grab one event at a time from the buffer.
+//
+// The buffer is a fixed-size lock-free queue, so the driver's thread never
+// waits on the game.  If the game falls so far behind that the buffer
+// fills, new events are dropped (and counted) until there is room.
 class MidiCommIn
 {
 public:
    static MidiCommDescriptionList GetDeviceList();
 
-   // device_id is obtained from GetDeviceList()
+   // Returns the new device's id.  The source must outlive any
+   // MidiCommIn that opens it.
+   static unsigned int RegisterVirtualDevice(const std::wstring &name, MidiCommInSource *source);
+
+   // Called every time an input event is buffered or either device list
+   // changes, so a main loop that sleeps while idle can wake up for it.
+   // It runs on whatever thread the news arrived on (often a driver
+   // callback), so it must be quick and must not block.  Null turns it
+   // off.
+   static void SetWakeCallback(void (*callback)());
+
+   // device_id is obtained from GetDeviceList().  Opening a native device
+   // that isn't in the most recent list throws MidiError_MM_BadDeviceID.
    MidiCommIn(unsigned int device_id);
    ~MidiCommIn();
 
@@ -52,6 +147,23 @@ public:
    // Returns whether the input device has more buffered events.
    bool KeepReading() const;
 
+   // When the event Read() will return next arrived.  Only valid when
+   // KeepReading() is true.
+   microseconds_t NextTimestamp() const;
+
+   // How many events were lost because the buffer was full
+   unsigned long DroppedEventCount() const;
+
+   // Adds an event to the end of the input buffer exactly as if it had
+   // just arrived from the device.  Only simple (non-SysEx, non-meta)
+   // events are kept.  This may be called from any thread, but only one
+   // thread may be injecting events into a given device at a time.
+   void InjectEvent(const MidiEvent &ev);
+
+   // The same, but as if it had arrived at the given time instead of now
+   // (for replaying recorded input)
+   void InjectEvent(const MidiEvent &ev, microseconds_t timestamp);
+
    // Internal callback, do not use!
    //
    // NOTE: The Mac implementation of this class uses this callback
@@ -62,27 +174,87 @@ public:
    void InputCallback(unsigned int msg, unsigned long p1, unsigned long p2);
 
 private:
+   void OpenNative(unsigned int device_id);
+   void CloseNative();
+
    MidiCommDescription m_description;
 
-   MidiEventQueue m_event_buffer;
+   struct BufferedEvent
+   {
+      MidiEventSimple simple;
+      microseconds_t timestamp;
+   };
+
+   const static long BufferSize = 1024;
+   LockFreeQueue<BufferedEvent, BufferSize> m_event_buffer;
+   volatile long m_dropped_events;
+
+   // Non-zero if this is a virtual device
+   MidiCommInSource *m_source;
+
+   // The OS's number for a native device.  Unlike m_description.id, this
+   // can change when devices come and go, so it's only good while open.
+   unsigned int m_native_index;
 
 #ifdef WIN32
    HMIDIIN m_input_device;
-   mutable CRITICAL_SECTION m_buffer_mutex;
-#else
+#elif defined __APPLE__
    MIDIClientRef m_client;
    MIDIPortRef m_port;
-   mutable pthread_mutex_t m_mutex;
 #endif
 
 };
 
+// Several input devices read as though they were one.  Read() returns
+// events from all of them in the order they arrived, each tagged with the
+// id of the device it came from.  Every device keeps buffering into its
+// own queue, so each additional device only costs one more queue to look
+// at per Read().
+class MidiCommInGroup
+{
+public:
+   MidiCommInGroup() { }
+
+   // Closes every device in the group
+   ~MidiCommInGroup();
+
+   // The group takes ownership of the device
+   void Add(MidiCommIn *device);
+
+   size_t Count() const { return m_devices.size(); }
+   const MidiCommIn &Device(size_t index) const { return *m_devices[index]; }
+
+   // Returns the position of the device with the given id within the
+   // group, or -1 if it isn't part of it.
+   int IndexOf(unsigned int device_id) const;
+
+   // Returns the earliest buffered event from any device.  Throws
+   // MidiError_NoInputAvailable if KeepReading() is false.
+   MidiCommInEvent Read();
+
+   bool KeepReading() const;
+
+   // Discards buffered events from every device
+   void Reset();
+
+private:
+   MidiCommInGroup(const MidiCommInGroup&);
+   MidiCommInGroup &operator=(const MidiCommInGroup&);
+
+   std::vector<MidiCommIn*> m_devices;
+};
+
 class MidiCommOut
 {
 public:
    static MidiCommDescriptionList GetDeviceList();
 
-   // device_id is obtained from GetDeviceList()
+   // Returns the new device's id.  The sink must outlive any
+   // MidiCommOut that opens it.
+   static unsigned int RegisterVirtualDevice(const std::wstring &name, MidiCommOutSink *sink);
+
+   // device_id is obtained from GetDeviceList().  Opening a native device
+   // that isn't in the most recent list throws MidiError_MM_BadDeviceID.
    MidiCommOut(unsigned int device_id);
    ~MidiCommOut();
 
@@ -94,12 +266,29 @@ public:
    // Turns all notes off and resets all controllers
    void Reset();
 
+   // Passed along to virtual devices' sinks.  Hardware has no use for
+   // them, so they do nothing there.
+   void PrepareSong(const Midi &song);
+   void SongPosition(microseconds_t song_position);
+   std::wstring Status() const;
+
 private:
+   void OpenNative(unsigned int device_id);
+   void CloseNative();
+   void WriteNative(const MidiEvent &out);
+   void ResetNative();
+
    MidiCommDescription m_description;
 
+   // Non-zero if this is a virtual device
+   MidiCommOutSink *m_sink;
+
+   // The OS's number for a native device (see MidiCommIn)
+   unsigned int m_native_index;
+
 #ifdef WIN32
    HMIDIOUT m_output_device;
-#else
+#elif defined __APPLE__
    void Acquire(unsigned int device_id);
    void Release();
 
@@ -113,4 +302,85 @@ private:
 
 };
 
+// Feeds a MidiCommOut from its own thread.  Write() and Reset() only queue
+// the request and return immediately, so a slow or saturated device can't
+// hold up the caller (or any other device with its own worker).
+//
+// Only one thread may call Write() and Reset(), and the device must not be
+// used directly while a worker owns it.
+//
+// When the queue fills up, something has to be dropped (and counted).
+// New notes go first: once the queue is three-quarters full, note-ons
+// are turned away so note-offs and controller changes still fit.  If
+// even those don't fit, or a Reset() doesn't, the device is reset as
+// soon as the worker has caught up, so nothing is left hanging.
+//
+// Because the caller only queues events, it can't tell when they really
+// went out.  Events written with an intended send time have their
+// lateness recorded in the DispatchTiming (on the worker's thread) once
+// the device has taken them.
+class MidiCommOutWorker
+{
+public:
+   // The device (and timing, which may be null) must outlive the worker
+   MidiCommOutWorker(MidiCommOut &device, DispatchTiming *timing = 0);
+
+   // Delivers anything still queued before returning
+   ~MidiCommOutWorker();
+
+   // Errors from the device surface here, on the next call after the
+   // worker ran into them.
+   //
+   // intended is when the event should have been sent (on the
+   // Compatible::GetMicroseconds() clock), or zero if it isn't timed.
+   // track_id is only used to file the timing.
+   void Write(const MidiEvent &out, size_t track_id = 0, microseconds_t intended = 0);
+   void Reset();
+
+   MidiCommOut &Device() { return m_device; }
+   const MidiCommOut &Device() const { return m_device; }
+   unsigned long DroppedEventCount() const;
+
+private:
+   MidiCommOutWorker(const MidiCommOutWorker&);
+   MidiCommOutWorker &operator=(const MidiCommOutWorker&);
+
+   struct Command
+   {
+      bool reset;
+      MidiEventSimple simple;
+
+      size_t track_id;
+      microseconds_t intended;
+   };
+
+   static void Run(void *context);
+   void Run();
+
+   bool Queue(const Command &command);
+   void RequestReset();
+   void Send(const Command &command);
+   void ThrowPendingError();
+
+   MidiCommOut &m_device;
+   DispatchTiming *m_timing;
+
+   const static long QueueSize = 4096;
+   const static long NoteOnLimit = QueueSize * 3 / 4;
+   LockFreeQueue<Command, QueueSize> m_queue;
+   Signal m_wake;
+
+   volatile long m_stop;
+   volatile long m_dropped_events;
+
+   // Set when a reset couldn't be queued.  Nothing more is queued until
+   // it has been taken care of, by whichever thread gets to it first.
+   volatile long m_reset_pending;
+
+   // The first MidiErrorCode the worker hit, or -1
+   volatile long m_error;
+
+   Thread *m_thread;
+};
+
 #endif
@@ -34,9 +34,10 @@ MidiEvent MidiEvent::ReadFromStream(istream &stream, unsigned char last_status,
 
    switch (ev.Type())
    {
-   case MidiEventType_Meta:  ev.ReadMeta(stream);      break;
-   case MidiEventType_SysEx: ev.ReadSysEx(stream);     break;
-   default:                  ev.ReadStandard(stream);  break;
+   case MidiEventType_Meta:   ev.ReadMeta(stream);      break;
+   case MidiEventType_SysEx:
+   case MidiEventType_System: ev.ReadSysEx(stream);     break;
+   default:                   ev.ReadStandard(stream);  break;
    }
 
    return ev;
@@ -184,9 +185,28 @@ bool MidiEvent::GetSimpleEvent(MidiEventSimple *simple) const
    return true;
 }
 
+int MidiEvent::SimpleEventLength() const
+{
+   switch (Type())
+   {
+   case MidiEventType_ProgramChange:
+   case MidiEventType_ChannelPressure:
+      return 2;
+
+   case MidiEventType_System:
+      if (m_status == 0xF2) return 3;              // Song Position Pointer
+      if (m_status == 0xF1 || m_status == 0xF3) return 2;
+      return 1;
+
+   default:
+      return 3;
+   }
+}
+
 MidiEventType MidiEvent::Type() const
 {
-   if (m_status >  0xEF && m_status < 0xFF) return MidiEventType_SysEx;
+   if (m_status == 0xF0 || m_status == 0xF7) return MidiEventType_SysEx;
+   if (m_status >  0xF0 && m_status < 0xFF) return MidiEventType_System;
    if (m_status <  0x80) return MidiEventType_Unknown;
    if (m_status == 0xFF) return MidiEventType_Meta;
 
@@ -37,6 +37,9 @@ public:
    // return false for Meta and SysEx events.)
    bool GetSimpleEvent(MidiEventSimple *simple) const;
 
+   // How many bytes of a simple event are actually sent (1 to 3)
+   int SimpleEventLength() const;
+
    MidiEventType Type() const;
    unsigned long GetDeltaPulses() const { return m_delta_pulses; }
 
@@ -231,7 +231,7 @@ void MidiTrack::Reset()
    m_notes_remaining = static_cast<unsigned int>(m_note_set.size());
 }
 
-MidiEventList MidiTrack::Update(microseconds_t delta_microseconds)
+MidiEventList MidiTrack::Update(microseconds_t delta_microseconds, MidiEventMicrosecondList *event_times)
 {
    m_running_microseconds += delta_microseconds;
 
@@ -241,6 +241,7 @@ MidiEventList MidiTrack::Update(microseconds_t delta_microseconds)
       if (m_event_usecs[i] <= m_running_microseconds)
       {
          evs.push_back(m_events[i]);
+         if (event_times) event_times->push_back(m_event_usecs[i]);
          m_last_event = static_cast<long>(i);
 
          if (m_events[i].Type() == MidiEventType_NoteOn &&
@@ -46,7 +46,9 @@ public:
    bool hasNotes() const { return (m_note_set.size() > 0); }
 
    void Reset();
-   MidiEventList Update(microseconds_t delta_microseconds);
+   // If event_times is given, the song time (in microseconds) that each of
+   // the returned events was scheduled for is appended to it.
+   MidiEventList Update(microseconds_t delta_microseconds, MidiEventMicrosecondList *event_times = 0);
 
    unsigned int AggregateEventsRemain() const { return static_cast<unsigned int>(m_events.size() - (m_last_event + 1)); }
    unsigned int AggregateEventCount() const { return static_cast<unsigned int>(m_events.size()); }
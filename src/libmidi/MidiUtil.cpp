@@ -5,7 +5,7 @@
 #include "MidiUtil.h"
 #include "../string_util.h"
 
-#ifndef WIN32
+#ifdef __APPLE__
 #include <CoreFoundation/CFByteOrder.h>
 #endif
 
@@ -13,7 +13,8 @@ using namespace std;
 
 unsigned long BigToSystem32(unsigned long x) 
 {
-#ifdef WIN32
+   // Everything other than the Mac is assumed to be little-endian
+#ifndef __APPLE__
    return ((((x) & 0x00ff0000) >> 8 )  |
           (( (x) & 0x0000ff00) << 8 )  |
           (( (x) & 0xff000000) >> 24)  |
@@ -25,7 +26,7 @@ unsigned long BigToSystem32(unsigned long x)
 
 unsigned short BigToSystem16(unsigned short x)
 {
-#ifdef WIN32
+#ifndef __APPLE__
    return ((((x) & 0xff00) >> 8) |
           (( (x) & 0x00ff) << 8));
 #else
@@ -102,6 +103,7 @@ std::wstring GetMidiEventTypeDescription(MidiEventType type)
    {
    case MidiEventType_Meta:             return L"Meta";
    case MidiEventType_SysEx:            return L"System Exclusive";
+   case MidiEventType_System:           return L"System";
 
    case MidiEventType_NoteOff:          return L"Note-Off";
    case MidiEventType_NoteOn:           return L"Note-On";
@@ -80,6 +80,10 @@ enum MidiEventType
    MidiEventType_SysEx,
    MidiEventType_Unknown,
 
+   // System common and real-time messages (clock, Start/Stop, song
+   // position, etc.).  These never appear in a file.
+   MidiEventType_System,
+
    MidiEventType_NoteOff,
    MidiEventType_NoteOn,
    MidiEventType_Aftertouch,
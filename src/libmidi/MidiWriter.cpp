@@ -0,0 +1,157 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "MidiWriter.h"
+#include "../CompatibleSystem.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+using namespace std;
+
+static void WriteBig32(ostream &out, unsigned long value)
+{
+   out.put(static_cast<char>((value >> 24) & 0xFF));
+   out.put(static_cast<char>((value >> 16) & 0xFF));
+   out.put(static_cast<char>((value >>  8) & 0xFF));
+   out.put(static_cast<char>( value        & 0xFF));
+}
+
+static void WriteBig16(ostream &out, unsigned short value)
+{
+   out.put(static_cast<char>((value >> 8) & 0xFF));
+   out.put(static_cast<char>( value       & 0xFF));
+}
+
+// The inverse of parse_variable_length
+static void WriteVariableLength(ostream &out, unsigned long value)
+{
+   unsigned char bytes[5];
+   int count = 0;
+
+   bytes[count++] = static_cast<unsigned char>(value & 0x7F);
+   while (value >>= 7) bytes[count++] = static_cast<unsigned char>((value & 0x7F) | 0x80);
+
+   while (count > 0) out.put(static_cast<char>(bytes[--count]));
+}
+
+MidiWriter::MidiWriter(unsigned short pulses_per_quarter_note, unsigned long tempo_us_per_qn)
+   : m_pulses_per_quarter_note(pulses_per_quarter_note), m_tempo_us_per_qn(tempo_us_per_qn), m_next_order(0)
+{ }
+
+MidiWriter::TrackData &MidiWriter::Track(size_t track)
+{
+   if (track >= m_tracks.size()) m_tracks.resize(track + 1);
+   return m_tracks[track];
+}
+
+void MidiWriter::SetTrackName(size_t track, const string &name)
+{
+   Track(track).name = name;
+}
+
+void MidiWriter::AddEvent(size_t track, microseconds_t time, const MidiEvent &ev)
+{
+   // System messages aren't allowed in a standard MIDI file
+   MidiEventSimple simple;
+   if (ev.Type() == MidiEventType_System || !ev.GetSimpleEvent(&simple)) return;
+
+   if (time < 0) time = 0;
+
+   TimedEvent e;
+   e.pulses = static_cast<unsigned long>(time * m_pulses_per_quarter_note / m_tempo_us_per_qn);
+   e.order = m_next_order++;
+   e.simple = simple;
+
+   Track(track).events.push_back(e);
+}
+
+void MidiWriter::WriteTrack(ostream &out, const string &track_data)
+{
+   out.write("MTrk", 4);
+   WriteBig32(out, static_cast<unsigned long>(track_data.length()));
+   out.write(track_data.data(), static_cast<streamsize>(track_data.length()));
+}
+
+void MidiWriter::Write(ostream &out) const
+{
+   // Always write at least the tempo track
+   const size_t track_count = max(m_tracks.size(), static_cast<size_t>(1));
+
+   out.write("MThd", 4);
+   WriteBig32(out, 6);
+   WriteBig16(out, 1);
+   WriteBig16(out, static_cast<unsigned short>(track_count));
+   WriteBig16(out, m_pulses_per_quarter_note);
+
+   for (size_t t = 0; t < track_count; ++t)
+   {
+      ostringstream data;
+
+      if (t == 0)
+      {
+         WriteVariableLength(data, 0);
+         data.put(static_cast<char>(0xFF));
+         data.put(static_cast<char>(MidiMetaEvent_TempoChange));
+         data.put(3);
+         data.put(static_cast<char>((m_tempo_us_per_qn >> 16) & 0xFF));
+         data.put(static_cast<char>((m_tempo_us_per_qn >>  8) & 0xFF));
+         data.put(static_cast<char>( m_tempo_us_per_qn        & 0xFF));
+      }
+
+      if (t < m_tracks.size())
+      {
+         const TrackData &track = m_tracks[t];
+
+         if (track.name.length() > 0)
+         {
+            WriteVariableLength(data, 0);
+            data.put(static_cast<char>(0xFF));
+            data.put(static_cast<char>(MidiMetaEvent_TrackName));
+            WriteVariableLength(data, static_cast<unsigned long>(track.name.length()));
+            data.write(track.name.data(), static_cast<streamsize>(track.name.length()));
+         }
+
+         vector<TimedEvent> events = track.events;
+         sort(events.begin(), events.end());
+
+         unsigned long last_pulses = 0;
+         for (vector<TimedEvent>::const_iterator i = events.begin(); i != events.end(); ++i)
+         {
+            const MidiEventSimple &s = i->simple;
+
+            // System messages don't belong in a track
+            if (s.status < 0x80 || s.status >= 0xF0) continue;
+
+            WriteVariableLength(data, i->pulses - last_pulses);
+            last_pulses = i->pulses;
+
+            data.put(static_cast<char>(s.status));
+            data.put(static_cast<char>(s.byte1));
+
+            // Program change and channel pressure only have one data byte
+            const unsigned char kind = s.status & 0xF0;
+            if (kind != 0xC0 && kind != 0xD0) data.put(static_cast<char>(s.byte2));
+         }
+      }
+
+      WriteVariableLength(data, 0);
+      data.put(static_cast<char>(0xFF));
+      data.put(static_cast<char>(MidiMetaEvent_EndOfTrack));
+      data.put(0);
+
+      WriteTrack(out, data.str());
+   }
+}
+
+bool MidiWriter::WriteFile(const wstring &filename) const
+{
+   ofstream file;
+   Compatible::OpenFile(file, filename, ios::out | ios::binary | ios::trunc);
+
+   if (!file.good()) return false;
+
+   Write(file);
+   return file.good();
+}
@@ -0,0 +1,67 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __MIDI_WRITER_H
+#define __MIDI_WRITER_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "MidiEvent.h"
+#include "MidiTypes.h"
+
+// Builds a standard (type 1) MIDI file out of events stamped with song
+// times in microseconds.  Everything is written at a single fixed tempo,
+// so with the defaults each pulse is exactly one millisecond.
+class MidiWriter
+{
+public:
+   MidiWriter(unsigned short pulses_per_quarter_note = 500, unsigned long tempo_us_per_qn = 500000);
+
+   // Tracks are created as needed and events may be added in any order.
+   // Meta and SysEx events are ignored.  Negative times are clamped to
+   // the start of the song.
+   void AddEvent(size_t track, microseconds_t time, const MidiEvent &ev);
+   void SetTrackName(size_t track, const std::string &name);
+
+   size_t TrackCount() const { return m_tracks.size(); }
+
+   void Write(std::ostream &out) const;
+
+   // Returns false if the file couldn't be written
+   bool WriteFile(const std::wstring &filename) const;
+
+private:
+   struct TimedEvent
+   {
+      unsigned long pulses;
+      size_t order;
+      MidiEventSimple simple;
+
+      bool operator<(const TimedEvent &rhs) const
+      {
+         if (pulses < rhs.pulses) return true;
+         if (pulses > rhs.pulses) return false;
+         return order < rhs.order;
+      }
+   };
+
+   struct TrackData
+   {
+      std::string name;
+      std::vector<TimedEvent> events;
+   };
+
+   TrackData &Track(size_t track);
+   static void WriteTrack(std::ostream &out, const std::string &track_data);
+
+   unsigned short m_pulses_per_quarter_note;
+   unsigned long m_tempo_us_per_qn;
+
+   size_t m_next_order;
+   std::vector<TrackData> m_tracks;
+};
+
+#endif
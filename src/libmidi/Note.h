@@ -5,7 +5,9 @@
 #ifndef __MIDI_NOTE_H
 #define __MIDI_NOTE_H
 
+#include <cstddef>
 #include <set>
+#include <vector>
 #include "MidiTypes.h"
 
 // Range of all 128 MIDI notes possible
@@ -51,8 +53,6 @@ struct GenericNote
    // play the user's input correctly
    unsigned char channel;
    int velocity;
-
-   NoteState state;
 };
 
 // Note keeps the internal pulses found in the MIDI file which are
@@ -65,4 +65,14 @@ typedef GenericNote<microseconds_t> TranslatedNote;
 typedef std::set<Note, Note> NoteSet;
 typedef std::set<TranslatedNote, TranslatedNote> TranslatedNoteSet;
 
+// A song's notes, in the same order as its TranslatedNoteSet.  Notes are
+// referred to by their position in the list (not to be confused with
+// their NoteId, which is their pitch).
+typedef std::vector<TranslatedNote> TranslatedNoteList;
+
+// What has become of each note (a NoteState, one byte apiece) during one
+// play-through, in the same order as the TranslatedNoteList.  The notes
+// themselves never change, so starting over only means resetting this.
+typedef std::vector<unsigned char> NoteStateList;
+
 #endif
@@ -16,13 +16,21 @@
 #include "CompatibleSystem.h"
 #include "PianoGameError.h"
 #include "libmidi/Midi.h"
+#include "libmidi/MidiComm.h"
 #include "libmidi/SynthVolume.h"
 
 #include "Tga.h"
 #include "Renderer.h"
+#include "SoftwareRasterizer.h"
+#include "FramePacer.h"
 #include "SharedState.h"
 #include "GameState.h"
 #include "State_Title.h"
+#include "AudioSink.h"
+#include "SoftSynth.h"
+#include "SoundFont.h"
+#include "AudioSource.h"
+#include "AudioNoteInput.h"
 
 using namespace std;
 
@@ -30,6 +38,97 @@ using namespace std;
 
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 
+// Set when MIDI arrives (or a device comes or goes) so the main loop can
+// sleep through idle frames without missing it
+static HANDLE game_loop_wake = 0;
+static void WakeGameLoop() { SetEvent(game_loop_wake); }
+
+// The built-in synth as an output device.  The sound card is only opened
+// (and the audio thread, which wakes every few milliseconds, only run)
+// while something has the device open.
+class SoftSynthDevice : public MidiCommOutSink
+{
+public:
+   SoftSynthDevice(SoftSynth *synth) : m_synth(synth), m_sink(0), m_thread(0), m_open_count(0) { }
+
+   virtual void Open()
+   {
+      if (m_open_count++ > 0) return;
+
+      // Without a sound card the synth just stays quiet
+      try { m_sink = new WaveOutAudioSink(m_synth->SampleRate(), PeriodFrames, BufferCount); }
+      catch (const PianoGameError &) { return; }
+
+      m_thread = new SynthAudioThread(*m_synth, *m_sink, PeriodFrames, false);
+   }
+
+   virtual void Close()
+   {
+      if (--m_open_count > 0) return;
+
+      delete m_thread;
+      delete m_sink;
+      m_thread = 0;
+      m_sink = 0;
+
+      // Nothing should still be sounding the next time it's opened
+      m_synth->Reset();
+   }
+
+   virtual void Write(const MidiEvent &out) { m_synth->Write(out); }
+   virtual void Reset() { m_synth->Reset(); }
+   virtual void PrepareSong(const Midi &song) { m_synth->PrepareSong(song); }
+   virtual void SongPosition(microseconds_t song_position) { m_synth->SongPosition(song_position); }
+   virtual std::wstring Status() const { return m_synth->Status(); }
+
+private:
+   // About 6ms per buffer, four deep
+   const static size_t PeriodFrames = 256;
+   const static int BufferCount = 4;
+
+   SoftSynth *m_synth;
+   AudioSink *m_sink;
+   SynthAudioThread *m_thread;
+   int m_open_count;
+};
+
+// Offers the built-in synth as an output device.  It lives for as long as
+// the program does (devices may be holding on to it), so it's never freed.
+static void RegisterSoftSynth()
+{
+   const static unsigned int SampleRate = 44100;
+
+   // With a General MIDI SoundFont it plays real samples instead of its
+   // own simple timbres.  A font that won't load is just skipped.
+   const SoundFont *font = 0;
+   const wstring font_filename = UserSetting::Get(L"SoundFont", L"");
+   if (font_filename.length() > 0)
+   {
+      try { font = new SoundFont(font_filename); }
+      catch (const PianoGameError &) { }
+   }
+
+   SoftSynth *synth = new SoftSynth(SampleRate, font);
+   MidiCommOut::RegisterVirtualDevice(L"Piano Game Synth", new SoftSynthDevice(synth));
+}
+
+// Offers the microphone as an input device, for pianos without MIDI.  Like
+// the synth, it's never freed.
+static void RegisterAcousticInput()
+{
+   const static unsigned int SampleRate = 44100;
+
+   // Hop-sized buffers, so the detector never waits on more than one
+   const static size_t PeriodFrames = 256;
+   const static int BufferCount = 8;
+
+   AudioSource *source = 0;
+   try { source = new WaveInAudioSource(SampleRate, PeriodFrames, BufferCount); }
+   catch (const PianoGameError &) { return; }
+
+   MidiCommIn::RegisterVirtualDevice(L"Acoustic Piano (Microphone)", new AudioNoteInput(source));
+}
+
 #else
 
 #include <GLUT/GLUT.h>
@@ -45,6 +144,19 @@ static void SpecialKeyEventHandlerProc(int key, int x, int y);
 static void MouseEventHandlerProc(int button, int state, int x, int y);
 static void MouseMoveHandlerProc(int x, int y);
 
+// While idling, GLUT's idle callback is switched off and the game loop
+// only runs again for input, MIDI or a timer
+static bool idling = false;
+static int idle_timer_generation = 0;
+static void ResumeGameLoop();
+
+// MIDI arrives on CoreMIDI's thread, so it's handed to the main run loop
+// through this source
+static CFRunLoopRef main_run_loop = 0;
+static CFRunLoopSourceRef game_loop_wake = 0;
+static void WakeGameLoop();
+static void WakeSourcePerform(void *);
+
 #endif
 
 
@@ -119,7 +231,14 @@ int main(int argc, char *argv[])
 
       UserSetting::Initialize(application_name);
 
+      // Start looking for MIDI devices in the background now so it
+      // overlaps with loading the song and setting up the window.
+      MidiCommDevices::Refresh();
+
 #ifdef WIN32
+      RegisterSoftSynth();
+      RegisterAcousticInput();
+
       // CommandLineToArgvW is only available in Windows XP or later.  So,
       // rather than maintain separate binaries for Win2K, I do a runtime
       // library load and check to see if the function I need is available.
@@ -282,10 +401,45 @@ int main(int argc, char *argv[])
       glLoadIdentity();
       gluOrtho2D(0, WindowWidth, 0, WindowHeight);
 
+      // Draw on the CPU and just copy each frame to the window, to compare
+      // against the headless numbers.  This has to be decided before the
+      // first texture is loaded, and the rasterizer is never freed.
+      if (UserSetting::Get(L"Software Renderer", L"0") == L"1")
+      {
+         Renderer::UseSoftwareRasterizer(new SoftwareRasterizer(WindowWidth, WindowHeight));
+      }
+
+      // Start each frame just before the vsync it's going to make, so
+      // input is picked up as late as possible.  Like the rasterizer,
+      // the pacer is never freed.
+      if (UserSetting::Get(L"Frame Pacing", L"1") == L"1")
+      {
+         // Displays that won't say are almost always 60Hz
+         int refresh_rate = Compatible::GetDisplayRefreshRate();
+         if (refresh_rate <= 0) refresh_rate = 60;
+
+         state_manager.SetFramePacer(new FramePacer(1000000 / refresh_rate));
+      }
+
       SharedState state;
       state.song_title = FileSelector::TrimFilename(command_line);
       state.midi = midi;
 
+#ifdef WIN32
+      game_loop_wake = CreateEvent(0, FALSE, FALSE, 0);
+      if (!game_loop_wake) throw PianoGameError(L"Couldn't create the main loop's wake event.");
+#else
+      CFRunLoopSourceContext wake_context = { 0 };
+      wake_context.perform = WakeSourcePerform;
+
+      main_run_loop = CFRunLoopGetCurrent();
+      game_loop_wake = CFRunLoopSourceCreate(0, 0, &wake_context);
+      CFRunLoopAddSource(main_run_loop, game_loop_wake, kCFRunLoopCommonModes);
+#endif
+
+      // Before the title screen opens any input devices
+      MidiCommIn::SetWakeCallback(WakeGameLoop);
+
       state_manager.SetInitialState(new TitleState(state));
 
       // LOGTODO: glGetString(): GL_VENDOR, GL_RENDERER, GL_VERSION, GL_EXTENSIONS
@@ -315,9 +469,20 @@ int main(int argc, char *argv[])
                renderer.SetVSyncInterval(1);
                state_manager.Draw(renderer);
             }
+
+            // When nothing on screen moves by itself (or we're in the
+            // background), sleep until a message, MIDI, or the idle
+            // timeout.  Input is handled the moment it arrives, just as
+            // when running flat out.
+            DWORD idle = INFINITE;
+            if (window_state.IsActive()) idle = state_manager.GetIdleMilliseconds();
+
+            if (idle > 0) MsgWaitForMultipleObjectsEx(1, &game_loop_wake, idle, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
          }
       }
 
+      MidiCommIn::SetWakeCallback(0);
+
       wglMakeCurrent(dc_win, 0);
       wglDeleteContext(glrc);
       ReleaseDC(hwnd, dc_win);
@@ -385,6 +550,13 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
          return 0;
       }
 
+   case WM_DEVICECHANGE:
+      {
+         // A MIDI device may have come or gone
+         MidiCommDevices::Refresh();
+         break;
+      }
+
    case WM_SYSCOMMAND:
       {
          // Prevent the screensaver or monitor power-save from kicking in.
@@ -410,6 +582,8 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
          case VK_ESCAPE:   state_manager.KeyPress(KeyEscape);  break;
 
          case VK_F6:       state_manager.KeyPress(KeyF6);      break;
+         case VK_F7:       state_manager.KeyPress(KeyF7);      break;
+         case VK_F8:       state_manager.KeyPress(KeyF8);      break;
 
          case VK_OEM_PLUS: state_manager.KeyPress(KeyPlus);    break;
          case VK_OEM_MINUS:state_manager.KeyPress(KeyMinus);   break;
@@ -443,6 +617,34 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
 #else
 
 
+void ResumeGameLoop()
+{
+   if (!idling) return;
+
+   idling = false;
+   glutIdleFunc(GameLoop);
+}
+
+// Timers can't be cancelled, so any left over from an earlier idle
+// stretch are ignored
+static void IdleTimerProc(int generation)
+{
+   if (generation == idle_timer_generation) ResumeGameLoop();
+}
+
+// Called from CoreMIDI's thread
+void WakeGameLoop()
+{
+   CFRunLoopSourceSignal(game_loop_wake);
+   CFRunLoopWakeUp(main_run_loop);
+}
+
+// ...which brings us back here, on the main thread
+void WakeSourcePerform(void *)
+{
+   ResumeGameLoop();
+}
+
 void GameLoop()
 {
    if (!window_state.IsActive()) return;
@@ -455,6 +657,17 @@ void GameLoop()
       renderer.SetVSyncInterval(1);
       
       state_manager.Draw(renderer);
+
+      // Nothing on screen moves by itself, so stop spinning until there's
+      // input, MIDI, or the idle timeout
+      const unsigned long idle = state_manager.GetIdleMilliseconds();
+      if (idle == 0) ResumeGameLoop();
+      else if (!idling)
+      {
+         idling = true;
+         glutIdleFunc(0);
+         glutTimerFunc(idle, IdleTimerProc, ++idle_timer_generation);
+      }
    }
    catch (const PianoGameError &e)
    {
@@ -559,7 +772,8 @@ static pascal OSStatus AppEventHandlerProc(EventHandlerCallRef callRef, EventRef
 
 static void MouseEventHandlerProc(int button, int state, int x, int y)
 {
-    
+   ResumeGameLoop();
+
    switch (state)
    {
       case GLUT_DOWN:
@@ -590,12 +804,15 @@ static void MouseEventHandlerProc(int button, int state, int x, int y)
 
 static void MouseMoveHandlerProc(int x, int y)
 {
+    ResumeGameLoop();
     state_manager.MouseMove(x, y);
 }
 
 
 void KeyEventHandlerProc(unsigned char key, int x, int y)
 {
+    ResumeGameLoop();
+
     switch (key)
     {
     case ' ':    state_manager.KeyPress(KeySpace);   break;
@@ -609,6 +826,8 @@ void KeyEventHandlerProc(unsigned char key, int x, int y)
 
 void SpecialKeyEventHandlerProc(int key, int x, int y)
 {
+    ResumeGameLoop();
+
     switch (key)
     {
     case GLUT_KEY_UP:       state_manager.KeyPress(KeyUp);      break;
@@ -616,6 +835,8 @@ void SpecialKeyEventHandlerProc(int key, int x, int y)
     case GLUT_KEY_LEFT:     state_manager.KeyPress(KeyLeft);    break;
     case GLUT_KEY_RIGHT:    state_manager.KeyPress(KeyRight);   break;
     case GLUT_KEY_F6:       state_manager.KeyPress(KeyF6);      break;
+    case GLUT_KEY_F7:       state_manager.KeyPress(KeyF7);      break;
+    case GLUT_KEY_F8:       state_manager.KeyPress(KeyF8);      break;
     }
 }
 
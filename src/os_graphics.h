@@ -11,11 +11,15 @@
 #ifdef WIN32
 #include <gl/gl.h>
 #include <gl/glu.h>
-#else
+#elif defined __APPLE__
 #include <OpenGL/OpenGL.h>
 #include <AGL/agl.h>
 #include <OpenGL/gl.h>
 #include <OpenGL/glu.h>
+#else
+// Headless builds (e.g. the Linux test tools) still compile against GL,
+// but never create a context or actually draw anything.
+#include <GL/gl.h>
 #endif
 
 
@@ -26,7 +26,7 @@
 
 
 
-#ifndef WIN32
+#ifdef __APPLE__
 
 #include <Carbon/Carbon.h>
 
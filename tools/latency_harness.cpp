@@ -0,0 +1,783 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+// Input-to-sound latency harness
+//
+// Runs PlayingState headlessly against a synthetic song using virtual
+// MIDI devices.  A separate thread plays the "You Play" track into the
+// fake input device at the moment each note is due, and the fake output
+// device timestamps the matching note as the game writes it back out.
+// That covers the entire path: InputCallback, the input queue, waiting
+// for the next frame, PlayingState::Listen, note matching, and Write.
+//
+// Every combination of the given frame rates, song densities (background
+// notes per second, played automatically) and synthetic draw loads (time
+// spent "drawing" each frame before waiting for the next vsync) is run
+// and its latency distribution reported.  Alongside the time from each
+// key press to its sound, it reports the time to the vsync that first
+// shows the frame which handled it.
+//
+// Building (Linux, from the repository root, as a single command):
+//
+//   g++ -std=gnu++98 -O2 -Isrc -o latency_harness tools/latency_harness.cpp
+//      $(ls src/*.cpp src/libmidi/*.cpp | grep -v -e main.cpp -e registry.cpp -e SynthVolume.cpp)
+//      -lGL -lpthread
+//
+// Usage:
+//
+//   latency_harness [--fps 30,60,120] [--density 0,50,500] [--draw-ms 0,8]
+//                   [--pacing 0] [--seconds 10] [--interval-ms 250] [--jitter-ms 25]
+//                   [--extra-inputs 0] [--clock 0] [--record take.mid]
+//                   [--session run.session] [--csv results.csv]
+//
+// --pacing 1 runs the frame loop through a FramePacer (as the game does
+// by default), which starts each frame just before the vsync it expects
+// instead of right after the last one.  "missed" counts paced frames
+// shown at least half a period after their predicted deadline.
+//
+// --extra-inputs opens that many additional (silent) input devices
+// alongside the fake one, to check that merging several devices' input
+// doesn't add latency.
+//
+// --clock 1 points the "MIDI Clock Output" setting at another fake device
+// and reports how far the gaps between clock pulses stray from what the
+// song's tempo says they should be.
+//
+// --record saves what the fake input played (from the last run) through
+// the game's performance recorder, along with its .csv of matches.
+//
+// --session saves the last run's whole session (see SessionRecorder) and
+// the generated song next to it (as run.session.mid), ready for
+// replay_session to play back.
+//
+// Real players don't press keys in step with the frame loop, so each
+// note-on is nudged by a (repeatable) random offset of up to jitter-ms
+// either side of the note's start.  Keep that well inside the game's
+// hit window or notes will start going unmatched.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "GameState.h"
+#include "SharedState.h"
+#include "State_Playing.h"
+#include "CompatibleSystem.h"
+#include "LatencyHistogram.h"
+#include "PerformanceRecorder.h"
+#include "Threading.h"
+#include "UserSettings.h"
+#include "FramePacer.h"
+
+#include "libmidi/Midi.h"
+#include "libmidi/MidiComm.h"
+#include "libmidi/MidiWriter.h"
+
+// The "You Play" notes go out on this channel and everything played
+// automatically on another, so the output sink can tell them apart.
+const static unsigned char UserChannel = 0;
+const static unsigned char BackgroundChannel = 1;
+
+const static size_t UserTrack = 1;
+const static size_t BackgroundTrack = 2;
+
+const static int ScreenWidth = 1024;
+const static int ScreenHeight = 768;
+
+struct Options
+{
+   Options() : seconds(10), interval_ms(250), jitter_ms(25), extra_inputs(0), clock(0) { }
+
+   vector<int> fps;
+   vector<int> density;
+   vector<int> draw_ms;
+   vector<int> pacing;
+
+   int seconds;
+   int interval_ms;
+   int jitter_ms;
+   int extra_inputs;
+   int clock;
+
+   string csv_filename;
+   string record_filename;
+   string session_filename;
+};
+
+struct RunResult
+{
+   int fps;
+   int density;
+   int draw_ms;
+   int pacing;
+
+   unsigned long injected;
+   unsigned long matched;
+
+   microseconds_t p50;
+   microseconds_t p90;
+   microseconds_t p99;
+   microseconds_t max;
+
+   // From key press to the vsync that showed it
+   microseconds_t shown_p50;
+   microseconds_t shown_p99;
+
+   // Only counted with pacing
+   unsigned long missed;
+
+   // Only filled in with --clock
+   unsigned long pulses;
+   unsigned long stray_pulses;
+   microseconds_t clock_p50;
+   microseconds_t clock_p99;
+   microseconds_t clock_max;
+};
+
+// Sleeps most of the way to the target and spins the rest for accuracy
+static void WaitUntil(microseconds_t target)
+{
+   const static microseconds_t SpinMicroseconds = 2000;
+
+   for (;;)
+   {
+      const microseconds_t remaining = target - Compatible::GetMicroseconds();
+      if (remaining <= 0) return;
+
+      if (remaining > SpinMicroseconds) Thread::Sleep(static_cast<unsigned long>((remaining - SpinMicroseconds) / 1000));
+   }
+}
+
+// Keeps track of when each injected note-on went in so the output
+// side can work out how long it took to come back out.
+class PendingNotes
+{
+public:
+   PendingNotes() { Clear(); }
+
+   void Clear()
+   {
+      MutexLock lock(m_mutex);
+      for (int i = 0; i < 128; ++i) m_injected_at[i] = 0;
+   }
+
+   void Injected(NoteId note, microseconds_t when)
+   {
+      MutexLock lock(m_mutex);
+      m_injected_at[note & 0x7F] = when;
+   }
+
+   // Returns 0 if nothing was waiting on this note
+   microseconds_t Take(NoteId note)
+   {
+      MutexLock lock(m_mutex);
+
+      const microseconds_t when = m_injected_at[note & 0x7F];
+      m_injected_at[note & 0x7F] = 0;
+      return when;
+   }
+
+private:
+   Mutex m_mutex;
+   microseconds_t m_injected_at[128];
+};
+
+class FakeOutput : public MidiCommOutSink
+{
+public:
+   FakeOutput(PendingNotes &pending) : m_pending(pending), m_matched(0) { }
+
+   void Start()
+   {
+      m_latency.Reset();
+      m_shown_latency.Reset();
+      m_matched = 0;
+
+      MutexLock lock(m_unshown_mutex);
+      m_unshown.clear();
+   }
+
+   virtual void Write(const MidiEvent &out)
+   {
+      const microseconds_t now = Compatible::GetMicroseconds();
+
+      if (out.Type() != MidiEventType_NoteOn || out.NoteVelocity() == 0) return;
+      if (out.Channel() != UserChannel) return;
+
+      const microseconds_t injected_at = m_pending.Take(out.NoteNumber());
+      if (injected_at == 0) return;
+
+      m_latency.Record(now - injected_at);
+      m_matched++;
+
+      MutexLock lock(m_unshown_mutex);
+      Unshown u = { injected_at, now };
+      m_unshown.push_back(u);
+   }
+
+   // The main loop calls this at each vsync.  A note written before it
+   // came from the frame that vsync shows (output is written during the
+   // frame's update, which starts after the previous vsync).
+   void Shown(microseconds_t vsync)
+   {
+      MutexLock lock(m_unshown_mutex);
+
+      size_t kept = 0;
+      for (size_t i = 0; i < m_unshown.size(); ++i)
+      {
+         if (m_unshown[i].written_at <= vsync) m_shown_latency.Record(vsync - m_unshown[i].injected_at);
+         else m_unshown[kept++] = m_unshown[i];
+      }
+      m_unshown.resize(kept);
+   }
+
+   const LatencyHistogram &Latency() const { return m_latency; }
+   const LatencyHistogram &ShownLatency() const { return m_shown_latency; }
+   unsigned long Matched() const { return m_matched; }
+
+private:
+   struct Unshown
+   {
+      microseconds_t injected_at;
+      microseconds_t written_at;
+   };
+
+   PendingNotes &m_pending;
+   LatencyHistogram m_latency;
+   LatencyHistogram m_shown_latency;
+   unsigned long m_matched;
+
+   Mutex m_unshown_mutex;
+   vector<Unshown> m_unshown;
+};
+
+// Receives the game's MIDI clock.  Jitter is how far each gap between
+// consecutive pulses is from the length the tempo calls for.
+class FakeClock : public MidiCommOutSink
+{
+public:
+   FakeClock() { Start(0); }
+
+   void Start(microseconds_t expected_interval)
+   {
+      m_expected_interval = expected_interval;
+      m_running = false;
+      m_last_pulse = 0;
+      m_pulses = 0;
+      m_stray_pulses = 0;
+      m_jitter.Reset();
+   }
+
+   virtual void Write(const MidiEvent &out)
+   {
+      const microseconds_t now = Compatible::GetMicroseconds();
+
+      MidiEventSimple simple;
+      if (!out.GetSimpleEvent(&simple)) return;
+
+      switch (simple.status)
+      {
+      case 0xFA: // Start
+      case 0xFB: // Continue
+         m_running = true;
+         m_last_pulse = 0;
+         break;
+
+      case 0xFC: // Stop
+         m_running = false;
+         break;
+
+      case 0xF8:
+         // Pulses outside of Start/Stop mean the transport is confused
+         if (!m_running) { m_stray_pulses++; break; }
+
+         if (m_last_pulse != 0)
+         {
+            const microseconds_t error = (now - m_last_pulse) - m_expected_interval;
+            m_jitter.Record(error < 0 ? -error : error);
+         }
+
+         m_last_pulse = now;
+         m_pulses++;
+         break;
+      }
+   }
+
+   const LatencyHistogram &Jitter() const { return m_jitter; }
+   unsigned long Pulses() const { return m_pulses; }
+   unsigned long StrayPulses() const { return m_stray_pulses; }
+
+private:
+   microseconds_t m_expected_interval;
+
+   bool m_running;
+   microseconds_t m_last_pulse;
+
+   unsigned long m_pulses;
+   unsigned long m_stray_pulses;
+   LatencyHistogram m_jitter;
+};
+
+// Plays a list of events into whichever MidiCommIn has this device open,
+// each at the wall-clock time the game's song position reaches it.
+class FakeInput : public MidiCommInSource
+{
+public:
+   struct ScheduledEvent
+   {
+      microseconds_t song_time;
+      MidiEvent ev;
+   };
+
+   FakeInput(PendingNotes &pending) : m_pending(pending), m_input(0), m_stop(0),
+      m_reference_wall(0), m_reference_song(0), m_injected(0) { }
+
+   virtual void Attach(MidiCommIn *input) { m_input = input; }
+   virtual void Detach(MidiCommIn *) { m_input = 0; }
+
+   // The main loop calls this once per frame so we know how song time
+   // maps onto wall-clock time.
+   void SetReference(microseconds_t wall, microseconds_t song)
+   {
+      MutexLock lock(m_reference_mutex);
+      m_reference_wall = wall;
+      m_reference_song = song;
+   }
+
+   void Start(const vector<ScheduledEvent> &schedule)
+   {
+      m_schedule = schedule;
+      m_injected = 0;
+      m_stop = 0;
+   }
+
+   void Stop() { Atomic::CompareAndSwap(&m_stop, 0, 1); }
+
+   unsigned long Injected() const { return m_injected; }
+
+   static void Run(void *context) { reinterpret_cast<FakeInput*>(context)->Run(); }
+
+private:
+   microseconds_t WallTimeFor(microseconds_t song_time)
+   {
+      MutexLock lock(m_reference_mutex);
+
+      // Everything runs at 100% speed, so the mapping is one-to-one
+      return m_reference_wall + (song_time - m_reference_song);
+   }
+
+   void Run()
+   {
+      for (size_t i = 0; i < m_schedule.size(); ++i)
+      {
+         const ScheduledEvent &e = m_schedule[i];
+
+         // The reference moves every frame, so re-check it until we're
+         // close enough to commit to a time.
+         for (;;)
+         {
+            if (Atomic::Read(&m_stop)) return;
+
+            const microseconds_t remaining = WallTimeFor(e.song_time) - Compatible::GetMicroseconds();
+            if (remaining <= 5000) break;
+
+            Thread::Sleep(static_cast<unsigned long>(min(remaining - 5000, static_cast<microseconds_t>(50000)) / 1000));
+         }
+         WaitUntil(WallTimeFor(e.song_time));
+
+         if (!m_input) continue;
+
+         if (e.ev.Type() == MidiEventType_NoteOn && e.ev.NoteVelocity() > 0)
+         {
+            m_pending.Injected(e.ev.NoteNumber(), Compatible::GetMicroseconds());
+            m_injected++;
+         }
+
+         m_input->InjectEvent(e.ev);
+      }
+   }
+
+   PendingNotes &m_pending;
+   MidiCommIn *m_input;
+
+   volatile long m_stop;
+
+   Mutex m_reference_mutex;
+   microseconds_t m_reference_wall;
+   microseconds_t m_reference_song;
+
+   vector<ScheduledEvent> m_schedule;
+   unsigned long m_injected;
+};
+
+// An input device that never sends anything
+class SilentInput : public MidiCommInSource
+{
+public:
+   virtual void Attach(MidiCommIn *) { }
+   virtual void Detach(MidiCommIn *) { }
+};
+
+// The user's track walks up and down an octave (so consecutive notes are
+// never the same key) while the background is a deterministic scatter of
+// short notes across the whole keyboard.
+static Midi BuildSong(const Options &options, int density, const string &save_as)
+{
+   const microseconds_t length = static_cast<microseconds_t>(options.seconds) * 1000000;
+
+   MidiWriter writer;
+   writer.SetTrackName(UserTrack, "Harness (You Play)");
+   writer.SetTrackName(BackgroundTrack, "Harness (Background)");
+
+   const static NoteId Scale[] = { 60, 62, 64, 65, 67, 69, 71, 72, 71, 69, 67, 65, 64, 62 };
+   const static int ScaleLength = sizeof(Scale) / sizeof(NoteId);
+
+   const microseconds_t interval = static_cast<microseconds_t>(options.interval_ms) * 1000;
+   int step = 0;
+   for (microseconds_t t = 0; t < length; t += interval)
+   {
+      const NoteId note = Scale[step++ % ScaleLength];
+      writer.AddEvent(UserTrack, t, MidiEvent::Build(MidiEventSimple(0x90 | UserChannel, note, 100)));
+      writer.AddEvent(UserTrack, t + interval / 2, MidiEvent::Build(MidiEventSimple(0x80 | UserChannel, note, 0)));
+   }
+
+   if (density > 0)
+   {
+      const microseconds_t spacing = 1000000 / density;
+      const static microseconds_t BackgroundNoteLength = 200000;
+
+      unsigned long seed = 12345;
+      for (microseconds_t t = 0; t < length; t += spacing)
+      {
+         seed = seed * 1103515245 + 12345;
+         const NoteId note = static_cast<NoteId>(21 + (seed >> 16) % 88);
+
+         writer.AddEvent(BackgroundTrack, t, MidiEvent::Build(MidiEventSimple(0x90 | BackgroundChannel, note, 64)));
+         writer.AddEvent(BackgroundTrack, t + BackgroundNoteLength, MidiEvent::Build(MidiEventSimple(0x80 | BackgroundChannel, note, 0)));
+      }
+   }
+
+   ostringstream out;
+   writer.Write(out);
+
+   if (!save_as.empty())
+   {
+      ofstream file(save_as.c_str(), ios::out | ios::trunc | ios::binary);
+      file << out.str();
+   }
+
+   istringstream in(out.str());
+   return Midi::ReadFromStream(in);
+}
+
+static bool EarlierEvent(const FakeInput::ScheduledEvent &lhs, const FakeInput::ScheduledEvent &rhs)
+{
+   return lhs.song_time < rhs.song_time;
+}
+
+// Replays the user's notes: on near the start, off at the end
+static vector<FakeInput::ScheduledEvent> BuildSchedule(const Midi &midi, int jitter_ms)
+{
+   vector<FakeInput::ScheduledEvent> schedule;
+
+   const microseconds_t jitter_range = static_cast<microseconds_t>(jitter_ms) * 2000 + 1;
+   unsigned long seed = 54321;
+
+   const TranslatedNoteSet &notes = midi.Notes();
+   for (TranslatedNoteSet::const_iterator i = notes.begin(); i != notes.end(); ++i)
+   {
+      if (i->track_id != UserTrack) continue;
+
+      seed = seed * 1103515245 + 12345;
+      const microseconds_t jitter = static_cast<microseconds_t>(seed >> 8) % jitter_range - jitter_ms * 1000;
+
+      FakeInput::ScheduledEvent on;
+      on.song_time = i->start + jitter;
+      on.ev = MidiEvent::Build(MidiEventSimple(0x90 | UserChannel, static_cast<unsigned char>(i->note_id), 100));
+      schedule.push_back(on);
+
+      FakeInput::ScheduledEvent off;
+      off.song_time = i->end;
+      off.ev = MidiEvent::Build(MidiEventSimple(0x80 | UserChannel, static_cast<unsigned char>(i->note_id), 0));
+      schedule.push_back(off);
+   }
+
+   stable_sort(schedule.begin(), schedule.end(), EarlierEvent);
+   return schedule;
+}
+
+static RunResult RunOne(const Options &options, int fps, int density, int draw_ms, int pacing,
+   unsigned int input_id, const vector<unsigned int> &extra_input_ids, unsigned int output_id,
+   FakeInput &input, FakeOutput &output, FakeClock *clock, PendingNotes &pending)
+{
+   Midi midi = BuildSong(options, density, options.session_filename.empty() ? "" : options.session_filename + ".mid");
+
+   SharedState state;
+   state.midi = &midi;
+   state.midi_in = new MidiCommInGroup();
+   state.midi_in->Add(new MidiCommIn(input_id));
+   for (size_t i = 0; i < extra_input_ids.size(); ++i) state.midi_in->Add(new MidiCommIn(extra_input_ids[i]));
+   state.midi_out = new MidiCommOut(output_id);
+   state.song_title = L"Latency Harness";
+
+   state.track_properties.resize(midi.Tracks().size());
+   state.track_properties[UserTrack].mode = Track::ModeYouPlay;
+   if (BackgroundTrack < state.track_properties.size()) state.track_properties[BackgroundTrack].mode = Track::ModePlayedAutomatically;
+
+   pending.Clear();
+   output.Start();
+
+   // The harness song never changes tempo
+   if (clock) clock->Start(midi.TempoMap()[0].us_per_quarter_note / 24);
+
+   // The state's Init() resets the song, so the schedule has to be
+   // read from a copy that has been through the same translation.
+   input.Start(BuildSchedule(midi, options.jitter_ms));
+
+   const microseconds_t frame_period = 1000000 / fps;
+   FramePacer pacer(frame_period);
+
+   GameStateManager manager(ScreenWidth, ScreenHeight);
+   if (pacing) manager.SetFramePacer(&pacer);
+   manager.SetInitialState(new PlayingState(state));
+   const microseconds_t draw_load = static_cast<microseconds_t>(draw_ms) * 1000;
+
+   microseconds_t next_vsync = Compatible::GetMicroseconds() + frame_period;
+   bool injector_started = false;
+   Thread *injector = 0;
+
+   while (!midi.IsSongOver())
+   {
+      manager.Update(false);
+
+      input.SetReference(Compatible::GetMicroseconds(), midi.GetSongPositionInMicroseconds());
+      if (!injector_started)
+      {
+         injector = new Thread(FakeInput::Run, &input);
+         injector_started = true;
+      }
+
+      // Pretend to draw, then block on the next vsync like SwapBuffers
+      WaitUntil(Compatible::GetMicroseconds() + draw_load);
+      if (pacing) pacer.DrawFinished();
+
+      const microseconds_t now = Compatible::GetMicroseconds();
+      while (next_vsync <= now) next_vsync += frame_period;
+      WaitUntil(next_vsync);
+
+      output.Shown(next_vsync);
+      if (pacing) pacer.FrameShown();
+   }
+
+   input.Stop();
+   delete injector;
+
+   // The song ending queued a state change.  One more update deletes the
+   // playing state, which flushes and joins its output workers before we
+   // pull the devices out from under them.
+   manager.Update(false);
+
+   delete state.midi_in;
+   delete state.midi_out;
+
+   RunResult r;
+   r.fps = fps;
+   r.density = density;
+   r.draw_ms = draw_ms;
+   r.pacing = pacing;
+   r.injected = input.Injected();
+   r.matched = output.Matched();
+   r.p50 = output.Latency().Percentile(0.50);
+   r.p90 = output.Latency().Percentile(0.90);
+   r.p99 = output.Latency().Percentile(0.99);
+   r.max = output.Latency().Max();
+   r.shown_p50 = output.ShownLatency().Percentile(0.50);
+   r.shown_p99 = output.ShownLatency().Percentile(0.99);
+   r.missed = pacer.MissedDeadlines();
+
+   r.pulses = 0;
+   r.stray_pulses = 0;
+   r.clock_p50 = r.clock_p99 = r.clock_max = 0;
+   if (clock)
+   {
+      r.pulses = clock->Pulses();
+      r.stray_pulses = clock->StrayPulses();
+      r.clock_p50 = clock->Jitter().Percentile(0.50);
+      r.clock_p99 = clock->Jitter().Percentile(0.99);
+      r.clock_max = clock->Jitter().Max();
+   }
+
+   return r;
+}
+
+static vector<int> ParseList(const char *arg)
+{
+   vector<int> values;
+
+   stringstream ss(arg);
+   string item;
+   while (getline(ss, item, ',')) values.push_back(atoi(item.c_str()));
+
+   return values;
+}
+
+static void Usage()
+{
+   cerr << "usage: latency_harness [--fps 30,60,120] [--density 0,50,500] [--draw-ms 0,8]" << endl;
+   cerr << "                       [--pacing 0] [--seconds 10] [--interval-ms 250] [--jitter-ms 25]" << endl;
+   cerr << "                       [--extra-inputs 0] [--clock 0] [--record take.mid]" << endl;
+   cerr << "                       [--session run.session] [--csv results.csv]" << endl;
+}
+
+static string FormatMs(microseconds_t us, int precision = 2)
+{
+   return STRING(fixed << setprecision(precision) << (us / 1000.0));
+}
+
+int main(int argc, char *argv[])
+{
+   Options options;
+
+   for (int i = 1; i < argc; ++i)
+   {
+      const string arg = argv[i];
+      if (i + 1 >= argc) { Usage(); return 1; }
+
+      const char *value = argv[++i];
+      if (arg == "--fps") options.fps = ParseList(value);
+      else if (arg == "--density") options.density = ParseList(value);
+      else if (arg == "--draw-ms") options.draw_ms = ParseList(value);
+      else if (arg == "--pacing") options.pacing = ParseList(value);
+      else if (arg == "--seconds") options.seconds = atoi(value);
+      else if (arg == "--interval-ms") options.interval_ms = atoi(value);
+      else if (arg == "--jitter-ms") options.jitter_ms = atoi(value);
+      else if (arg == "--extra-inputs") options.extra_inputs = atoi(value);
+      else if (arg == "--clock") options.clock = atoi(value);
+      else if (arg == "--csv") options.csv_filename = value;
+      else if (arg == "--record") options.record_filename = value;
+      else if (arg == "--session") options.session_filename = value;
+      else { Usage(); return 1; }
+   }
+
+   if (options.fps.empty()) options.fps = ParseList("30,60,120");
+   if (options.density.empty()) options.density = ParseList("0,50,500");
+   if (options.draw_ms.empty()) options.draw_ms = ParseList("0,8");
+   if (options.pacing.empty()) options.pacing = ParseList("0");
+
+   if (options.seconds <= 0 || options.interval_ms <= 0 || options.jitter_ms < 0 || options.extra_inputs < 0) { Usage(); return 1; }
+
+   PendingNotes pending;
+   FakeInput input(pending);
+   FakeOutput output(pending);
+
+   const unsigned int input_id = MidiCommIn::RegisterVirtualDevice(L"Latency Harness Input", &input);
+   const unsigned int output_id = MidiCommOut::RegisterVirtualDevice(L"Latency Harness Output", &output);
+
+   SilentInput silent;
+   vector<unsigned int> extra_input_ids;
+   for (int i = 0; i < options.extra_inputs; ++i)
+   {
+      extra_input_ids.push_back(MidiCommIn::RegisterVirtualDevice(WSTRING(L"Latency Harness Extra Input " << i + 1), &silent));
+   }
+
+   FakeClock clock;
+   if (options.clock)
+   {
+      const wstring clock_name = L"Latency Harness Clock";
+      MidiCommOut::RegisterVirtualDevice(clock_name, &clock);
+      UserSetting::Set(L"MIDI Clock Output", clock_name);
+   }
+
+   if (!options.record_filename.empty())
+   {
+      UserSetting::Set(L"Performance Recording", wstring(options.record_filename.begin(), options.record_filename.end()));
+   }
+
+   if (!options.session_filename.empty())
+   {
+      UserSetting::Set(L"Session Recording", wstring(options.session_filename.begin(), options.session_filename.end()));
+   }
+
+   cout << "   fps  density  draw_ms  pacing  injected  matched    p50_ms    p90_ms    p99_ms    max_ms  shown_p50  shown_p99  missed";
+   if (options.clock) cout << "  pulses  stray  clk_p50_ms  clk_p99_ms  clk_max_ms";
+   cout << endl;
+
+   vector<RunResult> results;
+   try
+   {
+      for (size_t f = 0; f < options.fps.size(); ++f)
+      {
+         for (size_t d = 0; d < options.density.size(); ++d)
+         {
+            for (size_t w = 0; w < options.draw_ms.size(); ++w)
+            {
+               for (size_t p = 0; p < options.pacing.size(); ++p)
+               {
+                  if (options.fps[f] <= 0) continue;
+
+                  const RunResult r = RunOne(options, options.fps[f], options.density[d], options.draw_ms[w], options.pacing[p],
+                     input_id, extra_input_ids, output_id, input, output, options.clock ? &clock : 0, pending);
+                  results.push_back(r);
+
+                  cout << setw(6) << r.fps << setw(9) << r.density << setw(9) << r.draw_ms << setw(8) << r.pacing
+                     << setw(10) << r.injected << setw(9) << r.matched
+                     << setw(10) << FormatMs(r.p50) << setw(10) << FormatMs(r.p90)
+                     << setw(10) << FormatMs(r.p99) << setw(10) << FormatMs(r.max)
+                     << setw(11) << FormatMs(r.shown_p50) << setw(11) << FormatMs(r.shown_p99) << setw(8) << r.missed;
+
+                  if (options.clock)
+                  {
+                     cout << setw(8) << r.pulses << setw(7) << r.stray_pulses
+                        << setw(12) << FormatMs(r.clock_p50, 3) << setw(12) << FormatMs(r.clock_p99, 3)
+                        << setw(12) << FormatMs(r.clock_max, 3);
+                  }
+                  cout << endl;
+               }
+            }
+         }
+      }
+   }
+   catch (const MidiError &e)
+   {
+      wcerr << L"MIDI error: " << e.GetErrorDescription() << endl;
+      return 1;
+   }
+   catch (const GameStateError &e)
+   {
+      cerr << "Game state error: " << e.what() << endl;
+      return 1;
+   }
+
+   // The recording is written in the background
+   if (!options.record_filename.empty()) PerformanceRecorder::WaitForPendingWrites();
+
+   if (!options.csv_filename.empty())
+   {
+      ofstream csv(options.csv_filename.c_str(), ios::out | ios::trunc);
+      csv << "fps,density,draw_ms,pacing,injected,matched,p50_us,p90_us,p99_us,max_us,shown_p50_us,shown_p99_us,missed,clock_pulses,clock_stray_pulses,clock_p50_us,clock_p99_us,clock_max_us\n";
+      for (size_t i = 0; i < results.size(); ++i)
+      {
+         const RunResult &r = results[i];
+         csv << r.fps << "," << r.density << "," << r.draw_ms << "," << r.pacing << "," << r.injected << "," << r.matched << ","
+            << r.p50 << "," << r.p90 << "," << r.p99 << "," << r.max << ","
+            << r.shown_p50 << "," << r.shown_p99 << "," << r.missed << ","
+            << r.pulses << "," << r.stray_pulses << "," << r.clock_p50 << "," << r.clock_p99 << "," << r.clock_max << "\n";
+      }
+
+      if (!csv.good())
+      {
+         cerr << "Couldn't write " << options.csv_filename << endl;
+         return 1;
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,404 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+// Acoustic input benchmark
+//
+// Checks how well (and how quickly) PitchDetector hears a song, by
+// comparing the notes it reports against the song's own notes.
+//
+// The song is rendered to a WAV file with OfflineRenderer (or a recording
+// is given with --wav), then heard two ways:
+//
+// Offline: the whole file is pushed through a PitchDetector as fast as
+// possible.  Latency is how far into the audio the detector was when it
+// reported each note, less where the note really started.  This is the
+// detector on its own, and is repeatable.
+//
+// Live: the file is played in real time through the same path the game
+// uses (a WavAudioSource behind an AudioNoteInput registered as a virtual
+// MIDI input device, read back out of MidiCommIn).  Latency is each event's
+// MidiCommIn timestamp, less when the note started playing.  This adds
+// waiting for each hop of audio to arrive and the time taken to analyze it.
+//
+// A detected note counts as a hit if it's the right key and turns up no
+// more than --early-ms before or --late-ms after the note really started.
+// Octave errors are wrong notes an octave away from a note that was
+// sounding at the time.  Percussion (channel 10) isn't scored, and notes
+// outside the detector's range are counted separately.
+//
+// Building (Linux, from the repository root, as a single command):
+//
+//   g++ -std=gnu++98 -O2 -Isrc -o pitch_bench tools/pitch_bench.cpp
+//      $(ls src/*.cpp src/libmidi/*.cpp | grep -v -e main.cpp -e registry.cpp -e SynthVolume.cpp)
+//      -lGL -lpthread
+//
+// Usage:
+//
+//   pitch_bench [song.mid] [--wav recording.wav] [--sf2 font.sf2]
+//               [--write-wav rendered.wav] [--live 1]
+//               [--early-ms 20] [--late-ms 150]
+//
+// A recording given with --wav must line up with the song the way
+// OfflineRenderer's output does: silence before the first note trimmed
+// off.  Without a song, a generated piano piece (about a minute of
+// melody over chords) is used.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "AudioNoteInput.h"
+#include "AudioSource.h"
+#include "OfflineRenderer.h"
+#include "PitchDetector.h"
+#include "SoundFont.h"
+#include "CompatibleSystem.h"
+#include "LatencyHistogram.h"
+#include "PianoGameError.h"
+#include "Threading.h"
+
+#include "libmidi/Midi.h"
+#include "libmidi/MidiComm.h"
+#include "libmidi/MidiEvent.h"
+#include "libmidi/MidiWriter.h"
+
+struct Options
+{
+   Options() : live(1), early_ms(20), late_ms(150) { }
+
+   string midi_file;
+   string wav;
+   string sf2;
+   string write_wav;
+
+   int live;
+   int early_ms;
+   int late_ms;
+};
+
+// A note as the detector reported it, in microseconds from the start of
+// the audio
+struct Heard
+{
+   microseconds_t time;
+   NoteId note;
+};
+
+static MidiEvent Simple(unsigned char status, unsigned char byte1, unsigned char byte2)
+{
+   MidiEventSimple simple(status, byte1, byte2);
+   return MidiEvent::Build(simple);
+}
+
+// A minute of one hand playing a melody over the other's chords, with
+// the odd repeated note, across most of the keyboard
+static Midi BuildSong()
+{
+   MidiWriter writer;
+   writer.AddEvent(1, 0, Simple(0xC0, 0, 0));
+
+   const static int Progression[] = { 0, 5, 7, 3 };
+   const microseconds_t Beat = 500000;
+
+   for (int bar = 0; bar < 30; ++bar)
+   {
+      const microseconds_t start = bar * Beat * 4;
+      const int root = 48 + Progression[bar % 4];
+
+      // Left hand: a low root, then the chord above it on beat two
+      writer.AddEvent(1, start, Simple(0x90, static_cast<unsigned char>(root - 12), 80));
+      writer.AddEvent(1, start + Beat * 2 - 20000, Simple(0x80, static_cast<unsigned char>(root - 12), 0));
+      for (int n = 0; n < 3; ++n)
+      {
+         const unsigned char note = static_cast<unsigned char>(root + (n == 0 ? 0 : (n == 1 ? 4 : 7)));
+         writer.AddEvent(1, start + Beat * 2, Simple(0x90, note, 60));
+         writer.AddEvent(1, start + Beat * 4 - 20000, Simple(0x80, note, 0));
+      }
+
+      // Right hand: eighth notes, a different (repeatable) shape each bar
+      for (int step = 0; step < 8; ++step)
+      {
+         const int i = bar * 8 + step;
+         const unsigned char note = static_cast<unsigned char>(root + 12 + ((i * 5 + bar) % 17));
+         const unsigned char velocity = static_cast<unsigned char>(70 + (i * 13) % 45);
+
+         writer.AddEvent(1, start + step * Beat / 2, Simple(0x90, note, velocity));
+         writer.AddEvent(1, start + (step + 1) * Beat / 2 - 30000, Simple(0x80, note, 0));
+      }
+   }
+
+   stringstream out;
+   writer.Write(out);
+
+   istringstream in(out.str());
+   return Midi::ReadFromStream(in);
+}
+
+static string FormatMs(microseconds_t us)
+{
+   ostringstream out;
+   out << fixed << setprecision(1) << (us / 1000.0);
+   return out.str();
+}
+
+static bool EarlierNote(const TranslatedNote &a, const TranslatedNote &b)
+{
+   return a.start < b.start;
+}
+
+static bool EarlierHeard(const Heard &a, const Heard &b)
+{
+   return a.time < b.time;
+}
+
+static void Score(const string &label, const vector<TranslatedNote> &reference, vector<Heard> heard, const Options &options)
+{
+   sort(heard.begin(), heard.end(), EarlierHeard);
+   vector<bool> used(heard.size(), false);
+
+   const microseconds_t early = options.early_ms * 1000;
+   const microseconds_t late = options.late_ms * 1000;
+
+   LatencyHistogram latency;
+   microseconds_t earliest = 0;
+   size_t hits = 0;
+
+   size_t first = 0;
+   for (size_t r = 0; r < reference.size(); ++r)
+   {
+      const TranslatedNote &note = reference[r];
+
+      while (first < heard.size() && heard[first].time < note.start - early) first++;
+      for (size_t h = first; h < heard.size() && heard[h].time <= note.start + late; ++h)
+      {
+         if (used[h] || heard[h].note != note.note_id) continue;
+
+         used[h] = true;
+         hits++;
+
+         latency.Record(heard[h].time - note.start);
+         earliest = min(earliest, heard[h].time - note.start);
+         break;
+      }
+   }
+
+   size_t octave_errors = 0;
+   for (size_t h = 0; h < heard.size(); ++h)
+   {
+      if (used[h]) continue;
+
+      for (size_t r = 0; r < reference.size() && reference[r].start <= heard[h].time; ++r)
+      {
+         const TranslatedNote &note = reference[r];
+         if (note.end < heard[h].time) continue;
+         if (note.note_id != heard[h].note + 12 && note.note_id + 12 != heard[h].note) continue;
+
+         octave_errors++;
+         break;
+      }
+   }
+
+   const double precision = heard.empty() ? 0.0 : static_cast<double>(hits) / heard.size();
+   const double recall = reference.empty() ? 0.0 : static_cast<double>(hits) / reference.size();
+   const double f1 = (precision + recall > 0.0) ? 2.0 * precision * recall / (precision + recall) : 0.0;
+
+   cout << label << ": " << heard.size() << " notes heard, " << hits << " of " << reference.size() << " right, "
+      << (heard.size() - hits) << " wrong (" << octave_errors << " octave errors)" << endl;
+   cout << "   precision " << fixed << setprecision(3) << precision
+      << "  recall " << recall << "  F1 " << f1 << endl;
+   cout << "   latency ms: p50 " << FormatMs(latency.Percentile(0.50))
+      << "  p90 " << FormatMs(latency.Percentile(0.90))
+      << "  p99 " << FormatMs(latency.Percentile(0.99))
+      << "  max " << FormatMs(latency.Max());
+   if (earliest < 0) cout << "  (earliest " << FormatMs(earliest) << ")";
+   cout << endl;
+}
+
+static vector<Heard> HearOffline(const vector<float> &audio, unsigned int sample_rate, microseconds_t *analysis_time)
+{
+   PitchDetector detector(sample_rate);
+
+   vector<Heard> heard;
+   DetectedNoteList notes;
+
+   const microseconds_t start = Compatible::GetMicroseconds();
+   for (size_t pos = 0; pos < audio.size(); pos += detector.HopFrames())
+   {
+      notes.clear();
+      detector.Process(&audio[pos], min(detector.HopFrames(), audio.size() - pos), &notes);
+
+      for (size_t i = 0; i < notes.size(); ++i)
+      {
+         if (!notes[i].on) continue;
+
+         Heard h;
+         h.time = static_cast<microseconds_t>(notes[i].frame * 1000000.0 / sample_rate);
+         h.note = notes[i].note;
+         heard.push_back(h);
+      }
+   }
+   *analysis_time = Compatible::GetMicroseconds() - start;
+
+   const LatencyHistogram &hops = detector.HopTime();
+   cout << "detector: " << detector.WindowFrames() << " frame window, " << detector.HopFrames() << " frame hops ("
+      << FormatMs(static_cast<microseconds_t>(detector.HopFrames() * 1000000.0 / sample_rate)) << " ms), latency budget "
+      << FormatMs(detector.LatencyBudget()) << " ms" << endl;
+   cout << "hop analysis us: p50 " << hops.Percentile(0.50) << "  p99 " << hops.Percentile(0.99) << "  max " << hops.Max() << endl;
+
+   return heard;
+}
+
+static vector<Heard> HearLive(const string &wav, microseconds_t length)
+{
+   WavAudioSource *source = new WavAudioSource(wstring(wav.begin(), wav.end()), true);
+   AudioNoteInput input(source);
+
+   const unsigned int id = MidiCommIn::RegisterVirtualDevice(L"Pitch Bench", &input);
+
+   vector<Heard> heard;
+   {
+      MidiCommIn in(id);
+
+      // Poll about as often as the game's frame loop would
+      const microseconds_t stop = Compatible::GetMicroseconds() + length + 500000;
+      while (Compatible::GetMicroseconds() < stop)
+      {
+         while (in.KeepReading())
+         {
+            const microseconds_t timestamp = in.NextTimestamp();
+            const MidiEvent ev = in.Read();
+            if (ev.Type() != MidiEventType_NoteOn || ev.NoteVelocity() == 0) continue;
+
+            Heard h;
+            h.time = timestamp - source->StartTime();
+            h.note = ev.NoteNumber();
+            heard.push_back(h);
+         }
+
+         Thread::Sleep(2);
+      }
+
+      cout << "live: " << in.DroppedEventCount() << " events dropped" << endl;
+   }
+
+   const LatencyHistogram &hops = input.Detector().HopTime();
+   cout << "live hop analysis us: p50 " << hops.Percentile(0.50) << "  p99 " << hops.Percentile(0.99) << "  max " << hops.Max() << endl;
+
+   return heard;
+}
+
+int main(int argc, char *argv[])
+{
+   Options options;
+
+   int i = 1;
+   if (argc > 1 && string(argv[1]).substr(0, 2) != "--") options.midi_file = argv[i++];
+
+   for (; i + 1 < argc; i += 2)
+   {
+      const string flag = argv[i];
+      const string value = argv[i + 1];
+
+      if (flag == "--wav") options.wav = value;
+      else if (flag == "--sf2") options.sf2 = value;
+      else if (flag == "--write-wav") options.write_wav = value;
+      else if (flag == "--live") options.live = atoi(value.c_str());
+      else if (flag == "--early-ms") options.early_ms = atoi(value.c_str());
+      else if (flag == "--late-ms") options.late_ms = atoi(value.c_str());
+      else
+      {
+         cerr << "unknown option " << flag << endl;
+         return 1;
+      }
+   }
+
+   try
+   {
+      Midi song = options.midi_file.empty() ? BuildSong() : Midi::ReadFromFile(wstring(options.midi_file.begin(), options.midi_file.end()));
+      song.Reset(0, 0);
+
+      string wav = options.wav;
+      if (wav.empty())
+      {
+         SoundFont *font = options.sf2.empty() ? 0 : new SoundFont(wstring(options.sf2.begin(), options.sf2.end()));
+
+         vector<Track::Properties> tracks(song.Tracks().size());
+         for (size_t t = 0; t < tracks.size(); ++t) tracks[t].mode = Track::ModePlayedAutomatically;
+
+         OfflineRenderer renderer(song, tracks, font);
+         renderer.Render(1);
+
+         wav = options.write_wav.empty() ? "pitch_bench.wav" : options.write_wav;
+         if (!renderer.WriteWavFile(wstring(wav.begin(), wav.end())))
+         {
+            cerr << "couldn't write " << wav << endl;
+            return 1;
+         }
+
+         delete font;
+      }
+
+      vector<float> audio;
+      unsigned int sample_rate = 0;
+      if (!ReadWavFile(wstring(wav.begin(), wav.end()), &audio, &sample_rate))
+      {
+         cerr << "couldn't read " << wav << endl;
+         return 1;
+      }
+
+      const microseconds_t length = static_cast<microseconds_t>(audio.size() * 1000000.0 / sample_rate);
+
+      // The audio starts where the song's first note does
+      const microseconds_t song_start = max<microseconds_t>(0, song.GetDeadAirStartOffsetMicroseconds());
+
+      const PitchDetector range(sample_rate);
+
+      vector<TranslatedNote> reference;
+      size_t out_of_range = 0;
+      const TranslatedNoteSet &notes = song.Notes();
+      for (TranslatedNoteSet::const_iterator n = notes.begin(); n != notes.end(); ++n)
+      {
+         if (n->channel == 9) continue;
+         if (n->note_id < range.Lowest() || n->note_id > range.Highest()) { out_of_range++; continue; }
+
+         TranslatedNote note = *n;
+         note.start -= song_start;
+         note.end -= song_start;
+         reference.push_back(note);
+      }
+      sort(reference.begin(), reference.end(), EarlierNote);
+
+      cout << wav << ": " << FormatMs(length) << " ms at " << sample_rate << " Hz, "
+         << reference.size() << " notes to hear (" << out_of_range << " out of range)" << endl;
+
+      microseconds_t analysis_time = 0;
+      const vector<Heard> offline = HearOffline(audio, sample_rate, &analysis_time);
+      cout << "analyzed at " << fixed << setprecision(0) << (length / static_cast<double>(max<microseconds_t>(analysis_time, 1))) << "x realtime" << endl;
+      Score("offline", reference, offline, options);
+
+      if (options.live)
+      {
+         cout << endl;
+         Score("live", reference, HearLive(wav, length), options);
+      }
+   }
+   catch (const PianoGameError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+   catch (const MidiError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+
+   return 0;
+}
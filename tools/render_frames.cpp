@@ -0,0 +1,297 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+// Headless frame renderer
+//
+// Plays a song through PlayingState, with no input, and draws every frame
+// with the SoftwareRasterizer instead of OpenGL, so drawing can be
+// measured on a machine without a graphics card.  Frame times come from
+// a fixed-rate GameClock, so the same song always produces the same
+// frames.
+//
+// It reports how long the rasterizer spent on each frame, along with the
+// draw calls and vertices the frame took.  Every --every frames, the
+// frame can also be saved as a TGA (--save) or compared with one saved
+// earlier (--check), which makes a golden-image test for changes to the
+// drawing code.
+//
+// Building (Linux, from the repository root, as a single command):
+//
+//   g++ -std=gnu++98 -O2 -Isrc -o render_frames tools/render_frames.cpp
+//      $(ls src/*.cpp src/libmidi/*.cpp | grep -v -e main.cpp -e registry.cpp -e SynthVolume.cpp)
+//      -lGL -lpthread
+//
+// Usage (from the repository root, where it finds the graphics):
+//
+//   render_frames song.mid [--you-play 1,2] [--size 1024x768] [--fps 60]
+//                 [--seconds 10] [--every 60] [--save dir] [--check dir]
+//                 [--tolerance 0] [--notes merged|exact] [--keys retained|immediate]
+//
+// Track numbers are zero-based, in file order; the rest of the tracks are
+// played automatically.  --seconds defaults to the length of the song.
+// --tolerance is how far (per channel) a pixel may stray from the saved
+// frame before it counts as different.  --notes exact turns off merging
+// overlapping notes (the same as pressing F7 while playing), and --keys
+// immediate draws the whole keyboard every frame instead of keeping it in
+// a texture (F8).  Fill is the area of every quad drawn, plus what was
+// copied into textures.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "GameState.h"
+#include "SharedState.h"
+#include "State_Playing.h"
+#include "Renderer.h"
+#include "SoftwareRasterizer.h"
+#include "LatencyHistogram.h"
+#include "PianoGameError.h"
+#include "string_util.h"
+
+#include "libmidi/Midi.h"
+
+// Only moves when told to
+class FixedClock : public GameClock
+{
+public:
+   FixedClock() : m_now(0) { }
+
+   virtual unsigned long GetMilliseconds() { return m_now; }
+   void Set(unsigned long milliseconds) { m_now = milliseconds; }
+
+private:
+   unsigned long m_now;
+};
+
+static vector<int> ParseList(const string &text)
+{
+   vector<int> values;
+
+   istringstream in(text);
+   string item;
+   while (getline(in, item, ',')) values.push_back(atoi(item.c_str()));
+
+   return values;
+}
+
+static wstring FrameFilename(const string &directory, unsigned long frame)
+{
+   char name[32];
+   sprintf(name, "frame_%05lu.tga", frame);
+
+   const string filename = directory + "/" + name;
+   return wstring(filename.begin(), filename.end());
+}
+
+// Returns how many pixels differ from the saved frame by more than
+// tolerance, or -1 if it couldn't be read or is the wrong size
+static long CompareFrame(const SoftwareRasterizer &raster, const wstring &filename, int tolerance)
+{
+   int width = 0;
+   int height = 0;
+   vector<unsigned char> expected;
+   if (!SoftwareRasterizer::ReadTga(filename, &width, &height, &expected)) return -1;
+   if (width != raster.Width() || height != raster.Height()) return -1;
+
+   const vector<unsigned char> &actual = raster.Pixels();
+
+   long different = 0;
+   for (size_t i = 0; i < actual.size(); i += 4)
+   {
+      for (int c = 0; c < 4; ++c)
+      {
+         if (abs(actual[i + c] - expected[i + c]) <= tolerance) continue;
+
+         different++;
+         break;
+      }
+   }
+
+   return different;
+}
+
+int main(int argc, char *argv[])
+{
+   string midi_file;
+   vector<int> you_play;
+   int width = 1024;
+   int height = 768;
+   int fps = 60;
+   double seconds = 0;
+   int every = 60;
+   string save_dir;
+   string check_dir;
+   int tolerance = 0;
+   bool exact_notes = false;
+   bool immediate_keys = false;
+
+   for (int i = 1; i < argc; ++i)
+   {
+      const string arg = argv[i];
+      if (arg.substr(0, 2) != "--")
+      {
+         midi_file = arg;
+         continue;
+      }
+
+      if (i + 1 >= argc)
+      {
+         cerr << "missing value for " << arg << endl;
+         return 1;
+      }
+      const string value = argv[++i];
+
+      if (arg == "--you-play") you_play = ParseList(value);
+      else if (arg == "--size") sscanf(value.c_str(), "%dx%d", &width, &height);
+      else if (arg == "--fps") fps = max(1, atoi(value.c_str()));
+      else if (arg == "--seconds") seconds = atof(value.c_str());
+      else if (arg == "--every") every = max(1, atoi(value.c_str()));
+      else if (arg == "--save") save_dir = value;
+      else if (arg == "--check") check_dir = value;
+      else if (arg == "--tolerance") tolerance = max(0, atoi(value.c_str()));
+      else if (arg == "--notes") exact_notes = (value == "exact");
+      else if (arg == "--keys") immediate_keys = (value == "immediate");
+      else
+      {
+         cerr << "unknown option " << arg << endl;
+         return 1;
+      }
+   }
+
+   if (midi_file.empty() || width <= 0 || height <= 0)
+   {
+      cerr << "usage: render_frames song.mid [--you-play 1,2] [--size 1024x768] [--fps 60]" << endl;
+      cerr << "                     [--seconds 10] [--every 60] [--save dir] [--check dir] [--tolerance 0]" << endl;
+      cerr << "                     [--notes merged|exact] [--keys retained|immediate]" << endl;
+      return 1;
+   }
+
+   // It has to be in place before any textures are loaded, and outlive
+   // the manager (which frees them)
+   SoftwareRasterizer raster(width, height);
+   Renderer::UseSoftwareRasterizer(&raster);
+
+   int failures = 0;
+   try
+   {
+      Midi midi = Midi::ReadFromFile(wstring(midi_file.begin(), midi_file.end()));
+      if (seconds <= 0) seconds = midi.GetSongLengthInMicroseconds() / 1000000.0;
+
+      SharedState state;
+      state.midi = &midi;
+      state.song_title = L"Render Frames";
+
+      state.track_properties.resize(midi.Tracks().size());
+      for (size_t t = 0; t < state.track_properties.size(); ++t)
+      {
+         if (midi.Tracks()[t].Notes().empty()) continue;
+         state.track_properties[t].mode = Track::ModePlayedAutomatically;
+      }
+      for (size_t t = 0; t < you_play.size(); ++t)
+      {
+         if (you_play[t] < 0 || you_play[t] >= static_cast<int>(state.track_properties.size())) continue;
+         state.track_properties[you_play[t]].mode = Track::ModeYouPlay;
+      }
+
+      FixedClock clock;
+      GameStateManager manager(width, height);
+      manager.SetClock(&clock);
+      manager.SetInitialState(new PlayingState(state));
+      if (exact_notes) manager.KeyPress(KeyF7);
+      if (immediate_keys) manager.KeyPress(KeyF8);
+
+      const unsigned long frame_count = static_cast<unsigned long>(seconds * fps);
+
+      LatencyHistogram raster_time;
+      microseconds_t total_raster_time = 0;
+      unsigned long total_draw_calls = 0;
+      unsigned long total_vertices = 0;
+      double total_pixels = 0;
+      double total_copied = 0;
+      unsigned long saved = 0;
+      unsigned long checked = 0;
+
+      for (unsigned long frame = 0; frame < frame_count; ++frame)
+      {
+         clock.Set(static_cast<unsigned long>((frame + 1) * 1000ULL / fps));
+         manager.Update(false);
+
+         Renderer renderer(0);
+         manager.Draw(renderer);
+
+         const SpriteBatchStats &stats = Renderer::LastFrameStats();
+         raster_time.Record(stats.raster_time);
+         total_raster_time += stats.raster_time;
+         total_draw_calls += stats.draw_calls;
+         total_vertices += stats.vertices;
+         total_pixels += stats.pixels;
+         total_copied += stats.copied_pixels;
+
+         if (frame % every != 0) continue;
+
+         if (!save_dir.empty())
+         {
+            if (!raster.WriteTga(FrameFilename(save_dir, frame)))
+            {
+               cerr << "couldn't save frame " << frame << " to " << save_dir << endl;
+               failures++;
+            }
+            saved++;
+         }
+
+         if (!check_dir.empty())
+         {
+            const long different = CompareFrame(raster, FrameFilename(check_dir, frame), tolerance);
+            if (different < 0)
+            {
+               cerr << "frame " << frame << ": no matching saved frame in " << check_dir << endl;
+               failures++;
+            }
+            else if (different > 0)
+            {
+               cerr << "frame " << frame << ": " << different << " pixels differ" << endl;
+               failures++;
+            }
+            checked++;
+         }
+      }
+
+      const unsigned long frames = max(frame_count, 1UL);
+      cout << midi_file << ": " << frame_count << " frames at " << width << "x" << height << endl;
+      cout << "raster_us  mean " << (total_raster_time / frames) << "  p50 " << raster_time.Percentile(0.50)
+         << "  p99 " << raster_time.Percentile(0.99) << "  max " << raster_time.Max() << endl;
+      cout << "per frame  draw calls " << fixed << setprecision(1) << (total_draw_calls / static_cast<double>(frames))
+         << "  vertices " << (total_vertices / static_cast<double>(frames)) << endl;
+      cout << "per frame  fill " << setprecision(0) << (total_pixels / frames) << " px  copied " << (total_copied / frames) << " px" << endl;
+
+      if (saved > 0) cout << "saved " << saved << " frames to " << save_dir << endl;
+      if (checked > 0) cout << "checked " << checked << " frames against " << check_dir << ": "
+         << (failures == 0 ? "identical" : "DIFFERENT") << endl;
+   }
+   catch (const PianoGameError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+   catch (const MidiError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+   catch (const GameStateError &e)
+   {
+      cerr << "Game state error: " << e.what() << endl;
+      return 1;
+   }
+
+   Renderer::UseSoftwareRasterizer(0);
+   return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,239 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+// Offline song renderer
+//
+// Renders a song's accompaniment to a WAV file with the built-in synth,
+// as fast as the machine allows, using OfflineRenderer.  Every track is
+// played automatically except the ones given to --you-play, which only
+// keep their non-note events (program changes, pedal, and so on), just
+// like a "You Play" track in the game.  The result is a backing track to
+// practice against.
+//
+// --bench renders the song once per thread count and reports the
+// realtime factor (seconds of audio per second of rendering), the speedup
+// over the first run, and whether each run's audio came out identical to
+// the first.  Speedup is bounded by the number of cores and by how evenly
+// the song's notes spread across channels and keys.
+//
+// Building (Linux, from the repository root, as a single command):
+//
+//   g++ -std=gnu++98 -O2 -Isrc -o render_song tools/render_song.cpp
+//      $(ls src/*.cpp src/libmidi/*.cpp | grep -v -e main.cpp -e registry.cpp -e SynthVolume.cpp)
+//      -lGL -lpthread
+//
+// Usage:
+//
+//   render_song [song.mid] [--out backing.wav] [--sf2 font.sf2]
+//               [--you-play 1,2] [--threads 4] [--bench 1,2,4,8]
+//
+// Track numbers are zero-based, in file order.  Without a song, a small
+// generated arrangement (eight channels, a few minutes long) is used.
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "OfflineRenderer.h"
+#include "SoundFont.h"
+#include "PianoGameError.h"
+
+#include "libmidi/Midi.h"
+#include "libmidi/MidiEvent.h"
+#include "libmidi/MidiWriter.h"
+
+static vector<int> ParseList(const string &text)
+{
+   vector<int> values;
+
+   istringstream in(text);
+   string item;
+   while (getline(in, item, ',')) values.push_back(atoi(item.c_str()));
+
+   return values;
+}
+
+static MidiEvent Simple(unsigned char status, unsigned char byte1, unsigned char byte2)
+{
+   MidiEventSimple simple(status, byte1, byte2);
+   return MidiEvent::Build(simple);
+}
+
+// Three minutes of a busy eight-piece arrangement, one track per channel,
+// so there's plenty of independent work to go around
+static Midi BuildSong()
+{
+   MidiWriter writer;
+
+   const static int Parts = 8;
+   const static unsigned char Programs[Parts] = { 0, 48, 33, 24, 56, 73, 11, 0 };
+   for (unsigned char part = 0; part < Parts; ++part)
+   {
+      const unsigned char channel = (part == Parts - 1) ? 9 : part;
+      writer.AddEvent(part + 1, 0, Simple(0xC0 | channel, Programs[part], 0));
+      writer.AddEvent(part + 1, 0, Simple(0xB0 | channel, 10, static_cast<unsigned char>(16 + part * 14)));
+   }
+
+   const microseconds_t Beat = 400000;
+   const microseconds_t Eighth = Beat / 2;
+   for (int beat = 0; beat < 450; ++beat)
+   {
+      const microseconds_t start = beat * Beat;
+      const unsigned char root = static_cast<unsigned char>(48 + (beat / 4 % 4) * 5 % 12);
+
+      for (int half = 0; half < 2; ++half)
+      {
+         const microseconds_t t = start + half * Eighth;
+         const int step = beat * 2 + half;
+
+         // Piano melody and harmony, two melodic lines, and a guitar, on
+         // every eighth note
+         writer.AddEvent(1, t, Simple(0x90, static_cast<unsigned char>(root + 24 + (step * 7) % 12), 96));
+         writer.AddEvent(1, t + Eighth - 1000, Simple(0x80, static_cast<unsigned char>(root + 24 + (step * 7) % 12), 0));
+         writer.AddEvent(1, t, Simple(0x90, static_cast<unsigned char>(root + 12 + (step * 5) % 12), 70));
+         writer.AddEvent(1, t + Eighth - 1000, Simple(0x80, static_cast<unsigned char>(root + 12 + (step * 5) % 12), 0));
+
+         writer.AddEvent(4, t, Simple(0x93, static_cast<unsigned char>(root + 12 + (step * 3) % 7), 80));
+         writer.AddEvent(4, t + Eighth - 1000, Simple(0x83, static_cast<unsigned char>(root + 12 + (step * 3) % 7), 0));
+
+         writer.AddEvent(5, t, Simple(0x94, static_cast<unsigned char>(root + 19 + (step * 11) % 12), 75));
+         writer.AddEvent(5, t + Eighth - 1000, Simple(0x84, static_cast<unsigned char>(root + 19 + (step * 11) % 12), 0));
+
+         writer.AddEvent(6, t, Simple(0x95, static_cast<unsigned char>(root + 31 + (step * 2) % 9), 70));
+         writer.AddEvent(6, t + Eighth - 1000, Simple(0x85, static_cast<unsigned char>(root + 31 + (step * 2) % 9), 0));
+
+         writer.AddEvent(8, t, Simple(0x99, 42, 80));
+      }
+
+      // Strings and bells hold a chord for each bar
+      if (beat % 4 == 0)
+      {
+         for (int n = 0; n < 4; ++n)
+         {
+            const unsigned char note = static_cast<unsigned char>(root + 12 + n * 4 - (n >= 2 ? 1 : 0));
+            writer.AddEvent(2, start, Simple(0x91, note, 70));
+            writer.AddEvent(2, start + Beat * 4 - 1000, Simple(0x81, note, 0));
+            writer.AddEvent(7, start, Simple(0x96, static_cast<unsigned char>(note + 24), 50));
+            writer.AddEvent(7, start + Beat * 2, Simple(0x86, static_cast<unsigned char>(note + 24), 0));
+         }
+      }
+
+      // Bass and drums on every beat
+      writer.AddEvent(3, start, Simple(0x92, root - 12, 100));
+      writer.AddEvent(3, start + Eighth, Simple(0x82, root - 12, 0));
+      writer.AddEvent(8, start, Simple(0x99, (beat % 2) ? 38 : 36, 110));
+   }
+
+   stringstream out;
+   writer.Write(out);
+
+   istringstream in(out.str());
+   return Midi::ReadFromStream(in);
+}
+
+static void Report(const OfflineRenderStats &stats, const OfflineRenderStats &first, bool identical)
+{
+   const double speedup = stats.RealtimeFactor() / max(first.RealtimeFactor(), 0.000001);
+
+   cout << setw(8) << stats.threads
+      << setw(12) << fixed << setprecision(0) << (stats.render_time / 1000.0)
+      << setw(12) << fixed << setprecision(1) << stats.RealtimeFactor() << "x"
+      << setw(10) << fixed << setprecision(2) << speedup << "x"
+      << setw(12) << (identical ? "yes" : "NO")
+      << endl;
+}
+
+int main(int argc, char *argv[])
+{
+   string midi_file;
+   string out;
+   string sf2;
+   vector<int> you_play;
+   int threads = 4;
+   vector<int> bench;
+
+   int i = 1;
+   if (argc > 1 && string(argv[1]).substr(0, 2) != "--") midi_file = argv[i++];
+
+   for (; i + 1 < argc; i += 2)
+   {
+      const string flag = argv[i];
+      const string value = argv[i + 1];
+
+      if (flag == "--out") out = value;
+      else if (flag == "--sf2") sf2 = value;
+      else if (flag == "--you-play") you_play = ParseList(value);
+      else if (flag == "--threads") threads = atoi(value.c_str());
+      else if (flag == "--bench") bench = ParseList(value);
+      else
+      {
+         cerr << "unknown option " << flag << endl;
+         return 1;
+      }
+   }
+
+   try
+   {
+      SoundFont *font = sf2.empty() ? 0 : new SoundFont(wstring(sf2.begin(), sf2.end()));
+
+      Midi song = midi_file.empty() ? BuildSong() : Midi::ReadFromFile(wstring(midi_file.begin(), midi_file.end()));
+      song.Reset(0, 0);
+
+      vector<Track::Properties> tracks(song.Tracks().size());
+      for (size_t t = 0; t < tracks.size(); ++t) tracks[t].mode = Track::ModePlayedAutomatically;
+      for (size_t t = 0; t < you_play.size(); ++t)
+      {
+         if (you_play[t] >= 0 && you_play[t] < static_cast<int>(tracks.size())) tracks[you_play[t]].mode = Track::ModeYouPlay;
+      }
+
+      OfflineRenderer renderer(song, tracks, font);
+
+      if (bench.empty()) bench.push_back(threads);
+
+      cout << (midi_file.empty() ? "generated song" : midi_file) << ": " << tracks.size() << " tracks, "
+         << fixed << setprecision(1) << (song.GetSongLengthInMicroseconds() / 1000000.0) << "s, "
+         << (font ? sf2 : "built-in timbres") << endl;
+      cout << setw(8) << "threads" << setw(12) << "render ms" << setw(13) << "realtime" << setw(11) << "speedup" << setw(12) << "identical" << endl;
+
+      OfflineRenderStats first = OfflineRenderStats();
+      vector<short> first_samples;
+      for (size_t b = 0; b < bench.size(); ++b)
+      {
+         const OfflineRenderStats stats = renderer.Render(bench[b]);
+         if (b == 0)
+         {
+            first = stats;
+            first_samples = renderer.Samples();
+         }
+
+         Report(stats, first, renderer.Samples() == first_samples);
+      }
+
+      cout << first.work_units << " work units, " << fixed << setprecision(1) << (first.audio_length / 1000000.0) << "s of audio" << endl;
+
+      if (!out.empty())
+      {
+         if (renderer.WriteWavFile(wstring(out.begin(), out.end()))) cout << "wrote " << renderer.FrameCount() << " frames to " << out << endl;
+         else cerr << "couldn't write " << out << endl;
+      }
+
+      delete font;
+   }
+   catch (const PianoGameError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+   catch (const MidiError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+
+   return 0;
+}
@@ -0,0 +1,352 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+// Session replayer
+//
+// Plays a session saved by the game's "Session Recording" setting (see
+// SessionRecorder) back through PlayingState, headlessly and as fast as
+// the machine allows.  Frame times come from an injected GameClock, key
+// and mouse events go straight to the GameStateManager, and the MIDI the
+// game read is fed back in through virtual input devices with its
+// original timestamps, each before the frame that read it.
+//
+// The replay records a session of its own, which has to come out
+// identical to the original: every output event and the final score,
+// down to the last bit.  The first difference (if any) is reported.
+//
+// Nothing is drawn, so the time spent is the game loop alone (song
+// playback, input, scoring and output routing), which makes this a
+// repeatable CPU benchmark: it reports the time per update and how many
+// times faster than realtime the session went.
+//
+// Building (Linux, from the repository root, as a single command):
+//
+//   g++ -std=gnu++98 -O2 -Isrc -o replay_session tools/replay_session.cpp
+//      $(ls src/*.cpp src/libmidi/*.cpp | grep -v -e main.cpp -e registry.cpp -e SynthVolume.cpp)
+//      -lGL -lpthread
+//
+// Usage:
+//
+//   replay_session song.mid recorded.session [--repeat 5] [--out replayed.session]
+//
+// The song has to be the one that was played.  latency_harness --session
+// saves its generated song alongside the session.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "GameState.h"
+#include "SharedState.h"
+#include "State_Playing.h"
+#include "CompatibleSystem.h"
+#include "LatencyHistogram.h"
+#include "SessionLog.h"
+#include "UserSettings.h"
+#include "PianoGameError.h"
+#include "string_util.h"
+
+#include "libmidi/Midi.h"
+#include "libmidi/MidiComm.h"
+
+// Stands in for one of the input devices the session was recorded with
+class ReplayInput : public MidiCommInSource
+{
+public:
+   ReplayInput() : m_input(0) { }
+
+   virtual void Attach(MidiCommIn *input) { m_input = input; }
+   virtual void Detach(MidiCommIn *) { m_input = 0; }
+
+   void Inject(const MidiEventSimple &simple, microseconds_t timestamp)
+   {
+      if (m_input) m_input->InjectEvent(MidiEvent::Build(simple), timestamp);
+   }
+
+private:
+   MidiCommIn *m_input;
+};
+
+// Only moves when the replay says so
+class ReplayClock : public GameClock
+{
+public:
+   ReplayClock() : m_now(0) { }
+
+   virtual unsigned long GetMilliseconds() { return m_now; }
+   void Advance(unsigned long milliseconds) { m_now += milliseconds; }
+
+private:
+   unsigned long m_now;
+};
+
+struct ReplayResult
+{
+   ReplayResult() : finished(false), frames(0), session_length(0), elapsed(0) { }
+
+   bool finished;
+   unsigned long frames;
+
+   // Milliseconds of recorded frame time, and microseconds it took to replay
+   unsigned long session_length;
+   microseconds_t elapsed;
+};
+
+static bool SameEvent(const MidiEventSimple &a, const MidiEventSimple &b)
+{
+   return a.status == b.status && a.byte1 == b.byte1 && a.byte2 == b.byte2;
+}
+
+static bool SameRecord(const SessionRecord &a, const SessionRecord &b)
+{
+   if (a.type != b.type) return false;
+
+   switch (a.type)
+   {
+   case SessionFrame: return a.delta_milliseconds == b.delta_milliseconds && a.skipped == b.skipped;
+   case SessionKey: return a.key == b.key;
+   case SessionMousePress:
+   case SessionMouseRelease: return a.button == b.button;
+   case SessionMouseMove: return a.x == b.x && a.y == b.y;
+   case SessionMidiIn: return a.device == b.device && a.timestamp == b.timestamp && SameEvent(a.simple, b.simple);
+   case SessionMidiOut: return a.track_id == b.track_id && SameEvent(a.simple, b.simple);
+
+   case SessionStats:
+      return a.stats.total_note_count == b.stats.total_note_count
+         && a.stats.notes_user_could_have_played == b.stats.notes_user_could_have_played
+         && a.stats.speed_integral == b.stats.speed_integral
+         && a.stats.notes_user_actually_played == b.stats.notes_user_actually_played
+         && a.stats.stray_notes == b.stats.stray_notes
+         && a.stats.total_notes_user_pressed == b.stats.total_notes_user_pressed
+         && a.stats.longest_combo == b.stats.longest_combo
+         && a.stats.score == b.stats.score;
+   }
+
+   return false;
+}
+
+static const char *RecordName(SessionRecordType type)
+{
+   switch (type)
+   {
+   case SessionFrame: return "frame";
+   case SessionKey: return "key";
+   case SessionMousePress: return "mouse press";
+   case SessionMouseRelease: return "mouse release";
+   case SessionMouseMove: return "mouse move";
+   case SessionMidiIn: return "MIDI input";
+   case SessionMidiOut: return "MIDI output";
+   case SessionStats: return "score";
+   }
+
+   return "unknown";
+}
+
+// The replay's own session is read back from replay_file into replayed
+static ReplayResult Replay(const Midi &song, const SessionHeader &header, const vector<SessionRecord> &records,
+   vector<ReplayInput*> &inputs, const vector<unsigned int> &input_ids, const wstring &replay_file,
+   vector<SessionRecord> *replayed, LatencyHistogram &update_time)
+{
+   ReplayResult result;
+
+   // PlayingState moves the song along, so it gets its own copy
+   Midi midi = song;
+
+   SharedState state;
+   state.midi = &midi;
+   state.song_speed = header.song_speed;
+   state.song_title = L"Session Replay";
+   state.track_properties = header.track_properties;
+
+   if (header.input_count > 0)
+   {
+      state.midi_in = new MidiCommInGroup();
+      for (int i = 0; i < header.input_count; ++i) state.midi_in->Add(new MidiCommIn(input_ids[i]));
+   }
+
+   ReplayClock clock;
+   GameStateManager manager(header.screen_width, header.screen_height);
+   manager.SetClock(&clock);
+   manager.SetInitialState(new PlayingState(state));
+
+   const microseconds_t start = Compatible::GetMicroseconds();
+   for (size_t i = 0; i < records.size(); ++i)
+   {
+      const SessionRecord &r = records[i];
+      switch (r.type)
+      {
+      case SessionKey: manager.KeyPress(r.key); break;
+      case SessionMousePress: manager.MousePress(r.button); break;
+      case SessionMouseRelease: manager.MouseRelease(r.button); break;
+      case SessionMouseMove: manager.MouseMove(r.x, r.y); break;
+
+      case SessionFrame:
+         {
+            // Whatever the game read during this frame (everything up to
+            // the next frame, key or mouse record) has to be waiting
+            // before it starts
+            for (size_t j = i + 1; j < records.size(); ++j)
+            {
+               const SessionRecord &in = records[j];
+               if (in.type != SessionMidiIn && in.type != SessionMidiOut && in.type != SessionStats) break;
+               if (in.type != SessionMidiIn) continue;
+
+               if (in.device >= 0 && in.device < static_cast<int>(inputs.size())) inputs[in.device]->Inject(in.simple, in.timestamp);
+            }
+
+            clock.Advance(r.delta_milliseconds);
+            result.session_length += r.delta_milliseconds;
+
+            const microseconds_t update_start = Compatible::GetMicroseconds();
+            manager.Update(r.skipped);
+            update_time.Record(Compatible::GetMicroseconds() - update_start);
+
+            result.frames++;
+         }
+         break;
+
+      // Input was already injected with its frame, and the rest is what the
+      // replay has to reproduce
+      default: break;
+      }
+   }
+   result.elapsed = Compatible::GetMicroseconds() - start;
+
+   // The last recorded frame is the one that closed the playing screen,
+   // writing out the replay's own session.  If it never closed, it's
+   // still using the input devices, so they're left alone.
+   SessionHeader replayed_header;
+   result.finished = SessionRecorder::ReadFile(replay_file, &replayed_header, replayed);
+   if (result.finished) delete state.midi_in;
+
+   return result;
+}
+
+// Returns the index of the first record that differs, or -1
+static long FirstDifference(const vector<SessionRecord> &a, const vector<SessionRecord> &b)
+{
+   const size_t count = min(a.size(), b.size());
+   for (size_t i = 0; i < count; ++i) if (!SameRecord(a[i], b[i])) return static_cast<long>(i);
+
+   if (a.size() != b.size()) return static_cast<long>(count);
+   return -1;
+}
+
+int main(int argc, char *argv[])
+{
+   if (argc < 3)
+   {
+      cerr << "usage: replay_session song.mid recorded.session [--repeat 5] [--out replayed.session]" << endl;
+      return 1;
+   }
+
+   const string midi_file = argv[1];
+   const string session_file = argv[2];
+   int repeat = 1;
+   string out = session_file + ".replay";
+
+   for (int i = 3; i + 1 < argc; i += 2)
+   {
+      const string flag = argv[i];
+      const string value = argv[i + 1];
+
+      if (flag == "--repeat") repeat = max(1, atoi(value.c_str()));
+      else if (flag == "--out") out = value;
+      else
+      {
+         cerr << "unknown option " << flag << endl;
+         return 1;
+      }
+   }
+
+   SessionHeader header;
+   vector<SessionRecord> records;
+   if (!SessionRecorder::ReadFile(wstring(session_file.begin(), session_file.end()), &header, &records))
+   {
+      cerr << "couldn't read session " << session_file << endl;
+      return 1;
+   }
+
+   int failures = 0;
+   try
+   {
+      const Midi song = Midi::ReadFromFile(wstring(midi_file.begin(), midi_file.end()));
+      if (song.Notes().size() != header.note_count || song.GetSongLengthInMicroseconds() != header.song_length
+         || song.Tracks().size() != header.track_properties.size())
+      {
+         cerr << midi_file << " isn't the song this session was recorded with" << endl;
+         return 1;
+      }
+
+      vector<ReplayInput*> inputs;
+      vector<unsigned int> input_ids;
+      for (int i = 0; i < header.input_count; ++i)
+      {
+         inputs.push_back(new ReplayInput());
+         input_ids.push_back(MidiCommIn::RegisterVirtualDevice(WSTRING(L"Session Replay Input " << i + 1), inputs.back()));
+      }
+
+      const wstring wide_out(out.begin(), out.end());
+      UserSetting::Set(L"Session Recording", wide_out);
+
+      cout << session_file << ": " << records.size() << " records, " << header.input_count << " input device(s)" << endl;
+      cout << setw(5) << "run" << setw(9) << "frames" << setw(12) << "replay ms" << setw(12) << "realtime"
+         << setw(10) << "p50_us" << setw(10) << "p99_us" << setw(10) << "max_us" << setw(12) << "identical" << endl;
+
+      for (int run = 0; run < repeat; ++run)
+      {
+         remove(out.c_str());
+
+         LatencyHistogram update_time;
+         vector<SessionRecord> replayed;
+         const ReplayResult r = Replay(song, header, records, inputs, input_ids, wide_out, &replayed, update_time);
+
+         const bool read = r.finished;
+         const long difference = read ? FirstDifference(records, replayed) : 0;
+
+         const double realtime = (r.session_length * 1000.0) / max(static_cast<double>(r.elapsed), 1.0);
+         cout << setw(5) << run + 1 << setw(9) << r.frames
+            << setw(12) << fixed << setprecision(1) << (r.elapsed / 1000.0)
+            << setw(11) << fixed << setprecision(1) << realtime << "x"
+            << setw(10) << update_time.Percentile(0.50) << setw(10) << update_time.Percentile(0.99) << setw(10) << update_time.Max()
+            << setw(12) << (read && difference < 0 ? "yes" : "NO") << endl;
+
+         if (!read)
+         {
+            cerr << "  the playing screen never closed, so there's nothing to compare" << endl;
+            failures++;
+         }
+         else if (difference >= 0)
+         {
+            const size_t d = static_cast<size_t>(difference);
+            cerr << "  first difference at record " << d << " of " << records.size() << ": "
+               << (d < records.size() ? RecordName(records[d].type) : "(end)") << " recorded, "
+               << (d < replayed.size() ? RecordName(replayed[d].type) : "(end)") << " replayed" << endl;
+            failures++;
+         }
+      }
+   }
+   catch (const PianoGameError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+   catch (const MidiError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+   catch (const GameStateError &e)
+   {
+      cerr << "Game state error: " << e.what() << endl;
+      return 1;
+   }
+
+   return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,260 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+// Batch take scorer
+//
+// Scores recorded takes of a song (the ".csv" files the game's
+// "Performance Recording" setting writes next to each take) with the
+// same ScoringEngine the game uses, spreading the takes across as many
+// threads as asked for.  Each take is replayed exactly as the game scored
+// it, so the statistics come out the same as they did at the end of the
+// song, whatever order the takes finish in.
+//
+// One CSV row per take goes to standard output, in the order the takes
+// were given.  With --check, every take is also scored a second time on
+// the calling thread alone and any difference is reported.
+//
+// Building (Linux, from the repository root, as a single command):
+//
+//   g++ -std=gnu++98 -O2 -Isrc -o score_takes tools/score_takes.cpp
+//      $(ls src/*.cpp src/libmidi/*.cpp | grep -v -e main.cpp -e registry.cpp -e SynthVolume.cpp)
+//      -lGL -lpthread
+//
+// Usage:
+//
+//   score_takes song.mid take.mid.csv [take.mid.csv ...] --you-play 1,2
+//               [--inputs -1,0] [--threads 4] [--check 1]
+//
+// Track numbers are zero-based, in file order, and have to match the
+// "You Play" tracks the takes were recorded against.  --inputs gives the
+// input device (position in the input group, or -1 for any) each of those
+// tracks was tied to, in the same order.
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "CompatibleSystem.h"
+#include "PerformanceRecorder.h"
+#include "ScoringEngine.h"
+#include "Threading.h"
+#include "PianoGameError.h"
+
+#include "libmidi/Midi.h"
+
+static vector<int> ParseList(const string &text)
+{
+   vector<int> values;
+
+   istringstream in(text);
+   string item;
+   while (getline(in, item, ',')) values.push_back(atoi(item.c_str()));
+
+   return values;
+}
+
+struct TakeResult
+{
+   TakeResult() : read(false), events(0) { }
+
+   bool read;
+   size_t events;
+   SongStatistics stats;
+};
+
+static bool SameStats(const SongStatistics &a, const SongStatistics &b)
+{
+   return a.total_note_count == b.total_note_count
+      && a.notes_user_could_have_played == b.notes_user_could_have_played
+      && a.speed_integral == b.speed_integral
+      && a.notes_user_actually_played == b.notes_user_actually_played
+      && a.stray_notes == b.stray_notes
+      && a.total_notes_user_pressed == b.total_notes_user_pressed
+      && a.longest_combo == b.longest_combo
+      && a.score == b.score;
+}
+
+// Shared by every scoring thread.  Only next_take changes.
+struct Batch
+{
+   const TranslatedNoteList *notes;
+   const vector<Track::Properties> *tracks;
+   const vector<string> *takes;
+   vector<TakeResult> *results;
+
+   volatile long next_take;
+};
+
+static TakeResult ScoreTake(ScoringEngine &engine, const string &filename)
+{
+   TakeResult result;
+
+   vector<RecordedInput> inputs;
+   if (!PerformanceRecorder::ReadCsv(wstring(filename.begin(), filename.end()), &inputs)) return result;
+
+   engine.Reset();
+   if (!inputs.empty()) engine.Replay(&inputs[0], inputs.size());
+
+   result.read = true;
+   result.events = inputs.size();
+   result.stats = engine.Stats();
+   return result;
+}
+
+static void ScoreTakes(void *context)
+{
+   Batch &batch = *reinterpret_cast<Batch*>(context);
+
+   // Each thread has its own engine; the note table is only read
+   ScoringEngine engine(*batch.notes, *batch.tracks, true);
+
+   while (true)
+   {
+      const long i = Atomic::Increment(&batch.next_take) - 1;
+      if (i >= static_cast<long>(batch.takes->size())) return;
+
+      (*batch.results)[i] = ScoreTake(engine, (*batch.takes)[i]);
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   string midi_file;
+   vector<string> takes;
+   vector<int> you_play;
+   vector<int> inputs;
+   int threads = 4;
+   bool check = false;
+
+   for (int i = 1; i < argc; ++i)
+   {
+      const string arg = argv[i];
+      if (arg.substr(0, 2) != "--")
+      {
+         if (midi_file.empty()) midi_file = arg;
+         else takes.push_back(arg);
+         continue;
+      }
+
+      if (i + 1 >= argc)
+      {
+         cerr << "missing value for " << arg << endl;
+         return 1;
+      }
+      const string value = argv[++i];
+
+      if (arg == "--you-play") you_play = ParseList(value);
+      else if (arg == "--inputs") inputs = ParseList(value);
+      else if (arg == "--threads") threads = atoi(value.c_str());
+      else if (arg == "--check") check = (atoi(value.c_str()) != 0);
+      else
+      {
+         cerr << "unknown option " << arg << endl;
+         return 1;
+      }
+   }
+
+   if (midi_file.empty() || takes.empty() || you_play.empty())
+   {
+      cerr << "usage: score_takes song.mid take.mid.csv [take.mid.csv ...] --you-play 1,2" << endl;
+      cerr << "                   [--inputs -1,0] [--threads 4] [--check 1]" << endl;
+      return 1;
+   }
+
+   try
+   {
+      const Midi song = Midi::ReadFromFile(wstring(midi_file.begin(), midi_file.end()));
+
+      vector<Track::Properties> tracks(song.Tracks().size());
+      for (size_t t = 0; t < tracks.size(); ++t) tracks[t].mode = Track::ModePlayedAutomatically;
+      for (size_t t = 0; t < you_play.size(); ++t)
+      {
+         if (you_play[t] < 0 || you_play[t] >= static_cast<int>(tracks.size())) continue;
+
+         tracks[you_play[t]].mode = Track::ModeYouPlay;
+         if (t < inputs.size()) tracks[you_play[t]].input_device = inputs[t];
+      }
+
+      const TranslatedNoteSet &note_set = song.Notes();
+      const TranslatedNoteList notes(note_set.begin(), note_set.end());
+
+      vector<TakeResult> results(takes.size());
+
+      Batch batch;
+      batch.notes = &notes;
+      batch.tracks = &tracks;
+      batch.takes = &takes;
+      batch.results = &results;
+      batch.next_take = 0;
+
+      const microseconds_t start = Compatible::GetMicroseconds();
+
+      // The calling thread does its share too
+      vector<Thread*> workers;
+      for (int i = 1; i < threads; ++i) workers.push_back(new Thread(ScoreTakes, &batch));
+      ScoreTakes(&batch);
+      for (size_t i = 0; i < workers.size(); ++i) delete workers[i];
+
+      const microseconds_t elapsed = Compatible::GetMicroseconds() - start;
+
+      cout << "take,events,notes,could_have_played,played,stray,pressed,longest_combo,speed_integral,score" << endl;
+
+      int unreadable = 0;
+      for (size_t i = 0; i < takes.size(); ++i)
+      {
+         const TakeResult &r = results[i];
+         if (!r.read)
+         {
+            cerr << "couldn't read " << takes[i] << endl;
+            unreadable++;
+            continue;
+         }
+
+         const SongStatistics &s = r.stats;
+         cout << takes[i] << "," << r.events << "," << s.total_note_count << "," << s.notes_user_could_have_played << ","
+            << s.notes_user_actually_played << "," << s.stray_notes << "," << s.total_notes_user_pressed << ","
+            << s.longest_combo << "," << s.speed_integral << "," << fixed << setprecision(1) << s.score << endl;
+      }
+
+      cerr << takes.size() << " takes in " << fixed << setprecision(1) << (elapsed / 1000.0) << " ms on "
+         << max(threads, 1) << " threads" << endl;
+
+      int mismatches = 0;
+      if (check)
+      {
+         ScoringEngine engine(notes, tracks, true);
+         for (size_t i = 0; i < takes.size(); ++i)
+         {
+            if (!results[i].read) continue;
+
+            const TakeResult again = ScoreTake(engine, takes[i]);
+            if (again.read && SameStats(again.stats, results[i].stats)) continue;
+
+            cerr << "MISMATCH scoring " << takes[i] << " again" << endl;
+            mismatches++;
+         }
+
+         if (mismatches == 0) cerr << "every take scored the same on one thread" << endl;
+      }
+
+      if (unreadable > 0 || mismatches > 0) return 1;
+   }
+   catch (const PianoGameError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+   catch (const MidiError &e)
+   {
+      wcerr << e.GetErrorDescription() << endl;
+      return 1;
+   }
+
+   return 0;
+}
@@ -0,0 +1,358 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+// Software synth benchmark
+//
+// Measures two things about SoftSynth:
+//
+// Throughput: a chord of N sustained (organ) voices is rendered offline
+// for a few seconds of audio.  The realtime factor is how many seconds of
+// audio one second of CPU produces; divide the voice count by the share
+// of a core it needs to get voices per core.
+//
+// Latency: a SynthAudioThread renders into memory in real time while a
+// separate thread plays notes into the synth like the game would.  Each
+// note's wait in the command queue is recorded.  Once a period's audio is
+// rendered it's the audio device's job, so add the sink's buffering
+// (period x buffer count) to get what the player hears.
+//
+// Building (Linux, from the repository root, as a single command):
+//
+//   g++ -std=gnu++98 -O2 -Isrc -o synth_bench tools/synth_bench.cpp
+//      $(ls src/*.cpp src/libmidi/*.cpp | grep -v -e main.cpp -e registry.cpp -e SynthVolume.cpp)
+//      -lGL -lpthread
+//
+// Usage:
+//
+//   synth_bench [--voices 32,64,128,256] [--seconds 5] [--period 256]
+//               [--notes 400] [--wav out.wav] [--sf2 font.sf2]
+//               [--midi song.mid]
+//
+// --wav saves the audio from the latency run.
+//
+// --sf2 loads a SoundFont, which both tests then play instead of the
+// built-in timbres.  It also reports how long the font took to
+// open and how much of it a song (--midi, or a small generated General
+// MIDI arrangement) causes to be paged in, as playback moves through it
+// much faster than real time.  For honest residency numbers, make sure
+// the font isn't already in the OS's file cache.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "AudioSink.h"
+#include "SoftSynth.h"
+#include "SoundFont.h"
+#include "CompatibleSystem.h"
+#include "LatencyHistogram.h"
+#include "PianoGameError.h"
+#include "Threading.h"
+
+#include "libmidi/Midi.h"
+#include "libmidi/MidiEvent.h"
+#include "libmidi/MidiWriter.h"
+
+const static unsigned int SampleRate = 44100;
+
+static vector<int> ParseList(const string &text)
+{
+   vector<int> values;
+
+   istringstream in(text);
+   string item;
+   while (getline(in, item, ',')) values.push_back(atoi(item.c_str()));
+
+   return values;
+}
+
+static MidiEvent Simple(unsigned char status, unsigned char byte1, unsigned char byte2)
+{
+   MidiEventSimple simple(status, byte1, byte2);
+   return MidiEvent::Build(simple);
+}
+
+static string FormatMs(microseconds_t us)
+{
+   ostringstream out;
+   out << fixed << setprecision(2) << (us / 1000.0);
+   return out.str();
+}
+
+static void RunThroughput(int voices, int seconds, const SoundFont *font)
+{
+   SoftSynth synth(SampleRate, font);
+
+   // Spread the notes over every channel but percussion so the pedal and
+   // pan math is exercised too
+   for (int i = 0; i < voices; ++i)
+   {
+      unsigned char channel = static_cast<unsigned char>(i % 15);
+      if (channel >= 9) channel++;
+
+      synth.Write(Simple(0xC0 | channel, 19, 0));
+      synth.Write(Simple(0xB0 | channel, 10, static_cast<unsigned char>((i * 37) % 128)));
+      synth.Write(Simple(0x90 | channel, static_cast<unsigned char>(24 + (i / 15) * 5), 100));
+   }
+
+   const size_t period = 256;
+   vector<short> buffer(period * 2);
+
+   const size_t total = static_cast<size_t>(seconds) * SampleRate;
+   const microseconds_t start = Compatible::GetMicroseconds();
+   for (size_t done = 0; done < total; done += period) synth.Render(&buffer[0], period);
+   const microseconds_t elapsed = Compatible::GetMicroseconds() - start;
+
+   const double factor = (seconds * 1000000.0) / max<microseconds_t>(elapsed, 1);
+
+   cout << setw(8) << voices
+      << setw(10) << synth.ActiveVoices()
+      << setw(12) << fixed << setprecision(1) << factor << "x"
+      << setw(14) << fixed << setprecision(0) << (voices * factor)
+      << endl;
+}
+
+struct Producer
+{
+   SoftSynth *synth;
+   int notes;
+};
+
+static void ProduceNotes(void *context)
+{
+   Producer *p = reinterpret_cast<Producer*>(context);
+
+   // A repeatable little melody, one note every ~12ms with some chords
+   for (int i = 0; i < p->notes; ++i)
+   {
+      const unsigned char note = static_cast<unsigned char>(48 + (i * 7) % 36);
+
+      p->synth->Write(Simple(0x90, note, 90));
+      if (i % 4 == 0) p->synth->Write(Simple(0x90, static_cast<unsigned char>(note + 4), 70));
+
+      Thread::Sleep(12);
+
+      p->synth->Write(Simple(0x80, note, 0));
+      if (i % 4 == 0) p->synth->Write(Simple(0x80, static_cast<unsigned char>(note + 4), 0));
+   }
+}
+
+static void RunLatency(int period, int notes, const string &wav, const SoundFont *font)
+{
+   SoftSynth synth(SampleRate, font);
+
+   // Enough room for the whole run, with a bit to spare
+   MemoryAudioSink sink((notes * 14 / 1000 + 2) * SampleRate);
+
+   Producer producer;
+   producer.synth = &synth;
+   producer.notes = notes;
+
+   const microseconds_t period_us = static_cast<microseconds_t>(period) * 1000000 / SampleRate;
+   {
+      SynthAudioThread audio(synth, sink, period, true);
+      {
+         Thread producer_thread(ProduceNotes, &producer);
+      }
+
+      // Let the last release finish rendering
+      Thread::Sleep(100);
+
+      const LatencyHistogram &render_time = audio.RenderTime();
+      cout << "period " << period << " frames (" << FormatMs(period_us) << " ms), " << audio.Periods() << " periods rendered" << endl;
+      cout << "render ms:      p50 " << FormatMs(render_time.Percentile(0.50))
+         << "  p99 " << FormatMs(render_time.Percentile(0.99))
+         << "  max " << FormatMs(render_time.Max()) << endl;
+   }
+
+   const LatencyHistogram &queued = synth.QueueLatency();
+   cout << "commands " << queued.Count() << ", dropped " << synth.DroppedCommands() << ", stolen voices " << synth.StolenVoices() << endl;
+   cout << "queue wait ms:  p50 " << FormatMs(queued.Percentile(0.50))
+      << "  p99 " << FormatMs(queued.Percentile(0.99))
+      << "  max " << FormatMs(queued.Max()) << endl;
+
+   if (!wav.empty())
+   {
+      if (WriteWavFile(wstring(wav.begin(), wav.end()), sink.Samples(), sink.FrameCount(), SampleRate))
+      {
+         cout << "wrote " << sink.FrameCount() << " frames to " << wav << endl;
+      }
+      else cerr << "couldn't write " << wav << endl;
+   }
+}
+
+// A minute of piano, strings, bass, and drums: four presets out of
+// however many the font has
+static Midi BuildSong()
+{
+   MidiWriter writer;
+
+   const static unsigned char Programs[] = { 0, 48, 33 };
+   for (unsigned char channel = 0; channel < 3; ++channel) writer.AddEvent(channel + 1, 0, Simple(0xC0 | channel, Programs[channel], 0));
+
+   const microseconds_t Beat = 500000;
+   for (int beat = 0; beat < 120; ++beat)
+   {
+      const microseconds_t start = beat * Beat;
+      const unsigned char root = static_cast<unsigned char>(48 + (beat / 4 % 4) * 5 % 12);
+
+      // Melody
+      const unsigned char melody = static_cast<unsigned char>(root + 24 + (beat * 7) % 12);
+      writer.AddEvent(1, start, Simple(0x90, melody, 96));
+      writer.AddEvent(1, start + Beat - 1000, Simple(0x80, melody, 0));
+
+      // Strings hold a chord for each bar
+      if (beat % 4 == 0)
+      {
+         for (int n = 0; n < 3; ++n)
+         {
+            const unsigned char note = static_cast<unsigned char>(root + 12 + n * 4 - (n == 2 ? 1 : 0));
+            writer.AddEvent(2, start, Simple(0x91, note, 70));
+            writer.AddEvent(2, start + Beat * 4 - 1000, Simple(0x81, note, 0));
+         }
+      }
+
+      // Bass on every beat
+      writer.AddEvent(3, start, Simple(0x92, root - 12, 100));
+      writer.AddEvent(3, start + Beat / 2, Simple(0x82, root - 12, 0));
+
+      // Kick, snare, and hats
+      writer.AddEvent(4, start, Simple(0x99, (beat % 2) ? 38 : 36, 110));
+      writer.AddEvent(4, start + Beat / 2, Simple(0x99, 42, 80));
+   }
+
+   stringstream out;
+   writer.Write(out);
+
+   istringstream in(out.str());
+   return Midi::ReadFromStream(in);
+}
+
+static string FormatMB(size_t bytes)
+{
+   ostringstream out;
+   out << fixed << setprecision(1) << (bytes / (1024.0 * 1024.0));
+   return out.str();
+}
+
+static void ReportResidency(const string &label, const SoundFontResidency &r)
+{
+   cout << setw(16) << left << label << right
+      << "prefetched " << setw(7) << FormatMB(r.pages_prefetched * r.page_size) << " MB";
+
+   if (r.resident_known) cout << ", resident " << setw(7) << FormatMB(r.pages_resident * r.page_size) << " MB";
+   cout << endl;
+}
+
+static void WaitForPrefetch(const SoundFontPrefetcher &prefetcher, microseconds_t *longest)
+{
+   const microseconds_t start = Compatible::GetMicroseconds();
+   while (!prefetcher.CaughtUp()) Thread::Sleep(1);
+
+   *longest = max(*longest, Compatible::GetMicroseconds() - start);
+}
+
+// Returns the loaded font
+static SoundFont *RunSoundFont(const string &filename, const string &midi_file)
+{
+   const microseconds_t load_start = Compatible::GetMicroseconds();
+   SoundFont *font = new SoundFont(wstring(filename.begin(), filename.end()));
+   const microseconds_t load_time = Compatible::GetMicroseconds() - load_start;
+
+   cout << "SoundFont " << filename << ": " << FormatMB(font->File().Size()) << " MB, "
+      << font->Presets().size() << " presets, " << font->RegionCount() << " regions, opened in "
+      << FormatMs(load_time) << " ms" << endl;
+
+   Midi song = midi_file.empty() ? BuildSong() : Midi::ReadFromFile(wstring(midi_file.begin(), midi_file.end()));
+   song.Reset(0, 0);
+
+   SoundFontPrefetcher prefetcher(*font, song);
+
+   const SoundFontResidency before = prefetcher.Residency();
+   cout << "song uses " << before.presets_used << " presets, " << before.regions_used << " regions, "
+      << FormatMB(before.bytes_used) << " MB of samples" << endl;
+
+   // The first LookAhead's worth is fetched as soon as the prefetcher is made
+   microseconds_t longest = 0;
+   WaitForPrefetch(prefetcher, &longest);
+   ReportResidency("at start", prefetcher.Residency());
+
+   // Then move through the song in quarter second steps without waiting
+   // for real time, so each step has to catch up from a standing start
+   const microseconds_t Step = 250000;
+   const microseconds_t length = song.GetSongLengthInMicroseconds();
+   for (microseconds_t position = Step; position <= length; position += Step)
+   {
+      prefetcher.SetPosition(position);
+      WaitForPrefetch(prefetcher, &longest);
+   }
+
+   ReportResidency("at end", prefetcher.Residency());
+   cout << "longest catch-up " << FormatMs(longest) << " ms (look-ahead is "
+      << FormatMs(SoundFontPrefetcher::LookAhead) << " ms)" << endl << endl;
+
+   return font;
+}
+
+int main(int argc, char *argv[])
+{
+   vector<int> voices = ParseList("32,64,128,256");
+   int seconds = 5;
+   int period = 256;
+   int notes = 400;
+   string wav;
+   string sf2;
+   string midi_file;
+
+   for (int i = 1; i + 1 < argc; i += 2)
+   {
+      const string flag = argv[i];
+      const string value = argv[i + 1];
+
+      if (flag == "--voices") voices = ParseList(value);
+      else if (flag == "--seconds") seconds = atoi(value.c_str());
+      else if (flag == "--period") period = atoi(value.c_str());
+      else if (flag == "--notes") notes = atoi(value.c_str());
+      else if (flag == "--wav") wav = value;
+      else if (flag == "--sf2") sf2 = value;
+      else if (flag == "--midi") midi_file = value;
+      else
+      {
+         cerr << "unknown option " << flag << endl;
+         return 1;
+      }
+   }
+
+   SoundFont *font = 0;
+   if (!sf2.empty())
+   {
+      try { font = RunSoundFont(sf2, midi_file); }
+      catch (const PianoGameError &e)
+      {
+         wcerr << e.GetErrorDescription() << endl;
+         return 1;
+      }
+      catch (const MidiError &e)
+      {
+         wcerr << e.GetErrorDescription() << endl;
+         return 1;
+      }
+   }
+
+   cout << "Throughput (" << seconds << "s of audio at " << SampleRate << " Hz)" << endl;
+   cout << setw(8) << "voices" << setw(10) << "active" << setw(13) << "realtime" << setw(14) << "voices/core" << endl;
+   for (size_t i = 0; i < voices.size(); ++i) RunThroughput(voices[i], seconds, font);
+
+   cout << endl << "Latency" << endl;
+   RunLatency(period, notes, wav, font);
+
+   delete font;
+   return 0;
+}